@@ -40,11 +40,26 @@ class PageAllocator {
   // guaranteed to be page-aligned and the memory is guaranteed to be zeroed.
   // |size| must be a multiple of 4KB (a page size). Crashes if the underlying
   // mmap() fails.
-  static UniquePtr Allocate(size_t size);
+  // Only the address space is reserved upfront: the physical memory for each
+  // page is committed by the kernel the first time the page is written.
+  // If |use_huge_pages| is true and the platform supports transparent huge
+  // pages (Linux and Android), the returned pointer is aligned to a huge page
+  // (2MB) and the region is madvise()-d with MADV_HUGEPAGE, so that the kernel
+  // can back it with huge pages and save TLB misses on accesses spread across
+  // it. This is only a hint: the allocation doesn't fail if the kernel has THP
+  // disabled or there are no huge pages available.
+  static UniquePtr Allocate(size_t size, bool use_huge_pages = false);
 
   // Like the above, but returns a nullptr if the mmap() fails (e.g., if out
   // of virtual address space).
-  static UniquePtr AllocateMayFail(size_t size);
+  static UniquePtr AllocateMayFail(size_t size, bool use_huge_pages = false);
+
+  // Returns the physical memory of the pages in [|ptr|, |ptr| + |size|) to the
+  // kernel, which stop counting in the RSS of the process right away. The
+  // pages stay mapped, but their content becomes undefined (zeroes on Linux)
+  // and they are committed again when written. |ptr| and |size| must be
+  // page-aligned.
+  static void ReleasePages(void* ptr, size_t size);
 };
 
 }  // namespace base
@@ -21,10 +21,12 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <memory>
 #include <type_traits>
 
 #include "perfetto/base/export.h"
 #include "perfetto/base/logging.h"
+#include "perfetto/base/utils.h"
 #include "perfetto/protozero/contiguous_memory_range.h"
 #include "perfetto/protozero/proto_utils.h"
 #include "perfetto/protozero/scattered_stream_writer.h"
@@ -37,32 +39,36 @@ class FakeProducer;
 
 namespace protozero {
 
+class MessageArena;
 class MessageHandleBase;
 
 // Base class extended by the proto C++ stubs generated by the ProtoZero
 // compiler. This class provides the minimal runtime required to support
-// append-only operations and is designed for performance. None of the methods
-// require any dynamic memory allocation.
+// append-only operations and is designed for performance. The methods don't
+// require any dynamic memory allocation, with one exception: the first time a
+// root message nests deeper than MessageArena::kInlineNestingDepth, the
+// storage for the deeper levels is allocated (once per root message).
+// Root messages are instantiated through RootMessage<T> (see below), which
+// provides the storage for their nested messages.
 class PERFETTO_EXPORT Message {
  public:
   friend class MessageHandleBase;
   // Grant end_to_end_shared_memory_fuzzer access in order to write raw
   // bytes into the buffer.
   friend class ::perfetto::shm_fuzz::FakeProducer;
-  // Adjust the |nested_messages_arena_| size when changing this, or the
-  // static_assert in the .cc file will bark.
   static constexpr uint32_t kMaxNestingDepth = 8;
 
   // Ctor and Dtor of Message are never called, with the exeception
-  // of root (non-nested) messages. Nested messages are allocated via placement
-  // new in the |nested_messages_arena_| and implictly destroyed when the arena
-  // of the root message goes away. This is fine as long as all the fields are
-  // PODs, which is checked by the static_assert in the ctor (see the Reset()
-  // method in the .cc file).
+  // of root (non-nested) messages. Nested messages live in the storage of the
+  // MessageArena of their root message and are implictly destroyed when the
+  // arena goes away. This is fine as long as all the fields are PODs, which is
+  // checked by the static_assert in the ctor (see the Reset() method in the .cc
+  // file).
   Message() = default;
 
   // Clears up the state, allowing the message to be reused as a fresh one.
-  void Reset(ScatteredStreamWriter*);
+  // |arena| provides the storage for the nested messages.
+  void Reset(ScatteredStreamWriter*, MessageArena* arena);
 
   // Commits all the changes to the buffer (backfills the size field of this and
   // all nested messages) and seals the message. Returns the size of the message
@@ -143,11 +149,97 @@ class PERFETTO_EXPORT Message {
     WriteToStream(buffer, pos);
   }
 
+  // Variants of the methods above for field ids known at compile time, used
+  // by the generated stubs. The tag is pre-encoded and, unless the current
+  // chunk is about to be exhausted, written together with the value straight
+  // into the chunk, with a single bounds check.
+  template <uint32_t field_id, typename T>
+  void AppendVarInt(T value) {
+    AppendField<field_id, proto_utils::kFieldTypeVarInt,
+                proto_utils::kMaxVarIntEncodedSize>([value](uint8_t* pos) {
+      return proto_utils::WriteVarInt(value, pos);
+    });
+  }
+
+  template <uint32_t field_id, typename T>
+  void AppendSignedVarInt(T value) {
+    AppendVarInt<field_id>(proto_utils::ZigZagEncode(value));
+  }
+
+  template <uint32_t field_id>
+  void AppendTinyVarInt(int32_t value) {
+    PERFETTO_DCHECK(0 <= value && value < 0x80);
+    AppendField<field_id, proto_utils::kFieldTypeVarInt, 1>(
+        [value](uint8_t* pos) {
+          *pos = static_cast<uint8_t>(value);
+          return pos + 1;
+        });
+  }
+
+  template <uint32_t field_id, typename T>
+  void AppendFixed(T value) {
+    static_assert(sizeof(T) == 8 || sizeof(T) == 4,
+                  "Value must be 4 or 8 bytes");
+    AppendField<field_id,
+                sizeof(T) == 8 ? proto_utils::kFieldTypeFixed64
+                               : proto_utils::kFieldTypeFixed32,
+                sizeof(T)>([value](uint8_t* pos) {
+      memcpy(pos, &value, sizeof(T));
+      return pos + sizeof(T);
+    });
+  }
+
   void AppendString(uint32_t field_id, const char* str);
   void AppendBytes(uint32_t field_id, const void* value, size_t size);
 
-  // Begins a nested message, using the static storage provided by the parent
-  // class (see comment in |nested_messages_arena_|). The nested message ends
+  // Appends a length-delimited field of |size| bytes and returns a pointer to
+  // its payload, which the caller has to fill in place before writing any
+  // other field. Saves the copy of AppendBytes() for large payloads that can
+  // be serialized straight into the buffer. Returns nullptr, without
+  // appending anything, if the stream writer can't provide |size| contiguous
+  // bytes (see ScatteredStreamWriter::ReserveBytesForDirectWrite()): in that
+  // case the caller should fall back on AppendBytes().
+  uint8_t* AppendBytesForDirectWrite(uint32_t field_id, size_t size);
+
+  // Packed repeated fields are encoded as a single length-delimited field
+  // whose payload is the concatenation of the (untagged) values. The methods
+  // below write all the |count| |values| in one go. Appending the same field
+  // more than once is allowed, decoders concatenate the values of all the
+  // occurrences. When the values aren't known upfront use instead the stubs in
+  // packed_repeated_fields.h, which stream them one at a time.
+
+  // Proto types: packed repeated uint64, uint32, int64, int32, bool, enum.
+  template <typename T>
+  void AppendPackedVarInt(uint32_t field_id, const T* values, size_t count) {
+    AppendPackedVarIntInternal(field_id, values, count,
+                               [](T value) { return value; });
+  }
+
+  // Proto types: packed repeated sint64, sint32.
+  template <typename T>
+  void AppendPackedSignedVarInt(uint32_t field_id,
+                                const T* values,
+                                size_t count) {
+    AppendPackedVarIntInternal(
+        field_id, values, count,
+        [](T value) { return proto_utils::ZigZagEncode(value); });
+  }
+
+  // Proto types: packed repeated fixed64, sfixed64, fixed32, sfixed32, double,
+  // float.
+  template <typename T>
+  void AppendPackedFixed(uint32_t field_id, const T* values, size_t count) {
+    static_assert(sizeof(T) == 8 || sizeof(T) == 4,
+                  "Value must be 4 or 8 bytes");
+    if (count == 0)
+      return;
+    WriteLengthDelimitedPreamble(field_id, count * sizeof(T));
+    WriteToStream(reinterpret_cast<const uint8_t*>(values),
+                  reinterpret_cast<const uint8_t*>(values + count));
+  }
+
+  // Begins a nested message, using the storage provided by the MessageArena
+  // of the root message. The nested message ends
   // either when Finalize() is called or when any other Append* method is called
   // in the parent class.
   // The template argument T is supposed to be a stub class auto generated from
@@ -160,16 +252,125 @@ class PERFETTO_EXPORT Message {
                   "T must be a subclass of Message");
     static_assert(sizeof(T) == sizeof(Message),
                   "Message subclasses cannot introduce extra state.");
-    T* message = reinterpret_cast<T*>(nested_messages_arena_);
-    BeginNestedMessageInternal(field_id, message);
-    return message;
+    return reinterpret_cast<T*>(BeginNestedMessageInternal(field_id));
+  }
+
+ protected:
+  // Used by the stubs in packed_repeated_fields.h, which are nested messages
+  // whose payload is the sequence of untagged values of a packed field.
+  template <typename T>
+  void AppendRawVarInt(T value) {
+    PERFETTO_DCHECK(!finalized_);
+    if (PERFETTO_LIKELY(stream_writer_->bytes_available() >=
+                        proto_utils::kMaxVarIntEncodedSize)) {
+      uint8_t* const begin = stream_writer_->write_ptr();
+      uint8_t* const end = proto_utils::WriteVarInt(value, begin);
+      stream_writer_->set_write_ptr(end);
+      size_ += static_cast<uint32_t>(end - begin);
+      return;
+    }
+    uint8_t buffer[proto_utils::kMaxVarIntEncodedSize];
+    WriteToStream(buffer, proto_utils::WriteVarInt(value, buffer));
+  }
+
+  template <typename T>
+  void AppendRawFixed(T value) {
+    static_assert(sizeof(T) == 8 || sizeof(T) == 4,
+                  "Value must be 4 or 8 bytes");
+    WriteToStream(reinterpret_cast<const uint8_t*>(&value),
+                  reinterpret_cast<const uint8_t*>(&value + 1));
   }
 
  private:
   Message(const Message&) = delete;
   Message& operator=(const Message&) = delete;
 
-  void BeginNestedMessageInternal(uint32_t field_id, Message*);
+  // Returns the nested message, reset, in the storage of the arena.
+  Message* BeginNestedMessageInternal(uint32_t field_id);
+
+  // Writes the pre-encoded tag of the field followed by its value, which
+  // |write_value| encodes in at most |kMaxValueSize| bytes at the pointer it
+  // is passed, returning the pointer past them.
+  template <uint32_t field_id,
+            proto_utils::FieldType wire_type,
+            size_t kMaxValueSize,
+            typename ValueWriter>
+  void AppendField(ValueWriter write_value) {
+    using Tag = proto_utils::PreEncodedTag<field_id, wire_type>;
+    if (nested_message_)
+      EndNestedMessage();
+
+    constexpr size_t kMaxSize = Tag::kSize + kMaxValueSize;
+    if (PERFETTO_LIKELY(stream_writer_->bytes_available() >= kMaxSize)) {
+      PERFETTO_DCHECK(!finalized_);
+      uint8_t* const begin = stream_writer_->write_ptr();
+      uint8_t* const end = write_value(Tag::Write(begin));
+      stream_writer_->set_write_ptr(end);
+      size_ += static_cast<uint32_t>(end - begin);
+      return;
+    }
+    uint8_t buffer[kMaxSize];
+    WriteToStream(buffer, write_value(Tag::Write(buffer)));
+  }
+
+  // Writes the tag and the length of a length-delimited field, whose |size|
+  // bytes of payload must be written straight after.
+  void WriteLengthDelimitedPreamble(uint32_t field_id, size_t size);
+
+  template <typename T, typename Encoder>
+  void AppendPackedVarIntInternal(uint32_t field_id,
+                                  const T* values,
+                                  size_t count,
+                                  Encoder encode) {
+    if (count == 0)
+      return;
+    if (nested_message_)
+      EndNestedMessage();
+
+    // Fast path: if the field fits in the current chunk even if all the values
+    // take the max size, write it straight into the chunk in one pass and
+    // backfill its length, like for nested messages.
+    const size_t max_size = proto_utils::kMaxTagEncodedSize +
+                            proto_utils::kMessageLengthFieldSize +
+                            count * proto_utils::kMaxVarIntEncodedSize;
+    if (PERFETTO_LIKELY(stream_writer_->bytes_available() >= max_size)) {
+      PERFETTO_DCHECK(!finalized_);
+      uint8_t* const begin = stream_writer_->write_ptr();
+      uint8_t* const size_field = proto_utils::WriteVarInt(
+          proto_utils::MakeTagLengthDelimited(field_id), begin);
+      uint8_t* const values_begin =
+          size_field + proto_utils::kMessageLengthFieldSize;
+      uint8_t* pos = values_begin;
+      for (size_t i = 0; i < count; i++)
+        pos = proto_utils::WriteVarInt(encode(values[i]), pos);
+      PERFETTO_DCHECK(static_cast<size_t>(pos - values_begin) <
+                      proto_utils::kMaxMessageLength);
+      proto_utils::WriteRedundantVarInt(
+          static_cast<uint32_t>(pos - values_begin), size_field);
+      stream_writer_->set_write_ptr(pos);
+      size_ += static_cast<uint32_t>(pos - begin);
+      return;
+    }
+
+    // Otherwise the field will span across chunks and its length can't be
+    // backfilled: the chunk that holds it might have been already returned to
+    // the service by the time the values have been written. Compute it
+    // upfront instead and encode the values in batches.
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++)
+      size += proto_utils::VarIntSize(encode(values[i]));
+    WriteLengthDelimitedPreamble(field_id, size);
+    uint8_t buffer[128];
+    uint8_t* pos = buffer;
+    for (size_t i = 0; i < count; i++) {
+      if (pos > buffer + sizeof(buffer) - proto_utils::kMaxVarIntEncodedSize) {
+        WriteToStream(buffer, pos);
+        pos = buffer;
+      }
+      pos = proto_utils::WriteVarInt(encode(values[i]), pos);
+    }
+    WriteToStream(buffer, pos);
+  }
 
   // Called by Finalize and Append* methods.
   void EndNestedMessage();
@@ -219,20 +420,66 @@ class PERFETTO_EXPORT Message {
   // nested messages are finalized and sealed when any other field is set in the
   // parent message (or the parent message itself is finalized) and cannot be
   // accessed anymore afterwards.
-  // TODO(primiano): optimization: I think that nested_message_, when non-null.
-  // will always be @ (this) + offsetof(nested_messages_arena_).
   Message* nested_message_;
 
-  // The root message owns the storage for all its nested messages, up to a max
-  // of kMaxNestingDepth levels (see the .cc file). Note that the boundaries of
-  // the arena are meaningful only for the root message.
-  // Unfortunately we cannot put the sizeof() math here because we cannot sizeof
-  // the current class in a header. However the .cc file has a static_assert
-  // that guarantees that (see the Reset() method in the .cc file).
-  alignas(sizeof(void*)) uint8_t nested_messages_arena_[512];
+  // Shared by the root message and all its nested messages, provides the
+  // storage for the latter.
+  MessageArena* arena_;
+};
+
+// Provides the storage for the nested messages of a root message. Because of
+// the stacked fashion in which they are written, there is at most one nested
+// message alive per nesting level, and that's all the storage needed. The one
+// for the first few levels, which cover most protos, is inline. The one for
+// the deeper levels is allocated the first time they are reached, and kept
+// from then on. This keeps root messages (e.g. the one held by each
+// TraceWriter) small, without bounding the nesting below kMaxNestingDepth.
+class PERFETTO_EXPORT MessageArena {
+ public:
+  static constexpr uint32_t kInlineNestingDepth = 4;
+
+  MessageArena();
+  ~MessageArena();
+
+  // Returns the storage for the nested message at |nesting_depth| (>= 1).
+  Message* GetMessageStorage(uint32_t nesting_depth) {
+    PERFETTO_DCHECK(nesting_depth >= 1);
+    if (PERFETTO_LIKELY(nesting_depth <= kInlineNestingDepth))
+      return reinterpret_cast<Message*>(&inline_storage_[nesting_depth - 1]);
+    return GetOverflowStorage(nesting_depth);
+  }
+
+ private:
+  using Storage = std::aligned_storage<sizeof(Message), alignof(Message)>::type;
+
+  MessageArena(const MessageArena&) = delete;
+  MessageArena& operator=(const MessageArena&) = delete;
+
+  Message* GetOverflowStorage(uint32_t nesting_depth);
+
+  Storage inline_storage_[kInlineNestingDepth];
+
+  // Storage for the levels from kInlineNestingDepth + 1 to kMaxNestingDepth.
+  std::unique_ptr<Storage[]> overflow_storage_;
+};
+
+// A root (i.e. non-nested) message of type |T| together with the storage for
+// its nested messages. This is what the owner of the ScatteredStreamWriter
+// (e.g. the TraceWriter) should instantiate.
+template <typename T>
+class RootMessage : public T {
+ public:
+  RootMessage() = default;
+
+  void Reset(ScatteredStreamWriter* stream_writer) {
+    T::Reset(stream_writer, &arena_);
+  }
+
+ private:
+  RootMessage(const RootMessage&) = delete;
+  RootMessage& operator=(const RootMessage&) = delete;
 
-  // DO NOT add any fields below |nested_messages_arena_|. The memory layout of
-  // nested messages would overflow the storage allocated by the root message.
+  MessageArena arena_;
 };
 
 }  // namespace protozero
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_PERFETTO_PROTOZERO_PACKED_REPEATED_FIELDS_H_
+#define INCLUDE_PERFETTO_PROTOZERO_PACKED_REPEATED_FIELDS_H_
+
+#include "perfetto/protozero/message.h"
+#include "perfetto/protozero/proto_utils.h"
+
+namespace protozero {
+
+// Stubs to stream the values of a packed repeated field one at a time, for the
+// cases where they aren't known upfront (otherwise Message::AppendPacked*()
+// is simpler and faster). On the wire a packed field looks like a nested
+// message whose payload is the sequence of its untagged values. Hence these
+// are written through BeginNestedMessage(), which reserves the length of the
+// field and backfills it when the field is finalized (also when the values
+// span across several chunks). They are returned by the add_xxx_packed()
+// methods of the generated stubs and, like any nested message, are finalized
+// as soon as any other field of the parent message is written.
+
+// Proto types: packed repeated uint64, uint32, int64, int32, bool, enum.
+template <typename T>
+class PackedVarInt : public Message {
+ public:
+  void Append(T value) { AppendRawVarInt(value); }
+};
+
+// Proto types: packed repeated sint64, sint32.
+template <typename T>
+class PackedSignedVarInt : public Message {
+ public:
+  void Append(T value) { AppendRawVarInt(proto_utils::ZigZagEncode(value)); }
+};
+
+// Proto types: packed repeated fixed64, sfixed64, fixed32, sfixed32, double,
+// float.
+template <typename T>
+class PackedFixed : public Message {
+ public:
+  void Append(T value) { AppendRawFixed(value); }
+};
+
+}  // namespace protozero
+
+#endif  // INCLUDE_PERFETTO_PROTOZERO_PACKED_REPEATED_FIELDS_H_
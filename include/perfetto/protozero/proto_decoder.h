@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_PERFETTO_PROTOZERO_PROTO_DECODER_H_
+#define INCLUDE_PERFETTO_PROTOZERO_PROTO_DECODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <limits>
+#include <string>
+
+#include "perfetto/base/utils.h"
+#include "perfetto/protozero/proto_utils.h"
+
+namespace protozero {
+
+// A read-only view of the payload of a length-delimited field (bytes or
+// nested message). Does not own the memory.
+struct ConstBytes {
+  const uint8_t* data;
+  size_t size;
+};
+
+// Same as above, for string fields. The string is NOT null-terminated.
+struct ConstChars {
+  std::string ToStdString() const { return std::string(data, size); }
+
+  const char* data;
+  size_t size;
+};
+
+// Reads the fields of a proto-encoded message from a contiguous byte range,
+// without copying or allocating memory. This is the decoding counterpart of
+// protozero::Message: the returned fields point straight into the buffer,
+// which must outlive them. Nested messages are decoded by constructing another
+// ProtoDecoder over their payload (see ConstBytes).
+//
+// The input is not trusted: malformed or truncated fields never cause
+// out-of-bounds reads, they just stop the decoding. Callers that care about
+// well-formedness (e.g. PacketStreamValidator) check that bytes_left() is 0
+// once ReadField() returns an invalid field.
+//
+// The .pbzero.h stubs generated by the protoc plugin contain a typed Decoder
+// for each message, built on top of this class.
+class ProtoDecoder {
+ public:
+  // Keep this struct trivially constructible: Field{} is the invalid field.
+  struct Field {
+    bool valid() const { return id != 0; }
+
+    uint32_t as_uint32() const { return static_cast<uint32_t>(int_value); }
+    int32_t as_int32() const { return static_cast<int32_t>(int_value); }
+    uint64_t as_uint64() const { return int_value; }
+    int64_t as_int64() const { return static_cast<int64_t>(int_value); }
+    bool as_bool() const { return int_value != 0; }
+
+    // For sint32 and sint64 fields (ZigZag encoded).
+    int32_t as_sint32() const {
+      return static_cast<int32_t>(static_cast<uint32_t>(int_value) >> 1) ^
+             -static_cast<int32_t>(int_value & 1);
+    }
+    int64_t as_sint64() const {
+      return static_cast<int64_t>(int_value >> 1) ^
+             -static_cast<int64_t>(int_value & 1);
+    }
+
+    float as_float() const {
+      float value;
+      uint32_t bits = as_uint32();
+      memcpy(&value, &bits, sizeof(value));
+      return value;
+    }
+    double as_double() const {
+      double value;
+      memcpy(&value, &int_value, sizeof(value));
+      return value;
+    }
+
+    // Only for length-delimited fields.
+    ConstBytes as_bytes() const {
+      return ConstBytes{data, static_cast<size_t>(int_value)};
+    }
+    ConstChars as_string() const {
+      return ConstChars{reinterpret_cast<const char*>(data),
+                        static_cast<size_t>(int_value)};
+    }
+
+    uint32_t id;  // 0 for the invalid field, as 0 is not a valid field id.
+    proto_utils::FieldType type;
+
+    // The value of varint and fixed fields. The size of the payload of
+    // length-delimited fields (as in proto_utils::ParseField()).
+    uint64_t int_value;
+
+    // The payload of length-delimited fields, nullptr for the other types.
+    const uint8_t* data;
+  };
+
+  // Iterates over all the occurrences of a (non-packed) repeated field.
+  class RepeatedFieldIterator {
+   public:
+    RepeatedFieldIterator(uint32_t id, const uint8_t* begin, const uint8_t* end)
+        : id_(id), read_ptr_(begin), end_(end) {
+      FindNext();
+    }
+
+    explicit operator bool() const { return field_.valid(); }
+    const Field& operator*() const { return field_; }
+    const Field* operator->() const { return &field_; }
+    RepeatedFieldIterator& operator++() {
+      FindNext();
+      return *this;
+    }
+
+   private:
+    void FindNext();
+
+    uint32_t id_;
+    const uint8_t* read_ptr_;
+    const uint8_t* end_;
+    Field field_;
+  };
+
+  ProtoDecoder(const uint8_t* buffer, size_t length)
+      : begin_(buffer), end_(buffer + length), read_ptr_(buffer) {}
+  explicit ProtoDecoder(ConstBytes bytes)
+      : ProtoDecoder(bytes.data, bytes.size) {}
+
+  // Reads the next field and moves past it. Returns the invalid field once
+  // the end of the buffer is reached, or if the next field is malformed. In
+  // the latter case the read cursor doesn't move and bytes_left() is > 0.
+  Field ReadField();
+
+  // Returns the last occurrence of the field with the given |id| (which is the
+  // one that counts for non-repeated fields), or the invalid field if there is
+  // none. Scans the whole buffer and doesn't move the read cursor.
+  Field FindField(uint32_t id) const;
+
+  // Returns an iterator over all the occurrences of the field |id|.
+  RepeatedFieldIterator GetRepeated(uint32_t id) const {
+    return RepeatedFieldIterator(id, begin_, end_);
+  }
+
+  // Moves the read cursor back to the beginning of the buffer.
+  void Reset() { read_ptr_ = begin_; }
+
+  size_t read_offset() const {
+    return static_cast<size_t>(read_ptr_ - begin_);
+  }
+  size_t bytes_left() const { return static_cast<size_t>(end_ - read_ptr_); }
+
+  // Parses a varint in [ptr, end). Returns a pointer to the byte after it, or
+  // nullptr if the varint is truncated or longer than 10 bytes. Unlike
+  // proto_utils::ParseVarInt(), this is safe to use on untrusted input.
+  static inline const uint8_t* ParseVarInt(const uint8_t* ptr,
+                                           const uint8_t* end,
+                                           uint64_t* value) {
+    uint64_t result = 0;
+    for (uint32_t shift = 0; ptr < end && shift < 64; shift += 7) {
+      const uint8_t byte = *ptr++;
+      result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        *value = result;
+        return ptr;
+      }
+    }
+    return nullptr;
+  }
+
+  // Parses the preamble of the field at |ptr| and either its value (varint and
+  // fixed fields) or the size of its payload (length-delimited fields, in
+  // which case |field->data| is set to the returned pointer). Returns a
+  // pointer to the byte after the parsed part, or nullptr if that is
+  // malformed or truncated. Does NOT check that the payload of
+  // length-delimited fields fits in [ptr, end): that is up to the caller,
+  // which might have it in a different buffer (e.g. for messages split
+  // across several non-contiguous buffers).
+  static const uint8_t* ParseFieldHeader(const uint8_t* ptr,
+                                         const uint8_t* end,
+                                         Field* field);
+
+ private:
+  // Like ReadField(), but starting from |ptr|. Returns the pointer to the
+  // next field, or nullptr if the field is malformed.
+  static const uint8_t* ParseField(const uint8_t* ptr,
+                                   const uint8_t* end,
+                                   Field* field);
+
+  const uint8_t* const begin_;
+  const uint8_t* const end_;
+  const uint8_t* read_ptr_;
+};
+
+// Iterates over the values of a packed repeated field. |wire_type| is the one
+// of the elements: kFieldTypeVarInt for integers, bools and enums,
+// kFieldTypeFixed32 / kFieldTypeFixed64 for the fixed-size types (including
+// float and double). |zigzag| is true for sint32 and sint64.
+template <proto_utils::FieldType wire_type,
+          typename CppType,
+          bool zigzag = false>
+class PackedRepeatedFieldIterator {
+ public:
+  static_assert(wire_type != proto_utils::kFieldTypeLengthDelimited,
+                "Only scalar fields can be packed");
+  static_assert(wire_type == proto_utils::kFieldTypeVarInt ||
+                    sizeof(CppType) ==
+                        (wire_type == proto_utils::kFieldTypeFixed32 ? 4 : 8),
+                "CppType doesn't match the size of the fixed wire type");
+  static_assert(!zigzag || wire_type == proto_utils::kFieldTypeVarInt,
+                "Only varints can be ZigZag encoded");
+
+  // Iterates over a single packed payload (see Field::as_bytes()).
+  explicit PackedRepeatedFieldIterator(ConstBytes payload)
+      : occurrences_(0, nullptr, nullptr),
+        read_ptr_(payload.data),
+        end_(payload.data + payload.size) {
+    Next();
+  }
+
+  // Iterates over the values of all the occurrences of the field |id| in
+  // |decoder|. A packed field can be split across several occurrences (e.g.
+  // by the streaming add_xxx_packed() of protozero::Message), and decoders
+  // must accept its values also when they are not packed.
+  PackedRepeatedFieldIterator(uint32_t id, const ProtoDecoder& decoder)
+      : occurrences_(decoder.GetRepeated(id)),
+        read_ptr_(nullptr),
+        end_(nullptr) {
+    Next();
+  }
+
+  explicit operator bool() const { return valid_; }
+  CppType operator*() const { return value_; }
+  PackedRepeatedFieldIterator& operator++() {
+    Next();
+    return *this;
+  }
+
+  // True if a payload ended in the middle of a value, or if an unpacked
+  // occurrence had the wrong wire type. These are skipped.
+  bool parse_error() const { return parse_error_; }
+
+ private:
+  void Next() {
+    valid_ = false;
+    while (read_ptr_ >= end_) {
+      if (!occurrences_)
+        return;
+      const ProtoDecoder::Field field = *occurrences_;
+      ++occurrences_;
+      if (field.type == proto_utils::kFieldTypeLengthDelimited) {
+        read_ptr_ = field.data;
+        end_ = field.data + field.as_bytes().size;
+      } else if (field.type == wire_type) {
+        SetValue(field.int_value);
+        return;
+      } else {
+        parse_error_ = true;
+      }
+    }
+    if (wire_type == proto_utils::kFieldTypeVarInt) {
+      uint64_t value = 0;
+      const uint8_t* next = ProtoDecoder::ParseVarInt(read_ptr_, end_, &value);
+      if (!next) {
+        parse_error_ = true;
+        return;
+      }
+      read_ptr_ = next;
+      SetValue(value);
+    } else {
+      if (static_cast<size_t>(end_ - read_ptr_) < sizeof(CppType)) {
+        parse_error_ = true;
+        return;
+      }
+      memcpy(&value_, read_ptr_, sizeof(CppType));
+      read_ptr_ += sizeof(CppType);
+      valid_ = true;
+    }
+  }
+
+  // |raw_value| is as in ProtoDecoder::Field::int_value.
+  void SetValue(uint64_t raw_value) {
+    if (wire_type != proto_utils::kFieldTypeVarInt) {
+      // The fixed32 values are in the lower bits.
+      const uint32_t raw_value32 = static_cast<uint32_t>(raw_value);
+      const void* src = &raw_value;
+      if (sizeof(CppType) == sizeof(raw_value32))
+        src = &raw_value32;
+      memcpy(&value_, src, sizeof(CppType));
+    } else if (zigzag) {
+      value_ = static_cast<CppType>(static_cast<int64_t>(raw_value >> 1) ^
+                                    -static_cast<int64_t>(raw_value & 1));
+    } else {
+      value_ = static_cast<CppType>(raw_value);
+    }
+    valid_ = true;
+  }
+
+  ProtoDecoder::RepeatedFieldIterator occurrences_;
+  const uint8_t* read_ptr_;
+  const uint8_t* end_;
+  CppType value_{};
+  bool valid_ = false;
+  bool parse_error_ = false;
+};
+
+// static
+inline const uint8_t* ProtoDecoder::ParseFieldHeader(const uint8_t* ptr,
+                                                     const uint8_t* end,
+                                                     Field* field) {
+  // The preamble is a varint: the field id is in the upper bits, the wire type
+  // in the 3 least significant ones.
+  uint64_t preamble = 0;
+  ptr = ParseVarInt(ptr, end, &preamble);
+  if (PERFETTO_UNLIKELY(!ptr))
+    return nullptr;
+  const uint64_t field_id = preamble >> 3;
+  if (PERFETTO_UNLIKELY(field_id == 0 ||
+                        field_id > std::numeric_limits<uint32_t>::max())) {
+    return nullptr;
+  }
+  field->id = static_cast<uint32_t>(field_id);
+  field->type = static_cast<proto_utils::FieldType>(preamble & 7);
+  field->data = nullptr;
+
+  switch (field->type) {
+    case proto_utils::kFieldTypeVarInt:
+      return ParseVarInt(ptr, end, &field->int_value);
+
+    case proto_utils::kFieldTypeFixed64:
+      if (PERFETTO_UNLIKELY(end - ptr < static_cast<ptrdiff_t>(8)))
+        return nullptr;
+      memcpy(&field->int_value, ptr, sizeof(uint64_t));
+      return ptr + sizeof(uint64_t);
+
+    case proto_utils::kFieldTypeFixed32: {
+      if (PERFETTO_UNLIKELY(end - ptr < static_cast<ptrdiff_t>(4)))
+        return nullptr;
+      uint32_t value;
+      memcpy(&value, ptr, sizeof(uint32_t));
+      field->int_value = value;
+      return ptr + sizeof(uint32_t);
+    }
+
+    case proto_utils::kFieldTypeLengthDelimited:
+      ptr = ParseVarInt(ptr, end, &field->int_value);
+      field->data = ptr;
+      return ptr;
+  }
+
+  // Groups (deprecated) and invalid wire types.
+  return nullptr;
+}
+
+// static
+inline const uint8_t* ProtoDecoder::ParseField(const uint8_t* ptr,
+                                               const uint8_t* end,
+                                               Field* field) {
+  ptr = ParseFieldHeader(ptr, end, field);
+  if (ptr && field->type == proto_utils::kFieldTypeLengthDelimited) {
+    if (PERFETTO_UNLIKELY(field->int_value >
+                          static_cast<uint64_t>(end - ptr))) {
+      return nullptr;
+    }
+    ptr += field->int_value;
+  }
+  return ptr;
+}
+
+inline ProtoDecoder::Field ProtoDecoder::ReadField() {
+  Field field;
+  const uint8_t* next =
+      read_ptr_ < end_ ? ParseField(read_ptr_, end_, &field) : nullptr;
+  if (!next)
+    return Field{};
+  read_ptr_ = next;
+  return field;
+}
+
+}  // namespace protozero
+
+#endif  // INCLUDE_PERFETTO_PROTOZERO_PROTO_DECODER_H_
@@ -19,6 +19,7 @@
 
 #include <inttypes.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <type_traits>
 
@@ -42,7 +43,9 @@ constexpr size_t kMaxMessageLength = (1u << (kMessageLengthFieldSize * 7)) - 1;
 // Largest value of simple (not length-delimited) field is 64-bit varint
 // (10 bytes at most). 15 bytes buffer is enough to store a simple field.
 constexpr size_t kMaxTagEncodedSize = 5;
-constexpr size_t kMaxSimpleFieldEncodedSize = kMaxTagEncodedSize + 10;
+constexpr size_t kMaxVarIntEncodedSize = 10;
+constexpr size_t kMaxSimpleFieldEncodedSize =
+    kMaxTagEncodedSize + kMaxVarIntEncodedSize;
 
 // Proto types: (int|uint|sint)(32|64), bool, enum.
 constexpr uint32_t MakeTagVarInt(uint32_t field_id) {
@@ -83,6 +86,30 @@ inline uint8_t* WriteVarInt(T value, uint8_t* target) {
   return target + 1;
 }
 
+// bool has no std::make_unsigned<> counterpart.
+inline uint8_t* WriteVarInt(bool value, uint8_t* target) {
+  *target = value ? 1 : 0;
+  return target + 1;
+}
+
+// Returns the number of bytes that WriteVarInt() takes to encode |value|.
+template <typename T>
+inline size_t VarIntSize(T value) {
+  using UnsignedType = typename std::make_unsigned<T>::type;
+  UnsignedType unsigned_value = static_cast<UnsignedType>(value);
+
+  size_t size = 1;
+  while (unsigned_value >= 0x80) {
+    unsigned_value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+inline size_t VarIntSize(bool) {
+  return 1;
+}
+
 // Writes a fixed-size redundant encoding of the given |value|. This is
 // used to backfill fixed-size reservations for the length field using a
 // non-canonical varint encoding (e.g. \x81\x80\x80\x00 instead of \x01).
@@ -98,6 +125,41 @@ inline void WriteRedundantVarInt(uint32_t value, uint8_t* buf) {
   }
 }
 
+// Compile-time counterparts of VarIntSize() and WriteVarInt(). The latter
+// returns the encoded bytes packed in little-endian order into an integer, so
+// it's limited to values that take at most 8 bytes (e.g. field tags).
+constexpr size_t VarIntSizeConstexpr(uint64_t value) {
+  return value < 0x80 ? 1 : 1 + VarIntSizeConstexpr(value >> 7);
+}
+
+constexpr uint64_t EncodeVarIntConstexpr(uint64_t value) {
+  return value < 0x80 ? value
+                      : (value & 0x7f) | 0x80 |
+                            (EncodeVarIntConstexpr(value >> 7) << 8);
+}
+
+// The tag of a field whose id and wire type are known at compile time (as in
+// the generated stubs), pre-encoded so that writing it takes one store.
+template <uint32_t field_id, FieldType wire_type>
+struct PreEncodedTag {
+  static constexpr uint32_t kTag = (field_id << 3) | wire_type;
+  static constexpr size_t kSize = VarIntSizeConstexpr(kTag);
+  static constexpr uint64_t kEncoded = EncodeVarIntConstexpr(kTag);
+  static_assert(kSize <= kMaxTagEncodedSize, "Field id too big");
+
+  // Writes the tag at |dst|, which must have room for |kSize| bytes, and
+  // returns the pointer past it. Assumes a little-endian architecture.
+  static inline uint8_t* Write(uint8_t* dst) {
+    if (kSize == 1) {
+      *dst = static_cast<uint8_t>(kEncoded);
+    } else {
+      const uint64_t encoded = kEncoded;
+      memcpy(dst, &encoded, kSize);
+    }
+    return dst + kSize;
+  }
+};
+
 template <uint32_t field_id>
 void StaticAssertSingleBytePreamble() {
   static_assert(field_id < 16,
@@ -47,6 +47,14 @@ class PERFETTO_EXPORT ScatteredStreamWriter {
    public:
     virtual ~Delegate();
     virtual ContiguousMemoryRange GetNewBuffer() = 0;
+
+    // Like GetNewBuffer(), but for ReserveBytesForDirectWrite(): asks for a
+    // buffer of at least |min_size| bytes. Can return a smaller buffer, which
+    // is then used as if returned by GetNewBuffer(), or an empty range to
+    // keep using the current one (e.g. if |min_size| is larger than any
+    // buffer the delegate can provide). The default implementation just
+    // calls GetNewBuffer().
+    virtual ContiguousMemoryRange GetNewBufferForDirectWrite(size_t min_size);
   };
 
   explicit ScatteredStreamWriter(Delegate* delegate);
@@ -94,6 +102,20 @@ class PERFETTO_EXPORT ScatteredStreamWriter {
     return begin;
   }
 
+  // Reserves |size| contiguous bytes for the caller to write in place, e.g. to
+  // serialize a large payload straight into the buffer, without going through
+  // an intermediate copy. Unlike ReserveBytes(), |size| can exceed the size of
+  // the buffers returned by Delegate::GetNewBuffer(): if it doesn't fit in the
+  // current buffer, the rest of it is left unused and a new buffer large
+  // enough is requested to Delegate::GetNewBufferForDirectWrite(). Returns
+  // nullptr if the delegate can't provide it, in which case the caller should
+  // fall back on WriteBytes(). The reserved bytes are not zeroed.
+  uint8_t* ReserveBytesForDirectWrite(size_t size) {
+    if (PERFETTO_LIKELY(size <= bytes_available()))
+      return ReserveBytesUnsafe(size);
+    return ReserveBytesForDirectWriteSlowPath(size);
+  }
+
   // Resets the buffer boundaries and the write pointer to the given |range|.
   // Subsequent WriteByte(s) will write into |range|.
   void Reset(ContiguousMemoryRange range);
@@ -106,11 +128,20 @@ class PERFETTO_EXPORT ScatteredStreamWriter {
 
   uint8_t* write_ptr() const { return write_ptr_; }
 
+  // For callers that write directly at write_ptr(), after having checked that
+  // there are enough bytes_available(): moves the write pointer past the bytes
+  // they have written.
+  void set_write_ptr(uint8_t* write_ptr) {
+    assert(write_ptr >= write_ptr_ && write_ptr <= cur_range_.end);
+    write_ptr_ = write_ptr;
+  }
+
  private:
   ScatteredStreamWriter(const ScatteredStreamWriter&) = delete;
   ScatteredStreamWriter& operator=(const ScatteredStreamWriter&) = delete;
 
   void Extend();
+  uint8_t* ReserveBytesForDirectWriteSlowPath(size_t size);
 
   Delegate* const delegate_;
   ContiguousMemoryRange cur_range_;
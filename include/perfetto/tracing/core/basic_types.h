@@ -62,6 +62,55 @@ static constexpr size_t kBufferPageSize = 8192;
 
 constexpr uid_t kInvalidUid = static_cast<uid_t>(-1);
 
+// What a TraceWriter should do when the shared memory buffer is full and it
+// needs a new chunk to write into.
+enum class BufferExhaustedPolicy {
+  // Block the writing thread until the service frees up a chunk. No data is
+  // lost, but the calling thread can stall for a significant amount of time.
+  kStall = 0,
+
+  // Never block. Discard the packets written until a chunk becomes available
+  // again and report the number of lost packets and bytes to the service,
+  // which exposes them in TraceStats. Meant for latency-sensitive threads.
+  kDrop = 1,
+};
+
+// Controls how the producer batches the CommitData() requests for the chunks
+// it completes. See TraceConfig.ProducerConfig.commit_max_latency_ms & co.
+// The default policy commits the completed chunks at the next task.
+struct CommitPolicy {
+  // Max time a completed chunk can wait before being committed.
+  uint32_t max_latency_ms = 0;
+
+  // Commit straight away (at the next task) once these many bytes of chunks
+  // are pending, without waiting for |max_latency_ms|.
+  uint32_t min_batch_bytes = 0;
+
+  // If true, |max_latency_ms| is reduced when the shared memory buffer fills
+  // up quickly, so that the pending chunks never take more than a fraction
+  // of it.
+  bool adaptive = false;
+};
+
+// How the producer should use the shared memory buffer and commit its chunks.
+// Decided by the service from the TraceConfig.ProducerConfig, and passed to
+// the producer along with the buffer.
+struct SharedMemoryOptions {
+  // If true, the service reserved the last page of the buffer for the commit
+  // ring (see TraceConfig.ProducerConfig.use_commit_ring). The page must not
+  // be used for chunks.
+  bool use_commit_ring = false;
+
+  // If true, the service scans the buffer for complete chunks (see
+  // TraceConfig.ProducerConfig.smb_scan_period_ms). The producer is expected
+  // to commit only the first chunk of each writer, so that the service learns
+  // its target buffer, and the patches.
+  bool service_scans_smb = false;
+
+  // How the producer should batch its CommitData() requests.
+  CommitPolicy commit_policy;
+};
+
 }  // namespace perfetto
 
 #endif  // INCLUDE_PERFETTO_TRACING_CORE_BASIC_TYPES_H_
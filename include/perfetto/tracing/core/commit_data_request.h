@@ -42,6 +42,7 @@ class CommitDataRequest;
 class CommitDataRequest_ChunksToMove;
 class CommitDataRequest_ChunkToPatch;
 class CommitDataRequest_ChunkToPatch_Patch;
+class CommitDataRequest_DataLoss;
 }  // namespace protos
 }  // namespace perfetto
 
@@ -158,6 +159,38 @@ class PERFETTO_EXPORT CommitDataRequest {
     std::string unknown_fields_;
   };
 
+  class PERFETTO_EXPORT DataLoss {
+   public:
+    DataLoss();
+    ~DataLoss();
+    DataLoss(DataLoss&&) noexcept;
+    DataLoss& operator=(DataLoss&&);
+    DataLoss(const DataLoss&);
+    DataLoss& operator=(const DataLoss&);
+
+    // Conversion methods from/to the corresponding protobuf types.
+    void FromProto(const perfetto::protos::CommitDataRequest_DataLoss&);
+    void ToProto(perfetto::protos::CommitDataRequest_DataLoss*) const;
+
+    uint32_t target_buffer() const { return target_buffer_; }
+    void set_target_buffer(uint32_t value) { target_buffer_ = value; }
+
+    uint64_t packets_dropped() const { return packets_dropped_; }
+    void set_packets_dropped(uint64_t value) { packets_dropped_ = value; }
+
+    uint64_t bytes_dropped() const { return bytes_dropped_; }
+    void set_bytes_dropped(uint64_t value) { bytes_dropped_ = value; }
+
+   private:
+    uint32_t target_buffer_ = {};
+    uint64_t packets_dropped_ = {};
+    uint64_t bytes_dropped_ = {};
+
+    // Allows to preserve unknown protobuf fields for compatibility
+    // with future versions of .proto files.
+    std::string unknown_fields_;
+  };
+
   CommitDataRequest();
   ~CommitDataRequest();
   CommitDataRequest(CommitDataRequest&&) noexcept;
@@ -194,10 +227,59 @@ class PERFETTO_EXPORT CommitDataRequest {
   uint64_t flush_request_id() const { return flush_request_id_; }
   void set_flush_request_id(uint64_t value) { flush_request_id_ = value; }
 
+  int data_losses_size() const { return static_cast<int>(data_losses_.size()); }
+  const std::vector<DataLoss>& data_losses() const { return data_losses_; }
+  DataLoss* add_data_losses() {
+    data_losses_.emplace_back();
+    return &data_losses_.back();
+  }
+
+  uint32_t commit_ring_write_idx() const { return commit_ring_write_idx_; }
+  void set_commit_ring_write_idx(uint32_t value) {
+    commit_ring_write_idx_ = value;
+  }
+
+  int packed_chunks_to_move_size() const {
+    return static_cast<int>(packed_chunks_to_move_.size());
+  }
+  const std::vector<uint32_t>& packed_chunks_to_move() const {
+    return packed_chunks_to_move_;
+  }
+  uint32_t* add_packed_chunks_to_move() {
+    packed_chunks_to_move_.emplace_back();
+    return &packed_chunks_to_move_.back();
+  }
+
+  const std::string& packed_chunks_to_patch() const {
+    return packed_chunks_to_patch_;
+  }
+  void set_packed_chunks_to_patch(const std::string& value) {
+    packed_chunks_to_patch_ = value;
+  }
+  void set_packed_chunks_to_patch(const void* p, size_t s) {
+    packed_chunks_to_patch_.assign(reinterpret_cast<const char*>(p), s);
+  }
+
+  int released_writers_size() const {
+    return static_cast<int>(released_writers_.size());
+  }
+  const std::vector<uint32_t>& released_writers() const {
+    return released_writers_;
+  }
+  uint32_t* add_released_writers() {
+    released_writers_.emplace_back();
+    return &released_writers_.back();
+  }
+
  private:
   std::vector<ChunksToMove> chunks_to_move_;
   std::vector<ChunkToPatch> chunks_to_patch_;
   uint64_t flush_request_id_ = {};
+  std::vector<DataLoss> data_losses_;
+  uint32_t commit_ring_write_idx_ = {};
+  std::vector<uint32_t> packed_chunks_to_move_;
+  std::string packed_chunks_to_patch_ = {};
+  std::vector<uint32_t> released_writers_;
 
   // Allows to preserve unknown protobuf fields for compatibility
   // with future versions of .proto files.
@@ -56,6 +56,10 @@ class TraceWriter;
 //   The service business logic in src/core/service_impl.cc.
 class PERFETTO_EXPORT Service {
  public:
+  // The number of concurrent tracing sessions allowed unless
+  // SetTracingSessionLimits() says otherwise.
+  static constexpr size_t kDefaultMaxTracingSessions = 5;
+
   // The API for the Producer port of the Service.
   // Subclassed by:
   // 1. The service_impl.cc business logic when returning it in response to
@@ -83,6 +87,10 @@ class PERFETTO_EXPORT Service {
     // See shared_memory_abi.h
     virtual size_t shared_buffer_page_size_kb() const = 0;
 
+    // How the producer should use the shared memory buffer and commit its
+    // chunks. See basic_types.h.
+    virtual SharedMemoryOptions shared_memory_options() const = 0;
+
     // Creates a trace writer, which allows to create events, handling the
     // underying shared memory buffer and signalling to the Service. This method
     // is thread-safe but the returned object is not. A TraceWriter should be
@@ -93,8 +101,15 @@ class PERFETTO_EXPORT Service {
     // writer should be stored by the tracing service. This value is passed
     // upon creation of the data source (CreateDataSourceInstance()) in the
     // DataSourceConfig.target_buffer().
+    // |buffer_exhausted_policy| decides whether the writer should block or
+    // drop data when the shared memory buffer is full. Writers used on
+    // latency-sensitive threads should pass BufferExhaustedPolicy::kDrop.
     virtual std::unique_ptr<TraceWriter> CreateTraceWriter(
-        BufferID target_buffer) = 0;
+        BufferID target_buffer,
+        BufferExhaustedPolicy buffer_exhausted_policy) = 0;
+
+    // Same as above, with BufferExhaustedPolicy::kStall.
+    std::unique_ptr<TraceWriter> CreateTraceWriter(BufferID target_buffer);
 
     // Called in response to a Producer::Flush(request_id) call after all data
     // for the flush request has been committed.
@@ -127,6 +142,14 @@ class PERFETTO_EXPORT Service {
     // Tracing data will be delivered invoking Consumer::OnTraceData().
     virtual void ReadBuffers() = 0;
 
+    // Like ReadBuffers(), but doesn't consume the contents of the buffers:
+    // the data returned is read from a copy of the buffers taken at the time
+    // of the call, while the tracing session keeps writing into them. This
+    // allows to dump a ring buffer (e.g. a long running "flight recorder"
+    // session) more than once. Packets returned by this call will be returned
+    // again by the next ReadBuffers() call.
+    virtual void ReadBuffersSnapshot() = 0;
+
     virtual void FreeBuffers() = 0;
   };  // class ConsumerEndpoint.
 
@@ -163,6 +186,18 @@ class PERFETTO_EXPORT Service {
   // To disconnect just destroy the returned ConsumerEndpoint object. It is safe
   // to destroy the Consumer once the Consumer::OnDisconnect() has been invoked.
   virtual std::unique_ptr<ConsumerEndpoint> ConnectConsumer(Consumer*) = 0;
+
+  // Moves the copy of the committed chunks into the trace buffers (and the
+  // patching of their contents) to |num_threads| threads, each one owning a
+  // subset of the buffers. 0 (the default) keeps everything on the service's
+  // task runner. Must be called before any producer connects.
+  virtual void SetDataPlaneThreads(size_t num_threads) = 0;
+
+  // Limits the number of concurrent tracing sessions and the total size of
+  // their buffers. EnableTracing() fails for the sessions above the limits.
+  // 0 |max_total_buffer_size_kb| means no limit (the default).
+  virtual void SetTracingSessionLimits(size_t max_sessions,
+                                       size_t max_total_buffer_size_kb) = 0;
 };
 
 }  // namespace perfetto
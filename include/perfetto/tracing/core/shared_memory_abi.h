@@ -522,14 +522,17 @@ class SharedMemoryABI {
     return kNumChunksForLayout[(page_layout & kLayoutMask) >> kLayoutShift];
   }
 
- private:
-  SharedMemoryABI(const SharedMemoryABI&) = delete;
-  SharedMemoryABI& operator=(const SharedMemoryABI&) = delete;
-
+  // Returns the size of each chunk (including its ChunkHeader) of a page with
+  // the given |page_layout| (the word stored in the PageHeader), or 0 if the
+  // page is not partitioned.
   uint16_t GetChunkSizeForLayout(uint32_t page_layout) const {
     return chunk_sizes_[(page_layout & kLayoutMask) >> kLayoutShift];
   }
 
+ private:
+  SharedMemoryABI(const SharedMemoryABI&) = delete;
+  SharedMemoryABI& operator=(const SharedMemoryABI&) = delete;
+
   Chunk TryAcquireChunk(size_t page_idx,
                         size_t chunk_idx,
                         ChunkState,
@@ -47,19 +47,27 @@ class PERFETTO_EXPORT SharedMemoryArbiter {
   // written in each chunk header owned by a given TraceWriter and is used by
   // the Service to reconstruct TracePackets written by the same TraceWriter.
   // Returns null impl of TraceWriter if all WriterID slots are exhausted.
+  // |buffer_exhausted_policy| decides what the writer does when the shared
+  // memory buffer is full (see BufferExhaustedPolicy in basic_types.h).
   virtual std::unique_ptr<TraceWriter> CreateTraceWriter(
-      BufferID target_buffer) = 0;
+      BufferID target_buffer,
+      BufferExhaustedPolicy buffer_exhausted_policy) = 0;
+
+  // Same as above, with BufferExhaustedPolicy::kStall.
+  std::unique_ptr<TraceWriter> CreateTraceWriter(BufferID target_buffer);
 
   // Notifies the service that all data for the given FlushRequestID has been
   // committed in the shared memory buffer.
   virtual void NotifyFlushComplete(FlushRequestID) = 0;
 
   // Implemented in src/core/shared_memory_arbiter_impl.cc .
+  // |options| must match ProducerEndpoint::shared_memory_options().
   static std::unique_ptr<SharedMemoryArbiter> CreateInstance(
       SharedMemory*,
       size_t page_size,
       Service::ProducerEndpoint*,
-      base::TaskRunner*);
+      base::TaskRunner*,
+      const SharedMemoryOptions& options = SharedMemoryOptions());
 };
 
 }  // namespace perfetto
@@ -65,6 +65,7 @@ class PERFETTO_EXPORT TraceConfig {
     enum FillPolicy {
       UNSPECIFIED = 0,
       RING_BUFFER = 1,
+      DISCARD = 2,
     };
     BufferConfig();
     ~BufferConfig();
@@ -83,9 +84,17 @@ class PERFETTO_EXPORT TraceConfig {
     FillPolicy fill_policy() const { return fill_policy_; }
     void set_fill_policy(FillPolicy value) { fill_policy_ = value; }
 
+    bool use_huge_pages() const { return use_huge_pages_; }
+    void set_use_huge_pages(bool value) { use_huge_pages_ = value; }
+
+    uint32_t producer_quota_kb() const { return producer_quota_kb_; }
+    void set_producer_quota_kb(uint32_t value) { producer_quota_kb_ = value; }
+
    private:
     uint32_t size_kb_ = {};
     FillPolicy fill_policy_ = {};
+    bool use_huge_pages_ = {};
+    uint32_t producer_quota_kb_ = {};
 
     // Allows to preserve unknown protobuf fields for compatibility
     // with future versions of .proto files.
@@ -119,9 +128,13 @@ class PERFETTO_EXPORT TraceConfig {
       return &producer_name_filter_.back();
     }
 
+    bool share_instance() const { return share_instance_; }
+    void set_share_instance(bool value) { share_instance_ = value; }
+
    private:
     DataSourceConfig config_ = {};
     std::vector<std::string> producer_name_filter_;
+    bool share_instance_ = {};
 
     // Allows to preserve unknown protobuf fields for compatibility
     // with future versions of .proto files.
@@ -156,10 +169,34 @@ class PERFETTO_EXPORT TraceConfig {
     uint32_t page_size_kb() const { return page_size_kb_; }
     void set_page_size_kb(uint32_t value) { page_size_kb_ = value; }
 
+    bool use_commit_ring() const { return use_commit_ring_; }
+    void set_use_commit_ring(bool value) { use_commit_ring_ = value; }
+
+    uint32_t smb_scan_period_ms() const { return smb_scan_period_ms_; }
+    void set_smb_scan_period_ms(uint32_t value) { smb_scan_period_ms_ = value; }
+
+    uint32_t commit_max_latency_ms() const { return commit_max_latency_ms_; }
+    void set_commit_max_latency_ms(uint32_t value) {
+      commit_max_latency_ms_ = value;
+    }
+
+    uint32_t commit_min_batch_kb() const { return commit_min_batch_kb_; }
+    void set_commit_min_batch_kb(uint32_t value) {
+      commit_min_batch_kb_ = value;
+    }
+
+    bool adaptive_commit() const { return adaptive_commit_; }
+    void set_adaptive_commit(bool value) { adaptive_commit_ = value; }
+
    private:
     std::string producer_name_ = {};
     uint32_t shm_size_kb_ = {};
     uint32_t page_size_kb_ = {};
+    bool use_commit_ring_ = {};
+    uint32_t smb_scan_period_ms_ = {};
+    uint32_t commit_max_latency_ms_ = {};
+    uint32_t commit_min_batch_kb_ = {};
+    bool adaptive_commit_ = {};
 
     // Allows to preserve unknown protobuf fields for compatibility
     // with future versions of .proto files.
@@ -300,6 +337,14 @@ class PERFETTO_EXPORT TraceConfig {
     return &guardrail_overrides_;
   }
 
+  bool stop_when_buffers_full() const { return stop_when_buffers_full_; }
+  void set_stop_when_buffers_full(bool value) {
+    stop_when_buffers_full_ = value;
+  }
+
+  bool sort_packets() const { return sort_packets_; }
+  void set_sort_packets(bool value) { sort_packets_ = value; }
+
  private:
   std::vector<BufferConfig> buffers_;
   std::vector<DataSource> data_sources_;
@@ -312,6 +357,8 @@ class PERFETTO_EXPORT TraceConfig {
   uint32_t file_write_period_ms_ = {};
   uint64_t max_file_size_bytes_ = {};
   GuardrailOverrides guardrail_overrides_ = {};
+  bool stop_when_buffers_full_ = {};
+  bool sort_packets_ = {};
 
   // Allows to preserve unknown protobuf fields for compatibility
   // with future versions of .proto files.
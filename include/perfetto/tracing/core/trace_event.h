@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_PERFETTO_TRACING_CORE_TRACE_EVENT_H_
+#define INCLUDE_PERFETTO_TRACING_CORE_TRACE_EVENT_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "perfetto/base/export.h"
+#include "perfetto/base/utils.h"
+#include "perfetto/tracing/core/basic_types.h"
+#include "perfetto/tracing/core/service.h"
+
+// Lightweight macros to emit trace events from any thread of a producer
+// process, without having to create and manage TraceWriter(s):
+//
+//   PERFETTO_DEFINE_TRACE_CATEGORY(kRpcCategory, "rpc");
+//
+//   void HandleRequest(const Request& req) {
+//     PERFETTO_TRACE_EVENT(kRpcCategory, "HandleRequest");
+//     PERFETTO_TRACE_COUNTER(kRpcCategory, "queue_size", queue.size());
+//     ...
+//   }
+//
+// Events are written as ChromeTraceEvent(s) by a TraceEventSource, which the
+// producer starts and stops together with the data source instance it backs.
+// Each thread lazily creates its own TraceWriter the first time it emits an
+// event for a TraceEventSource and keeps it until the source is stopped or the
+// thread exits.
+//
+// When a category is disabled, each macro costs a single relaxed atomic load.
+
+// Defines a TraceCategory with static storage duration. Categories can be
+// defined only at namespace scope.
+#define PERFETTO_DEFINE_TRACE_CATEGORY(var, category_name) \
+  ::perfetto::TraceCategory var(category_name)
+
+#define PERFETTO_TRACE_EVENT_ENABLED(category) \
+  PERFETTO_UNLIKELY((category).enabled())
+
+// Emits a begin event now and the matching end event at the end of the scope.
+#define PERFETTO_TRACE_EVENT(category, name)                         \
+  ::perfetto::ScopedTraceEvent PERFETTO_TRACE_EVENT_UID(scoped_event)( \
+      category, name)
+
+#define PERFETTO_TRACE_EVENT_BEGIN(category, name)                     \
+  do {                                                                 \
+    if (PERFETTO_TRACE_EVENT_ENABLED(category)) {                      \
+      ::perfetto::TraceEventSource::AddEvent(                          \
+          category, ::perfetto::TraceEventSource::kPhaseBegin, name); \
+    }                                                                  \
+  } while (0)
+
+#define PERFETTO_TRACE_EVENT_END(category, name)                     \
+  do {                                                               \
+    if (PERFETTO_TRACE_EVENT_ENABLED(category)) {                    \
+      ::perfetto::TraceEventSource::AddEvent(                        \
+          category, ::perfetto::TraceEventSource::kPhaseEnd, name); \
+    }                                                                \
+  } while (0)
+
+#define PERFETTO_TRACE_EVENT_INSTANT(category, name)                     \
+  do {                                                                   \
+    if (PERFETTO_TRACE_EVENT_ENABLED(category)) {                        \
+      ::perfetto::TraceEventSource::AddEvent(                            \
+          category, ::perfetto::TraceEventSource::kPhaseInstant, name); \
+    }                                                                    \
+  } while (0)
+
+#define PERFETTO_TRACE_COUNTER(category, name, value)                    \
+  do {                                                                   \
+    if (PERFETTO_TRACE_EVENT_ENABLED(category)) {                        \
+      ::perfetto::TraceEventSource::AddCounter(category, name,           \
+                                               static_cast<int64_t>(value)); \
+    }                                                                    \
+  } while (0)
+
+#define PERFETTO_TRACE_EVENT_UID_CAT(a, b) a##b
+#define PERFETTO_TRACE_EVENT_UID_EXPAND(a, b) PERFETTO_TRACE_EVENT_UID_CAT(a, b)
+#define PERFETTO_TRACE_EVENT_UID(prefix) \
+  PERFETTO_TRACE_EVENT_UID_EXPAND(perfetto_##prefix##_, __LINE__)
+
+namespace perfetto {
+
+class TraceEventSource;
+
+// A group of trace events that can be enabled and disabled together. Must have
+// static storage duration (see PERFETTO_DEFINE_TRACE_CATEGORY above).
+class PERFETTO_EXPORT TraceCategory {
+ public:
+  explicit TraceCategory(const char* name);
+  ~TraceCategory();
+
+  const char* name() const { return name_; }
+
+  // This is the only check performed by the macros when tracing is off.
+  bool enabled() const {
+    return source_.load(std::memory_order_relaxed) != nullptr;
+  }
+
+ private:
+  friend class TraceEventSource;
+
+  TraceCategory(const TraceCategory&) = delete;
+  TraceCategory& operator=(const TraceCategory&) = delete;
+
+  const char* const name_;
+
+  // The source that writes the events of this category, or nullptr if the
+  // category is disabled.
+  std::atomic<TraceEventSource*> source_{nullptr};
+
+  // All the categories are linked in a list, see trace_event.cc.
+  TraceCategory* next_ = nullptr;
+};
+
+// Writes the events of the enabled categories into the target buffer of a data
+// source instance. The producer calls Start() when the service asks to create
+// the data source instance and Stop() when it's torn down. A category can be
+// enabled in one source at a time. Like categories, sources must have static
+// storage duration: events emitted concurrently with Stop() might still be
+// accessing them.
+class PERFETTO_EXPORT TraceEventSource {
+ public:
+  // Values for ChromeTraceEvent.phase.
+  enum Phase : char {
+    kPhaseBegin = 'B',
+    kPhaseEnd = 'E',
+    kPhaseInstant = 'I',
+    kPhaseCounter = 'C',
+  };
+
+  TraceEventSource();
+  ~TraceEventSource();
+
+  // Enables the categories in |categories|, or all of them if empty, and
+  // writes their events into |target_buffer|. The TraceWriter(s) of the
+  // emitting threads are created through |endpoint|, which must outlive
+  // Stop().
+  void Start(Service::ProducerEndpoint* endpoint,
+             BufferID target_buffer,
+             const std::vector<std::string>& categories);
+
+  // Disables the categories enabled by Start() and destroys the TraceWriter(s)
+  // of all the threads, committing their data. Waits for the events that are
+  // being written concurrently.
+  void Stop();
+
+  // Commits the last chunk of the TraceWriter(s) of all the threads. This is
+  // typically called by the producer when the service asks for a flush.
+  void Flush();
+
+  // Destroys the TraceWriter(s) of the calling thread, for all the sources,
+  // committing their data.
+  static void ResetCurrentThread();
+
+  // Used by the macros above.
+  static void AddEvent(const TraceCategory&, Phase, const char* name);
+  static void AddCounter(const TraceCategory&, const char* name, int64_t value);
+
+ private:
+  struct Session;
+  struct ThreadLocalWriters;
+
+  TraceEventSource(const TraceEventSource&) = delete;
+  TraceEventSource& operator=(const TraceEventSource&) = delete;
+
+  static void WriteEvent(const TraceCategory&,
+                         Phase,
+                         const char* name,
+                         const int64_t* counter_value);
+
+  static ThreadLocalWriters* GetThreadLocalWriters();
+
+  // Returns the writer of the calling thread for the current session, or
+  // nullptr if the source has been stopped. Must be called with the lock of
+  // |writers| held.
+  TraceWriter* GetThreadLocalWriter(ThreadLocalWriters*);
+
+  // The target of the events, replaced upon every Start(). The emitting
+  // threads look at the sessions only with their own lock held, so Stop()
+  // deletes them after having gone through the lock of every thread.
+  std::atomic<const Session*> session_{nullptr};
+  std::vector<std::unique_ptr<Session>> sessions_;
+};
+
+// Used by PERFETTO_TRACE_EVENT.
+class ScopedTraceEvent {
+ public:
+  ScopedTraceEvent(const TraceCategory& category, const char* name)
+      : name_(name) {
+    if (PERFETTO_TRACE_EVENT_ENABLED(category)) {
+      category_ = &category;
+      TraceEventSource::AddEvent(category, TraceEventSource::kPhaseBegin,
+                                 name);
+    }
+  }
+
+  ~ScopedTraceEvent() {
+    if (PERFETTO_UNLIKELY(category_)) {
+      TraceEventSource::AddEvent(*category_, TraceEventSource::kPhaseEnd,
+                                 name_);
+    }
+  }
+
+ private:
+  ScopedTraceEvent(const ScopedTraceEvent&) = delete;
+  ScopedTraceEvent& operator=(const ScopedTraceEvent&) = delete;
+
+  const TraceCategory* category_ = nullptr;
+  const char* const name_;
+};
+
+}  // namespace perfetto
+
+#endif  // INCLUDE_PERFETTO_TRACING_CORE_TRACE_EVENT_H_
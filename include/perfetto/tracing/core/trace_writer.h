@@ -17,6 +17,9 @@
 #ifndef INCLUDE_PERFETTO_TRACING_CORE_TRACE_WRITER_H_
 #define INCLUDE_PERFETTO_TRACING_CORE_TRACE_WRITER_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <functional>
 
 #include "perfetto/base/export.h"
@@ -77,6 +80,21 @@ class PERFETTO_EXPORT TraceWriter {
 
   virtual WriterID writer_id() const = 0;
 
+  // Interning of strings that are repeated across packets. The packets of a
+  // TraceWriter form a sequence, which has its own interning dictionary.
+  // Returns the id of |str| in the dictionary. When |*is_new| is set, the
+  // caller must emit the {id, str} entry in the interned_data of the packet
+  // being written, before any reference to it. Must be called after
+  // NewTracePacket(), which might reset the dictionary: this happens on the
+  // first packet, after the writer has dropped data (which might have
+  // contained some entries), and periodically, so that the entries are
+  // re-emitted after the older packets are overwritten in the ring buffer.
+  virtual uint64_t InternString(const char* str, size_t size, bool* is_new) = 0;
+
+  // Like InternString(), but looks up |str| by address, which is cheaper.
+  // |str| must not change while tracing (e.g. a string literal).
+  virtual uint64_t InternStaticString(const char* str, bool* is_new) = 0;
+
  private:
   TraceWriter(const TraceWriter&) = delete;
   TraceWriter& operator=(const TraceWriter&) = delete;
@@ -41,8 +41,17 @@ class ConsumerIPCClient {
   // callbacks invoked on the Consumer interface: no more Consumer callbacks are
   // invoked immediately after its destruction and any pending callback will be
   // dropped.
-  static std::unique_ptr<Service::ConsumerEndpoint>
-  Connect(const char* service_sock_name, Consumer*, base::TaskRunner*);
+  // If |use_shared_memory_for_reads| is true, the trace data returned by
+  // ReadBuffers() is moved through a shared memory region set up by the
+  // service, rather than being copied into the IPC messages. In this case the
+  // TracePacket(s) passed to Consumer::OnTraceData() point directly into the
+  // shared memory region and are valid only until OnTraceData() returns:
+  // the Consumer must copy them if it needs to retain them any longer.
+  static std::unique_ptr<Service::ConsumerEndpoint> Connect(
+      const char* service_sock_name,
+      Consumer*,
+      base::TaskRunner*,
+      bool use_shared_memory_for_reads = false);
 
  protected:
   ConsumerIPCClient() = delete;
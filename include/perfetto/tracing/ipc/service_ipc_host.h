@@ -36,7 +36,12 @@ class Service;
 //   src/tracing/ipc/service/service_ipc_host_impl.cc
 class ServiceIPCHost {
  public:
-  static std::unique_ptr<ServiceIPCHost> CreateInstance(base::TaskRunner*);
+  // If |use_huge_pages| is true, the shared memory buffers whose size is a
+  // multiple of the huge page size (2 MB) are backed by huge pages, when the
+  // system has them available.
+  static std::unique_ptr<ServiceIPCHost> CreateInstance(
+      base::TaskRunner*,
+      bool use_huge_pages = false);
   virtual ~ServiceIPCHost();
 
   // Start listening on the Producer & Consumer ports. Returns false in case of
@@ -50,6 +55,13 @@ class ServiceIPCHost {
   virtual bool Start(base::ScopedFile producer_socket_fd,
                      base::ScopedFile consumer_socket_fd) = 0;
 
+  // Returns the service business logic, or nullptr before Start(). It can be
+  // used to connect producers and consumers that live in the same process
+  // directly, without going through the sockets (see Service::ConnectProducer
+  // and Service::ConnectConsumer). Must be used only on the task runner
+  // passed to CreateInstance().
+  virtual Service* service() const = 0;
+
  protected:
   ServiceIPCHost();
 
@@ -16,11 +16,20 @@
 
 #include "perfetto/base/page_allocator.h"
 
+#include <stdint.h>
 #include <sys/mman.h>
 
+#include "perfetto/base/build_config.h"
 #include "perfetto/base/logging.h"
 #include "perfetto/base/utils.h"
 
+// Not defined by the older sysroots, same value on all architectures.
+#if (PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) ||   \
+     PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)) && \
+    !defined(MADV_HUGEPAGE)
+#define MADV_HUGEPAGE 14
+#endif
+
 namespace perfetto {
 namespace base {
 
@@ -28,19 +37,55 @@ namespace {
 
 constexpr size_t kGuardSize = kPageSize;
 
+// The size of a PMD-mapped huge page on x86_64 and arm64 (with 4KB pages).
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
 // static
-PageAllocator::UniquePtr AllocateInternal(size_t size, bool unchecked) {
+PageAllocator::UniquePtr AllocateInternal(size_t size,
+                                          bool unchecked,
+                                          bool use_huge_pages) {
   PERFETTO_DCHECK(size % kPageSize == 0);
-  size_t outer_size = size + kGuardSize * 2;
-  void* ptr = mmap(nullptr, outer_size, PROT_READ | PROT_WRITE,
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) && \
+    !PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  use_huge_pages = false;  // No transparent huge pages.
+#endif
+  // A region smaller than a huge page can't be backed by one anyway.
+  use_huge_pages = use_huge_pages && size >= kHugePageSize;
+
+  // To align the usable region to a huge page, reserve one more huge page of
+  // address space and unmap the excess on both sides once the mapping exists.
+  const size_t outer_size = size + kGuardSize * 2;
+  const size_t slack_size = use_huge_pages ? kHugePageSize : 0;
+  void* ptr = mmap(nullptr, outer_size + slack_size, PROT_READ | PROT_WRITE,
                    MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
   if (ptr == MAP_FAILED && unchecked)
     return nullptr;
   PERFETTO_CHECK(ptr && ptr != MAP_FAILED);
-  char* usable_region = reinterpret_cast<char*>(ptr) + kGuardSize;
-  int res = mprotect(ptr, kGuardSize, PROT_NONE);
+  char* start = reinterpret_cast<char*>(ptr);
+  if (slack_size) {
+    uintptr_t usable_addr = reinterpret_cast<uintptr_t>(start) + kGuardSize;
+    usable_addr = AlignUp<kHugePageSize>(usable_addr);
+    char* aligned_start = reinterpret_cast<char*>(usable_addr) - kGuardSize;
+    const size_t head_size = static_cast<size_t>(aligned_start - start);
+    const size_t tail_size = slack_size - head_size;
+    int res = 0;
+    if (head_size)
+      res |= munmap(start, head_size);
+    if (tail_size)
+      res |= munmap(aligned_start + outer_size, tail_size);
+    PERFETTO_CHECK(res == 0);
+    start = aligned_start;
+  }
+  char* usable_region = start + kGuardSize;
+  int res = mprotect(start, kGuardSize, PROT_NONE);
   res |= mprotect(usable_region + size, kGuardSize, PROT_NONE);
   PERFETTO_CHECK(res == 0);
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  // Best effort: fails with EINVAL on kernels built without THP support.
+  if (use_huge_pages && madvise(usable_region, size, MADV_HUGEPAGE) != 0)
+    PERFETTO_DPLOG("madvise(MADV_HUGEPAGE) failed");
+#endif
   return PageAllocator::UniquePtr(usable_region, PageAllocator::Deleter(size));
 }
 
@@ -60,13 +105,25 @@ void PageAllocator::Deleter::operator()(void* ptr) const {
 }
 
 // static
-PageAllocator::UniquePtr PageAllocator::Allocate(size_t size) {
-  return AllocateInternal(size, false /*unchecked*/);
+PageAllocator::UniquePtr PageAllocator::Allocate(size_t size,
+                                                 bool use_huge_pages) {
+  return AllocateInternal(size, false /*unchecked*/, use_huge_pages);
 }
 
 // static
-PageAllocator::UniquePtr PageAllocator::AllocateMayFail(size_t size) {
-  return AllocateInternal(size, true /*unchecked*/);
+PageAllocator::UniquePtr PageAllocator::AllocateMayFail(size_t size,
+                                                        bool use_huge_pages) {
+  return AllocateInternal(size, true /*unchecked*/, use_huge_pages);
+}
+
+// static
+void PageAllocator::ReleasePages(void* ptr, size_t size) {
+  PERFETTO_DCHECK(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
+  PERFETTO_DCHECK(size % kPageSize == 0);
+  // Unlike MADV_FREE, which lets the kernel reclaim the pages only under
+  // memory pressure, MADV_DONTNEED drops them from the RSS immediately.
+  int res = madvise(ptr, size, MADV_DONTNEED);
+  PERFETTO_DCHECK(res == 0);
 }
 
 }  // namespace base
@@ -17,6 +17,7 @@
 #include "perfetto/base/page_allocator.h"
 
 #include <stdint.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 
@@ -50,6 +51,33 @@ TEST(PageAllocatorTest, Basic) {
   ASSERT_FALSE(vm_test_utils::IsMapped(ptr_raw, kSize));
 }
 
+TEST(PageAllocatorTest, ReleasePages) {
+  const size_t kNumPages = 16;
+  const size_t kSize = 4096 * kNumPages;
+  PageAllocator::UniquePtr ptr = PageAllocator::Allocate(kSize);
+  ASSERT_TRUE(ptr);
+  char* raw = reinterpret_cast<char*>(ptr.get());
+  memset(raw, 'x', kSize);
+  ASSERT_TRUE(vm_test_utils::IsMapped(raw, kSize));
+
+  char* released = raw + 4096 * 4;
+  const size_t released_size = 4096 * 8;
+  PageAllocator::ReleasePages(released, released_size);
+  for (size_t page = 0; page < 8; page++)
+    EXPECT_FALSE(vm_test_utils::IsMapped(released + page * 4096, 4096));
+  EXPECT_TRUE(vm_test_utils::IsMapped(raw, 4096 * 4));
+  EXPECT_TRUE(vm_test_utils::IsMapped(released + released_size, 4096 * 4));
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_MACOSX)
+  EXPECT_EQ(0, released[0]);
+#endif
+
+  // The pages can be written again.
+  memset(released, 'y', released_size);
+  EXPECT_TRUE(vm_test_utils::IsMapped(released, released_size));
+  EXPECT_EQ('x', raw[0]);
+  EXPECT_EQ('y', released[released_size - 1]);
+}
+
 TEST(PageAllocatorTest, GuardRegions) {
   const size_t kSize = 4096;
   PageAllocator::UniquePtr ptr = PageAllocator::Allocate(kSize);
@@ -59,6 +87,33 @@ TEST(PageAllocatorTest, GuardRegions) {
   EXPECT_DEATH({ raw[kSize] = 'x'; }, ".*");
 }
 
+TEST(PageAllocatorTest, HugePages) {
+  const size_t kHugePageSize = 2 * 1024 * 1024;
+  const size_t kSize = 2 * kHugePageSize;
+  void* ptr_raw = nullptr;
+  {
+    PageAllocator::UniquePtr ptr =
+        PageAllocator::Allocate(kSize, true /*use_huge_pages*/);
+    ASSERT_TRUE(ptr);
+    ptr_raw = ptr.get();
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+    ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(ptr_raw) % kHugePageSize);
+#endif
+    volatile char* raw = reinterpret_cast<char*>(ptr_raw);
+    EXPECT_EQ(0, raw[0]);
+    EXPECT_EQ(0, raw[kSize - 1]);
+    raw[0] = 'x';
+    raw[kSize - 1] = 'x';
+    ASSERT_TRUE(vm_test_utils::IsMapped(ptr_raw, 4096));
+    EXPECT_DEATH({ raw[-1] = 'x'; }, ".*");
+    EXPECT_DEATH({ raw[kSize] = 'x'; }, ".*");
+  }
+
+  // The alignment slack is unmapped upfront, the rest on destruction.
+  ASSERT_FALSE(vm_test_utils::IsMapped(ptr_raw, kSize));
+}
+
 // Disable this on:
 // MacOS: because it doesn't seem to have an equivalent rlimit to bound mmap().
 // Sanitizers: they seem to try to shadow mmaped memory and fail due to OOMs.
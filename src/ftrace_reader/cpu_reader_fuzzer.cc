@@ -41,7 +41,7 @@ void FuzzCpuReaderParsePage(const uint8_t* data, size_t size);
 void FuzzCpuReaderParsePage(const uint8_t* data, size_t size) {
   protozero::ScatteredStreamWriterNullDelegate delegate(base::kPageSize);
   protozero::ScatteredStreamWriter stream(&delegate);
-  FtraceEventBundle writer;
+  protozero::RootMessage<FtraceEventBundle> writer;
 
   ProtoTranslationTable* table = GetTable("synthetic");
   if (!table) {
@@ -103,7 +103,7 @@ class ProtoProvider {
   size_t chunk_size_;
   ScatteredStreamDelegateForTesting delegate_;
   protozero::ScatteredStreamWriter stream_;
-  ZeroT writer_;
+  protozero::RootMessage<ZeroT> writer_;
 };
 
 using BundleProvider =
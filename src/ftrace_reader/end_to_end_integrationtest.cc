@@ -44,6 +44,8 @@ constexpr char kTracingPath[] = "/sys/kernel/debug/tracing/";
 
 using FtraceBundleHandle =
     protozero::MessageHandle<protos::pbzero::FtraceEventBundle>;
+using TestBundleWrapper =
+    protozero::RootMessage<protos::pbzero::TestBundleWrapper>;
 
 class EndToEndIntegrationTest : public ::testing::Test,
                                 public FtraceSink::Delegate {
@@ -64,8 +66,7 @@ class EndToEndIntegrationTest : public ::testing::Test,
     writer = std::unique_ptr<protozero::ScatteredStreamWriter>(
         new protozero::ScatteredStreamWriter(writer_delegate.get()));
     writer_delegate->set_writer(writer.get());
-    message = std::unique_ptr<protos::pbzero::TestBundleWrapper>(
-        new protos::pbzero::TestBundleWrapper);
+    message = std::unique_ptr<TestBundleWrapper>(new TestBundleWrapper);
     message->Reset(writer.get());
     message->set_before("--- Bundle wrapper before ---");
   }
@@ -97,7 +98,7 @@ class EndToEndIntegrationTest : public ::testing::Test,
   size_t cpu_being_written_ = 9999;
   std::unique_ptr<ScatteredStreamDelegateForTesting> writer_delegate = nullptr;
   std::unique_ptr<protozero::ScatteredStreamWriter> writer = nullptr;
-  std::unique_ptr<protos::pbzero::TestBundleWrapper> message = nullptr;
+  std::unique_ptr<TestBundleWrapper> message = nullptr;
 };
 
 }  // namespace
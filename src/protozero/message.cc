@@ -16,6 +16,8 @@
 
 #include "perfetto/protozero/message.h"
 
+#include <string.h>
+
 #include <type_traits>
 
 #include "perfetto/base/logging.h"
@@ -31,12 +33,14 @@ namespace protozero {
 
 // static
 constexpr uint32_t Message::kMaxNestingDepth;
+constexpr uint32_t MessageArena::kInlineNestingDepth;
 
 // Do NOT put any code in the constructor or use default initialization.
 // Use the Reset() method below instead. See the header for the reason why.
 
 // This method is called to initialize both root and nested messages.
-void Message::Reset(ScatteredStreamWriter* stream_writer) {
+void Message::Reset(ScatteredStreamWriter* stream_writer,
+                    MessageArena* arena) {
 // Older versions of libstdcxx don't have is_trivially_constructible.
 #if !defined(__GLIBCXX__) || __GLIBCXX__ >= 20170516
   static_assert(std::is_trivially_constructible<Message>::value,
@@ -46,12 +50,6 @@ void Message::Reset(ScatteredStreamWriter* stream_writer) {
   static_assert(std::is_trivially_destructible<Message>::value,
                 "Message must be trivially destructible");
 
-  static_assert(
-      sizeof(Message::nested_messages_arena_) >=
-          kMaxNestingDepth *
-              (sizeof(Message) - sizeof(Message::nested_messages_arena_)),
-      "Message::nested_messages_arena_ is too small");
-
   stream_writer_ = stream_writer;
   size_ = 0;
   size_field_ = nullptr;
@@ -59,6 +57,7 @@ void Message::Reset(ScatteredStreamWriter* stream_writer) {
   nested_message_ = nullptr;
   nesting_depth_ = 0;
   finalized_ = false;
+  arena_ = arena;
 #if PERFETTO_DCHECK_IS_ON()
   handle_ = nullptr;
   generation_++;
@@ -70,20 +69,33 @@ void Message::AppendString(uint32_t field_id, const char* str) {
 }
 
 void Message::AppendBytes(uint32_t field_id, const void* src, size_t size) {
+  WriteLengthDelimitedPreamble(field_id, size);
+  const uint8_t* src_u8 = reinterpret_cast<const uint8_t*>(src);
+  WriteToStream(src_u8, src_u8 + size);
+}
+
+uint8_t* Message::AppendBytesForDirectWrite(uint32_t field_id, size_t size) {
   if (nested_message_)
     EndNestedMessage();
 
+  PERFETTO_DCHECK(!finalized_);
   PERFETTO_DCHECK(size < proto_utils::kMaxMessageLength);
-  // Write the proto preamble (field id, type and length of the field).
-  uint8_t buffer[proto_utils::kMaxSimpleFieldEncodedSize];
-  uint8_t* pos = buffer;
+  uint8_t preamble[proto_utils::kMaxSimpleFieldEncodedSize];
+  uint8_t* pos = preamble;
   pos = proto_utils::WriteVarInt(proto_utils::MakeTagLengthDelimited(field_id),
                                  pos);
   pos = proto_utils::WriteVarInt(static_cast<uint32_t>(size), pos);
-  WriteToStream(buffer, pos);
-
-  const uint8_t* src_u8 = reinterpret_cast<const uint8_t*>(src);
-  WriteToStream(src_u8, src_u8 + size);
+  const size_t preamble_size = static_cast<size_t>(pos - preamble);
+
+  // The preamble is reserved together with the payload, so that nothing is
+  // written if the reservation fails.
+  uint8_t* field =
+      stream_writer_->ReserveBytesForDirectWrite(preamble_size + size);
+  if (!field)
+    return nullptr;
+  memcpy(field, preamble, preamble_size);
+  size_ += static_cast<uint32_t>(preamble_size + size);
+  return field + preamble_size;
 }
 
 uint32_t Message::Finalize() {
@@ -113,7 +125,7 @@ uint32_t Message::Finalize() {
   return size_;
 }
 
-void Message::BeginNestedMessageInternal(uint32_t field_id, Message* message) {
+Message* Message::BeginNestedMessageInternal(uint32_t field_id) {
   if (nested_message_)
     EndNestedMessage();
 
@@ -123,8 +135,9 @@ void Message::BeginNestedMessageInternal(uint32_t field_id, Message* message) {
       proto_utils::MakeTagLengthDelimited(field_id), data);
   WriteToStream(data, data_end);
 
-  message->Reset(stream_writer_);
   PERFETTO_CHECK(nesting_depth_ < kMaxNestingDepth);
+  Message* message = arena_->GetMessageStorage(nesting_depth_ + 1u);
+  message->Reset(stream_writer_, arena_);
   message->nesting_depth_ = nesting_depth_ + 1;
 
   // The length of the nested message cannot be known upfront. So right now
@@ -133,6 +146,21 @@ void Message::BeginNestedMessageInternal(uint32_t field_id, Message* message) {
       stream_writer_->ReserveBytes(proto_utils::kMessageLengthFieldSize));
   size_ += proto_utils::kMessageLengthFieldSize;
   nested_message_ = message;
+  return message;
+}
+
+void Message::WriteLengthDelimitedPreamble(uint32_t field_id, size_t size) {
+  if (nested_message_)
+    EndNestedMessage();
+
+  PERFETTO_DCHECK(size < proto_utils::kMaxMessageLength);
+  // Write the proto preamble (field id, type and length of the field).
+  uint8_t buffer[proto_utils::kMaxSimpleFieldEncodedSize];
+  uint8_t* pos = buffer;
+  pos = proto_utils::WriteVarInt(proto_utils::MakeTagLengthDelimited(field_id),
+                                 pos);
+  pos = proto_utils::WriteVarInt(static_cast<uint32_t>(size), pos);
+  WriteToStream(buffer, pos);
 }
 
 void Message::EndNestedMessage() {
@@ -140,4 +168,18 @@ void Message::EndNestedMessage() {
   nested_message_ = nullptr;
 }
 
+MessageArena::MessageArena() = default;
+MessageArena::~MessageArena() = default;
+
+Message* MessageArena::GetOverflowStorage(uint32_t nesting_depth) {
+  PERFETTO_DCHECK(nesting_depth > kInlineNestingDepth &&
+                  nesting_depth <= Message::kMaxNestingDepth);
+  if (!overflow_storage_) {
+    overflow_storage_.reset(
+        new Storage[Message::kMaxNestingDepth - kInlineNestingDepth]);
+  }
+  return reinterpret_cast<Message*>(
+      &overflow_storage_[nesting_depth - kInlineNestingDepth - 1]);
+}
+
 }  // namespace protozero
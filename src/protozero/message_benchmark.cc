@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "perfetto/protozero/message.h"
+#include "perfetto/protozero/packed_repeated_fields.h"
+#include "perfetto/protozero/scattered_stream_null_delegate.h"
+#include "perfetto/protozero/scattered_stream_writer.h"
+
+#include "perfetto/trace/ftrace/ftrace_event.pbzero.h"
+#include "perfetto/trace/ftrace/ftrace_event_bundle.pbzero.h"
+#include "perfetto/trace/ftrace/sched_switch.pbzero.h"
+#include "perfetto/trace/trace_packet.pbzero.h"
+
+// Micro-benchmarks of the protozero encoder. All of them write into a single
+// chunk, which is recycled whenever it's full, so that they measure only the
+// cost of the encoding and not the one of the underlying buffer.
+
+namespace protozero {
+namespace {
+
+namespace pbzero = perfetto::protos::pbzero;
+
+constexpr size_t kChunkSize = 4096;
+constexpr size_t kNumValues = 64;
+
+// A mix of 1, 2, 3 and 5 byte varints.
+std::vector<uint32_t> MakeValues() {
+  std::vector<uint32_t> values;
+  for (uint32_t i = 0; i < kNumValues; i++)
+    values.push_back((i % 4 == 3 ? 0x10000000 : 1u << (i % 4 * 7)) + i);
+  return values;
+}
+
+class Writer {
+ public:
+  Writer() : delegate_(kChunkSize), stream_writer_(&delegate_) {}
+
+  // Resets |msg| to a new root message.
+  template <typename T>
+  RootMessage<T>* Begin(RootMessage<T>* msg) {
+    msg->Reset(&stream_writer_);
+    return msg;
+  }
+
+ private:
+  ScatteredStreamWriterNullDelegate delegate_;
+  ScatteredStreamWriter stream_writer_;
+};
+
+// Field ids passed at runtime, the tag is encoded on each call.
+void BM_ProtozeroEncoder_VarIntRuntimeFieldId(benchmark::State& state) {
+  const std::vector<uint32_t> values = MakeValues();
+  Writer writer;
+  RootMessage<Message> msg;
+  uint64_t bytes = 0;
+  while (state.KeepRunning()) {
+    writer.Begin(&msg);
+    for (size_t i = 0; i < kNumValues; i += 4) {
+      msg.AppendVarInt(1, values[i]);
+      msg.AppendVarInt(2, values[i + 1]);
+      msg.AppendVarInt(3, values[i + 2]);
+      msg.AppendVarInt(300, values[i + 3]);
+    }
+    bytes += msg.Finalize();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+// Field ids passed as template arguments, like the generated stubs do.
+void BM_ProtozeroEncoder_VarIntCompileTimeFieldId(benchmark::State& state) {
+  const std::vector<uint32_t> values = MakeValues();
+  Writer writer;
+  RootMessage<Message> msg;
+  uint64_t bytes = 0;
+  while (state.KeepRunning()) {
+    writer.Begin(&msg);
+    for (size_t i = 0; i < kNumValues; i += 4) {
+      msg.AppendVarInt<1>(values[i]);
+      msg.AppendVarInt<2>(values[i + 1]);
+      msg.AppendVarInt<3>(values[i + 2]);
+      msg.AppendVarInt<300>(values[i + 3]);
+    }
+    bytes += msg.Finalize();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+void BM_ProtozeroEncoder_FixedRuntimeFieldId(benchmark::State& state) {
+  const std::vector<uint32_t> values = MakeValues();
+  Writer writer;
+  RootMessage<Message> msg;
+  uint64_t bytes = 0;
+  while (state.KeepRunning()) {
+    writer.Begin(&msg);
+    for (size_t i = 0; i < kNumValues; i += 2) {
+      msg.AppendFixed(1, values[i]);
+      msg.AppendFixed(2, static_cast<double>(values[i + 1]));
+    }
+    bytes += msg.Finalize();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+void BM_ProtozeroEncoder_FixedCompileTimeFieldId(benchmark::State& state) {
+  const std::vector<uint32_t> values = MakeValues();
+  Writer writer;
+  RootMessage<Message> msg;
+  uint64_t bytes = 0;
+  while (state.KeepRunning()) {
+    writer.Begin(&msg);
+    for (size_t i = 0; i < kNumValues; i += 2) {
+      msg.AppendFixed<1>(values[i]);
+      msg.AppendFixed<2>(static_cast<double>(values[i + 1]));
+    }
+    bytes += msg.Finalize();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+// The same values as a repeated field, a packed field written in one go and
+// a packed field streamed one value at a time.
+void BM_ProtozeroEncoder_RepeatedVarInt(benchmark::State& state) {
+  const std::vector<uint32_t> values = MakeValues();
+  Writer writer;
+  RootMessage<Message> msg;
+  uint64_t bytes = 0;
+  while (state.KeepRunning()) {
+    writer.Begin(&msg);
+    for (uint32_t value : values)
+      msg.AppendVarInt<1>(value);
+    bytes += msg.Finalize();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+void BM_ProtozeroEncoder_PackedVarInt(benchmark::State& state) {
+  const std::vector<uint32_t> values = MakeValues();
+  Writer writer;
+  RootMessage<Message> msg;
+  uint64_t bytes = 0;
+  while (state.KeepRunning()) {
+    writer.Begin(&msg);
+    msg.AppendPackedVarInt(1, values.data(), values.size());
+    bytes += msg.Finalize();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+void BM_ProtozeroEncoder_PackedVarIntStreamed(benchmark::State& state) {
+  const std::vector<uint32_t> values = MakeValues();
+  Writer writer;
+  RootMessage<Message> msg;
+  uint64_t bytes = 0;
+  while (state.KeepRunning()) {
+    writer.Begin(&msg);
+    auto* packed = msg.BeginNestedMessage<PackedVarInt<uint32_t>>(1);
+    for (uint32_t value : values)
+      packed->Append(value);
+    bytes += msg.Finalize();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+// A bundle of sched_switch events through the generated stubs, which is what
+// makes up the bulk of a typical trace.
+void BM_ProtozeroEncoder_SchedSwitchBundle(benchmark::State& state) {
+  Writer writer;
+  RootMessage<pbzero::FtraceEventBundle> bundle;
+  uint64_t bytes = 0;
+  uint64_t timestamp = 1000000;
+  while (state.KeepRunning()) {
+    writer.Begin(&bundle);
+    bundle.set_cpu(1);
+    for (int32_t i = 0; i < static_cast<int32_t>(kNumValues); i++) {
+      auto* event = bundle.add_event();
+      event->set_timestamp(timestamp += 1013);
+      event->set_pid(static_cast<uint32_t>(1000 + i));
+      auto* sched_switch = event->set_sched_switch();
+      sched_switch->set_prev_comm("surfaceflinger");
+      sched_switch->set_prev_pid(1000 + i);
+      sched_switch->set_prev_prio(120);
+      sched_switch->set_prev_state(1);
+      sched_switch->set_next_comm("RenderThread");
+      sched_switch->set_next_pid(2000 + i);
+      sched_switch->set_next_prio(110);
+    }
+    bytes += bundle.Finalize();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+// Args: {payload size}.
+// A payload serialized into a scratch buffer and then copied by AppendBytes(),
+// vs serialized in place after AppendBytesForDirectWrite(). The serialization
+// is simulated by a memset() in both cases.
+void BM_ProtozeroEncoder_BytesCopy(benchmark::State& state) {
+  const size_t size = static_cast<size_t>(state.range(0));
+  std::vector<uint8_t> scratch(size);
+  Writer writer;
+  RootMessage<Message> msg;
+  uint64_t bytes = 0;
+  uint8_t value = 0;
+  while (state.KeepRunning()) {
+    writer.Begin(&msg);
+    memset(scratch.data(), value++, size);
+    msg.AppendBytes(1, scratch.data(), size);
+    bytes += msg.Finalize();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+void BM_ProtozeroEncoder_BytesDirectWrite(benchmark::State& state) {
+  const size_t size = static_cast<size_t>(state.range(0));
+  Writer writer;
+  RootMessage<Message> msg;
+  uint64_t bytes = 0;
+  uint8_t value = 0;
+  while (state.KeepRunning()) {
+    writer.Begin(&msg);
+    memset(msg.AppendBytesForDirectWrite(1, size), value++, size);
+    bytes += msg.Finalize();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+// Args: {writers per thread}.
+// Each thread round-robins across its own writers, each with its own root
+// TracePacket, like in the processes with many traced threads. What matters
+// here is the footprint of the root messages, which is reported as the
+// root_message_bytes counter.
+void BM_ProtozeroEncoder_WriterPerThread(benchmark::State& state) {
+  const size_t num_writers = static_cast<size_t>(state.range(0));
+  std::vector<std::unique_ptr<Writer>> writers;
+  std::vector<std::unique_ptr<RootMessage<pbzero::TracePacket>>> packets;
+  for (size_t i = 0; i < num_writers; i++) {
+    writers.emplace_back(new Writer());
+    packets.emplace_back(new RootMessage<pbzero::TracePacket>());
+  }
+  uint64_t bytes = 0;
+  size_t next = 0;
+  while (state.KeepRunning()) {
+    auto* packet = writers[next]->Begin(packets[next].get());
+    next = (next + 1) % num_writers;
+    packet->set_timestamp(1000000);
+    auto* bundle = packet->set_ftrace_events();
+    bundle->set_cpu(1);
+    auto* event = bundle->add_event();
+    event->set_pid(42);
+    auto* sched_switch = event->set_sched_switch();
+    sched_switch->set_prev_pid(42);
+    sched_switch->set_next_pid(43);
+    bytes += packet->Finalize();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+  state.counters["root_message_bytes"] = benchmark::Counter(
+      static_cast<double>(sizeof(RootMessage<pbzero::TracePacket>)),
+      benchmark::Counter::kAvgThreads);
+}
+
+}  // namespace
+
+BENCHMARK(BM_ProtozeroEncoder_VarIntRuntimeFieldId);
+BENCHMARK(BM_ProtozeroEncoder_VarIntCompileTimeFieldId);
+BENCHMARK(BM_ProtozeroEncoder_FixedRuntimeFieldId);
+BENCHMARK(BM_ProtozeroEncoder_FixedCompileTimeFieldId);
+BENCHMARK(BM_ProtozeroEncoder_RepeatedVarInt);
+BENCHMARK(BM_ProtozeroEncoder_PackedVarInt);
+BENCHMARK(BM_ProtozeroEncoder_PackedVarIntStreamed);
+BENCHMARK(BM_ProtozeroEncoder_SchedSwitchBundle);
+BENCHMARK(BM_ProtozeroEncoder_BytesCopy)->Arg(64)->Arg(1024)->Arg(4000);
+BENCHMARK(BM_ProtozeroEncoder_BytesDirectWrite)->Arg(64)->Arg(1024)->Arg(4000);
+BENCHMARK(BM_ProtozeroEncoder_WriterPerThread)
+    ->Arg(1)
+    ->Arg(64)
+    ->Arg(512)
+    ->ThreadRange(1, 8);
+
+}  // namespace protozero
@@ -24,7 +24,7 @@ namespace protozero {
 namespace {
 
 TEST(MessageHandleTest, MoveHandleSharedMessageDoesntFinalize) {
-  Message message;
+  RootMessage<Message> message;
   message.Reset(nullptr);
 
   MessageHandle<Message> handle_1(&message);
@@ -37,7 +37,7 @@ constexpr const char kStartWatermark[] = {'a', 'b', 'c', 'd',
 constexpr const char kEndWatermark[] = {'9', '8', '7', '6',
                                         'z', 'w', 'y', '\0'};
 
-class FakeRootMessage : public Message {};
+class FakeRootMessage : public RootMessage<Message> {};
 class FakeChildMessage : public Message {};
 
 uint32_t SimpleHash(const std::string& str) {
@@ -62,7 +62,9 @@ class MessageTest : public ::testing::Test {
       EXPECT_STREQ(kStartWatermark, reinterpret_cast<char*>(mem.get()));
       EXPECT_STREQ(kEndWatermark,
                    reinterpret_cast<char*>(mem.get() + sizeof(kStartWatermark) +
-                                           sizeof(Message)));
+                                           sizeof(FakeRootMessage)));
+      reinterpret_cast<FakeRootMessage*>(mem.get() + sizeof(kStartWatermark))
+          ->~FakeRootMessage();
       mem.reset();
     }
     messages_.clear();
@@ -82,7 +84,7 @@ class MessageTest : public ::testing::Test {
     memcpy(msg_start + sizeof(FakeRootMessage), kEndWatermark,
            sizeof(kEndWatermark));
     messages_.push_back(std::move(mem));
-    FakeRootMessage* msg = reinterpret_cast<FakeRootMessage*>(msg_start);
+    FakeRootMessage* msg = new (msg_start) FakeRootMessage();
     msg->Reset(stream_writer_.get());
     return msg;
   }
@@ -167,6 +169,57 @@ TEST_F(MessageTest, BasicTypesNoNesting) {
   ASSERT_EQ("1829", GetNextSerializedBytes(2));
 }
 
+// Same as above, but with the field ids passed as template arguments. The
+// fields straddle the 16-byte chunks, covering both the direct write into the
+// chunk and the fallback.
+TEST_F(MessageTest, BasicTypesCompileTimeFieldIds) {
+  Message* msg = NewMessage();
+  msg->AppendVarInt<1>(0);
+  msg->AppendVarInt<2>(std::numeric_limits<uint32_t>::max());
+  msg->AppendVarInt<3>(42);
+  msg->AppendVarInt<4>(std::numeric_limits<uint64_t>::max());
+  msg->AppendFixed<5>(3.1415f /* float */);
+  msg->AppendFixed<6>(3.14159265358979323846 /* double */);
+  msg->AppendTinyVarInt<7>(1);
+  msg->AppendVarInt<257>(1);
+  msg->AppendSignedVarInt<3>(-21);
+  msg->AppendFixed<1000000>(0xdeadbeefu);
+
+  EXPECT_EQ(50u, msg->Finalize());
+  EXPECT_EQ(50u, GetNumSerializedBytes());
+
+  ASSERT_EQ("0800", GetNextSerializedBytes(2));
+  ASSERT_EQ("10FFFFFFFF0F", GetNextSerializedBytes(6));
+  ASSERT_EQ("182A", GetNextSerializedBytes(2));
+  ASSERT_EQ("20FFFFFFFFFFFFFFFFFF01", GetNextSerializedBytes(11));
+  ASSERT_EQ("2D560E4940", GetNextSerializedBytes(5));
+  ASSERT_EQ("31182D4454FB210940", GetNextSerializedBytes(9));
+  ASSERT_EQ("3801", GetNextSerializedBytes(2));
+  ASSERT_EQ("881001", GetNextSerializedBytes(3));
+  ASSERT_EQ("1829", GetNextSerializedBytes(2));
+  ASSERT_EQ("85A4E803EFBEADDE", GetNextSerializedBytes(8));
+}
+
+TEST_F(MessageTest, DirectWrite) {
+  Message* msg = NewMessage();
+
+  // FakeScatteredBuffer can't provide more than a chunk of contiguous memory.
+  EXPECT_EQ(nullptr, msg->AppendBytesForDirectWrite(1, kChunkSize));
+
+  msg->AppendVarInt(2, 42);
+  uint8_t* payload = msg->AppendBytesForDirectWrite(3, 10);
+  ASSERT_NE(nullptr, payload);
+  for (uint8_t i = 0; i < 10; i++)
+    payload[i] = 0xA0 + i;
+  msg->AppendVarInt(4, 1);
+
+  EXPECT_EQ(16u, msg->Finalize());
+  EXPECT_EQ(16u, GetNumSerializedBytes());
+  ASSERT_EQ("102A", GetNextSerializedBytes(2));
+  ASSERT_EQ("1A0AA0A1A2A3A4A5A6A7A8A9", GetNextSerializedBytes(12));
+  ASSERT_EQ("2001", GetNextSerializedBytes(2));
+}
+
 TEST_F(MessageTest, NestedMessagesSimple) {
   Message* root_msg = NewMessage();
   root_msg->AppendVarInt(1 /* field_id */, 1);
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/protozero/proto_decoder.h"
+
+#include <string.h>
+
+#include <limits>
+
+#include "perfetto/base/utils.h"
+
+namespace protozero {
+
+using namespace proto_utils;
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error Unimplemented for big endian archs.
+#endif
+
+ProtoDecoder::Field ProtoDecoder::FindField(uint32_t id) const {
+  Field result{};
+  Field field;
+  for (const uint8_t* ptr = begin_; ptr < end_;) {
+    ptr = ParseField(ptr, end_, &field);
+    if (!ptr)
+      break;
+    if (field.id == id)
+      result = field;
+  }
+  return result;
+}
+
+void ProtoDecoder::RepeatedFieldIterator::FindNext() {
+  while (read_ptr_ < end_) {
+    read_ptr_ = ParseField(read_ptr_, end_, &field_);
+    if (!read_ptr_)
+      break;
+    if (field_.id == id_)
+      return;
+  }
+  read_ptr_ = end_;
+  field_ = Field{};
+}
+
+}  // namespace protozero
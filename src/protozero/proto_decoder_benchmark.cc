@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "perfetto/protozero/proto_decoder.h"
+
+#include "perfetto/trace/ftrace/ftrace_event.pbzero.h"
+#include "perfetto/trace/ftrace/ftrace_event_bundle.pbzero.h"
+#include "perfetto/trace/ftrace/sched_switch.pbzero.h"
+#include "perfetto/trace/trace_packet.pb.h"
+#include "perfetto/trace/trace_packet.pbzero.h"
+
+namespace protozero {
+namespace {
+
+namespace pbzero = perfetto::protos::pbzero;
+
+constexpr int kNumPackets = 64;
+
+// Each packet is a bundle of sched_switch events, like the ones emitted by the
+// ftrace data source, which make up the bulk of a typical trace.
+std::vector<std::string> MakeTrace(int events_per_packet) {
+  std::vector<std::string> packets;
+  uint64_t timestamp = 1000000;
+  for (int i = 0; i < kNumPackets; i++) {
+    perfetto::protos::TracePacket packet;
+    packet.set_timestamp(timestamp);
+    auto* bundle = packet.mutable_ftrace_events();
+    bundle->set_cpu(static_cast<uint32_t>(i % 4));
+    for (int j = 0; j < events_per_packet; j++) {
+      auto* event = bundle->add_event();
+      event->set_timestamp(timestamp += 1013);
+      event->set_pid(static_cast<uint32_t>(1000 + j));
+      auto* sched_switch = event->mutable_sched_switch();
+      sched_switch->set_prev_comm("surfaceflinger");
+      sched_switch->set_prev_pid(1000 + j);
+      sched_switch->set_prev_prio(120);
+      sched_switch->set_prev_state(1);
+      sched_switch->set_next_comm("RenderThread");
+      sched_switch->set_next_pid(2000 + j);
+      sched_switch->set_next_prio(110);
+    }
+    packets.push_back(packet.SerializeAsString());
+  }
+  return packets;
+}
+
+int64_t TotalSize(const std::vector<std::string>& packets) {
+  int64_t size = 0;
+  for (const std::string& packet : packets)
+    size += static_cast<int64_t>(packet.size());
+  return size;
+}
+
+const uint8_t* AsBytes(const std::string& str) {
+  return reinterpret_cast<const uint8_t*>(str.data());
+}
+
+// Args: {sched_switch events per packet}.
+// All the benchmarks below read the timestamp, the next_pid and the length of
+// next_comm of each event.
+void BM_ProtoDecoder_Libprotobuf(benchmark::State& state) {
+  const std::vector<std::string> packets =
+      MakeTrace(static_cast<int>(state.range(0)));
+  uint64_t sum = 0;
+  while (state.KeepRunning()) {
+    for (const std::string& encoded : packets) {
+      perfetto::protos::TracePacket packet;
+      packet.ParseFromString(encoded);
+      for (const auto& event : packet.ftrace_events().event()) {
+        sum += event.timestamp();
+        sum += static_cast<uint64_t>(event.sched_switch().next_pid());
+        sum += event.sched_switch().next_comm().size();
+      }
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * TotalSize(packets));
+}
+
+// Uses the Decoder(s) generated by the protoc plugin.
+void BM_ProtoDecoder_Generated(benchmark::State& state) {
+  const std::vector<std::string> packets =
+      MakeTrace(static_cast<int>(state.range(0)));
+  uint64_t sum = 0;
+  while (state.KeepRunning()) {
+    for (const std::string& encoded : packets) {
+      pbzero::TracePacket::Decoder packet(AsBytes(encoded), encoded.size());
+      pbzero::FtraceEventBundle::Decoder bundle(packet.ftrace_events());
+      for (auto it = bundle.event(); it; ++it) {
+        pbzero::FtraceEvent::Decoder event(it->as_bytes());
+        pbzero::SchedSwitchFtraceEvent::Decoder sched_switch(
+            event.sched_switch());
+        sum += event.timestamp();
+        sum += static_cast<uint64_t>(sched_switch.next_pid());
+        sum += sched_switch.next_comm().size;
+      }
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * TotalSize(packets));
+}
+
+// Visits each field once with ProtoDecoder::ReadField().
+void BM_ProtoDecoder_ReadField(benchmark::State& state) {
+  const std::vector<std::string> packets =
+      MakeTrace(static_cast<int>(state.range(0)));
+  uint64_t sum = 0;
+  while (state.KeepRunning()) {
+    for (const std::string& encoded : packets) {
+      ProtoDecoder packet(AsBytes(encoded), encoded.size());
+      for (auto f = packet.ReadField(); f.valid(); f = packet.ReadField()) {
+        if (f.id != pbzero::TracePacket::kFtraceEventsFieldNumber)
+          continue;
+        ProtoDecoder bundle(f.as_bytes());
+        for (auto b = bundle.ReadField(); b.valid(); b = bundle.ReadField()) {
+          if (b.id != pbzero::FtraceEventBundle::kEventFieldNumber)
+            continue;
+          ProtoDecoder event(b.as_bytes());
+          for (auto e = event.ReadField(); e.valid(); e = event.ReadField()) {
+            if (e.id == pbzero::FtraceEvent::kTimestampFieldNumber) {
+              sum += e.as_uint64();
+            } else if (e.id == pbzero::FtraceEvent::kSchedSwitchFieldNumber) {
+              ProtoDecoder sched_switch(e.as_bytes());
+              for (auto s = sched_switch.ReadField(); s.valid();
+                   s = sched_switch.ReadField()) {
+                if (s.id == pbzero::SchedSwitchFtraceEvent::kNextPidFieldNumber)
+                  sum += static_cast<uint64_t>(s.as_int32());
+                if (s.id ==
+                    pbzero::SchedSwitchFtraceEvent::kNextCommFieldNumber) {
+                  sum += s.as_string().size;
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * TotalSize(packets));
+}
+
+}  // namespace
+
+BENCHMARK(BM_ProtoDecoder_Libprotobuf)->Arg(1)->Arg(64)->Arg(512);
+BENCHMARK(BM_ProtoDecoder_Generated)->Arg(1)->Arg(64)->Arg(512);
+BENCHMARK(BM_ProtoDecoder_ReadField)->Arg(1)->Arg(64)->Arg(512);
+
+}  // namespace protozero
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/protozero/proto_decoder.h"
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+// Autogenerated headers in out/*/gen/
+#include "src/protozero/test/example_proto/test_messages.pb.h"
+#include "src/protozero/test/example_proto/test_messages.pbzero.h"
+
+namespace pbtest = foo::bar::pbzero;  // Generated by the protozero plugin.
+namespace pbgold = foo::bar;  // Generated by the official protobuf compiler.
+
+namespace protozero {
+namespace {
+
+using namespace proto_utils;
+
+const uint8_t* AsBytes(const std::string& str) {
+  return reinterpret_cast<const uint8_t*>(str.data());
+}
+
+std::string EncodeEveryField() {
+  pbgold::EveryField msg;
+  msg.set_field_int32(-1);
+  msg.set_field_int64(std::numeric_limits<int64_t>::min());
+  msg.set_field_uint32(std::numeric_limits<uint32_t>::max());
+  msg.set_field_uint64(std::numeric_limits<uint64_t>::max());
+  msg.set_field_sint32(-42);
+  msg.set_field_sint64(std::numeric_limits<int64_t>::min());
+  msg.set_field_fixed32(0xdeadbeef);
+  msg.set_field_fixed64(0x0123456789abcdefull);
+  msg.set_field_sfixed32(-3);
+  msg.set_field_sfixed64(-4);
+  msg.set_field_float(1.5f);
+  msg.set_field_double(-2.25);
+  msg.set_field_bool(true);
+  msg.set_signed_enum(pbgold::NEGATIVE);
+  msg.set_big_enum(pbgold::END);
+  msg.set_field_string("foo");
+  msg.set_field_bytes(std::string("\0\1\2", 3));
+  msg.set_nested_enum(pbgold::EveryField::PONG);
+  msg.add_repeated_int32(1);
+  msg.add_repeated_int32(-2);
+  msg.add_repeated_int32(3);
+  return msg.SerializeAsString();
+}
+
+TEST(ProtoDecoderTest, ReadFields) {
+  pbgold::EveryField msg;
+  msg.set_field_int32(42);
+  msg.set_field_fixed64(1234);
+  msg.set_field_fixed32(5678);
+  msg.set_field_string("bar");
+  std::string encoded = msg.SerializeAsString();
+
+  ProtoDecoder decoder(AsBytes(encoded), encoded.size());
+
+  ProtoDecoder::Field field = decoder.ReadField();
+  EXPECT_EQ(pbtest::EveryField::kFieldInt32FieldNumber, field.id);
+  EXPECT_EQ(kFieldTypeVarInt, field.type);
+  EXPECT_EQ(42, field.as_int32());
+
+  field = decoder.ReadField();
+  EXPECT_EQ(pbtest::EveryField::kFieldFixed32FieldNumber, field.id);
+  EXPECT_EQ(kFieldTypeFixed32, field.type);
+  EXPECT_EQ(5678u, field.as_uint32());
+
+  field = decoder.ReadField();
+  EXPECT_EQ(pbtest::EveryField::kFieldFixed64FieldNumber, field.id);
+  EXPECT_EQ(kFieldTypeFixed64, field.type);
+  EXPECT_EQ(1234u, field.as_uint64());
+
+  field = decoder.ReadField();
+  EXPECT_EQ(pbtest::EveryField::kFieldStringFieldNumber, field.id);
+  EXPECT_EQ(kFieldTypeLengthDelimited, field.type);
+  EXPECT_EQ("bar", field.as_string().ToStdString());
+
+  EXPECT_FALSE(decoder.ReadField().valid());
+  EXPECT_EQ(0u, decoder.bytes_left());
+  EXPECT_EQ(encoded.size(), decoder.read_offset());
+
+  decoder.Reset();
+  EXPECT_EQ(pbtest::EveryField::kFieldInt32FieldNumber, decoder.ReadField().id);
+}
+
+TEST(ProtoDecoderTest, GeneratedDecoder) {
+  std::string encoded = EncodeEveryField();
+  pbtest::EveryField::Decoder decoder(AsBytes(encoded), encoded.size());
+
+  EXPECT_EQ(-1, decoder.field_int32());
+  EXPECT_EQ(std::numeric_limits<int64_t>::min(), decoder.field_int64());
+  EXPECT_EQ(std::numeric_limits<uint32_t>::max(), decoder.field_uint32());
+  EXPECT_EQ(std::numeric_limits<uint64_t>::max(), decoder.field_uint64());
+  EXPECT_EQ(-42, decoder.field_sint32());
+  EXPECT_EQ(std::numeric_limits<int64_t>::min(), decoder.field_sint64());
+  EXPECT_EQ(0xdeadbeef, decoder.field_fixed32());
+  EXPECT_EQ(0x0123456789abcdefull, decoder.field_fixed64());
+  EXPECT_EQ(-3, decoder.field_sfixed32());
+  EXPECT_EQ(-4, decoder.field_sfixed64());
+  EXPECT_EQ(1.5f, decoder.field_float());
+  EXPECT_EQ(-2.25, decoder.field_double());
+  EXPECT_TRUE(decoder.field_bool());
+  EXPECT_EQ(pbtest::NEGATIVE, decoder.signed_enum());
+  EXPECT_EQ(pbtest::END, decoder.big_enum());
+  EXPECT_EQ("foo", decoder.field_string().ToStdString());
+  ConstBytes bytes = decoder.field_bytes();
+  EXPECT_EQ(std::string("\0\1\2", 3),
+            std::string(reinterpret_cast<const char*>(bytes.data), bytes.size));
+  EXPECT_EQ(pbtest::EveryField_NestedEnum_PONG, decoder.nested_enum());
+
+  EXPECT_TRUE(decoder.has_field_bool());
+  EXPECT_FALSE(decoder.has_small_enum());
+  EXPECT_EQ(pbtest::NOT_TO_BE, decoder.small_enum());
+
+  std::vector<int32_t> repeated;
+  for (auto it = decoder.repeated_int32(); it; ++it)
+    repeated.push_back(it->as_int32());
+  EXPECT_EQ(std::vector<int32_t>({1, -2, 3}), repeated);
+}
+
+TEST(ProtoDecoderTest, NestedMessages) {
+  pbgold::NestedA msg;
+  msg.add_repeated_a()->mutable_value_b()->set_value_c(1);
+  msg.add_repeated_a();
+  msg.add_repeated_a()->mutable_value_b()->set_value_c(3);
+  msg.mutable_super_nested()->set_value_c(4);
+  std::string encoded = msg.SerializeAsString();
+
+  pbtest::NestedA::Decoder decoder(AsBytes(encoded), encoded.size());
+  pbtest::NestedA_NestedB_NestedC::Decoder super_nested(decoder.super_nested());
+  EXPECT_EQ(4, super_nested.value_c());
+
+  std::vector<int32_t> values;
+  for (auto it = decoder.repeated_a(); it; ++it) {
+    pbtest::NestedA_NestedB::Decoder b(it->as_bytes());
+    pbtest::NestedA_NestedB_NestedC::Decoder c(b.value_b());
+    values.push_back(b.has_value_b() ? c.value_c() : -1);
+  }
+  EXPECT_EQ(std::vector<int32_t>({1, -1, 3}), values);
+}
+
+TEST(ProtoDecoderTest, FindFieldReturnsLastOccurrence) {
+  pbgold::EveryField first;
+  first.set_field_int32(1);
+  first.set_field_string("first");
+  pbgold::EveryField second;
+  second.set_field_int32(2);
+  std::string encoded = first.SerializeAsString() + second.SerializeAsString();
+
+  pbtest::EveryField::Decoder decoder(AsBytes(encoded), encoded.size());
+  EXPECT_EQ(2, decoder.field_int32());
+  EXPECT_EQ("first", decoder.field_string().ToStdString());
+  EXPECT_FALSE(decoder.FindField(pbtest::EveryField::kFieldBoolFieldNumber)
+                   .valid());
+
+  // FindField() doesn't move the read cursor.
+  EXPECT_EQ(0u, decoder.read_offset());
+}
+
+TEST(ProtoDecoderTest, PackedRepeatedFields) {
+  uint8_t buf[32];
+  uint8_t* ptr = buf;
+  ptr = WriteVarInt(1u, ptr);
+  ptr = WriteVarInt(300u, ptr);
+  ptr = WriteVarInt(std::numeric_limits<uint64_t>::max(), ptr);
+  ConstBytes varints{buf, static_cast<size_t>(ptr - buf)};
+
+  std::vector<uint64_t> values;
+  PackedRepeatedFieldIterator<kFieldTypeVarInt, uint64_t> it(varints);
+  for (; it; ++it)
+    values.push_back(*it);
+  EXPECT_EQ(std::vector<uint64_t>(
+                {1u, 300u, std::numeric_limits<uint64_t>::max()}),
+            values);
+  EXPECT_FALSE(it.parse_error());
+
+  // A truncated varint.
+  buf[varints.size++] = 0x80;
+  values.clear();
+  PackedRepeatedFieldIterator<kFieldTypeVarInt, uint64_t> it2(varints);
+  for (; it2; ++it2)
+    values.push_back(*it2);
+  EXPECT_EQ(3u, values.size());
+  EXPECT_TRUE(it2.parse_error());
+
+  const float floats[] = {1.f, -2.5f};
+  uint8_t fixed[sizeof(floats) + 1];
+  memcpy(fixed, floats, sizeof(floats));
+  std::vector<float> float_values;
+  PackedRepeatedFieldIterator<kFieldTypeFixed32, float> float_it(
+      ConstBytes{fixed, sizeof(fixed)});
+  for (; float_it; ++float_it)
+    float_values.push_back(*float_it);
+  EXPECT_EQ(std::vector<float>({1.f, -2.5f}), float_values);
+  EXPECT_TRUE(float_it.parse_error());  // The trailing odd byte.
+}
+
+template <typename T, typename Iterator>
+std::vector<T> ToVector(Iterator it) {
+  std::vector<T> values;
+  for (; it; ++it)
+    values.push_back(*it);
+  EXPECT_FALSE(it.parse_error());
+  return values;
+}
+
+TEST(ProtoDecoderTest, PackedRepeatedFieldsDecoder) {
+  pbgold::PackedRepeatedFields msg;
+  msg.add_field_int32(-1);
+  msg.add_field_int32(300);
+  msg.add_field_uint64(std::numeric_limits<uint64_t>::max());
+  msg.add_field_sint32(-5);
+  msg.add_field_sint32(5);
+  msg.add_field_sint64(std::numeric_limits<int64_t>::min());
+  msg.add_field_fixed32(0xdeadbeef);
+  msg.add_field_sfixed64(-200);
+  msg.add_field_float(1.5f);
+  msg.add_field_float(-2.25f);
+  msg.add_field_double(0.5);
+  msg.add_field_bool(true);
+  msg.add_field_bool(false);
+  msg.add_signed_enum(pbgold::NEGATIVE);
+  // The values of a field split across two occurrences are concatenated.
+  std::string encoded = msg.SerializeAsString() + msg.SerializeAsString();
+
+  pbtest::PackedRepeatedFields::Decoder decoder(AsBytes(encoded),
+                                                encoded.size());
+  EXPECT_EQ(std::vector<int32_t>({-1, 300, -1, 300}),
+            ToVector<int32_t>(decoder.field_int32()));
+  EXPECT_EQ(std::vector<uint64_t>(2, std::numeric_limits<uint64_t>::max()),
+            ToVector<uint64_t>(decoder.field_uint64()));
+  EXPECT_EQ(std::vector<int32_t>({-5, 5, -5, 5}),
+            ToVector<int32_t>(decoder.field_sint32()));
+  EXPECT_EQ(std::vector<int64_t>(2, std::numeric_limits<int64_t>::min()),
+            ToVector<int64_t>(decoder.field_sint64()));
+  EXPECT_EQ(std::vector<uint32_t>(2, 0xdeadbeef),
+            ToVector<uint32_t>(decoder.field_fixed32()));
+  EXPECT_EQ(std::vector<int64_t>(2, -200),
+            ToVector<int64_t>(decoder.field_sfixed64()));
+  EXPECT_EQ(std::vector<float>({1.5f, -2.25f, 1.5f, -2.25f}),
+            ToVector<float>(decoder.field_float()));
+  EXPECT_EQ(std::vector<double>(2, 0.5),
+            ToVector<double>(decoder.field_double()));
+  EXPECT_EQ(std::vector<bool>({true, false, true, false}),
+            ToVector<bool>(decoder.field_bool()));
+  EXPECT_EQ(std::vector<pbtest::SignedEnum>(2, pbtest::NEGATIVE),
+            ToVector<pbtest::SignedEnum>(decoder.signed_enum()));
+  EXPECT_TRUE(ToVector<int64_t>(decoder.field_int64()).empty());
+}
+
+TEST(ProtoDecoderTest, TruncatedInput) {
+  std::string encoded = EncodeEveryField();
+  for (size_t size = 0; size < encoded.size(); size++) {
+    ProtoDecoder decoder(AsBytes(encoded), size);
+    size_t num_fields = 0;
+    while (decoder.ReadField().valid())
+      num_fields++;
+    EXPECT_LE(decoder.read_offset(), size);
+
+    // Only a prefix of whole fields can be read, the rest is left over.
+    ProtoDecoder full(AsBytes(encoded), encoded.size());
+    for (size_t i = 0; i < num_fields; i++)
+      full.ReadField();
+    EXPECT_EQ(full.read_offset(), decoder.read_offset());
+    EXPECT_EQ(size == full.read_offset(), decoder.bytes_left() == 0);
+  }
+}
+
+TEST(ProtoDecoderTest, MalformedInput) {
+  // Field id 0.
+  const uint8_t kZeroId[] = {0x00, 0x01};
+  ProtoDecoder zero_id(kZeroId, sizeof(kZeroId));
+  EXPECT_FALSE(zero_id.ReadField().valid());
+  EXPECT_EQ(2u, zero_id.bytes_left());
+
+  // Start group (wire type 3).
+  const uint8_t kGroup[] = {0x0b, 0x0c};
+  ProtoDecoder group(kGroup, sizeof(kGroup));
+  EXPECT_FALSE(group.ReadField().valid());
+  EXPECT_EQ(2u, group.bytes_left());
+
+  // A varint longer than 10 bytes.
+  const uint8_t kLongVarInt[] = {0x08, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                                 0xff, 0xff, 0xff, 0xff, 0x01};
+  ProtoDecoder long_varint(kLongVarInt, sizeof(kLongVarInt));
+  EXPECT_FALSE(long_varint.ReadField().valid());
+
+  // A length-delimited field whose size exceeds the buffer (by a lot).
+  const uint8_t kHugeSize[] = {0x12, 0xff, 0xff, 0xff, 0xff, 0x0f, 0x00};
+  ProtoDecoder huge_size(kHugeSize, sizeof(kHugeSize));
+  EXPECT_FALSE(huge_size.ReadField().valid());
+  EXPECT_FALSE(huge_size.FindField(2).valid());
+  EXPECT_FALSE(static_cast<bool>(huge_size.GetRepeated(2)));
+}
+
+}  // namespace
+}  // namespace protozero
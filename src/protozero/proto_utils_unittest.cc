@@ -122,6 +122,34 @@ TEST(ProtoUtilsTest, VarIntEncoding) {
   }
 }
 
+TEST(ProtoUtilsTest, VarIntSize) {
+  for (size_t i = 0; i < ArraySize(kVarIntExpectations); ++i) {
+    const VarIntExpectation& exp = kVarIntExpectations[i];
+    EXPECT_EQ(exp.encoded_size, VarIntSize(exp.int_value));
+    EXPECT_EQ(exp.encoded_size, VarIntSizeConstexpr(exp.int_value));
+  }
+}
+
+TEST(ProtoUtilsTest, CompileTimeVarIntEncoding) {
+  for (size_t i = 0; i < ArraySize(kVarIntExpectations); ++i) {
+    const VarIntExpectation& exp = kVarIntExpectations[i];
+    if (exp.encoded_size > sizeof(uint64_t))
+      continue;
+    const uint64_t encoded = EncodeVarIntConstexpr(exp.int_value);
+    ASSERT_EQ(0, memcmp(&encoded, exp.encoded, exp.encoded_size));
+  }
+
+  static_assert(PreEncodedTag<1, kFieldTypeVarInt>::kSize == 1, "");
+  static_assert(PreEncodedTag<1, kFieldTypeVarInt>::kEncoded == 0x08, "");
+  static_assert(PreEncodedTag<0x80, kFieldTypeFixed32>::kSize == 2, "");
+  static_assert(PreEncodedTag<0x80, kFieldTypeFixed32>::kEncoded == 0x0885, "");
+
+  uint8_t buf[kMaxTagEncodedSize];
+  using MaxTag = PreEncodedTag<(1u << 29) - 1, kFieldTypeLengthDelimited>;
+  ASSERT_EQ(buf + 5, MaxTag::Write(buf));
+  ASSERT_EQ(0, memcmp("\xFA\xFF\xFF\xFF\x0F", buf, sizeof(buf)));
+}
+
 TEST(ProtoUtilsTest, RedundantVarIntEncoding) {
   uint8_t buf[kMessageLengthFieldSize];
 
@@ -247,7 +247,9 @@ class GeneratorJob {
         "#include <stddef.h>\n"
         "#include <stdint.h>\n\n"
         "#include \"perfetto/protozero/proto_field_descriptor.h\"\n"
-        "#include \"perfetto/protozero/message.h\"\n",
+        "#include \"perfetto/protozero/message.h\"\n"
+        "#include \"perfetto/protozero/packed_repeated_fields.h\"\n"
+        "#include \"perfetto/protozero/proto_decoder.h\"\n",
         "greeting", greeting, "guard", guard);
     stub_cc_->Print(
         "$greeting$\n"
@@ -407,9 +409,18 @@ class GeneratorJob {
         break;
       }
       case FieldDescriptor::TYPE_STRING: {
-        appender = "AppendString";
-        cpp_type = "const char*";
-        break;
+        // Also generate a variant for non-null terminated strings.
+        stub_h_->Print(
+            setter,
+            "void $action$_$name$(const char* value) {\n"
+            "  AppendString($id$, value);\n"
+            "}\n"
+            "// Doesn't check for null terminator.\n"
+            "// Expects |value| to be at least |size| long.\n"
+            "void $action$_$name$(const char* value, size_t size) {\n"
+            "  AppendBytes($id$, value, size);\n"
+            "}\n");
+        return;
       }
       case FieldDescriptor::TYPE_BYTES: {
         stub_h_->Print(
@@ -427,20 +438,115 @@ class GeneratorJob {
     }
     setter["appender"] = appender;
     setter["cpp_type"] = cpp_type;
+    // The field id is a template argument, so that the tag is encoded at
+    // compile time.
     stub_h_->Print(setter,
                    "void $action$_$name$($cpp_type$ value) {\n"
-                   "  $appender$($id$, value);\n"
+                   "  $appender$<$id$>(value);\n"
                    "}\n");
+  }
 
-    // For strings also generate a variant for non-null terminated strings.
-    if (field->type() == FieldDescriptor::TYPE_STRING) {
-      stub_h_->Print(setter,
-                     "// Doesn't check for null terminator.\n"
-                     "// Expects |value| to be at least |size| long.\n"
-                     "void $action$_$name$($cpp_type$ value, size_t size) {\n"
-                     "  AppendBytes($id$, value, size);\n"
-                     "}\n");
+  // Packed repeated fields get two add_xxx_packed() variants: one which writes
+  // a whole array of values and one which returns a stub to stream them.
+  void GeneratePackedFieldDescriptor(const FieldDescriptor* field) {
+    std::map<std::string, std::string> setter;
+    setter["id"] = std::to_string(field->number());
+    setter["name"] = field->name();
+
+    std::string encoding;
+    std::string cpp_type;
+
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_BOOL: {
+        encoding = "VarInt";
+        cpp_type = "bool";
+        break;
+      }
+      case FieldDescriptor::TYPE_INT32: {
+        encoding = "VarInt";
+        cpp_type = "int32_t";
+        break;
+      }
+      case FieldDescriptor::TYPE_INT64: {
+        encoding = "VarInt";
+        cpp_type = "int64_t";
+        break;
+      }
+      case FieldDescriptor::TYPE_UINT32: {
+        encoding = "VarInt";
+        cpp_type = "uint32_t";
+        break;
+      }
+      case FieldDescriptor::TYPE_UINT64: {
+        encoding = "VarInt";
+        cpp_type = "uint64_t";
+        break;
+      }
+      case FieldDescriptor::TYPE_SINT32: {
+        encoding = "SignedVarInt";
+        cpp_type = "int32_t";
+        break;
+      }
+      case FieldDescriptor::TYPE_SINT64: {
+        encoding = "SignedVarInt";
+        cpp_type = "int64_t";
+        break;
+      }
+      case FieldDescriptor::TYPE_FIXED32: {
+        encoding = "Fixed";
+        cpp_type = "uint32_t";
+        break;
+      }
+      case FieldDescriptor::TYPE_FIXED64: {
+        encoding = "Fixed";
+        cpp_type = "uint64_t";
+        break;
+      }
+      case FieldDescriptor::TYPE_SFIXED32: {
+        encoding = "Fixed";
+        cpp_type = "int32_t";
+        break;
+      }
+      case FieldDescriptor::TYPE_SFIXED64: {
+        encoding = "Fixed";
+        cpp_type = "int64_t";
+        break;
+      }
+      case FieldDescriptor::TYPE_FLOAT: {
+        encoding = "Fixed";
+        cpp_type = "float";
+        break;
+      }
+      case FieldDescriptor::TYPE_DOUBLE: {
+        encoding = "Fixed";
+        cpp_type = "double";
+        break;
+      }
+      case FieldDescriptor::TYPE_ENUM: {
+        encoding = "VarInt";
+        cpp_type = GetCppClassName(field->enum_type(), true);
+        break;
+      }
+      case FieldDescriptor::TYPE_STRING:
+      case FieldDescriptor::TYPE_BYTES:
+      case FieldDescriptor::TYPE_GROUP:
+      case FieldDescriptor::TYPE_MESSAGE: {
+        Abort("Unsupported packed field type.");
+        return;
+      }
     }
+    setter["encoding"] = encoding;
+    setter["cpp_type"] = cpp_type;
+    stub_h_->Print(setter,
+                   "void add_$name$_packed(const $cpp_type$* values, "
+                   "size_t count) {\n"
+                   "  AppendPacked$encoding$($id$, values, count);\n"
+                   "}\n"
+                   "::protozero::Packed$encoding$<$cpp_type$>* "
+                   "add_$name$_packed() {\n"
+                   "  return BeginNestedMessage<"
+                   "::protozero::Packed$encoding$<$cpp_type$>>($id$);\n"
+                   "}\n");
   }
 
   void GenerateNestedMessageFieldDescriptor(const FieldDescriptor* field) {
@@ -533,6 +639,158 @@ class GeneratorJob {
     stub_cc_->Print("}\n\n");
   }
 
+  // Generates the typed accessors of a field for the Decoder of its message.
+  void GenerateFieldDecoder(const FieldDescriptor* field) {
+    std::map<std::string, std::string> getter;
+    getter["name"] = field->name();
+    getter["id"] = GetFieldNumberConstant(field);
+
+    if (field->is_repeated() && !field->is_packed()) {
+      stub_h_->Print(getter,
+                     "::protozero::ProtoDecoder::RepeatedFieldIterator "
+                     "$name$() const {\n"
+                     "  return GetRepeated($id$);\n"
+                     "}\n");
+      return;
+    }
+
+    std::string cpp_type;
+    std::string converter;
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_BOOL:
+        cpp_type = "bool";
+        converter = "as_bool()";
+        break;
+      case FieldDescriptor::TYPE_INT32:
+      case FieldDescriptor::TYPE_SFIXED32:
+        cpp_type = "int32_t";
+        converter = "as_int32()";
+        break;
+      case FieldDescriptor::TYPE_INT64:
+      case FieldDescriptor::TYPE_SFIXED64:
+        cpp_type = "int64_t";
+        converter = "as_int64()";
+        break;
+      case FieldDescriptor::TYPE_UINT32:
+      case FieldDescriptor::TYPE_FIXED32:
+        cpp_type = "uint32_t";
+        converter = "as_uint32()";
+        break;
+      case FieldDescriptor::TYPE_UINT64:
+      case FieldDescriptor::TYPE_FIXED64:
+        cpp_type = "uint64_t";
+        converter = "as_uint64()";
+        break;
+      case FieldDescriptor::TYPE_SINT32:
+        cpp_type = "int32_t";
+        converter = "as_sint32()";
+        break;
+      case FieldDescriptor::TYPE_SINT64:
+        cpp_type = "int64_t";
+        converter = "as_sint64()";
+        break;
+      case FieldDescriptor::TYPE_FLOAT:
+        cpp_type = "float";
+        converter = "as_float()";
+        break;
+      case FieldDescriptor::TYPE_DOUBLE:
+        cpp_type = "double";
+        converter = "as_double()";
+        break;
+      case FieldDescriptor::TYPE_ENUM:
+        cpp_type = GetCppClassName(field->enum_type(), true);
+        converter = "as_int32()";
+        break;
+      case FieldDescriptor::TYPE_STRING:
+        cpp_type = "::protozero::ConstChars";
+        converter = "as_string()";
+        break;
+      case FieldDescriptor::TYPE_BYTES:
+      case FieldDescriptor::TYPE_MESSAGE:
+        // Nested messages are decoded with their own Decoder.
+        cpp_type = "::protozero::ConstBytes";
+        converter = "as_bytes()";
+        break;
+      case FieldDescriptor::TYPE_GROUP:
+        Abort("Unsupported field type.");
+        return;
+    }
+    getter["cpp_type"] = cpp_type;
+    getter["converter"] = converter;
+
+    // The packed fields are iterated value by value, across all their
+    // occurrences.
+    if (field->is_packed()) {
+      std::string wire_type = "kFieldTypeVarInt";
+      std::string zigzag = "false";
+      switch (field->type()) {
+        case FieldDescriptor::TYPE_FIXED32:
+        case FieldDescriptor::TYPE_SFIXED32:
+        case FieldDescriptor::TYPE_FLOAT:
+          wire_type = "kFieldTypeFixed32";
+          break;
+        case FieldDescriptor::TYPE_FIXED64:
+        case FieldDescriptor::TYPE_SFIXED64:
+        case FieldDescriptor::TYPE_DOUBLE:
+          wire_type = "kFieldTypeFixed64";
+          break;
+        case FieldDescriptor::TYPE_SINT32:
+        case FieldDescriptor::TYPE_SINT64:
+          zigzag = "true";
+          break;
+        default:
+          break;
+      }
+      getter["iterator"] =
+          "::protozero::PackedRepeatedFieldIterator<"
+          "::protozero::proto_utils::" +
+          wire_type + ", " + cpp_type + ", " + zigzag + ">";
+      stub_h_->Print(getter,
+                     "$iterator$ $name$() const {\n"
+                     "  return $iterator$($id$, *this);\n"
+                     "}\n");
+      return;
+    }
+
+    stub_h_->Print(getter,
+                   "bool has_$name$() const {\n"
+                   "  return FindField($id$).valid();\n"
+                   "}\n");
+    if (field->type() == FieldDescriptor::TYPE_ENUM) {
+      stub_h_->Print(getter,
+                     "$cpp_type$ $name$() const {\n"
+                     "  return static_cast<$cpp_type$>("
+                     "FindField($id$).$converter$);\n"
+                     "}\n");
+    } else {
+      stub_h_->Print(getter,
+                     "$cpp_type$ $name$() const {\n"
+                     "  return FindField($id$).$converter$;\n"
+                     "}\n");
+    }
+  }
+
+  // Generates a zero-copy Decoder, nested in the class of the message. Each
+  // accessor scans the encoded message (see ProtoDecoder::FindField()), so
+  // callers reading many fields of large messages should rather iterate them
+  // once with ReadField().
+  void GenerateMessageDecoder(const Descriptor* message) {
+    stub_h_->Print(
+        "\n"
+        "class Decoder : public ::protozero::ProtoDecoder {\n"
+        " public:\n");
+    stub_h_->Indent();
+    stub_h_->Print(
+        "Decoder(const uint8_t* data, size_t size)\n"
+        "    : ::protozero::ProtoDecoder(data, size) {}\n"
+        "explicit Decoder(::protozero::ConstBytes bytes)\n"
+        "    : ::protozero::ProtoDecoder(bytes) {}\n");
+    for (int i = 0; i < message->field_count(); ++i)
+      GenerateFieldDecoder(message->field(i));
+    stub_h_->Outdent();
+    stub_h_->Print("};\n");
+  }
+
   void GenerateMessageDescriptor(const Descriptor* message) {
     stub_h_->Print(
         "class $name$ : public ::protozero::Message {\n"
@@ -575,16 +833,16 @@ class GeneratorJob {
     for (int i = 0; i < message->field_count(); ++i) {
       const FieldDescriptor* field = message->field(i);
       if (field->is_packed()) {
-        Abort("Packed repeated fields are not supported.");
-        return;
-      }
-      if (field->type() != FieldDescriptor::TYPE_MESSAGE) {
+        GeneratePackedFieldDescriptor(field);
+      } else if (field->type() != FieldDescriptor::TYPE_MESSAGE) {
         GenerateSimpleFieldDescriptor(field);
       } else {
         GenerateNestedMessageFieldDescriptor(field);
       }
     }
 
+    GenerateMessageDecoder(message);
+
     stub_h_->Outdent();
     stub_h_->Print("};\n\n");
   }
@@ -24,6 +24,11 @@ namespace protozero {
 
 ScatteredStreamWriter::Delegate::~Delegate() {}
 
+ContiguousMemoryRange
+ScatteredStreamWriter::Delegate::GetNewBufferForDirectWrite(size_t) {
+  return GetNewBuffer();
+}
+
 ScatteredStreamWriter::ScatteredStreamWriter(Delegate* delegate)
     : delegate_(delegate),
       cur_range_({nullptr, nullptr}),
@@ -71,4 +76,15 @@ uint8_t* ScatteredStreamWriter::ReserveBytes(size_t size) {
   return begin;
 }
 
+uint8_t* ScatteredStreamWriter::ReserveBytesForDirectWriteSlowPath(
+    size_t size) {
+  ContiguousMemoryRange range = delegate_->GetNewBufferForDirectWrite(size);
+  if (!range.begin)
+    return nullptr;
+  Reset(range);
+  if (size > bytes_available())
+    return nullptr;
+  return ReserveBytesUnsafe(size);
+}
+
 }  // namespace protozero
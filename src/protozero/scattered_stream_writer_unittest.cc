@@ -19,6 +19,7 @@
 #include <string.h>
 
 #include <memory>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "perfetto/base/logging.h"
@@ -29,6 +30,25 @@ namespace {
 
 constexpr size_t kChunkSize = 8;
 
+// Also provides buffers larger than a chunk, for direct writes.
+class DirectWriteDelegate : public FakeScatteredBuffer {
+ public:
+  DirectWriteDelegate() : FakeScatteredBuffer(kChunkSize) {}
+
+  ContiguousMemoryRange GetNewBufferForDirectWrite(size_t min_size) override {
+    if (min_size > kMaxDirectWriteSize)
+      return {nullptr, nullptr};
+    large_buffers_.emplace_back(new uint8_t[min_size]);
+    uint8_t* begin = large_buffers_.back().get();
+    return {begin, begin + min_size};
+  }
+
+  static constexpr size_t kMaxDirectWriteSize = 64;
+  std::vector<std::unique_ptr<uint8_t[]>> large_buffers_;
+};
+
+constexpr size_t DirectWriteDelegate::kMaxDirectWriteSize;
+
 TEST(ScatteredStreamWriterTest, ScatteredWrites) {
   FakeScatteredBuffer delegate(kChunkSize);
   ScatteredStreamWriter ssw(&delegate);
@@ -107,5 +127,36 @@ TEST(ScatteredStreamWriterTest, ScatteredWrites) {
   EXPECT_EQ(0x52u, other_buffer[3]);
 }
 
+TEST(ScatteredStreamWriterTest, ReserveBytesForDirectWrite) {
+  DirectWriteDelegate delegate;
+  ScatteredStreamWriter ssw(&delegate);
+
+  // Reservations that fit in the current chunk don't involve the delegate.
+  ssw.WriteByte(0x01);
+  uint8_t* small = ssw.ReserveBytesForDirectWrite(4);
+  ASSERT_NE(nullptr, small);
+  memset(small, 0xAA, 4);
+  EXPECT_EQ(3u, ssw.bytes_available());
+  EXPECT_EQ(1u, delegate.chunks().size());
+  EXPECT_EQ(0u, delegate.large_buffers_.size());
+
+  // Larger ones get a dedicated buffer.
+  uint8_t* large = ssw.ReserveBytesForDirectWrite(32);
+  ASSERT_EQ(delegate.large_buffers_.back().get(), large);
+  memset(large, 0xBB, 32);
+  EXPECT_EQ(0u, ssw.bytes_available());
+
+  // If the delegate can't provide a large enough buffer, the writer carries
+  // on with the current one.
+  ssw.WriteByte(0x02);
+  EXPECT_EQ(nullptr, ssw.ReserveBytesForDirectWrite(128));
+  EXPECT_EQ(1u, delegate.large_buffers_.size());
+  EXPECT_EQ(kChunkSize - 1, ssw.bytes_available());
+  ssw.WriteByte(0x03);
+
+  EXPECT_EQ("01AAAAAAAA000000", delegate.GetChunkAsString(0));
+  EXPECT_EQ("0203000000000000", delegate.GetChunkAsString(1));
+}
+
 }  // namespace
 }  // namespace protozero
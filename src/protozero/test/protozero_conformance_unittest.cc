@@ -51,8 +51,8 @@ class ProtoZeroConformanceTest : public ::testing::Test {
  protected:
   template <class T>
   T* CreateMessage() {
-    T* message = new T();
-    root_messages_.push_back(std::unique_ptr<T>(message));
+    RootMessage<T>* message = new RootMessage<T>();
+    root_messages_.push_back(std::shared_ptr<Message>(message));
     message->Reset(stream_writer_.get());
     return message;
   }
@@ -69,7 +69,8 @@ class ProtoZeroConformanceTest : public ::testing::Test {
  private:
   std::unique_ptr<FakeScatteredBuffer> buffer_;
   std::unique_ptr<ScatteredStreamWriter> stream_writer_;
-  std::vector<std::unique_ptr<Message>> root_messages_;
+  // shared_ptr, unlike unique_ptr, deletes them through their actual type.
+  std::vector<std::shared_ptr<Message>> root_messages_;
 };
 
 TEST_F(ProtoZeroConformanceTest, SimpleFieldsNoNesting) {
@@ -131,6 +132,137 @@ TEST_F(ProtoZeroConformanceTest, SimpleFieldsNoNesting) {
   EXPECT_EQ(2000000, gold_msg.repeated_int32(3));
 }
 
+TEST_F(ProtoZeroConformanceTest, PackedRepeatedFields) {
+  auto* msg = CreateMessage<pbtest::PackedRepeatedFields>();
+
+  const int32_t int32s[] = {1, -1, 100, 2000000};
+  const int64_t int64s[] = {std::numeric_limits<int64_t>::min(), 0, 42};
+  const uint32_t uint32s[] = {std::numeric_limits<uint32_t>::max(), 127, 128};
+  const uint64_t uint64s[] = {std::numeric_limits<uint64_t>::max()};
+  const int32_t sint32s[] = {-5, 5};
+  const int64_t sint64s[] = {-9000, std::numeric_limits<int64_t>::max()};
+  const uint32_t fixed32s[] = {12345, 0};
+  const uint64_t fixed64s[] = {444123450000ull};
+  const int32_t sfixed32s[] = {-69999};
+  const int64_t sfixed64s[] = {-200, 200};
+  const float floats[] = {3.14f, -1.f};
+  const double doubles[] = {0.5555};
+  const bool bools[] = {true, false, true};
+  const pbtest::SignedEnum enums[] = {pbtest::NEGATIVE, pbtest::POSITIVE};
+
+  msg->add_field_int32_packed(int32s, 4);
+  msg->add_field_int64_packed(int64s, 3);
+  msg->add_field_uint32_packed(uint32s, 3);
+  msg->add_field_uint64_packed(uint64s, 1);
+  msg->add_field_sint32_packed(sint32s, 2);
+  msg->add_field_sint64_packed(sint64s, 2);
+  msg->add_field_fixed32_packed(fixed32s, 2);
+  msg->add_field_fixed64_packed(fixed64s, 1);
+  msg->add_field_sfixed32_packed(sfixed32s, 1);
+  msg->add_field_sfixed64_packed(sfixed64s, 2);
+  msg->add_field_float_packed(floats, 2);
+  msg->add_field_double_packed(doubles, 1);
+  msg->add_field_bool_packed(bools, 3);
+  msg->add_signed_enum_packed(enums, 2);
+  msg->add_field_int32_packed(int32s, 0);  // Writes nothing.
+  msg->add_field_int32_packed(int32s, 1);  // Appends to the previous values.
+  msg->Finalize();
+
+  size_t msg_size = GetNumSerializedBytes();
+  std::unique_ptr<uint8_t[]> msg_binary(new uint8_t[msg_size]);
+  GetSerializedBytes(0, msg_size, msg_binary.get());
+
+  pbgold::PackedRepeatedFields gold_msg;
+  ASSERT_TRUE(
+      gold_msg.ParseFromArray(msg_binary.get(), static_cast<int>(msg_size)));
+  EXPECT_EQ(std::vector<int32_t>({1, -1, 100, 2000000, 1}),
+            std::vector<int32_t>(gold_msg.field_int32().begin(),
+                                 gold_msg.field_int32().end()));
+  EXPECT_EQ(std::vector<int64_t>(int64s, int64s + 3),
+            std::vector<int64_t>(gold_msg.field_int64().begin(),
+                                 gold_msg.field_int64().end()));
+  EXPECT_EQ(std::vector<uint32_t>(uint32s, uint32s + 3),
+            std::vector<uint32_t>(gold_msg.field_uint32().begin(),
+                                  gold_msg.field_uint32().end()));
+  EXPECT_EQ(std::vector<uint64_t>(uint64s, uint64s + 1),
+            std::vector<uint64_t>(gold_msg.field_uint64().begin(),
+                                  gold_msg.field_uint64().end()));
+  EXPECT_EQ(std::vector<int32_t>(sint32s, sint32s + 2),
+            std::vector<int32_t>(gold_msg.field_sint32().begin(),
+                                 gold_msg.field_sint32().end()));
+  EXPECT_EQ(std::vector<int64_t>(sint64s, sint64s + 2),
+            std::vector<int64_t>(gold_msg.field_sint64().begin(),
+                                 gold_msg.field_sint64().end()));
+  EXPECT_EQ(std::vector<uint32_t>(fixed32s, fixed32s + 2),
+            std::vector<uint32_t>(gold_msg.field_fixed32().begin(),
+                                  gold_msg.field_fixed32().end()));
+  EXPECT_EQ(std::vector<uint64_t>(fixed64s, fixed64s + 1),
+            std::vector<uint64_t>(gold_msg.field_fixed64().begin(),
+                                  gold_msg.field_fixed64().end()));
+  EXPECT_EQ(std::vector<int32_t>(sfixed32s, sfixed32s + 1),
+            std::vector<int32_t>(gold_msg.field_sfixed32().begin(),
+                                 gold_msg.field_sfixed32().end()));
+  EXPECT_EQ(std::vector<int64_t>(sfixed64s, sfixed64s + 2),
+            std::vector<int64_t>(gold_msg.field_sfixed64().begin(),
+                                 gold_msg.field_sfixed64().end()));
+  EXPECT_EQ(std::vector<float>(floats, floats + 2),
+            std::vector<float>(gold_msg.field_float().begin(),
+                               gold_msg.field_float().end()));
+  EXPECT_EQ(std::vector<double>(doubles, doubles + 1),
+            std::vector<double>(gold_msg.field_double().begin(),
+                                gold_msg.field_double().end()));
+  EXPECT_EQ(std::vector<bool>(bools, bools + 3),
+            std::vector<bool>(gold_msg.field_bool().begin(),
+                              gold_msg.field_bool().end()));
+  ASSERT_EQ(2, gold_msg.signed_enum_size());
+  EXPECT_EQ(pbgold::NEGATIVE, gold_msg.signed_enum(0));
+  EXPECT_EQ(pbgold::POSITIVE, gold_msg.signed_enum(1));
+}
+
+TEST_F(ProtoZeroConformanceTest, StreamedPackedRepeatedFields) {
+  auto* msg = CreateMessage<pbtest::PackedRepeatedFields>();
+
+  // Enough values to span across several chunks.
+  std::vector<int64_t> expected_sint64s;
+  auto* sint64s = msg->add_field_sint64_packed();
+  for (int64_t i = -100; i < 100; i++) {
+    sint64s->Append(i * 1000);
+    expected_sint64s.push_back(i * 1000);
+  }
+  auto* doubles = msg->add_field_double_packed();
+  doubles->Append(0.5);
+  doubles->Append(-0.25);
+  // Ends the packed doubles, like any nested message.
+  const uint32_t uint32s[] = {1, 2};
+  msg->add_field_uint32_packed(uint32s, 2);
+  auto* uint32s_streamed = msg->add_field_uint32_packed();
+  uint32s_streamed->Append(3);
+  msg->add_field_bool_packed()->Append(true);
+  msg->add_signed_enum_packed()->Append(pbtest::NEGATIVE);
+  msg->Finalize();
+
+  size_t msg_size = GetNumSerializedBytes();
+  std::unique_ptr<uint8_t[]> msg_binary(new uint8_t[msg_size]);
+  GetSerializedBytes(0, msg_size, msg_binary.get());
+
+  pbgold::PackedRepeatedFields gold_msg;
+  ASSERT_TRUE(
+      gold_msg.ParseFromArray(msg_binary.get(), static_cast<int>(msg_size)));
+  EXPECT_EQ(expected_sint64s,
+            std::vector<int64_t>(gold_msg.field_sint64().begin(),
+                                 gold_msg.field_sint64().end()));
+  EXPECT_EQ(std::vector<double>({0.5, -0.25}),
+            std::vector<double>(gold_msg.field_double().begin(),
+                                gold_msg.field_double().end()));
+  EXPECT_EQ(std::vector<uint32_t>({1, 2, 3}),
+            std::vector<uint32_t>(gold_msg.field_uint32().begin(),
+                                  gold_msg.field_uint32().end()));
+  ASSERT_EQ(1, gold_msg.field_bool_size());
+  EXPECT_TRUE(gold_msg.field_bool(0));
+  ASSERT_EQ(1, gold_msg.signed_enum_size());
+  EXPECT_EQ(pbgold::NEGATIVE, gold_msg.signed_enum(0));
+}
+
 TEST_F(ProtoZeroConformanceTest, NestedMessages) {
   auto* msg_a = CreateMessage<pbtest::NestedA>();
 
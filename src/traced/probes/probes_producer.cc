@@ -24,6 +24,7 @@
 #include <string>
 
 #include "perfetto/base/logging.h"
+#include "perfetto/base/time.h"
 #include "perfetto/base/weak_ptr.h"
 #include "perfetto/traced/traced.h"
 #include "perfetto/tracing/core/data_source_config.h"
@@ -348,6 +349,10 @@ void ProbesProducer::SinkDelegate::WriteStats() {
 ProbesProducer::FtraceBundleHandle
 ProbesProducer::SinkDelegate::GetBundleForCpu(size_t) {
   trace_packet_ = writer_->NewTracePacket();
+  // The events of the bundle precede this time, which is good enough as a
+  // sorting hint for the service.
+  trace_packet_->set_timestamp(
+      static_cast<uint64_t>(base::GetWallTimeNs().count()));
   return FtraceBundleHandle(trace_packet_->set_ftrace_events());
 }
 
@@ -14,9 +14,12 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
 #include "perfetto/base/unix_task_runner.h"
 #include "perfetto/base/watchdog.h"
 #include "perfetto/traced/traced.h"
+#include "perfetto/tracing/core/service.h"
 #include "perfetto/tracing/ipc/service_ipc_host.h"
 #include "src/tracing/ipc/default_socket.h"
 
@@ -25,7 +28,11 @@ namespace perfetto {
 int __attribute__((visibility("default"))) ServiceMain(int, char**) {
   base::UnixTaskRunner task_runner;
   std::unique_ptr<ServiceIPCHost> svc;
-  svc = ServiceIPCHost::CreateInstance(&task_runner);
+  // Huge pages save TLB misses on large shared memory buffers, but they come
+  // from a pool that the system has to reserve upfront.
+  const char* env_huge_pages = getenv("PERFETTO_SHM_HUGE_PAGES");
+  const bool use_huge_pages = env_huge_pages && atoi(env_huge_pages) > 0;
+  svc = ServiceIPCHost::CreateInstance(&task_runner, use_huge_pages);
 
   // When built as part of the Android tree, the two socket are created and
   // bonund by init and their fd number is passed in two env variables.
@@ -43,6 +50,29 @@ int __attribute__((visibility("default"))) ServiceMain(int, char**) {
     svc->Start(GetProducerSocket(), GetConsumerSocket());
   }
 
+  // Optionally move the copy of the committed chunks into the trace buffers
+  // off the main thread. This must happen before any producer connects, which
+  // can't happen before the task runner starts running.
+  const char* env_data_plane = getenv("PERFETTO_DATA_PLANE_THREADS");
+  const int data_plane_threads = env_data_plane ? atoi(env_data_plane) : 0;
+  if (data_plane_threads > 0 && svc->service()) {
+    svc->service()->SetDataPlaneThreads(
+        static_cast<size_t>(data_plane_threads));
+  }
+
+  // Optionally raise (or lower) the number of concurrent tracing sessions and
+  // cap the total size of their buffers.
+  const char* env_max_sessions = getenv("PERFETTO_MAX_TRACING_SESSIONS");
+  const char* env_max_buffer_kb = getenv("PERFETTO_MAX_TOTAL_BUFFER_SIZE_KB");
+  const int max_sessions = env_max_sessions ? atoi(env_max_sessions) : 0;
+  const int max_buffer_kb = env_max_buffer_kb ? atoi(env_max_buffer_kb) : 0;
+  if ((max_sessions > 0 || max_buffer_kb > 0) && svc->service()) {
+    svc->service()->SetTracingSessionLimits(
+        max_sessions > 0 ? static_cast<size_t>(max_sessions)
+                         : Service::kDefaultMaxTracingSessions,
+        static_cast<size_t>(std::max(max_buffer_kb, 0)));
+  }
+
   // Set the CPU limit and start the watchdog running. The memory limit will
   // be set inside the service code as it relies on the size of buffers.
   // The CPU limit is 75% over a 30 second interval.
@@ -57,6 +57,44 @@ void CommitDataRequest::FromProto(
                 "size mismatch");
   flush_request_id_ =
       static_cast<decltype(flush_request_id_)>(proto.flush_request_id());
+
+  data_losses_.clear();
+  for (const auto& field : proto.data_losses()) {
+    data_losses_.emplace_back();
+    data_losses_.back().FromProto(field);
+  }
+
+  static_assert(sizeof(commit_ring_write_idx_) ==
+                    sizeof(proto.commit_ring_write_idx()),
+                "size mismatch");
+  commit_ring_write_idx_ = static_cast<decltype(commit_ring_write_idx_)>(
+      proto.commit_ring_write_idx());
+
+  packed_chunks_to_move_.clear();
+  for (const auto& field : proto.packed_chunks_to_move()) {
+    packed_chunks_to_move_.emplace_back();
+    static_assert(sizeof(packed_chunks_to_move_.back()) ==
+                      sizeof(proto.packed_chunks_to_move(0)),
+                  "size mismatch");
+    packed_chunks_to_move_.back() =
+        static_cast<decltype(packed_chunks_to_move_)::value_type>(field);
+  }
+
+  static_assert(sizeof(packed_chunks_to_patch_) ==
+                    sizeof(proto.packed_chunks_to_patch()),
+                "size mismatch");
+  packed_chunks_to_patch_ = static_cast<decltype(packed_chunks_to_patch_)>(
+      proto.packed_chunks_to_patch());
+
+  released_writers_.clear();
+  for (const auto& field : proto.released_writers()) {
+    released_writers_.emplace_back();
+    static_assert(sizeof(released_writers_.back()) ==
+                      sizeof(proto.released_writers(0)),
+                  "size mismatch");
+    released_writers_.back() =
+        static_cast<decltype(released_writers_)::value_type>(field);
+  }
   unknown_fields_ = proto.unknown_fields();
 }
 
@@ -78,6 +116,39 @@ void CommitDataRequest::ToProto(
                 "size mismatch");
   proto->set_flush_request_id(
       static_cast<decltype(proto->flush_request_id())>(flush_request_id_));
+
+  for (const auto& it : data_losses_) {
+    auto* entry = proto->add_data_losses();
+    it.ToProto(entry);
+  }
+
+  static_assert(sizeof(commit_ring_write_idx_) ==
+                    sizeof(proto->commit_ring_write_idx()),
+                "size mismatch");
+  proto->set_commit_ring_write_idx(
+      static_cast<decltype(proto->commit_ring_write_idx())>(
+          commit_ring_write_idx_));
+
+  for (const auto& it : packed_chunks_to_move_) {
+    proto->add_packed_chunks_to_move(
+        static_cast<decltype(proto->packed_chunks_to_move(0))>(it));
+    static_assert(sizeof(it) == sizeof(proto->packed_chunks_to_move(0)),
+                  "size mismatch");
+  }
+
+  static_assert(sizeof(packed_chunks_to_patch_) ==
+                    sizeof(proto->packed_chunks_to_patch()),
+                "size mismatch");
+  proto->set_packed_chunks_to_patch(
+      static_cast<decltype(proto->packed_chunks_to_patch())>(
+          packed_chunks_to_patch_));
+
+  for (const auto& it : released_writers_) {
+    proto->add_released_writers(
+        static_cast<decltype(proto->released_writers(0))>(it));
+    static_assert(sizeof(it) == sizeof(proto->released_writers(0)),
+                  "size mismatch");
+  }
   *(proto->mutable_unknown_fields()) = unknown_fields_;
 }
 
@@ -222,4 +293,53 @@ void CommitDataRequest::ChunkToPatch::Patch::ToProto(
   *(proto->mutable_unknown_fields()) = unknown_fields_;
 }
 
+CommitDataRequest::DataLoss::DataLoss() = default;
+CommitDataRequest::DataLoss::~DataLoss() = default;
+CommitDataRequest::DataLoss::DataLoss(const CommitDataRequest::DataLoss&) =
+    default;
+CommitDataRequest::DataLoss& CommitDataRequest::DataLoss::operator=(
+    const CommitDataRequest::DataLoss&) = default;
+CommitDataRequest::DataLoss::DataLoss(CommitDataRequest::DataLoss&&) noexcept =
+    default;
+CommitDataRequest::DataLoss& CommitDataRequest::DataLoss::operator=(
+    CommitDataRequest::DataLoss&&) = default;
+
+void CommitDataRequest::DataLoss::FromProto(
+    const perfetto::protos::CommitDataRequest_DataLoss& proto) {
+  static_assert(sizeof(target_buffer_) == sizeof(proto.target_buffer()),
+                "size mismatch");
+  target_buffer_ = static_cast<decltype(target_buffer_)>(proto.target_buffer());
+
+  static_assert(sizeof(packets_dropped_) == sizeof(proto.packets_dropped()),
+                "size mismatch");
+  packets_dropped_ =
+      static_cast<decltype(packets_dropped_)>(proto.packets_dropped());
+
+  static_assert(sizeof(bytes_dropped_) == sizeof(proto.bytes_dropped()),
+                "size mismatch");
+  bytes_dropped_ = static_cast<decltype(bytes_dropped_)>(proto.bytes_dropped());
+  unknown_fields_ = proto.unknown_fields();
+}
+
+void CommitDataRequest::DataLoss::ToProto(
+    perfetto::protos::CommitDataRequest_DataLoss* proto) const {
+  proto->Clear();
+
+  static_assert(sizeof(target_buffer_) == sizeof(proto->target_buffer()),
+                "size mismatch");
+  proto->set_target_buffer(
+      static_cast<decltype(proto->target_buffer())>(target_buffer_));
+
+  static_assert(sizeof(packets_dropped_) == sizeof(proto->packets_dropped()),
+                "size mismatch");
+  proto->set_packets_dropped(
+      static_cast<decltype(proto->packets_dropped())>(packets_dropped_));
+
+  static_assert(sizeof(bytes_dropped_) == sizeof(proto->bytes_dropped()),
+                "size mismatch");
+  proto->set_bytes_dropped(
+      static_cast<decltype(proto->bytes_dropped())>(bytes_dropped_));
+  *(proto->mutable_unknown_fields()) = unknown_fields_;
+}
+
 }  // namespace perfetto
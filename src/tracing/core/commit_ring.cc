@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/commit_ring.h"
+
+#include "perfetto/base/logging.h"
+
+namespace perfetto {
+
+CommitRing::CommitRing() = default;
+
+CommitRing::CommitRing(uint8_t* start, size_t size)
+    : start_(start),
+      capacity_(static_cast<uint32_t>((size - sizeof(Header)) /
+                                      sizeof(Entry))) {
+  PERFETTO_CHECK(size > sizeof(Header) + sizeof(Entry));
+  PERFETTO_CHECK(reinterpret_cast<uintptr_t>(start) % sizeof(Header) == 0);
+}
+
+bool CommitRing::TryPush(const Entry& entry, bool* was_empty) {
+  PERFETTO_DCHECK(is_valid());
+  const uint32_t write_idx = next_idx_;
+  const uint32_t next_write_idx = (write_idx + 1) % capacity_;
+  if (next_write_idx == header()->read_idx.load(std::memory_order_acquire))
+    return false;  // The ring is full.
+
+  entries()[write_idx] = entry;
+  next_idx_ = next_write_idx;
+
+  // The store of |write_idx| and the load of |read_idx| below (and the
+  // symmetric ones in TryPop()) must be sequentially consistent. Either the
+  // service sees the new |write_idx| before giving up on the ring, or we see
+  // that it had consumed all the previous entries and wake it up.
+  header()->write_idx.store(next_write_idx, std::memory_order_seq_cst);
+  *was_empty =
+      header()->read_idx.load(std::memory_order_seq_cst) == write_idx;
+  return true;
+}
+
+bool CommitRing::TryPop(Entry* entry) {
+  PERFETTO_DCHECK(is_valid());
+  const uint32_t read_idx = next_idx_;
+  const uint32_t write_idx =
+      header()->write_idx.load(std::memory_order_seq_cst);
+
+  // An out of bounds |write_idx| can only come from a buggy or malicious
+  // producer. Treat the ring as empty.
+  if (write_idx == read_idx || write_idx >= capacity_)
+    return false;
+
+  *entry = entries()[read_idx];
+  next_idx_ = (read_idx + 1) % capacity_;
+  header()->read_idx.store(next_idx_, std::memory_order_seq_cst);
+  return true;
+}
+
+}  // namespace perfetto
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACING_CORE_COMMIT_RING_H_
+#define SRC_TRACING_CORE_COMMIT_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace perfetto {
+
+// A single-producer / single-consumer queue of committed chunks that lives in
+// the last page of the shared memory buffer, when the service reserves it
+// (see TraceConfig.ProducerConfig.use_commit_ring).
+// The producer (the SharedMemoryArbiterImpl, under its lock) appends the
+// (page, chunk, target_buffer) tuple of each completed chunk, instead of
+// batching them into a CommitDataRequest IPC. The service drains the ring every
+// time it receives a CommitData() IPC. The producer sends an (empty)
+// CommitData() IPC only when pushing into an empty ring, to wake up the
+// service. Chunks that require patches and chunks that don't fit in the ring
+// fall back to the CommitDataRequest. Each request carries the producer's
+// write index at the time it was sent, so that the service can move the chunks
+// in the ring and in the request in the same order they have been returned.
+//
+// Layout:
+// +------------+---------+---------+-----+-----------------------+
+// | Header (8) | Entry 0 | Entry 1 | ... | Entry (capacity - 1)  |
+// +------------+---------+---------+-----+-----------------------+
+// |write_idx| is written only by the producer, |read_idx| only by the service.
+// The ring is full when write_idx + 1 == read_idx (mod capacity).
+//
+// Each side keeps its own copy of the index it owns: the service never trusts
+// the indexes written by the producer, and the entries it pops are validated
+// like any other CommitDataRequest.
+class CommitRing {
+ public:
+  struct Header {
+    std::atomic<uint32_t> write_idx;
+    std::atomic<uint32_t> read_idx;
+  };
+
+  struct Entry {
+    uint32_t page;
+    uint8_t chunk;
+    uint8_t reserved;
+    uint16_t target_buffer;
+  };
+
+  static_assert(sizeof(Header) == 8, "Header must be 8 bytes");
+  static_assert(sizeof(Entry) == 8, "Entry must be 8 bytes");
+
+  CommitRing();
+
+  // |start| and |size| are the boundaries of the memory region reserved for
+  // the ring. The region is expected to be zero-initialized when it's created.
+  CommitRing(uint8_t* start, size_t size);
+
+  bool is_valid() const { return capacity_ > 0; }
+  uint32_t capacity() const { return capacity_; }
+
+  // The index of the next entry to be pushed (producer side) or popped
+  // (service side).
+  uint32_t next_idx() const { return next_idx_; }
+
+  // Producer side. Returns false if the ring is full. Sets |was_empty| to true
+  // if the service had consumed all the previous entries, in which case the
+  // caller is expected to wake up the service.
+  bool TryPush(const Entry&, bool* was_empty);
+
+  // Service side. Returns false if the ring is empty.
+  bool TryPop(Entry*);
+
+ private:
+  Header* header() { return reinterpret_cast<Header*>(start_); }
+  Entry* entries() { return reinterpret_cast<Entry*>(start_ + sizeof(Header)); }
+
+  uint8_t* start_ = nullptr;
+  uint32_t capacity_ = 0;
+
+  // The index owned by this side of the ring: |write_idx| for the producer,
+  // |read_idx| for the service.
+  uint32_t next_idx_ = 0;
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACING_CORE_COMMIT_RING_H_
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/commit_ring.h"
+
+#include <string.h>
+
+#include "gtest/gtest.h"
+
+namespace perfetto {
+namespace {
+
+constexpr size_t kRingSize = 4096;
+
+class CommitRingTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    memset(buf_, 0, sizeof(buf_));
+    // The two sides of the ring are two distinct views of the same memory, as
+    // it happens for the producer and the service.
+    producer_ring_ = CommitRing(buf_, kRingSize);
+    service_ring_ = CommitRing(buf_, kRingSize);
+  }
+
+  CommitRing::Header* header() {
+    return reinterpret_cast<CommitRing::Header*>(buf_);
+  }
+
+  static CommitRing::Entry MakeEntry(uint32_t page, uint16_t target_buffer) {
+    CommitRing::Entry entry{};
+    entry.page = page;
+    entry.chunk = static_cast<uint8_t>(page % 14);
+    entry.target_buffer = target_buffer;
+    return entry;
+  }
+
+  alignas(CommitRing::Header) uint8_t buf_[kRingSize];
+  CommitRing producer_ring_;
+  CommitRing service_ring_;
+};
+
+TEST_F(CommitRingTest, PushAndPop) {
+  ASSERT_EQ((kRingSize - 8) / 8, producer_ring_.capacity());
+  CommitRing::Entry entry;
+  ASSERT_FALSE(service_ring_.TryPop(&entry));
+
+  bool was_empty = false;
+  ASSERT_TRUE(producer_ring_.TryPush(MakeEntry(1, 42), &was_empty));
+  EXPECT_TRUE(was_empty);
+  ASSERT_TRUE(producer_ring_.TryPush(MakeEntry(2, 43), &was_empty));
+  EXPECT_FALSE(was_empty);
+
+  ASSERT_TRUE(service_ring_.TryPop(&entry));
+  EXPECT_EQ(1u, entry.page);
+  EXPECT_EQ(1u, entry.chunk);
+  EXPECT_EQ(42u, entry.target_buffer);
+  ASSERT_TRUE(service_ring_.TryPop(&entry));
+  EXPECT_EQ(2u, entry.page);
+  EXPECT_EQ(43u, entry.target_buffer);
+  ASSERT_FALSE(service_ring_.TryPop(&entry));
+
+  // The service caught up, the next push must wake it up.
+  ASSERT_TRUE(producer_ring_.TryPush(MakeEntry(3, 44), &was_empty));
+  EXPECT_TRUE(was_empty);
+}
+
+TEST_F(CommitRingTest, FullRingAndWrapping) {
+  const uint32_t capacity = producer_ring_.capacity();
+  bool was_empty = false;
+  CommitRing::Entry entry;
+  for (int round = 0; round < 3; round++) {
+    // One slot is always kept empty to distinguish a full ring from an empty
+    // one.
+    for (uint32_t i = 0; i < capacity - 1; i++) {
+      ASSERT_TRUE(producer_ring_.TryPush(MakeEntry(i, 1), &was_empty));
+      EXPECT_EQ(i == 0, was_empty);
+    }
+    ASSERT_FALSE(producer_ring_.TryPush(MakeEntry(0, 1), &was_empty));
+
+    for (uint32_t i = 0; i < capacity - 1; i++) {
+      ASSERT_TRUE(service_ring_.TryPop(&entry));
+      ASSERT_EQ(i, entry.page);
+    }
+    ASSERT_FALSE(service_ring_.TryPop(&entry));
+  }
+}
+
+TEST_F(CommitRingTest, CorruptedWriteIndex) {
+  bool was_empty = false;
+  ASSERT_TRUE(producer_ring_.TryPush(MakeEntry(1, 1), &was_empty));
+  header()->write_idx.store(producer_ring_.capacity() + 10);
+  CommitRing::Entry entry;
+  ASSERT_FALSE(service_ring_.TryPop(&entry));
+}
+
+}  // namespace
+}  // namespace perfetto
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/data_plane.h"
+
+#include <atomic>
+
+#include "perfetto/base/logging.h"
+
+namespace perfetto {
+
+DataPlane::DataPlane(size_t num_threads) {
+  PERFETTO_CHECK(num_threads > 0);
+  for (size_t i = 0; i < num_threads; i++) {
+    workers_.emplace_back(new Worker());
+    Worker* worker = workers_.back().get();
+    worker->thread = std::thread(&DataPlane::RunWorker, worker);
+  }
+}
+
+DataPlane::~DataPlane() {
+  for (auto& worker : workers_) {
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    worker->quit = true;
+    worker->cv.notify_all();
+  }
+  for (auto& worker : workers_)
+    worker->thread.join();
+}
+
+// static
+void DataPlane::RunWorker(Worker* worker) {
+  std::unique_lock<std::mutex> lock(worker->mutex);
+  for (;;) {
+    worker->cv.wait(
+        lock, [worker] { return worker->quit || !worker->tasks.empty(); });
+    if (worker->tasks.empty())
+      return;  // Quitting, and all the tasks have run.
+    std::function<void()> task = std::move(worker->tasks.front());
+    worker->tasks.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+    worker->tasks_done++;
+    worker->cv.notify_all();
+  }
+}
+
+void DataPlane::PostTask(uint32_t shard_id, std::function<void()> task) {
+  PostTaskToWorker(workers_[shard_id % workers_.size()].get(),
+                   std::move(task));
+}
+
+void DataPlane::PostTaskToWorker(Worker* worker, std::function<void()> task) {
+  std::lock_guard<std::mutex> lock(worker->mutex);
+  PERFETTO_DCHECK(!worker->quit);
+  worker->tasks.emplace_back(std::move(task));
+  worker->tasks_posted++;
+  worker->cv.notify_all();
+}
+
+void DataPlane::PostBarrier(std::function<void()> callback) {
+  // Each thread decrements the counter once it gets to the barrier, the last
+  // one runs the callback.
+  std::shared_ptr<std::atomic<size_t>> pending(
+      new std::atomic<size_t>(workers_.size()));
+  std::shared_ptr<std::function<void()>> shared_callback(
+      new std::function<void()>(std::move(callback)));
+  for (auto& worker : workers_) {
+    PostTaskToWorker(worker.get(), [pending, shared_callback] {
+      if (pending->fetch_sub(1, std::memory_order_acq_rel) == 1)
+        (*shared_callback)();
+    });
+  }
+}
+
+void DataPlane::WaitForIdle() {
+  for (auto& worker : workers_) {
+    std::unique_lock<std::mutex> lock(worker->mutex);
+    const uint64_t tasks_posted = worker->tasks_posted;
+    worker->cv.wait(lock, [&worker, tasks_posted] {
+      return worker->tasks_done >= tasks_posted;
+    });
+  }
+}
+
+}  // namespace perfetto
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACING_CORE_DATA_PLANE_H_
+#define SRC_TRACING_CORE_DATA_PLANE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace perfetto {
+
+// The threads that copy the chunks committed by the producers into the trace
+// buffers, when the service is configured to use them (see
+// ServiceImpl::SetDataPlaneThreads()). The control plane (IPC, tracing
+// sessions, ReadBuffers()) stays on the service's task runner.
+//
+// Each trace buffer is owned by one thread, picked by hashing its id: the tasks
+// posted for the same buffer run in order, the ones for buffers owned by
+// different threads run in parallel.
+class DataPlane {
+ public:
+  explicit DataPlane(size_t num_threads);
+
+  // Runs the tasks that are still pending and joins the threads.
+  ~DataPlane();
+
+  size_t num_threads() const { return workers_.size(); }
+
+  // Can be called on any thread.
+  void PostTask(uint32_t shard_id, std::function<void()>);
+
+  // Runs |callback| on one of the threads once all the tasks posted so far, on
+  // all the threads, have run.
+  void PostBarrier(std::function<void()> callback);
+
+  // Blocks until all the tasks posted so far have run.
+  void WaitForIdle();
+
+ private:
+  struct Worker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;  // Signals |tasks| and |tasks_done| changes.
+    std::deque<std::function<void()>> tasks;
+    uint64_t tasks_posted = 0;
+    uint64_t tasks_done = 0;
+    bool quit = false;
+  };
+
+  DataPlane(const DataPlane&) = delete;
+  DataPlane& operator=(const DataPlane&) = delete;
+
+  static void RunWorker(Worker*);
+  void PostTaskToWorker(Worker*, std::function<void()>);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACING_CORE_DATA_PLANE_H_
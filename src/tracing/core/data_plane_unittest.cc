@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/data_plane.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace perfetto {
+namespace {
+
+TEST(DataPlaneTest, TasksOfTheSameShardRunInOrder) {
+  static constexpr uint32_t kNumShards = 5;
+  static constexpr int kTasksPerShard = 1000;
+  std::vector<int> last_task(kNumShards, -1);
+  std::vector<std::thread::id> thread_ids(kNumShards);
+  std::atomic<bool> out_of_order(false);
+  {
+    DataPlane data_plane(3);
+    ASSERT_EQ(3u, data_plane.num_threads());
+    for (int i = 0; i < kTasksPerShard; i++) {
+      for (uint32_t shard = 0; shard < kNumShards; shard++) {
+        data_plane.PostTask(shard, [&, shard, i] {
+          if (last_task[shard] != i - 1)
+            out_of_order = true;
+          last_task[shard] = i;
+          thread_ids[shard] = std::this_thread::get_id();
+        });
+      }
+    }
+    data_plane.WaitForIdle();
+    for (uint32_t shard = 0; shard < kNumShards; shard++)
+      EXPECT_EQ(kTasksPerShard - 1, last_task[shard]);
+
+    // The shards are spread across the threads.
+    EXPECT_NE(thread_ids[0], thread_ids[1]);
+    EXPECT_EQ(thread_ids[0], thread_ids[3]);
+  }
+  EXPECT_FALSE(out_of_order);
+}
+
+TEST(DataPlaneTest, Barrier) {
+  DataPlane data_plane(4);
+  std::mutex mutex;
+  std::vector<int> events;
+  for (uint32_t shard = 0; shard < 4; shard++) {
+    data_plane.PostTask(shard, [&mutex, &events] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      std::lock_guard<std::mutex> lock(mutex);
+      events.push_back(1);
+    });
+  }
+  data_plane.PostBarrier([&mutex, &events] {
+    std::lock_guard<std::mutex> lock(mutex);
+    events.push_back(2);
+  });
+  data_plane.WaitForIdle();
+  EXPECT_EQ(std::vector<int>({1, 1, 1, 1, 2}), events);
+}
+
+TEST(DataPlaneTest, DestructorRunsPendingTasks) {
+  int tasks_run = 0;
+  {
+    DataPlane data_plane(1);
+    for (int i = 0; i < 100; i++)
+      data_plane.PostTask(0, [&tasks_run] { tasks_run++; });
+  }
+  EXPECT_EQ(100, tasks_run);
+}
+
+}  // namespace
+}  // namespace perfetto
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/interned_string_table.h"
+
+namespace perfetto {
+
+InternedStringTable::InternedStringTable() = default;
+InternedStringTable::~InternedStringTable() = default;
+
+uint64_t InternedStringTable::InternString(const char* str,
+                                           size_t size,
+                                           bool* is_new) {
+  auto it_and_inserted = strings_.emplace(std::string(str, size), next_iid_);
+  *is_new = it_and_inserted.second;
+  if (*is_new)
+    next_iid_++;
+  return it_and_inserted.first->second;
+}
+
+uint64_t InternedStringTable::InternStaticString(const char* str,
+                                                 bool* is_new) {
+  auto it_and_inserted = static_strings_.emplace(str, next_iid_);
+  *is_new = it_and_inserted.second;
+  if (*is_new)
+    next_iid_++;
+  return it_and_inserted.first->second;
+}
+
+void InternedStringTable::Clear() {
+  strings_.clear();
+  static_strings_.clear();
+  next_iid_ = 1;
+}
+
+}  // namespace perfetto
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACING_CORE_INTERNED_STRING_TABLE_H_
+#define SRC_TRACING_CORE_INTERNED_STRING_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+
+namespace perfetto {
+
+// The interning dictionary of a packet sequence, used by the TraceWriter(s) to
+// implement TraceWriter::InternString() and InternStaticString(). Strings
+// interned by address and by content get independent ids, even if they are
+// equal. Not thread safe, like the TraceWriter that owns it.
+class InternedStringTable {
+ public:
+  InternedStringTable();
+  ~InternedStringTable();
+
+  uint64_t InternString(const char* str, size_t size, bool* is_new);
+  uint64_t InternStaticString(const char* str, bool* is_new);
+
+  // Forgets all the entries. Ids are reassigned from 1.
+  void Clear();
+
+  size_t size() const { return strings_.size() + static_strings_.size(); }
+
+ private:
+  InternedStringTable(const InternedStringTable&) = delete;
+  InternedStringTable& operator=(const InternedStringTable&) = delete;
+
+  std::unordered_map<std::string, uint64_t> strings_;
+  std::unordered_map<const char*, uint64_t> static_strings_;
+  uint64_t next_iid_ = 1;  // 0 is never used, see interned_data.proto.
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACING_CORE_INTERNED_STRING_TABLE_H_
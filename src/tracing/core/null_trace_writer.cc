@@ -27,7 +27,8 @@ namespace perfetto {
 
 NullTraceWriter::NullTraceWriter()
     : delegate_(base::kPageSize), stream_(&delegate_) {
-  cur_packet_.reset(new protos::pbzero::TracePacket());
+  cur_packet_.reset(
+      new protozero::RootMessage<protos::pbzero::TracePacket>());
   cur_packet_->Finalize();  // To avoid the DCHECK in NewTracePacket().
 }
 
@@ -53,4 +54,15 @@ WriterID NullTraceWriter::writer_id() const {
   return 0;
 }
 
+// The packets are discarded, no need to emit any interned data.
+uint64_t NullTraceWriter::InternString(const char*, size_t, bool* is_new) {
+  *is_new = false;
+  return 0;
+}
+
+uint64_t NullTraceWriter::InternStaticString(const char*, bool* is_new) {
+  *is_new = false;
+  return 0;
+}
+
 }  // namespace perfetto
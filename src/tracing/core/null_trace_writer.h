@@ -36,6 +36,8 @@ class NullTraceWriter : public TraceWriter {
   TracePacketHandle NewTracePacket() override;
   void Flush(std::function<void()> callback = {}) override;
   WriterID writer_id() const override;
+  uint64_t InternString(const char* str, size_t size, bool* is_new) override;
+  uint64_t InternStaticString(const char* str, bool* is_new) override;
 
  private:
   NullTraceWriter(const NullTraceWriter&) = delete;
@@ -46,7 +48,8 @@ class NullTraceWriter : public TraceWriter {
 
   // The packet returned via NewTracePacket(). Its owned by this class,
   // TracePacketHandle has just a pointer to it.
-  std::unique_ptr<protos::pbzero::TracePacket> cur_packet_;
+  std::unique_ptr<protozero::RootMessage<protos::pbzero::TracePacket>>
+      cur_packet_;
 };
 
 }  // namespace perfetto
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/packed_commit_data.h"
+
+#include <string.h>
+
+#include "perfetto/base/logging.h"
+#include "perfetto/tracing/core/commit_data_request.h"
+
+namespace perfetto {
+
+constexpr size_t PackedCommitData::kPatchSize;
+
+// static
+void PackedCommitData::AddChunkToMove(CommitDataRequest* req,
+                                      uint32_t page,
+                                      uint32_t chunk,
+                                      BufferID target_buffer) {
+  PERFETTO_DCHECK(chunk <= 0xffff);
+  *req->add_packed_chunks_to_move() = page;
+  *req->add_packed_chunks_to_move() =
+      chunk | (static_cast<uint32_t>(target_buffer) << 16);
+}
+
+void PackedCommitData::ChunksToPatchWriter::AddChunk(WriterID writer_id,
+                                                     ChunkID chunk_id,
+                                                     BufferID target_buffer) {
+  chunk_record_offset_ = blob_->size();
+  chunk_record_ = ChunkRecord{};
+  chunk_record_.chunk_id = chunk_id;
+  chunk_record_.writer_id = writer_id;
+  chunk_record_.target_buffer = target_buffer;
+  has_chunk_ = true;
+  blob_->append(reinterpret_cast<const char*>(&chunk_record_),
+                sizeof(chunk_record_));
+}
+
+void PackedCommitData::ChunksToPatchWriter::AddPatch(uint32_t offset,
+                                                     const uint8_t* data) {
+  PERFETTO_DCHECK(has_chunk_);
+  PERFETTO_CHECK(chunk_record_.num_patches < 0xffff);
+  PatchRecord patch{};
+  patch.offset = offset;
+  memcpy(patch.data, data, kPatchSize);
+  blob_->append(reinterpret_cast<const char*>(&patch), sizeof(patch));
+  chunk_record_.num_patches++;
+  UpdateChunkRecord(chunk_record_);
+}
+
+void PackedCommitData::ChunksToPatchWriter::SetHasMorePatches() {
+  PERFETTO_DCHECK(has_chunk_);
+  chunk_record_.flags |= ChunkRecord::kHasMorePatches;
+  UpdateChunkRecord(chunk_record_);
+}
+
+void PackedCommitData::ChunksToPatchWriter::UpdateChunkRecord(
+    const ChunkRecord& record) {
+  PERFETTO_DCHECK(chunk_record_offset_ + sizeof(record) <= blob_->size());
+  memcpy(&(*blob_)[chunk_record_offset_], &record, sizeof(record));
+}
+
+bool PackedCommitData::ChunksToMoveReader::Next(Entry* entry) {
+  if (pos_ + 2 > packed_.size())
+    return false;
+  entry->page = packed_[pos_];
+  entry->chunk = packed_[pos_ + 1] & 0xffff;
+  entry->target_buffer = static_cast<BufferID>(packed_[pos_ + 1] >> 16);
+  pos_ += 2;
+  return true;
+}
+
+bool PackedCommitData::ChunksToPatchReader::Next(Chunk* chunk) {
+  if (static_cast<size_t>(end_ - ptr_) < sizeof(ChunkRecord))
+    return false;
+  ChunkRecord record;
+  memcpy(&record, ptr_, sizeof(record));
+  const size_t patches_size =
+      static_cast<size_t>(record.num_patches) * sizeof(PatchRecord);
+  const uint8_t* patches = ptr_ + sizeof(record);
+  if (static_cast<size_t>(end_ - patches) < patches_size) {
+    PERFETTO_DLOG("Truncated record in packed_chunks_to_patch");
+    ptr_ = end_;
+    return false;
+  }
+  chunk->writer_id = record.writer_id;
+  chunk->chunk_id = record.chunk_id;
+  chunk->target_buffer = record.target_buffer;
+  chunk->has_more_patches = record.flags & ChunkRecord::kHasMorePatches;
+  chunk->num_patches = record.num_patches;
+  chunk->patches = patches;
+  ptr_ = patches + patches_size;
+  return true;
+}
+
+// static
+void PackedCommitData::ChunksToPatchReader::GetPatch(const Chunk& chunk,
+                                                     size_t idx,
+                                                     uint32_t* offset,
+                                                     uint8_t* data) {
+  PERFETTO_DCHECK(idx < chunk.num_patches);
+  PatchRecord patch;
+  memcpy(&patch, chunk.patches + idx * sizeof(PatchRecord), sizeof(patch));
+  *offset = patch.offset;
+  memcpy(data, patch.data, kPatchSize);
+}
+
+}  // namespace perfetto
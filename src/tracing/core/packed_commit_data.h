@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACING_CORE_PACKED_COMMIT_DATA_H_
+#define SRC_TRACING_CORE_PACKED_COMMIT_DATA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "perfetto/tracing/core/basic_types.h"
+#include "perfetto/tracing/core/shared_memory_abi.h"
+
+namespace perfetto {
+
+class CommitDataRequest;
+
+// Encoders and decoders for the compact form of the chunks to move and to patch
+// of a CommitDataRequest (the |packed_chunks_to_move| and
+// |packed_chunks_to_patch| fields). The producer emits only the packed form,
+// the service accepts both. Neither of the decoders allocates memory: they walk
+// the request in place.
+//
+// packed_chunks_to_move is a sequence of fixed32 pairs, one per chunk:
+//   [page] [chunk | (target_buffer << 16)]
+//
+// packed_chunks_to_patch is a sequence of records, each one being a
+// ChunkRecord followed by |num_patches| PatchRecord(s):
+// +-----------------+-----------------+-----+-----------------+
+// | ChunkRecord (12)| PatchRecord (8) | ... | PatchRecord (8) |
+// +-----------------+-----------------+-----+-----------------+
+// The records are in host byte order, the producer and the service always run
+// on the same machine.
+class PackedCommitData {
+ public:
+  static constexpr size_t kPatchSize = SharedMemoryABI::kPacketHeaderSize;
+
+  struct ChunkRecord {
+    enum Flags : uint8_t { kHasMorePatches = 1 << 0 };
+
+    uint32_t chunk_id;
+    uint16_t writer_id;
+    uint16_t target_buffer;
+    uint16_t num_patches;
+    uint8_t flags;
+    uint8_t reserved;
+  };
+
+  struct PatchRecord {
+    uint32_t offset;
+    uint8_t data[kPatchSize];
+  };
+
+  static_assert(sizeof(ChunkRecord) == 12, "ChunkRecord must be 12 bytes");
+  static_assert(sizeof(PatchRecord) == 8, "PatchRecord must be 8 bytes");
+
+  static void AddChunkToMove(CommitDataRequest*,
+                             uint32_t page,
+                             uint32_t chunk,
+                             BufferID);
+
+  // Appends the patches of a chunk to a |packed_chunks_to_patch| blob.
+  class ChunksToPatchWriter {
+   public:
+    explicit ChunksToPatchWriter(std::string* blob) : blob_(blob) {}
+
+    // Starts a new ChunkRecord. The following AddPatch() calls refer to it.
+    void AddChunk(WriterID, ChunkID, BufferID);
+
+    // |data| must point to kPatchSize bytes.
+    void AddPatch(uint32_t offset, const uint8_t* data);
+
+    void SetHasMorePatches();
+
+   private:
+    void UpdateChunkRecord(const ChunkRecord&);
+
+    std::string* const blob_;
+    size_t chunk_record_offset_ = 0;
+    ChunkRecord chunk_record_{};
+    bool has_chunk_ = false;
+  };
+
+  // Iterates over the chunks of a |packed_chunks_to_move| field.
+  class ChunksToMoveReader {
+   public:
+    struct Entry {
+      uint32_t page;
+      uint32_t chunk;
+      BufferID target_buffer;
+    };
+
+    explicit ChunksToMoveReader(const std::vector<uint32_t>& packed)
+        : packed_(packed) {}
+
+    // Returns false once all the entries have been read. A trailing odd word
+    // can only come from a buggy or malicious producer and is ignored.
+    bool Next(Entry*);
+
+   private:
+    const std::vector<uint32_t>& packed_;
+    size_t pos_ = 0;
+  };
+
+  // Iterates over the records of a |packed_chunks_to_patch| blob.
+  class ChunksToPatchReader {
+   public:
+    struct Chunk {
+      WriterID writer_id;
+      ChunkID chunk_id;
+      BufferID target_buffer;
+      bool has_more_patches;
+      uint16_t num_patches;
+
+      // Points to |num_patches| PatchRecord(s), not necessarily aligned.
+      const uint8_t* patches;
+    };
+
+    ChunksToPatchReader(const void* blob, size_t size)
+        : ptr_(reinterpret_cast<const uint8_t*>(blob)),
+          end_(ptr_ + size) {}
+
+    // Returns false at the end of the blob, or if the next record is truncated.
+    bool Next(Chunk*);
+
+    // Copies the |idx|-th patch of |chunk|. |data| must be kPatchSize bytes.
+    static void GetPatch(const Chunk&,
+                         size_t idx,
+                         uint32_t* offset,
+                         uint8_t* data);
+
+   private:
+    const uint8_t* ptr_;
+    const uint8_t* const end_;
+  };
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACING_CORE_PACKED_COMMIT_DATA_H_
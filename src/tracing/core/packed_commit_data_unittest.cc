@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/packed_commit_data.h"
+
+#include <string.h>
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "perfetto/tracing/core/commit_data_request.h"
+
+#include "perfetto/common/commit_data_request.pb.h"
+
+namespace perfetto {
+namespace {
+
+using Reader = PackedCommitData::ChunksToPatchReader;
+
+TEST(PackedCommitDataTest, ChunksToMove) {
+  CommitDataRequest req;
+  PackedCommitData::AddChunkToMove(&req, 0, 13, 1);
+  PackedCommitData::AddChunkToMove(&req, 100000, 0, 65535);
+
+  // Go through the proto, as it happens over the IPC.
+  protos::CommitDataRequest proto;
+  req.ToProto(&proto);
+  CommitDataRequest decoded_req;
+  decoded_req.FromProto(proto);
+
+  PackedCommitData::ChunksToMoveReader reader(
+      decoded_req.packed_chunks_to_move());
+  PackedCommitData::ChunksToMoveReader::Entry entry;
+  ASSERT_TRUE(reader.Next(&entry));
+  EXPECT_EQ(0u, entry.page);
+  EXPECT_EQ(13u, entry.chunk);
+  EXPECT_EQ(1u, entry.target_buffer);
+  ASSERT_TRUE(reader.Next(&entry));
+  EXPECT_EQ(100000u, entry.page);
+  EXPECT_EQ(0u, entry.chunk);
+  EXPECT_EQ(65535u, entry.target_buffer);
+  ASSERT_FALSE(reader.Next(&entry));
+
+  // A trailing odd word is ignored.
+  *decoded_req.add_packed_chunks_to_move() = 42;
+  PackedCommitData::ChunksToMoveReader odd_reader(
+      decoded_req.packed_chunks_to_move());
+  ASSERT_TRUE(odd_reader.Next(&entry));
+  ASSERT_TRUE(odd_reader.Next(&entry));
+  ASSERT_FALSE(odd_reader.Next(&entry));
+}
+
+TEST(PackedCommitDataTest, ChunksToPatch) {
+  std::string blob;
+  PackedCommitData::ChunksToPatchWriter writer(&blob);
+  const uint8_t kData1[] = {0x81, 0x82, 0x83, 0x04};
+  const uint8_t kData2[] = {0x85, 0x80, 0x80, 0x00};
+  writer.AddChunk(1 /*writer_id*/, 42 /*chunk_id*/, 3 /*target_buffer*/);
+  writer.AddPatch(8, kData1);
+  writer.AddPatch(100, kData2);
+  writer.AddChunk(2 /*writer_id*/, 0xffffffff /*chunk_id*/, 4);
+  writer.AddChunk(1023 /*writer_id*/, 7 /*chunk_id*/, 5);
+  writer.AddPatch(0, kData2);
+  writer.SetHasMorePatches();
+  ASSERT_EQ(3 * sizeof(PackedCommitData::ChunkRecord) +
+                3 * sizeof(PackedCommitData::PatchRecord),
+            blob.size());
+
+  Reader reader(blob.data(), blob.size());
+  Reader::Chunk chunk;
+  uint32_t offset = 0;
+  uint8_t data[PackedCommitData::kPatchSize] = {};
+
+  ASSERT_TRUE(reader.Next(&chunk));
+  EXPECT_EQ(1u, chunk.writer_id);
+  EXPECT_EQ(42u, chunk.chunk_id);
+  EXPECT_EQ(3u, chunk.target_buffer);
+  EXPECT_FALSE(chunk.has_more_patches);
+  ASSERT_EQ(2u, chunk.num_patches);
+  Reader::GetPatch(chunk, 0, &offset, data);
+  EXPECT_EQ(8u, offset);
+  EXPECT_EQ(0, memcmp(data, kData1, sizeof(data)));
+  Reader::GetPatch(chunk, 1, &offset, data);
+  EXPECT_EQ(100u, offset);
+  EXPECT_EQ(0, memcmp(data, kData2, sizeof(data)));
+
+  ASSERT_TRUE(reader.Next(&chunk));
+  EXPECT_EQ(2u, chunk.writer_id);
+  EXPECT_EQ(0xffffffffu, chunk.chunk_id);
+  EXPECT_EQ(0u, chunk.num_patches);
+
+  ASSERT_TRUE(reader.Next(&chunk));
+  EXPECT_EQ(1023u, chunk.writer_id);
+  EXPECT_TRUE(chunk.has_more_patches);
+  ASSERT_EQ(1u, chunk.num_patches);
+  Reader::GetPatch(chunk, 0, &offset, data);
+  EXPECT_EQ(0u, offset);
+  EXPECT_EQ(0, memcmp(data, kData2, sizeof(data)));
+
+  ASSERT_FALSE(reader.Next(&chunk));
+}
+
+TEST(PackedCommitDataTest, TruncatedChunksToPatch) {
+  std::string blob;
+  PackedCommitData::ChunksToPatchWriter writer(&blob);
+  const uint8_t kData[] = {0x81, 0x82, 0x83, 0x04};
+  writer.AddChunk(1, 1, 1);
+  writer.AddPatch(0, kData);
+  writer.AddChunk(1, 2, 1);
+  writer.AddPatch(0, kData);
+  writer.AddPatch(4, kData);
+
+  // Every truncation point must be handled gracefully, keeping only the
+  // records that are complete.
+  for (size_t size = 0; size < blob.size(); size++) {
+    Reader reader(blob.data(), size);
+    Reader::Chunk chunk;
+    size_t num_chunks = 0;
+    while (reader.Next(&chunk))
+      num_chunks++;
+    const size_t first_record_size = sizeof(PackedCommitData::ChunkRecord) +
+                                     sizeof(PackedCommitData::PatchRecord);
+    EXPECT_EQ(size >= first_record_size ? 1u : 0u, num_chunks);
+  }
+}
+
+}  // namespace
+}  // namespace perfetto
@@ -20,35 +20,37 @@
 #include <stddef.h>
 
 #include "perfetto/base/logging.h"
-#include "perfetto/protozero/proto_utils.h"
-#include "perfetto/trace/trusted_packet.pb.h"
+#include "perfetto/trace/trace_packet.pbzero.h"
+#include "src/tracing/core/sliced_proto_decoder.h"
 
 namespace perfetto {
 
+using protos::pbzero::TracePacket;
+
 // static
 bool PacketStreamValidator::Validate(const Slices& slices) {
-  SlicedProtobufInputStream stream(&slices);
-  size_t size = 0;
-  for (const Slice& slice : slices)
-    size += slice.size;
-
-  protos::TrustedPacket packet;
-  if (!packet.ParseFromBoundedZeroCopyStream(&stream, static_cast<int>(size)))
-    return false;
-
-  // Only the service is allowed to fill in the trusted uid.
-  if (packet.optional_trusted_uid_case() !=
-      protos::TrustedPacket::OPTIONAL_TRUSTED_UID_NOT_SET) {
-    return false;
-  }
+  SlicedProtoDecoder decoder(&slices);
+  for (auto field = decoder.ReadField(); field.valid();
+       field = decoder.ReadField()) {
+    switch (field.id) {
+      // Only the service is allowed to fill in the trusted uid.
+      case TracePacket::kTrustedUidFieldNumber:
+
+      // Only the service is allowed to fill in the packet sequence properties.
+      case TracePacket::kTrustedPacketSequenceIdFieldNumber:
+      case TracePacket::kPreviousPacketDroppedFieldNumber:
 
-  // Only the service is allowed to fill in the TraceConfig.
-  if (packet.has_trace_config())
-    return false;
+      // Only the service is allowed to fill in the TraceConfig.
+      case TracePacket::kTraceConfigFieldNumber:
 
-  // Only the service is allowed to fill in the TraceStats.
-  if (packet.has_trace_stats())
-    return false;
+      // Only the service is allowed to fill in the TraceStats.
+      case TracePacket::kTraceStatsFieldNumber:
+        return false;
+
+      default:
+        break;
+    }
+  }
 
   // We are deliberately not checking for clock_snapshot for the moment. It's
   // unclear if we want to allow producers to snapshot their clocks. Ideally we
@@ -56,7 +58,8 @@ bool PacketStreamValidator::Validate(const Slices& slices) {
   // and not system ones. However, right now, there isn't a compelling need to
   // be so prescriptive.
 
-  return true;
+  // Any bytes left mean that the packet is truncated or malformed.
+  return decoder.bytes_left() == 0;
 }
 
 }  // namespace perfetto
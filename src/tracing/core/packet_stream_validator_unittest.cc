@@ -88,6 +88,30 @@ TEST(PacketStreamValidatorTest, SimplePacketWithNegativeOneUid) {
   EXPECT_FALSE(PacketStreamValidator::Validate(seq));
 }
 
+TEST(PacketStreamValidatorTest, SimplePacketWithSequenceProperties) {
+  protos::TracePacket proto;
+  proto.set_trusted_packet_sequence_id(0);
+  std::string ser_buf = proto.SerializeAsString();
+  Slices seq;
+  seq.emplace_back(&ser_buf[0], ser_buf.size());
+  EXPECT_FALSE(PacketStreamValidator::Validate(seq));
+
+  // The writer can set incremental_state_cleared, but not
+  // previous_packet_dropped.
+  protos::TracePacket proto2;
+  proto2.set_incremental_state_cleared(true);
+  ser_buf = proto2.SerializeAsString();
+  seq.clear();
+  seq.emplace_back(&ser_buf[0], ser_buf.size());
+  EXPECT_TRUE(PacketStreamValidator::Validate(seq));
+
+  proto2.set_previous_packet_dropped(true);
+  ser_buf = proto2.SerializeAsString();
+  seq.clear();
+  seq.emplace_back(&ser_buf[0], ser_buf.size());
+  EXPECT_FALSE(PacketStreamValidator::Validate(seq));
+}
+
 TEST(PacketStreamValidatorTest, ComplexPacketWithUid) {
   protos::TracePacket proto;
   proto.mutable_for_testing()->set_str("string field");
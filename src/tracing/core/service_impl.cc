@@ -35,10 +35,12 @@
 #include "perfetto/tracing/core/shared_memory_abi.h"
 #include "perfetto/tracing/core/trace_packet.h"
 #include "perfetto/tracing/core/trace_writer.h"
+#include "src/tracing/core/packed_commit_data.h"
 #include "src/tracing/core/packet_stream_validator.h"
 #include "src/tracing/core/shared_memory_arbiter_impl.h"
 #include "src/tracing/core/trace_buffer.h"
 
+#include "perfetto/config/data_source_config.pb.h"
 #include "perfetto/trace/clock_snapshot.pb.h"
 #include "perfetto/trace/trusted_packet.pb.h"
 
@@ -57,18 +59,46 @@ constexpr base::TimeMillis kStatsSnapshotInterval(10 * 1000);
 constexpr int kMinWriteIntoFilePeriodMs = 100;
 constexpr int kDefaultWriteIntoFilePeriodMs = 5000;
 constexpr int kFlushTimeoutMs = 1000;
-constexpr int kMaxConcurrentTracingSessions = 5;
+
+// This is a rough threshold to determine how much to read from the buffers in
+// each ReadBuffers() task. This is to avoid executing a single huge sending
+// task for too long and risk to hit the watchdog. This is *not* an upper
+// bound: we just stop accumulating new packets and PostTask *after* we cross
+// this threshold. This constant essentially balances the PostTask and IPC
+// overhead vs the responsiveness of the service. An extremely small value will
+// cause one IPC and one PostTask for each slice but will keep the service
+// extremely responsive. An extremely large value will batch the send for the
+// full buffer in one large task, will hit the blocking send() once the socket
+// buffers are full and hang the service for a bit (until the consumer catches
+// up).
+constexpr size_t kApproxBytesPerTask = 32768;
 
 constexpr uint64_t kMillisPerHour = 3600000;
 
 // These apply only if enable_extra_guardrails is true.
 constexpr uint64_t kMaxTracingDurationMillis = 24 * kMillisPerHour;
 constexpr uint64_t kMaxTracingBufferSizeKb = 32 * 1024;
+
+// Replaces the slices of |packet|, which point into a trace buffer, with a
+// single owned copy of them.
+void CopyPacketOutOfBuffer(TracePacket* packet) {
+  Slice slice = Slice::Allocate(packet->size());
+  size_t offset = 0;
+  for (const Slice& old_slice : packet->slices()) {
+    memcpy(slice.own_data() + offset, old_slice.start, old_slice.size);
+    offset += old_slice.size;
+  }
+  TracePacket copy;
+  copy.AddSlice(std::move(slice));
+  *packet = std::move(copy);
+}
 }  // namespace
 
 // These constants instead are defined in the header because are used by tests.
 constexpr size_t ServiceImpl::kDefaultShmSize;
+constexpr uint32_t ServiceImpl::ProducerEndpointImpl::kDrainWholeCommitRing;
 constexpr size_t ServiceImpl::kMaxShmSize;
+constexpr size_t Service::kDefaultMaxTracingSessions;
 
 // static
 std::unique_ptr<Service> Service::CreateInstance(
@@ -78,6 +108,11 @@ std::unique_ptr<Service> Service::CreateInstance(
       new ServiceImpl(std::move(shm_factory), task_runner));
 }
 
+std::unique_ptr<TraceWriter> Service::ProducerEndpoint::CreateTraceWriter(
+    BufferID target_buffer) {
+  return CreateTraceWriter(target_buffer, BufferExhaustedPolicy::kStall);
+}
+
 ServiceImpl::ServiceImpl(std::unique_ptr<SharedMemory::Factory> shm_factory,
                          base::TaskRunner* task_runner)
     : task_runner_(task_runner),
@@ -116,6 +151,16 @@ std::unique_ptr<Service::ProducerEndpoint> ServiceImpl::ConnectProducer(
       id, uid, this, task_runner_, producer, producer_name));
   auto it_and_inserted = producers_.emplace(id, endpoint.get());
   PERFETTO_DCHECK(it_and_inserted.second);
+
+  // The ID might belong to a producer that disconnected earlier. The writers
+  // of the new one continue its sequences, as their first packets reset the
+  // incremental state.
+  auto retired_it = retired_packet_sequences_.lower_bound(
+      std::make_pair(id, static_cast<WriterID>(0)));
+  while (retired_it != retired_packet_sequences_.end() &&
+         retired_it->first.first == id) {
+    retired_it = retired_packet_sequences_.erase(retired_it);
+  }
   endpoint->shmem_size_hint_bytes_ = shared_memory_size_hint_bytes;
   task_runner_->PostTask(std::bind(&Producer::OnConnect, endpoint->producer_));
 
@@ -135,7 +180,16 @@ void ServiceImpl::DisconnectProducer(ProducerID id) {
     it = next;
   }
 
+  // The chunk copies still pending on the data plane point into the producer's
+  // shared memory, which is about to go away.
+  WaitForDataPlane();
   producers_.erase(id);
+
+  std::set<BufferID> buffers;
+  for (const auto& kv : buffers_)
+    buffers.insert(kv.first);
+  RetirePacketSequences(id, /*writer_id=*/0, std::move(buffers));
+
   UpdateMemoryGuardrail();
 }
 
@@ -227,12 +281,25 @@ bool ServiceImpl::EnableTracing(ConsumerEndpointImpl* consumer,
   // in a state where it stalls by design by having more TraceWriterImpl
   // instances than free pages in the buffer. This is really a bug in
   // trace_probes and the way it handles stalls in the shmem buffer.
-  if (tracing_sessions_.size() >= kMaxConcurrentTracingSessions) {
+  if (tracing_sessions_.size() >= max_tracing_sessions_) {
     PERFETTO_ELOG("Too many concurrent tracing sesions (%zu)",
                   tracing_sessions_.size());
     return false;
   }
 
+  if (max_total_buffer_size_kb_) {
+    size_t total_buffer_size_kb = 0;
+    for (const auto& buf : cfg.buffers())
+      total_buffer_size_kb += buf.size_kb();
+    for (const auto& id_to_session : tracing_sessions_)
+      total_buffer_size_kb += id_to_session.second.total_buffer_size_kb;
+    if (total_buffer_size_kb > max_total_buffer_size_kb_) {
+      PERFETTO_ELOG("Not enough memory for the trace buffers (%zu KB > %zu KB)",
+                    total_buffer_size_kb, max_total_buffer_size_kb_);
+      return false;
+    }
+  }
+
   const TracingSessionID tsid = ++last_tracing_session_id_;
   tracing_session =
       &tracing_sessions_.emplace(tsid, TracingSession(consumer, cfg))
@@ -275,14 +342,23 @@ bool ServiceImpl::EnableTracing(ConsumerEndpointImpl* consumer,
     tracing_session->buffers_index.push_back(global_id);
     const size_t buf_size_bytes = buffer_cfg.size_kb() * 1024u;
     total_buf_size_kb += buffer_cfg.size_kb();
-    auto it_and_inserted =
-        buffers_.emplace(global_id, TraceBuffer::Create(buf_size_bytes));
-    PERFETTO_DCHECK(it_and_inserted.second);  // buffers_.count(global_id) == 0.
-    std::unique_ptr<TraceBuffer>& trace_buffer = it_and_inserted.first->second;
+    const TraceBuffer::OverwritePolicy policy =
+        buffer_cfg.fill_policy() == TraceConfig::BufferConfig::DISCARD
+            ? TraceBuffer::kDiscard
+            : TraceBuffer::kOverwrite;
+    std::unique_ptr<TraceBuffer> trace_buffer = TraceBuffer::Create(
+        buf_size_bytes, policy, buffer_cfg.use_huge_pages());
     if (!trace_buffer) {
       did_allocate_all_buffers = false;
       break;
     }
+    trace_buffer->set_producer_quota(buffer_cfg.producer_quota_kb() * 1024u);
+    if (cfg.sort_packets())
+      trace_buffer->set_read_order(TraceBuffer::kTimestampOrder);
+    std::unique_ptr<BufferShard> shard(
+        new BufferShard(global_id, std::move(trace_buffer)));
+    auto it_and_inserted = buffers_.emplace(global_id, std::move(shard));
+    PERFETTO_DCHECK(it_and_inserted.second);  // buffers_.count(global_id) == 0.
   }
 
   UpdateMemoryGuardrail();
@@ -302,6 +378,7 @@ bool ServiceImpl::EnableTracing(ConsumerEndpointImpl* consumer,
   }
 
   consumer->tracing_session_id_ = tsid;
+  tracing_session->total_buffer_size_kb = total_buf_size_kb;
 
   // Enable the data sources on the producers.
   for (const TraceConfig::DataSource& cfg_data_source : cfg.data_sources()) {
@@ -370,6 +447,10 @@ void ServiceImpl::DisableTracing(TracingSessionID tsid) {
   for (const auto& data_source_inst : tracing_session->data_source_instances) {
     const ProducerID producer_id = data_source_inst.first;
     const DataSourceInstanceID ds_inst_id = data_source_inst.second.instance_id;
+    // A shared instance keeps running as long as other sessions use it.
+    const BufferID routing_id = data_source_inst.second.shared_routing_id;
+    if (routing_id && !DetachSharedInstance(routing_id, tracing_session))
+      continue;
     ProducerEndpointImpl* producer = GetProducer(producer_id);
     producer->TearDownDataSource(ds_inst_id);
   }
@@ -444,6 +525,28 @@ void ServiceImpl::Flush(TracingSessionID tsid,
 
 void ServiceImpl::NotifyFlushDoneForProducer(ProducerID producer_id,
                                              FlushRequestID flush_request_id) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  // The flush is done only once the chunks committed before the ack are in the
+  // trace buffers. Wait for the data plane to catch up with the copies.
+  if (data_plane_) {
+    PostPendingCopies();
+    auto weak_this = weak_ptr_factory_.GetWeakPtr();
+    base::TaskRunner* task_runner = task_runner_;
+    data_plane_->PostBarrier(
+        [task_runner, weak_this, producer_id, flush_request_id] {
+          task_runner->PostTask([weak_this, producer_id, flush_request_id] {
+            if (weak_this)
+              weak_this->OnFlushDoneForProducer(producer_id, flush_request_id);
+          });
+        });
+    return;
+  }
+  OnFlushDoneForProducer(producer_id, flush_request_id);
+}
+
+void ServiceImpl::OnFlushDoneForProducer(ProducerID producer_id,
+                                         FlushRequestID flush_request_id) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
   for (auto& kv : tracing_sessions_) {
     // Remove all pending flushes <= |flush_request_id| for |producer_id|.
     auto& pending_flushes = kv.second.pending_flushes;
@@ -530,18 +633,9 @@ void ServiceImpl::ReadBuffers(TracingSessionID tsid,
     total_slices += packet.slices().size();
   }
 
-  // This is a rough threshold to determine how much to read from the buffer in
-  // each task. This is to avoid executing a single huge sending task for too
-  // long and risk to hit the watchdog. This is *not* an upper bound: we just
-  // stop accumulating new packets and PostTask *after* we cross this threshold.
-  // This constant essentially balances the PostTask and IPC overhead vs the
-  // responsiveness of the service. An extremely small value will cause one IPC
-  // and one PostTask for each slice but will keep the service extremely
-  // responsive. An extremely large value will batch the send for the full
-  // buffer in one large task, will hit the blocking send() once the socket
-  // buffers are full and hang the service for a bit (until the consumer
-  // catches up).
-  static constexpr size_t kApproxBytesPerTask = 32768;
+  const size_t max_packets_bytes = tracing_session->write_into_file
+                                       ? std::numeric_limits<size_t>::max()
+                                       : kApproxBytesPerTask;
   bool did_hit_threshold = false;
 
   // TODO(primiano): Extend the ReadBuffers API to allow reading only some
@@ -549,51 +643,24 @@ void ServiceImpl::ReadBuffers(TracingSessionID tsid,
   for (size_t buf_idx = 0;
        buf_idx < tracing_session->num_buffers() && !did_hit_threshold;
        buf_idx++) {
-    auto tbuf_iter = buffers_.find(tracing_session->buffers_index[buf_idx]);
-    if (tbuf_iter == buffers_.end()) {
+    BufferShard* shard = GetBufferByID(tracing_session->buffers_index[buf_idx]);
+    if (!shard) {
       PERFETTO_DCHECK(false);
       continue;
     }
-    TraceBuffer& tbuf = *tbuf_iter->second;
-    tbuf.BeginRead();
-    while (!did_hit_threshold) {
-      TracePacket packet;
-      uid_t producer_uid = kInvalidUid;
-      if (!tbuf.ReadNextTracePacket(&packet, &producer_uid))
-        break;
-      PERFETTO_DCHECK(producer_uid != kInvalidUid);
-      PERFETTO_DCHECK(packet.size() > 0);
-      if (!PacketStreamValidator::Validate(packet.slices())) {
-        PERFETTO_DLOG("Dropping invalid packet");
-        continue;
-      }
-
-      // Append a slice with the trusted UID of the producer. This can't
-      // be spoofed because above we validated that the existing slices
-      // don't contain any trusted UID fields. For added safety we append
-      // instead of prepending because according to protobuf semantics, if
-      // the same field is encountered multiple times the last instance
-      // takes priority. Note that truncated packets are also rejected, so
-      // the producer can't give us a partial packet (e.g., a truncated
-      // string) which only becomes valid when the UID is appended here.
-      protos::TrustedPacket trusted_packet;
-      trusted_packet.set_trusted_uid(static_cast<int32_t>(producer_uid));
-      static constexpr size_t kTrustedBufSize = 16;
-      Slice slice = Slice::Allocate(kTrustedBufSize);
-      PERFETTO_CHECK(
-          trusted_packet.SerializeToArray(slice.own_data(), kTrustedBufSize));
-      slice.size = static_cast<size_t>(trusted_packet.GetCachedSize());
-      PERFETTO_DCHECK(slice.size > 0 && slice.size <= kTrustedBufSize);
-      packet.AddSlice(std::move(slice));
-
-      // Append the packet (inclusive of the trusted uid) to |packets|.
-      packets_bytes += packet.size();
-      total_slices += packet.slices().size();
-      did_hit_threshold = packets_bytes >= kApproxBytesPerTask &&
-                          !tracing_session->write_into_file;
-      packets.emplace_back(std::move(packet));
-    }  // for(packets...)
-  }    // for(buffers...)
+    std::lock_guard<std::mutex> lock(shard->lock);
+    const size_t first_packet_of_buffer = packets.size();
+    did_hit_threshold =
+        ReadTraceBuffer(shard->buffer.get(), max_packets_bytes, &packets,
+                        &packets_bytes, &total_slices);
+
+    // The packets point into the buffer, that the data plane can overwrite
+    // as soon as the lock is released. Copy them out.
+    if (data_plane_) {
+      for (size_t i = first_packet_of_buffer; i < packets.size(); i++)
+        CopyPacketOutOfBuffer(&packets[i]);
+    }
+  }  // for(buffers...)
 
   // If the caller asked us to write into a file by setting
   // |write_into_file| == true in the trace config, drain the packets read
@@ -691,6 +758,155 @@ void ServiceImpl::ReadBuffers(TracingSessionID tsid,
   consumer->consumer_->OnTraceData(std::move(packets), has_more);
 }
 
+void ServiceImpl::ReadBuffersSnapshot(TracingSessionID tsid,
+                                      ConsumerEndpointImpl* consumer) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  TracingSession* tracing_session = GetTracingSession(tsid);
+  if (!tracing_session) {
+    PERFETTO_DLOG("Cannot ReadBuffersSnapshot(): no tracing session is active");
+    return;
+  }
+
+  if (tracing_session->write_into_file) {
+    PERFETTO_DLOG("Cannot ReadBuffersSnapshot() when writing into a file");
+    return;
+  }
+
+  // If a previous snapshot is still being read, the ReadBuffers() tasks that
+  // drain it are already posted.
+  if (!tracing_session->snapshot_buffers.empty()) {
+    PERFETTO_DLOG("ReadBuffersSnapshot() already in progress");
+    return;
+  }
+
+  for (BufferID buffer_id : tracing_session->buffers_index) {
+    BufferShard* shard = GetBufferByID(buffer_id);
+    std::unique_ptr<TraceBuffer> snapshot;
+    if (shard) {
+      std::lock_guard<std::mutex> lock(shard->lock);
+      snapshot = shard->buffer->CloneReadOnly();
+    }
+    if (!snapshot) {
+      PERFETTO_ELOG("Failed to snapshot trace buffer %" PRIu16, buffer_id);
+      tracing_session->snapshot_buffers.clear();
+      consumer->consumer_->OnTraceData({}, /*has_more=*/false);
+      return;
+    }
+    tracing_session->snapshot_buffers.emplace_back(std::move(snapshot));
+  }
+  UpdateMemoryGuardrail();
+  ReadSnapshotBuffers(tsid, consumer, /*is_first_read=*/true);
+}
+
+void ServiceImpl::ReadSnapshotBuffers(TracingSessionID tsid,
+                                      ConsumerEndpointImpl* consumer,
+                                      bool is_first_read) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  TracingSession* tracing_session = GetTracingSession(tsid);
+  if (!tracing_session || tracing_session->snapshot_buffers.empty())
+    return;
+
+  // Make the snapshot self-contained, by emitting the trace config, the clocks
+  // and the stats at its beginning. The periodic ones, emitted by
+  // ReadBuffers(), are not affected.
+  std::vector<TracePacket> packets;
+  if (is_first_read) {
+    SnapshotClocks(&packets);
+    SnapshotStats(tracing_session, /*last_snapshot=*/{}, &packets);
+    EmitTraceConfig(tracing_session, &packets);
+  }
+  size_t packets_bytes = 0;
+  size_t total_slices = 0;
+  for (const TracePacket& packet : packets) {
+    packets_bytes += packet.size();
+    total_slices += packet.slices().size();
+  }
+
+  bool has_more = false;
+  for (auto& tbuf : tracing_session->snapshot_buffers) {
+    has_more = ReadTraceBuffer(tbuf.get(), kApproxBytesPerTask, &packets,
+                               &packets_bytes, &total_slices);
+    if (has_more)
+      break;
+  }
+
+  // The snapshot is fully read. Detach it from the session, but keep it alive
+  // until the end of this function: |packets| point into its memory.
+  std::vector<std::unique_ptr<TraceBuffer>> consumed_snapshot;
+  if (!has_more) {
+    consumed_snapshot = std::move(tracing_session->snapshot_buffers);
+    tracing_session->snapshot_buffers.clear();
+    UpdateMemoryGuardrail();
+  } else {
+    auto weak_consumer = consumer->GetWeakPtr();
+    auto weak_this = weak_ptr_factory_.GetWeakPtr();
+    task_runner_->PostTask([weak_this, weak_consumer, tsid] {
+      if (!weak_this || !weak_consumer)
+        return;
+      weak_this->ReadSnapshotBuffers(tsid, weak_consumer.get(),
+                                     /*is_first_read=*/false);
+    });
+  }
+
+  // Keep this as tail call, just in case the consumer re-enters.
+  consumer->consumer_->OnTraceData(std::move(packets), has_more);
+}
+
+bool ServiceImpl::ReadTraceBuffer(TraceBuffer* tbuf,
+                                  size_t max_packets_bytes,
+                                  std::vector<TracePacket>* packets,
+                                  size_t* packets_bytes,
+                                  size_t* total_slices) {
+  tbuf->BeginRead();
+  for (;;) {
+    TracePacket packet;
+    TraceBuffer::PacketSequenceProperties sequence_properties{};
+    bool previous_packet_dropped = false;
+    if (!tbuf->ReadNextTracePacket(&packet, &sequence_properties,
+                                   &previous_packet_dropped)) {
+      return false;
+    }
+    PERFETTO_DCHECK(sequence_properties.producer_uid_trusted != kInvalidUid);
+    PERFETTO_DCHECK(packet.size() > 0);
+    if (!PacketStreamValidator::Validate(packet.slices())) {
+      PERFETTO_DLOG("Dropping invalid packet");
+      continue;
+    }
+
+    // Append a slice with the trusted UID of the producer and the ID of
+    // the packet sequence. These can't be spoofed because above we
+    // validated that the existing slices don't contain any trusted fields.
+    // For added safety we append instead of prepending because according
+    // to protobuf semantics, if the same field is encountered multiple
+    // times the last instance takes priority. Note that truncated packets
+    // are also rejected, so the producer can't give us a partial packet
+    // (e.g., a truncated string) which only becomes valid when the UID is
+    // appended here.
+    protos::TrustedPacket trusted_packet;
+    trusted_packet.set_trusted_uid(
+        static_cast<int32_t>(sequence_properties.producer_uid_trusted));
+    trusted_packet.set_trusted_packet_sequence_id(
+        GetPacketSequenceID(sequence_properties.producer_id_trusted,
+                            sequence_properties.writer_id));
+    if (previous_packet_dropped)
+      trusted_packet.set_previous_packet_dropped(true);
+    static constexpr size_t kTrustedBufSize = 32;
+    Slice slice = Slice::Allocate(kTrustedBufSize);
+    PERFETTO_CHECK(
+        trusted_packet.SerializeToArray(slice.own_data(), kTrustedBufSize));
+    slice.size = static_cast<size_t>(trusted_packet.GetCachedSize());
+    PERFETTO_DCHECK(slice.size > 0 && slice.size <= kTrustedBufSize);
+    packet.AddSlice(std::move(slice));
+
+    // Append the packet (inclusive of the trusted uid) to |packets|.
+    *packets_bytes += packet.size();
+    *total_slices += packet.slices().size();
+    packets->emplace_back(std::move(packet));
+    if (*packets_bytes >= max_packets_bytes)
+      return true;
+  }
+}
+
 void ServiceImpl::FreeBuffers(TracingSessionID tsid) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
   PERFETTO_DLOG("Freeing buffers for session %" PRIu64, tsid);
@@ -701,8 +917,20 @@ void ServiceImpl::FreeBuffers(TracingSessionID tsid) {
   }
   DisableTracing(tsid);
 
+  // Let the data plane finish with the buffers before destroying them. No new
+  // task can be posted for them past this point, as they are unregistered
+  // below on this same thread.
+  WaitForDataPlane();
+  for (auto it = shared_instances_.begin(); it != shared_instances_.end();) {
+    if (it->second.detached_session == tracing_session) {
+      FreeBufferID(it->first);
+      it = shared_instances_.erase(it);
+    } else {
+      ++it;
+    }
+  }
   for (BufferID buffer_id : tracing_session->buffers_index) {
-    buffer_ids_.Free(buffer_id);
+    FreeBufferID(buffer_id);
     PERFETTO_DCHECK(buffers_.count(buffer_id) == 1);
     buffers_.erase(buffer_id);
   }
@@ -758,12 +986,16 @@ void ServiceImpl::UnregisterDataSource(ProducerID producer_id,
   PERFETTO_CHECK(producer_id);
   ProducerEndpointImpl* producer = GetProducer(producer_id);
   PERFETTO_DCHECK(producer);
+  if (data_plane_)
+    PostPendingCopies();  // They might go to shared instances forgotten below.
+  std::set<DataSourceInstanceID> torn_down;  // Shared instances appear twice.
   for (auto& kv : tracing_sessions_) {
     auto& ds_instances = kv.second.data_source_instances;
     for (auto it = ds_instances.begin(); it != ds_instances.end();) {
       if (it->first == producer_id && it->second.data_source_name == name) {
         DataSourceInstanceID ds_inst_id = it->second.instance_id;
-        producer->TearDownDataSource(ds_inst_id);
+        if (torn_down.insert(ds_inst_id).second)
+          producer->TearDownDataSource(ds_inst_id);
         it = ds_instances.erase(it);
       } else {
         ++it;
@@ -771,6 +1003,16 @@ void ServiceImpl::UnregisterDataSource(ProducerID producer_id,
     }  // for (data_source_instances)
   }    // for (tracing_session)
 
+  for (auto it = shared_instances_.begin(); it != shared_instances_.end();) {
+    if (it->second.producer_id == producer_id &&
+        it->second.data_source_name == name) {
+      FreeBufferID(it->first);
+      it = shared_instances_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
   for (auto it = data_sources_.begin(); it != data_sources_.end(); ++it) {
     if (it->second.producer_id == producer_id &&
         it->second.descriptor.name() == name) {
@@ -835,10 +1077,57 @@ void ServiceImpl::CreateDataSourceInstance(
   PERFETTO_DCHECK(global_id);
   ds_config.set_target_buffer(global_id);
 
+  // Join the shared instance started by another session, if any, instead of
+  // starting a new one.
+  std::string config_key;
+  if (cfg_data_source.share_instance()) {
+    DataSourceConfig key_config = ds_config;
+    key_config.set_target_buffer(0);
+    key_config.set_trace_duration_ms(0);
+    protos::DataSourceConfig key_proto;
+    key_config.ToProto(&key_proto);
+    config_key = key_proto.SerializeAsString();
+    for (auto& id_and_instance : shared_instances_) {
+      SharedDataSourceInstance& shared = id_and_instance.second;
+      if (shared.producer_id != producer->id_ ||
+          shared.config_key != config_key || shared.detached_session) {
+        continue;
+      }
+      BufferShard* shard = GetBufferByID(global_id);
+      PERFETTO_DCHECK(shard);
+      auto& shards = shared.target_shards;
+      if (std::find(shards.begin(), shards.end(), shard) != shards.end())
+        continue;  // Listed twice in the same session, don't share.
+      shards.push_back(shard);
+      tracing_session->data_source_instances.emplace(
+          producer->id_,
+          DataSourceInstance{shared.instance_id, shared.data_source_name,
+                             id_and_instance.first});
+      PERFETTO_DLOG("Sharing data source %s with target buffer %" PRIu16,
+                    ds_config.name().c_str(), global_id);
+      return;
+    }
+  }
+
   DataSourceInstanceID inst_id = ++last_data_source_instance_id_;
+
+  // The first session asking to share the instance routes its chunks through a
+  // dedicated BufferID, so that other sessions can join later.
+  BufferID routing_id = 0;
+  if (cfg_data_source.share_instance())
+    routing_id = buffer_ids_.Allocate();
+  if (routing_id) {
+    SharedDataSourceInstance& shared = shared_instances_[routing_id];
+    shared.producer_id = producer->id_;
+    shared.instance_id = inst_id;
+    shared.data_source_name = data_source.descriptor.name();
+    shared.config_key = std::move(config_key);
+    shared.target_shards.push_back(GetBufferByID(global_id));
+    ds_config.set_target_buffer(routing_id);
+  }
   tracing_session->data_source_instances.emplace(
       producer->id_,
-      DataSourceInstance{inst_id, data_source.descriptor.name()});
+      DataSourceInstance{inst_id, data_source.descriptor.name(), routing_id});
   PERFETTO_DLOG("Starting data source %s with target buffer %" PRIu16,
                 ds_config.name().c_str(), global_id);
   if (!producer->shared_memory()) {
@@ -865,7 +1154,15 @@ void ServiceImpl::CreateDataSourceInstance(
     // mmap fails. We should instead gracefully fail the request and tell the
     // client to go away.
     auto shared_memory = shm_factory_->CreateSharedMemory(shm_size);
-    producer->SetSharedMemory(std::move(shared_memory));
+    const bool use_commit_ring =
+        producer_config.use_commit_ring() && shm_size >= page_size * 2;
+    producer->smb_scan_period_ms_ = producer_config.smb_scan_period_ms();
+    producer->commit_policy_.max_latency_ms =
+        producer_config.commit_max_latency_ms();
+    producer->commit_policy_.min_batch_bytes =
+        producer_config.commit_min_batch_kb() * 1024;
+    producer->commit_policy_.adaptive = producer_config.adaptive_commit();
+    producer->SetSharedMemory(std::move(shared_memory), use_commit_ring);
     producer->OnTracingSetup();
     UpdateMemoryGuardrail();
   }
@@ -882,14 +1179,17 @@ void ServiceImpl::CopyProducerPageIntoLogBuffer(ProducerID producer_id_trusted,
                                                 BufferID buffer_id,
                                                 uint16_t num_fragments,
                                                 uint8_t chunk_flags,
-                                                const uint8_t* src,
-                                                size_t size) {
+                                                SharedMemoryABI* abi,
+                                                SharedMemoryABI::Chunk chunk) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
-  TraceBuffer* buf = GetBufferByID(buffer_id);
-  if (!buf) {
+  BufferShard* shard = GetBufferByID(buffer_id);
+  SharedDataSourceInstance* shared_instance =
+      shard ? nullptr : GetSharedInstance(producer_id_trusted, buffer_id);
+  if (!shard && !shared_instance) {
     PERFETTO_DLOG("Could not find target buffer %" PRIu16
                   " for producer %" PRIu16,
                   buffer_id, producer_id_trusted);
+    abi->ReleaseChunkAsFree(std::move(chunk));
     return;
   }
 
@@ -899,8 +1199,169 @@ void ServiceImpl::CopyProducerPageIntoLogBuffer(ProducerID producer_id_trusted,
   // Essentially we want to prevent a malicious producer to inject data into a
   // log buffer that has nothing to do with it.
 
-  buf->CopyChunkUntrusted(producer_id_trusted, producer_uid_trusted, writer_id,
-                          chunk_id, num_fragments, chunk_flags, src, size);
+  ChunkToCopy chunk_to_copy{producer_id_trusted, producer_uid_trusted,
+                            writer_id, chunk_id, num_fragments, chunk_flags,
+                            abi, std::move(chunk)};
+  if (!data_plane_) {
+    std::vector<BufferID> buffers_became_full;
+    if (shard) {
+      MoveChunksIntoShards(&shard, 1, &chunk_to_copy, 1, &buffers_became_full);
+    } else {
+      MoveChunksIntoShards(shared_instance->target_shards.data(),
+                           shared_instance->target_shards.size(),
+                           &chunk_to_copy, 1, &buffers_became_full);
+    }
+    for (BufferID full_buffer_id : buffers_became_full)
+      OnBufferFull(full_buffer_id);
+    return;
+  }
+
+  // The copies are batched per buffer and posted together at the end of the
+  // CommitData() request, or before anything that depends on them.
+  if (pending_copies_.empty()) {
+    auto weak_this = weak_ptr_factory_.GetWeakPtr();
+    task_runner_->PostTask([weak_this] {
+      if (weak_this)
+        weak_this->PostPendingCopies();
+    });
+  }
+  pending_copies_[buffer_id].emplace_back(std::move(chunk_to_copy));
+}
+
+void ServiceImpl::PostPendingCopies() {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  auto weak_this = weak_ptr_factory_.GetWeakPtr();
+  base::TaskRunner* task_runner = task_runner_;
+  for (auto& id_and_copies : pending_copies_) {
+    const BufferID buffer_id = id_and_copies.first;
+    // std::function<> must be copyable, hence the shared_ptr for the move-only
+    // chunks. The producer can't reuse them until they are released, and its
+    // shared memory outlives the task (see DisconnectProducer()).
+    std::shared_ptr<std::vector<ChunkToCopy>> copies(
+        new std::vector<ChunkToCopy>(std::move(id_and_copies.second)));
+    // The buffers can't go away before the copies are posted: FreeBuffers()
+    // and the detach of shared instances post them first.
+    // Without shards, the chunks are just released.
+    std::vector<BufferShard*> shards =
+        GetTargetShards(copies->front().producer_id, buffer_id);
+    PERFETTO_DCHECK(!shards.empty());
+    data_plane_->PostTask(buffer_id, [shards, copies, task_runner, weak_this] {
+      std::vector<BufferID> buffers_became_full;
+      MoveChunksIntoShards(shards.data(), shards.size(), copies->data(),
+                           copies->size(), &buffers_became_full);
+      if (buffers_became_full.empty())
+        return;
+      task_runner->PostTask([weak_this, buffers_became_full] {
+        for (BufferID full_buffer_id : buffers_became_full) {
+          if (weak_this)
+            weak_this->OnBufferFull(full_buffer_id);
+        }
+      });
+    });
+  }
+  pending_copies_.clear();
+}
+
+void ServiceImpl::WaitForDataPlane() {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  if (!data_plane_)
+    return;
+  PostPendingCopies();
+  data_plane_->WaitForIdle();
+}
+
+// static
+void ServiceImpl::MoveChunksIntoShards(
+    BufferShard* const* shards,
+    size_t num_shards,
+    ChunkToCopy* chunks,
+    size_t num_chunks,
+    std::vector<BufferID>* buffers_became_full) {
+  for (size_t s = 0; s < num_shards; s++) {
+    std::lock_guard<std::mutex> lock(shards[s]->lock);
+    TraceBuffer* buf = shards[s]->buffer.get();
+    const bool was_discarding_writes = buf->discarding_writes();
+    for (size_t i = 0; i < num_chunks; i++) {
+      ChunkToCopy& c = chunks[i];
+      buf->CopyChunkUntrusted(c.producer_id, c.producer_uid, c.writer_id,
+                              c.chunk_id, c.num_fragments, c.chunk_flags,
+                              c.chunk.payload_begin(), c.chunk.payload_size());
+    }
+    if (PERFETTO_UNLIKELY(!was_discarding_writes && buf->discarding_writes()))
+      buffers_became_full->push_back(shards[s]->id);
+  }
+
+  // This one has release-store semantics.
+  for (size_t i = 0; i < num_chunks; i++)
+    chunks[i].abi->ReleaseChunkAsFree(std::move(chunks[i].chunk));
+}
+
+void ServiceImpl::PatchChunk(ProducerID producer_id_trusted,
+                             BufferID target_buffer,
+                             WriterID writer_id,
+                             ChunkID chunk_id,
+                             const TraceBuffer::Patch* patches,
+                             size_t num_patches,
+                             bool other_patches_pending) {
+  std::vector<BufferShard*> shards =
+      GetTargetShards(producer_id_trusted, target_buffer);
+  if (!data_plane_) {
+    for (BufferShard* shard : shards) {
+      std::lock_guard<std::mutex> lock(shard->lock);
+      shard->buffer->TryPatchChunkContents(producer_id_trusted, writer_id,
+                                           chunk_id, patches, num_patches,
+                                           other_patches_pending);
+    }
+    return;
+  }
+
+  // Posted to the same thread as the copy of the chunk, which might still be
+  // pending.
+  PostPendingCopies();
+  std::shared_ptr<std::vector<TraceBuffer::Patch>> patches_copy(
+      new std::vector<TraceBuffer::Patch>(patches, patches + num_patches));
+  data_plane_->PostTask(target_buffer, [=] {
+    for (BufferShard* shard : shards) {
+      std::lock_guard<std::mutex> lock(shard->lock);
+      shard->buffer->TryPatchChunkContents(
+          producer_id_trusted, writer_id, chunk_id, patches_copy->data(),
+          patches_copy->size(), other_patches_pending);
+    }
+  });
+}
+
+void ServiceImpl::OnBufferFull(BufferID buffer_id) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  for (auto& id_and_session : tracing_sessions_) {
+    const TracingSessionID tsid = id_and_session.first;
+    TracingSession& tracing_session = id_and_session.second;
+    const std::vector<BufferID>& buffers = tracing_session.buffers_index;
+    if (std::find(buffers.begin(), buffers.end(), buffer_id) == buffers.end())
+      continue;
+    if (!tracing_session.config.stop_when_buffers_full() ||
+        !tracing_session.tracing_enabled) {
+      return;
+    }
+    for (BufferID other_buffer_id : buffers) {
+      BufferShard* shard = GetBufferByID(other_buffer_id);
+      if (!shard)
+        return;
+      std::lock_guard<std::mutex> lock(shard->lock);
+      if (!shard->buffer->discarding_writes())
+        return;
+    }
+
+    // Flushing would be pointless, there is no room left for the data. The
+    // call is posted as we might be in the middle of a producer's CommitData().
+    PERFETTO_LOG("All the buffers are full, disabling tracing session %" PRIu64,
+                 tsid);
+    auto weak_this = weak_ptr_factory_.GetWeakPtr();
+    task_runner_->PostTask([weak_this, tsid] {
+      if (weak_this)
+        weak_this->DisableTracing(tsid);
+    });
+    return;
+  }
 }
 
 void ServiceImpl::ApplyChunkPatches(
@@ -911,11 +1372,13 @@ void ServiceImpl::ApplyChunkPatches(
   for (const auto& chunk : chunks_to_patch) {
     const ChunkID chunk_id = static_cast<ChunkID>(chunk.chunk_id());
     const WriterID writer_id = static_cast<WriterID>(chunk.writer_id());
-    TraceBuffer* buf =
-        GetBufferByID(static_cast<BufferID>(chunk.target_buffer()));
+    const BufferID buffer_id = static_cast<BufferID>(chunk.target_buffer());
+    const bool is_valid_target_buffer =
+        GetBufferByID(buffer_id) ||
+        GetSharedInstance(producer_id_trusted, buffer_id);
     static_assert(std::numeric_limits<ChunkID>::max() == kMaxChunkID,
                   "Add a '|| chunk_id > kMaxChunkID' below if this fails");
-    if (!writer_id || writer_id > kMaxWriterID || !buf) {
+    if (!writer_id || writer_id > kMaxWriterID || !is_valid_target_buffer) {
       PERFETTO_DLOG(
           "Received invalid chunks_to_patch request from Producer: %" PRIu16
           ", BufferID: %" PRIu32 " ChunkdID: %" PRIu32 " WriterID: %" PRIu16,
@@ -945,8 +1408,53 @@ void ServiceImpl::ApplyChunkPatches(
       memcpy(&patches[i].data[0], patch_data.data(), patches[i].data.size());
       i++;
     }
-    buf->TryPatchChunkContents(producer_id_trusted, writer_id, chunk_id,
-                               &patches[0], i, chunk.has_more_patches());
+    PatchChunk(producer_id_trusted, buffer_id, writer_id, chunk_id,
+               &patches[0], i, chunk.has_more_patches());
+  }
+}
+
+void ServiceImpl::ApplyPackedChunkPatches(
+    ProducerID producer_id_trusted,
+    const std::string& packed_chunks_to_patch) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+
+  // Same as ApplyChunkPatches(), but the patches are copied straight from the
+  // request into the |patches| array, without any intermediate allocation.
+  PackedCommitData::ChunksToPatchReader reader(packed_chunks_to_patch.data(),
+                                               packed_chunks_to_patch.size());
+  PackedCommitData::ChunksToPatchReader::Chunk chunk;
+  while (reader.Next(&chunk)) {
+    const bool is_valid_target_buffer =
+        GetBufferByID(chunk.target_buffer) ||
+        GetSharedInstance(producer_id_trusted, chunk.target_buffer);
+    if (!chunk.writer_id || chunk.writer_id > kMaxWriterID ||
+        !is_valid_target_buffer) {
+      PERFETTO_DLOG(
+          "Received invalid packed_chunks_to_patch request from Producer: "
+          "%" PRIu16 ", BufferID: %" PRIu16 " ChunkdID: %" PRIu32
+          " WriterID: %" PRIu16,
+          producer_id_trusted, chunk.target_buffer, chunk.chunk_id,
+          chunk.writer_id);
+      continue;
+    }
+    std::array<TraceBuffer::Patch, 1024> patches;  // Uninitialized.
+    if (chunk.num_patches > patches.size()) {
+      PERFETTO_DLOG("Too many patches (%" PRIu16 ") batched in a request",
+                    chunk.num_patches);
+      PERFETTO_DCHECK(false);
+      continue;
+    }
+    static_assert(TraceBuffer::Patch::kSize == PackedCommitData::kPatchSize,
+                  "Patch size mismatch");
+    for (size_t i = 0; i < chunk.num_patches; i++) {
+      uint32_t offset = 0;
+      PackedCommitData::ChunksToPatchReader::GetPatch(chunk, i, &offset,
+                                                      &patches[i].data[0]);
+      patches[i].offset_untrusted = offset;
+    }
+    PatchChunk(producer_id_trusted, chunk.target_buffer, chunk.writer_id,
+               chunk.chunk_id, &patches[0], chunk.num_patches,
+               chunk.has_more_patches);
   }
 }
 
@@ -959,6 +1467,40 @@ ServiceImpl::TracingSession* ServiceImpl::GetTracingSession(
   return &it->second;
 }
 
+uint32_t ServiceImpl::GetPacketSequenceID(ProducerID producer_id,
+                                          WriterID writer_id) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  auto key = std::make_pair(producer_id, writer_id);
+  auto it = packet_sequence_ids_.find(key);
+  if (it != packet_sequence_ids_.end())
+    return it->second;
+  // A sequence is never recycled: its packets might still be in some buffer.
+  PERFETTO_CHECK(last_packet_sequence_id_ <
+                 std::numeric_limits<uint32_t>::max());
+  uint32_t sequence_id = ++last_packet_sequence_id_;
+  packet_sequence_ids_[key] = sequence_id;
+  return sequence_id;
+}
+
+void ServiceImpl::RetirePacketSequences(ProducerID producer_id,
+                                        WriterID writer_id,
+                                        std::set<BufferID> buffers) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  auto key = std::make_pair(producer_id, writer_id);
+  if (!buffers.empty()) {
+    retired_packet_sequences_[key] = std::move(buffers);
+    return;
+  }
+  retired_packet_sequences_.erase(key);
+  if (writer_id) {
+    packet_sequence_ids_.erase(key);
+    return;
+  }
+  auto it = packet_sequence_ids_.lower_bound(key);
+  while (it != packet_sequence_ids_.end() && it->first.first == producer_id)
+    it = packet_sequence_ids_.erase(it);
+}
+
 ProducerID ServiceImpl::GetNextProducerID() {
   PERFETTO_DCHECK_THREAD(thread_checker_);
   PERFETTO_CHECK(producers_.size() < kMaxProducerID);
@@ -969,13 +1511,102 @@ ProducerID ServiceImpl::GetNextProducerID() {
   return last_producer_id_;
 }
 
-TraceBuffer* ServiceImpl::GetBufferByID(BufferID buffer_id) {
+ServiceImpl::BufferShard* ServiceImpl::GetBufferByID(BufferID buffer_id) {
   auto buf_iter = buffers_.find(buffer_id);
   if (buf_iter == buffers_.end())
     return nullptr;
   return &*buf_iter->second;
 }
 
+ServiceImpl::SharedDataSourceInstance* ServiceImpl::GetSharedInstance(
+    ProducerID producer_id,
+    BufferID routing_id) {
+  auto it = shared_instances_.find(routing_id);
+  if (it == shared_instances_.end() || it->second.producer_id != producer_id)
+    return nullptr;
+  return &it->second;
+}
+
+std::vector<ServiceImpl::BufferShard*> ServiceImpl::GetTargetShards(
+    ProducerID producer_id,
+    BufferID target_buffer) {
+  BufferShard* shard = GetBufferByID(target_buffer);
+  if (shard)
+    return {shard};
+  SharedDataSourceInstance* shared = GetSharedInstance(producer_id,
+                                                       target_buffer);
+  if (shared)
+    return shared->target_shards;
+  return {};
+}
+
+bool ServiceImpl::DetachSharedInstance(BufferID routing_id,
+                                       TracingSession* tracing_session) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  auto it = shared_instances_.find(routing_id);
+  if (it == shared_instances_.end()) {
+    PERFETTO_DCHECK(false);
+    return false;
+  }
+
+  // The pending copies are resolved against the current sessions when posted.
+  if (data_plane_)
+    PostPendingCopies();
+  std::vector<BufferShard*> shards = it->second.target_shards;
+  for (BufferID buffer_id : tracing_session->buffers_index) {
+    BufferShard* shard = GetBufferByID(buffer_id);
+    shards.erase(std::remove(shards.begin(), shards.end(), shard),
+                 shards.end());
+  }
+  if (!shards.empty()) {
+    it->second.target_shards = std::move(shards);
+    return false;
+  }
+  // Keep routing the chunks to the buffers of the last session until they
+  // are freed.
+  it->second.detached_session = tracing_session;
+  return true;
+}
+
+void ServiceImpl::FreeBufferID(BufferID buffer_id) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  buffer_ids_.Free(buffer_id);
+  for (auto& kv : producers_) {
+    auto& writer_target_buffers = kv.second->writer_target_buffers_;
+    for (auto it = writer_target_buffers.begin();
+         it != writer_target_buffers.end();) {
+      if (it->second == buffer_id) {
+        it = writer_target_buffers.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  for (auto it = retired_packet_sequences_.begin();
+       it != retired_packet_sequences_.end();) {
+    auto next = it;
+    next++;
+    it->second.erase(buffer_id);
+    if (it->second.empty())
+      RetirePacketSequences(it->first.first, it->first.second, {});
+    it = next;
+  }
+}
+
+void ServiceImpl::SetTracingSessionLimits(size_t max_sessions,
+                                          size_t max_total_buffer_size_kb) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  max_tracing_sessions_ = max_sessions;
+  max_total_buffer_size_kb_ = max_total_buffer_size_kb;
+}
+
+void ServiceImpl::SetDataPlaneThreads(size_t num_threads) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  PERFETTO_CHECK(producers_.empty() && buffers_.empty());
+  data_plane_.reset(num_threads ? new DataPlane(num_threads) : nullptr);
+}
+
 void ServiceImpl::UpdateMemoryGuardrail() {
 #if !PERFETTO_BUILDFLAG(PERFETTO_CHROMIUM_BUILD) && \
     !PERFETTO_BUILDFLAG(PERFETTO_OS_MACOSX)
@@ -989,11 +1620,20 @@ void ServiceImpl::UpdateMemoryGuardrail() {
 
   // Sum up all the trace buffers.
   for (const auto& id_to_buffer : buffers_) {
-    total_buffer_bytes += id_to_buffer.second->size();
+    total_buffer_bytes += id_to_buffer.second->buffer->size();
+  }
+
+  // Sum up all the snapshots being read (see ReadBuffersSnapshot()).
+  for (const auto& id_to_session : tracing_sessions_) {
+    for (const auto& snapshot : id_to_session.second.snapshot_buffers)
+      total_buffer_bytes += snapshot->size();
   }
 
   // Set the guard rail to 32MB + the sum of all the buffers over a 30 second
-  // interval.
+  // interval. The watchdog checks it against the actual RSS of the process.
+  // The buffers are counted at their full size, as they can fill up at any
+  // time, even though their pages are committed only when written and are
+  // released once read (see TraceBuffer::ReleaseReadChunks()).
   uint64_t guardrail = 32 * 1024 * 1024 + total_buffer_bytes;
   base::Watchdog::GetInstance()->SetMemoryLimit(guardrail, 30 * 1000);
 #endif
@@ -1005,7 +1645,10 @@ void ServiceImpl::MaybeSnapshotClocks(TracingSession* tracing_session,
   if (now < tracing_session->last_clock_snapshot + kClockSnapshotInterval)
     return;
   tracing_session->last_clock_snapshot = now;
+  SnapshotClocks(packets);
+}
 
+void ServiceImpl::SnapshotClocks(std::vector<TracePacket>* packets) {
   protos::TrustedPacket packet;
   protos::ClockSnapshot* clock_snapshot = packet.mutable_clock_snapshot();
 
@@ -1063,8 +1706,16 @@ void ServiceImpl::MaybeSnapshotStats(TracingSession* tracing_session,
   base::TimeMillis now = base::GetWallTimeMs();
   if (now < tracing_session->last_stats_snapshot + kStatsSnapshotInterval)
     return;
+  const base::TimeMillis last_snapshot = tracing_session->last_stats_snapshot;
   tracing_session->last_stats_snapshot = now;
+  SnapshotStats(tracing_session, last_snapshot, packets);
+  tracing_session->commit_requests_at_last_snapshot = commit_requests_;
+}
 
+void ServiceImpl::SnapshotStats(TracingSession* tracing_session,
+                                base::TimeMillis last_snapshot,
+                                std::vector<TracePacket>* packets) {
+  const base::TimeMillis now = base::GetWallTimeMs();
   protos::TrustedPacket packet;
   packet.set_trusted_uid(static_cast<int32_t>(uid_));
 
@@ -1078,15 +1729,28 @@ void ServiceImpl::MaybeSnapshotStats(TracingSession* tracing_session,
   trace_stats->set_tracing_sessions(
       static_cast<uint32_t>(tracing_sessions_.size()));
   trace_stats->set_total_buffers(static_cast<uint32_t>(buffers_.size()));
+  trace_stats->set_commit_requests(commit_requests_);
+  trace_stats->set_chunks_committed(chunks_committed_);
+  if (last_snapshot.count() > 0 && now > last_snapshot) {
+    const uint64_t commit_requests_since_last_snapshot =
+        commit_requests_ - tracing_session->commit_requests_at_last_snapshot;
+    trace_stats->set_commit_requests_per_sec(static_cast<uint32_t>(
+        commit_requests_since_last_snapshot * 1000 /
+        static_cast<uint64_t>((now - last_snapshot).count())));
+  }
 
   for (BufferID buf_id : tracing_session->buffers_index) {
-    TraceBuffer* buf = GetBufferByID(buf_id);
-    if (!buf) {
+    BufferShard* shard = GetBufferByID(buf_id);
+    if (!shard) {
       PERFETTO_DCHECK(false);
       continue;
     }
     auto* buf_stats_proto = trace_stats->add_buffer_stats();
-    const TraceBuffer::Stats& buf_stats = buf->stats();
+    TraceBuffer::Stats buf_stats;
+    {
+      std::lock_guard<std::mutex> lock(shard->lock);
+      buf_stats = shard->buffer->stats();
+    }
     buf_stats_proto->set_bytes_written(buf_stats.bytes_written);
     buf_stats_proto->set_chunks_written(buf_stats.chunks_written);
     buf_stats_proto->set_chunks_overwritten(buf_stats.chunks_overwritten);
@@ -1096,6 +1760,30 @@ void ServiceImpl::MaybeSnapshotStats(TracingSession* tracing_session,
     buf_stats_proto->set_readaheads_succeeded(buf_stats.readaheads_succeeded);
     buf_stats_proto->set_readaheads_failed(buf_stats.readaheads_failed);
     buf_stats_proto->set_abi_violations(buf_stats.abi_violations);
+    buf_stats_proto->set_producer_packets_dropped(
+        buf_stats.producer_packets_dropped);
+    buf_stats_proto->set_producer_bytes_dropped(
+        buf_stats.producer_bytes_dropped);
+    buf_stats_proto->set_truncated_packets(buf_stats.truncated_packets);
+    buf_stats_proto->set_chunks_discarded(buf_stats.chunks_discarded);
+    for (const auto& id_and_stats : buf_stats.producer_stats) {
+      const TraceBuffer::ProducerStats& producer_stats = id_and_stats.second;
+      auto* producer_stats_proto = buf_stats_proto->add_producer_stats();
+      producer_stats_proto->set_producer_id(id_and_stats.first);
+      ProducerEndpointImpl* producer = GetProducer(id_and_stats.first);
+      if (producer)
+        producer_stats_proto->set_producer_name(producer->name_);
+      producer_stats_proto->set_bytes_written(producer_stats.bytes_written);
+      producer_stats_proto->set_chunks_written(producer_stats.chunks_written);
+      producer_stats_proto->set_chunks_overwritten(
+          producer_stats.chunks_overwritten);
+      producer_stats_proto->set_bytes_overwritten(
+          producer_stats.bytes_overwritten);
+      producer_stats_proto->set_chunks_discarded(
+          producer_stats.chunks_discarded);
+      producer_stats_proto->set_bytes_in_buffer(
+          producer_stats.bytes_in_buffer);
+    }
   }  // for (buf in session).
   Slice slice = Slice::Allocate(static_cast<size_t>(packet.ByteSize()));
   PERFETTO_CHECK(packet.SerializeWithCachedSizesToArray(slice.own_data()));
@@ -1108,6 +1796,11 @@ void ServiceImpl::MaybeEmitTraceConfig(TracingSession* tracing_session,
   if (tracing_session->did_emit_config)
     return;
   tracing_session->did_emit_config = true;
+  EmitTraceConfig(tracing_session, packets);
+}
+
+void ServiceImpl::EmitTraceConfig(TracingSession* tracing_session,
+                                  std::vector<TracePacket>* packets) {
   protos::TrustedPacket packet;
   tracing_session->config.ToProto(packet.mutable_trace_config());
   packet.set_trusted_uid(static_cast<int32_t>(uid_));
@@ -1169,6 +1862,16 @@ void ServiceImpl::ConsumerEndpointImpl::ReadBuffers() {
   service_->ReadBuffers(tracing_session_id_, this);
 }
 
+void ServiceImpl::ConsumerEndpointImpl::ReadBuffersSnapshot() {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  if (!tracing_session_id_) {
+    PERFETTO_LOG(
+        "Consumer called ReadBuffersSnapshot() but tracing was not active");
+    return;
+  }
+  service_->ReadBuffersSnapshot(tracing_session_id_, this);
+}
+
 void ServiceImpl::ConsumerEndpointImpl::FreeBuffers() {
   PERFETTO_DCHECK_THREAD(thread_checker_);
   if (!tracing_session_id_) {
@@ -1247,46 +1950,68 @@ void ServiceImpl::ProducerEndpointImpl::CommitData(
     return;
   }
   PERFETTO_DCHECK(shmem_abi_.is_valid());
+  service_->commit_requests_++;
+
+  // Move the chunks in the commit ring that have been returned before the
+  // ones in the request. The patches in the request might refer to them.
+  if (commit_ring_.is_valid())
+    DrainCommitRing(req_untrusted.commit_ring_write_idx());
+
   for (const auto& entry : req_untrusted.chunks_to_move()) {
-    const uint32_t page_idx = entry.page();
-    if (page_idx >= shmem_abi_.num_pages())
-      continue;  // A buggy or malicious producer.
-
-    SharedMemoryABI::Chunk chunk =
-        shmem_abi_.TryAcquireChunkForReading(page_idx, entry.chunk());
-    if (!chunk.is_valid()) {
-      PERFETTO_DLOG("Asked to move chunk %d:%d, but it's not complete",
-                    entry.page(), entry.chunk());
-      continue;
+    MoveChunkToTraceBuffer(entry.page(), entry.chunk(),
+                           static_cast<BufferID>(entry.target_buffer()));
+  }
+  PackedCommitData::ChunksToMoveReader chunks_to_move(
+      req_untrusted.packed_chunks_to_move());
+  PackedCommitData::ChunksToMoveReader::Entry entry;
+  while (chunks_to_move.Next(&entry))
+    MoveChunkToTraceBuffer(entry.page, entry.chunk, entry.target_buffer);
+
+  // The request might have been sent to flush the data or to introduce new
+  // writers, or it might carry patches for chunks that only the scan can find.
+  if (smb_scan_period_ms_)
+    ScanSharedMemory();
+
+  // The scan above has moved the last chunks of the released writers. Their
+  // IDs will be reused by the producer, possibly for other buffers.
+  for (uint32_t released_writer : req_untrusted.released_writers()) {
+    const WriterID writer_id = static_cast<WriterID>(released_writer);
+    std::set<BufferID> buffers;
+    auto it = writer_target_buffers_.find(writer_id);
+    if (it != writer_target_buffers_.end()) {
+      buffers.insert(it->second);
+      writer_target_buffers_.erase(it);
     }
-
-    // TryAcquireChunkForReading() has load-acquire semantics. Once acquired,
-    // the ABI contract expects the producer to not touch the chunk anymore
-    // (until the service marks that as free). This is why all the reads below
-    // are just memory_order_relaxed. Also, the code here assumes that all this
-    // data can be malicious and just gives up if anything is malformed.
-    BufferID buffer_id = static_cast<BufferID>(entry.target_buffer());
-    const SharedMemoryABI::ChunkHeader& chunk_header = *chunk.header();
-    WriterID writer_id = chunk_header.writer_id.load(std::memory_order_relaxed);
-    ChunkID chunk_id = chunk_header.chunk_id.load(std::memory_order_relaxed);
-    auto packets = chunk_header.packets.load(std::memory_order_relaxed);
-    uint16_t num_fragments = packets.count;
-    uint8_t chunk_flags = packets.flags;
-
-    service_->CopyProducerPageIntoLogBuffer(
-        id_, uid_, writer_id, chunk_id, buffer_id, num_fragments, chunk_flags,
-        chunk.payload_begin(), chunk.payload_size());
-
-    // This one has release-store semantics.
-    shmem_abi_.ReleaseChunkAsFree(std::move(chunk));
-  }  // for(chunks_to_move)
+    service_->RetirePacketSequences(id_, writer_id, std::move(buffers));
+  }
 
   service_->ApplyChunkPatches(id_, req_untrusted.chunks_to_patch());
+  if (!req_untrusted.packed_chunks_to_patch().empty()) {
+    service_->ApplyPackedChunkPatches(id_,
+                                      req_untrusted.packed_chunks_to_patch());
+  }
+
+  // Then the ones returned after the request was sent.
+  if (commit_ring_.is_valid())
+    DrainCommitRing();
+
+  for (const auto& data_loss : req_untrusted.data_losses()) {
+    // Empty for a buggy or malicious producer.
+    for (BufferShard* shard : service_->GetTargetShards(
+             id_, static_cast<BufferID>(data_loss.target_buffer()))) {
+      std::lock_guard<std::mutex> lock(shard->lock);
+      shard->buffer->AddProducerDataLoss(data_loss.packets_dropped(),
+                                         data_loss.bytes_dropped());
+    }
+  }
 
   if (req_untrusted.flush_request_id()) {
     service_->NotifyFlushDoneForProducer(id_, req_untrusted.flush_request_id());
   }
 
+  if (service_->data_plane_)
+    service_->PostPendingCopies();
+
   // Keep this invocation last. ProducerIPCService::CommitData() relies on this
   // callback being invoked within the same callstack and not posted. If this
   // changes, the code there needs to be changed accordingly.
@@ -1294,13 +2019,137 @@ void ServiceImpl::ProducerEndpointImpl::CommitData(
     callback();
 }
 
+void ServiceImpl::ProducerEndpointImpl::MoveChunkToTraceBuffer(
+    uint32_t page_idx,
+    uint32_t chunk_idx,
+    BufferID buffer_id) {
+  if (page_idx >= shmem_abi_.num_pages())
+    return;  // A buggy or malicious producer.
+
+  SharedMemoryABI::Chunk chunk =
+      shmem_abi_.TryAcquireChunkForReading(page_idx, chunk_idx);
+  if (!chunk.is_valid()) {
+    PERFETTO_DLOG("Asked to move chunk %d:%d, but it's not complete",
+                  page_idx, chunk_idx);
+    return;
+  }
+
+  // TryAcquireChunkForReading() has load-acquire semantics. Once acquired,
+  // the ABI contract expects the producer to not touch the chunk anymore
+  // (until the service marks that as free). This is why all the reads below
+  // are just memory_order_relaxed. Also, the code here assumes that all this
+  // data can be malicious and just gives up if anything is malformed.
+  const SharedMemoryABI::ChunkHeader& chunk_header = *chunk.header();
+  WriterID writer_id = chunk_header.writer_id.load(std::memory_order_relaxed);
+  ChunkID chunk_id = chunk_header.chunk_id.load(std::memory_order_relaxed);
+  auto packets = chunk_header.packets.load(std::memory_order_relaxed);
+  uint16_t num_fragments = packets.count;
+  uint8_t chunk_flags = packets.flags;
+
+  // Releases the chunk once copied.
+  service_->CopyProducerPageIntoLogBuffer(id_, uid_, writer_id, chunk_id,
+                                          buffer_id, num_fragments, chunk_flags,
+                                          &shmem_abi_, std::move(chunk));
+  service_->chunks_committed_++;
+
+  // The producer commits explicitly only the first chunk of each writer. From
+  // there on, ScanSharedMemory() moves the chunks of the writer by itself.
+  if (smb_scan_period_ms_ && writer_id <= kMaxWriterID) {
+    auto it_and_inserted = writer_target_buffers_.emplace(writer_id, buffer_id);
+    if (it_and_inserted.second) {
+      // The writer might reuse the ID of a released one, and continues its
+      // sequence.
+      service_->retired_packet_sequences_.erase(std::make_pair(id_, writer_id));
+    } else {
+      it_and_inserted.first->second = buffer_id;
+    }
+    MaybePostPeriodicScanTask();
+  }
+}
+
+void ServiceImpl::ProducerEndpointImpl::ScanSharedMemory() {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  for (size_t page_idx = 0; page_idx < shmem_abi_.num_pages(); page_idx++) {
+    const uint32_t layout = shmem_abi_.page_header(page_idx)->layout.load(
+        std::memory_order_acquire);
+    const uint32_t num_chunks = SharedMemoryABI::GetNumChunksForLayout(layout);
+    for (uint32_t chunk_idx = 0; chunk_idx < num_chunks; chunk_idx++) {
+      const uint32_t chunk_state =
+          (layout >> (chunk_idx * SharedMemoryABI::kChunkShift)) &
+          SharedMemoryABI::kChunkMask;
+      if (chunk_state != SharedMemoryABI::kChunkComplete)
+        continue;
+
+      // The producer doesn't touch complete chunks, so it's safe to peek at
+      // the header before acquiring the chunk. The chunks of writers that
+      // haven't been committed explicitly yet are left where they are, the
+      // producer will send them in a CommitData() request.
+      SharedMemoryABI::Chunk chunk =
+          shmem_abi_.GetChunkUnchecked(page_idx, layout, chunk_idx);
+      const WriterID writer_id =
+          chunk.header()->writer_id.load(std::memory_order_relaxed);
+      auto it = writer_target_buffers_.find(writer_id);
+      if (it == writer_target_buffers_.end())
+        continue;
+      MoveChunkToTraceBuffer(static_cast<uint32_t>(page_idx), chunk_idx,
+                             it->second);
+    }
+  }
+}
+
+void ServiceImpl::ProducerEndpointImpl::PeriodicScanSharedMemoryTask() {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  ScanSharedMemory();
+  scan_task_pending_ = false;
+  MaybePostPeriodicScanTask();
+}
+
+void ServiceImpl::ProducerEndpointImpl::MaybePostPeriodicScanTask() {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  if (scan_task_pending_ || writer_target_buffers_.empty())
+    return;
+  scan_task_pending_ = true;
+  auto weak_this = weak_ptr_factory_.GetWeakPtr();
+  task_runner_->PostDelayedTask(
+      [weak_this] {
+        if (weak_this)
+          weak_this->PeriodicScanSharedMemoryTask();
+      },
+      smb_scan_period_ms_);
+}
+
+void ServiceImpl::ProducerEndpointImpl::DrainCommitRing(uint32_t stop_idx) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  // The producer can keep appending entries while we drain the ring. Don't let
+  // it hog the service thread: after a full ring worth of entries, continue on
+  // the next task.
+  CommitRing::Entry entry;
+  for (uint32_t i = 0; i < commit_ring_.capacity(); i++) {
+    if (commit_ring_.next_idx() == stop_idx || !commit_ring_.TryPop(&entry))
+      return;
+    MoveChunkToTraceBuffer(entry.page, entry.chunk, entry.target_buffer);
+  }
+  auto weak_this = weak_ptr_factory_.GetWeakPtr();
+  task_runner_->PostTask([weak_this] {
+    if (weak_this)
+      weak_this->DrainCommitRing();
+  });
+}
+
 void ServiceImpl::ProducerEndpointImpl::SetSharedMemory(
-    std::unique_ptr<SharedMemory> shared_memory) {
+    std::unique_ptr<SharedMemory> shared_memory,
+    bool use_commit_ring) {
   PERFETTO_DCHECK(!shared_memory_ && !shmem_abi_.is_valid());
   shared_memory_ = std::move(shared_memory);
-  shmem_abi_.Initialize(reinterpret_cast<uint8_t*>(shared_memory_->start()),
-                        shared_memory_->size(),
-                        shared_buffer_page_size_kb() * 1024);
+  uint8_t* const start = reinterpret_cast<uint8_t*>(shared_memory_->start());
+  const size_t page_size = shared_buffer_page_size_kb() * 1024;
+  size_t abi_size = shared_memory_->size();
+  if (use_commit_ring) {
+    // The commit ring takes the last page of the SMB, see commit_ring.h.
+    abi_size -= page_size;
+    commit_ring_ = CommitRing(start + abi_size, page_size);
+  }
+  shmem_abi_.Initialize(start, abi_size, page_size);
 }
 
 SharedMemory* ServiceImpl::ProducerEndpointImpl::shared_memory() const {
@@ -1312,6 +2161,15 @@ size_t ServiceImpl::ProducerEndpointImpl::shared_buffer_page_size_kb() const {
   return shared_buffer_page_size_kb_;
 }
 
+SharedMemoryOptions ServiceImpl::ProducerEndpointImpl::shared_memory_options()
+    const {
+  SharedMemoryOptions options;
+  options.use_commit_ring = commit_ring_.is_valid();
+  options.service_scans_smb = smb_scan_period_ms_ > 0;
+  options.commit_policy = commit_policy_;
+  return options;
+}
+
 void ServiceImpl::ProducerEndpointImpl::TearDownDataSource(
     DataSourceInstanceID ds_inst_id) {
   // TODO(primiano): When we'll support tearing down the SMB, at this point we
@@ -1326,23 +2184,35 @@ void ServiceImpl::ProducerEndpointImpl::TearDownDataSource(
 }
 
 SharedMemoryArbiterImpl*
-ServiceImpl::ProducerEndpointImpl::GetOrCreateShmemArbiter() {
-  PERFETTO_DCHECK_THREAD(thread_checker_);
-  if (!inproc_shmem_arbiter_) {
-    inproc_shmem_arbiter_.reset(new SharedMemoryArbiterImpl(
-        shared_memory_->start(), shared_memory_->size(),
-        shared_buffer_page_size_kb_ * 1024, this, task_runner_));
-  }
+ServiceImpl::ProducerEndpointImpl::GetInProcessShmemArbiter() {
+  std::lock_guard<std::mutex> scoped_lock(inproc_shmem_arbiter_lock_);
+  PERFETTO_CHECK(inproc_shmem_arbiter_);  // Created by OnTracingSetup().
   return inproc_shmem_arbiter_.get();
 }
 
 std::unique_ptr<TraceWriter>
-ServiceImpl::ProducerEndpointImpl::CreateTraceWriter(BufferID buf_id) {
-  PERFETTO_DCHECK_THREAD(thread_checker_);
-  return GetOrCreateShmemArbiter()->CreateTraceWriter(buf_id);
+ServiceImpl::ProducerEndpointImpl::CreateTraceWriter(
+    BufferID buf_id,
+    BufferExhaustedPolicy buffer_exhausted_policy) {
+  // Like ProducerIPCClientImpl::CreateTraceWriter(), this can be called from
+  // any thread (e.g. by TraceEventSource). The arbiter is thread-safe.
+  return GetInProcessShmemArbiter()->CreateTraceWriter(buf_id,
+                                                      buffer_exhausted_policy);
 }
 
 void ServiceImpl::ProducerEndpointImpl::OnTracingSetup() {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  // The arbiter binds to the thread it's created on to post its tasks. Create
+  // it here rather than lazily, as the first TraceWriter can be created on any
+  // thread.
+  {
+    std::lock_guard<std::mutex> scoped_lock(inproc_shmem_arbiter_lock_);
+    PERFETTO_DCHECK(!inproc_shmem_arbiter_);
+    inproc_shmem_arbiter_.reset(new SharedMemoryArbiterImpl(
+        shared_memory_->start(), shared_memory_->size(),
+        shared_buffer_page_size_kb_ * 1024, this, task_runner_,
+        shared_memory_options()));
+  }
   auto weak_this = weak_ptr_factory_.GetWeakPtr();
   task_runner_->PostTask([weak_this] {
     if (weak_this)
@@ -1376,7 +2246,7 @@ void ServiceImpl::ProducerEndpointImpl::CreateDataSourceInstance(
 
 void ServiceImpl::ProducerEndpointImpl::NotifyFlushComplete(FlushRequestID id) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
-  return GetOrCreateShmemArbiter()->NotifyFlushComplete(id);
+  return GetInProcessShmemArbiter()->NotifyFlushComplete(id);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
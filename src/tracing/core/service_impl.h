@@ -18,8 +18,10 @@
 #define SRC_TRACING_CORE_SERVICE_IMPL_H_
 
 #include <functional>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 
 #include "gtest/gtest_prod.h"
@@ -33,7 +35,10 @@
 #include "perfetto/tracing/core/service.h"
 #include "perfetto/tracing/core/shared_memory_abi.h"
 #include "perfetto/tracing/core/trace_config.h"
+#include "src/tracing/core/commit_ring.h"
+#include "src/tracing/core/data_plane.h"
 #include "src/tracing/core/id_allocator.h"
+#include "src/tracing/core/trace_buffer.h"
 
 namespace perfetto {
 
@@ -46,7 +51,6 @@ class DataSourceConfig;
 class Producer;
 class SharedMemory;
 class SharedMemoryArbiterImpl;
-class TraceBuffer;
 class TraceConfig;
 class TracePacket;
 
@@ -71,9 +75,15 @@ class ServiceImpl : public Service {
     void RegisterDataSource(const DataSourceDescriptor&) override;
     void UnregisterDataSource(const std::string& name) override;
     void CommitData(const CommitDataRequest&, CommitDataCallback) override;
-    void SetSharedMemory(std::unique_ptr<SharedMemory>);
 
-    std::unique_ptr<TraceWriter> CreateTraceWriter(BufferID) override;
+    // If |use_commit_ring| is true, the last page of |shared_memory| is
+    // reserved for the CommitRing.
+    void SetSharedMemory(std::unique_ptr<SharedMemory>,
+                         bool use_commit_ring = false);
+
+    std::unique_ptr<TraceWriter> CreateTraceWriter(
+        BufferID,
+        BufferExhaustedPolicy) override;
     void OnTracingSetup();
     void Flush(FlushRequestID, const std::vector<DataSourceInstanceID>&);
     void CreateDataSourceInstance(DataSourceInstanceID,
@@ -82,13 +92,37 @@ class ServiceImpl : public Service {
     void TearDownDataSource(DataSourceInstanceID);
     SharedMemory* shared_memory() const override;
     size_t shared_buffer_page_size_kb() const override;
+    SharedMemoryOptions shared_memory_options() const override;
 
    private:
     friend class ServiceImpl;
     friend class ServiceImplTest;
     ProducerEndpointImpl(const ProducerEndpointImpl&) = delete;
     ProducerEndpointImpl& operator=(const ProducerEndpointImpl&) = delete;
-    SharedMemoryArbiterImpl* GetOrCreateShmemArbiter();
+    SharedMemoryArbiterImpl* GetInProcessShmemArbiter();
+
+    // Moves the chunk at the given (untrusted) position in the SMB into the
+    // |buffer_id| trace buffer and marks it free.
+    void MoveChunkToTraceBuffer(uint32_t page_idx,
+                                uint32_t chunk_idx,
+                                BufferID buffer_id);
+
+    // Moves the chunks enqueued in |commit_ring_|, stopping at |stop_idx|
+    // (untrusted). An out of range |stop_idx| drains the whole ring.
+    void DrainCommitRing(uint32_t stop_idx = kDrainWholeCommitRing);
+
+    static constexpr uint32_t kDrainWholeCommitRing =
+        std::numeric_limits<uint32_t>::max();
+
+    // Moves all the complete chunks in the SMB that belong to writers whose
+    // target buffer is known, without waiting for the producer to commit them.
+    // Used only if |smb_scan_period_ms_| > 0.
+    void ScanSharedMemory();
+    void PeriodicScanSharedMemoryTask();
+
+    // Posts a PeriodicScanSharedMemoryTask(), unless one is pending already or
+    // there are no writers to scan for.
+    void MaybePostPeriodicScanTask();
 
     ProducerID const id_;
     const uid_t uid_;
@@ -98,10 +132,26 @@ class ServiceImpl : public Service {
     std::unique_ptr<SharedMemory> shared_memory_;
     size_t shared_buffer_page_size_kb_ = 0;
     SharedMemoryABI shmem_abi_;
+    CommitRing commit_ring_;  // Invalid if not reserved in the SMB.
+
+    // See TraceConfig.ProducerConfig.smb_scan_period_ms. 0 if disabled.
+    uint32_t smb_scan_period_ms_ = 0;
+
+    // See TraceConfig.ProducerConfig.commit_max_latency_ms & co.
+    CommitPolicy commit_policy_;
+
+    // Learnt from the chunks committed explicitly. Used by ScanSharedMemory().
+    // An entry is erased when the producer releases the writer or when the
+    // target buffer is freed.
+    std::map<WriterID, BufferID> writer_target_buffers_;
+    bool scan_task_pending_ = false;
     size_t shmem_size_hint_bytes_ = 0;
     const std::string name_;
 
-    // This is used only in in-process configurations (mostly tests).
+    // This is used only in in-process configurations (mostly tests). Created
+    // by OnTracingSetup(). Guarded by |inproc_shmem_arbiter_lock_|, as the
+    // TraceWriter(s) can be created from any thread.
+    std::mutex inproc_shmem_arbiter_lock_;
     std::unique_ptr<SharedMemoryArbiterImpl> inproc_shmem_arbiter_;
     PERFETTO_THREAD_CHECKER(thread_checker_)
     base::WeakPtrFactory<ProducerEndpointImpl> weak_ptr_factory_;  // Keep last.
@@ -120,6 +170,7 @@ class ServiceImpl : public Service {
     void EnableTracing(const TraceConfig&, base::ScopedFile) override;
     void DisableTracing() override;
     void ReadBuffers() override;
+    void ReadBuffersSnapshot() override;
     void FreeBuffers() override;
     void Flush(uint32_t timeout_ms, FlushCallback) override;
 
@@ -144,6 +195,9 @@ class ServiceImpl : public Service {
   void DisconnectProducer(ProducerID);
   void RegisterDataSource(ProducerID, const DataSourceDescriptor&);
   void UnregisterDataSource(ProducerID, const std::string& name);
+  // Copies the payload of |chunk|, acquired for reading from |abi|, into the
+  // |buffer_id| trace buffer and then marks it free. With data plane threads,
+  // this happens asynchronously on the thread that owns the buffer.
   void CopyProducerPageIntoLogBuffer(ProducerID,
                                      uid_t,
                                      WriterID,
@@ -151,10 +205,16 @@ class ServiceImpl : public Service {
                                      BufferID,
                                      uint16_t num_fragments,
                                      uint8_t chunk_flags,
-                                     const uint8_t* src,
-                                     size_t size);
+                                     SharedMemoryABI* abi,
+                                     SharedMemoryABI::Chunk chunk);
+  // Called when the kDiscard buffer |buffer_id| becomes full. Disables its
+  // tracing session if all of the session's buffers are full and the session
+  // asked for that (TraceConfig.stop_when_buffers_full).
+  void OnBufferFull(BufferID buffer_id);
   void ApplyChunkPatches(ProducerID,
                          const std::vector<CommitDataRequest::ChunkToPatch>&);
+  void ApplyPackedChunkPatches(ProducerID,
+                               const std::string& packed_chunks_to_patch);
   void NotifyFlushDoneForProducer(ProducerID, FlushRequestID);
 
   // Called by ConsumerEndpointImpl.
@@ -168,6 +228,7 @@ class ServiceImpl : public Service {
              ConsumerEndpoint::FlushCallback);
   void FlushAndDisableTracing(TracingSessionID);
   void ReadBuffers(TracingSessionID, ConsumerEndpointImpl*);
+  void ReadBuffersSnapshot(TracingSessionID, ConsumerEndpointImpl*);
   void FreeBuffers(TracingSessionID);
 
   // Service implementation.
@@ -180,6 +241,10 @@ class ServiceImpl : public Service {
   std::unique_ptr<Service::ConsumerEndpoint> ConnectConsumer(
       Consumer*) override;
 
+  void SetDataPlaneThreads(size_t num_threads) override;
+  void SetTracingSessionLimits(size_t max_sessions,
+                               size_t max_total_buffer_size_kb) override;
+
   // Exposed mainly for testing.
   size_t num_producers() const { return producers_.size(); }
   ProducerEndpointImpl* GetProducer(ProducerID) const;
@@ -187,6 +252,17 @@ class ServiceImpl : public Service {
  private:
   friend class ServiceImplTest;
 
+  // A trace buffer and the lock that serializes the accesses to it from the
+  // service's thread and from the data plane thread that owns it, if any.
+  struct BufferShard {
+    BufferShard(BufferID i, std::unique_ptr<TraceBuffer> b)
+        : id(i), buffer(std::move(b)) {}
+
+    const BufferID id;
+    std::mutex lock;
+    std::unique_ptr<TraceBuffer> buffer;
+  };
+
   struct RegisteredDataSource {
     ProducerID producer_id;
     DataSourceDescriptor descriptor;
@@ -196,6 +272,35 @@ class ServiceImpl : public Service {
   struct DataSourceInstance {
     DataSourceInstanceID instance_id;
     std::string data_source_name;
+
+    // The key of |shared_instances_| if the instance is shared with other
+    // tracing sessions, 0 otherwise.
+    BufferID shared_routing_id;
+  };
+
+  struct TracingSession;
+
+  // A data source instance shared by several tracing sessions (see
+  // TraceConfig.DataSource.share_instance). The producer writes into
+  // |routing_id|, a BufferID without a TraceBuffer behind it, and the service
+  // copies each chunk into the buffers of all the sessions that share it.
+  struct SharedDataSourceInstance {
+    ProducerID producer_id;
+    DataSourceInstanceID instance_id;
+    std::string data_source_name;
+
+    // The serialized DataSourceConfig, without the per-session fields. Only
+    // sessions asking for the same config can share the instance.
+    std::string config_key;
+
+    // The buffers of the sessions currently sharing the instance.
+    std::vector<BufferShard*> target_shards;
+
+    // Set when the last session sharing the instance has detached from it.
+    // The data source is being torn down and the chunks it flushes on stop
+    // still go to the buffers of that session. |routing_id| stays reserved
+    // until those buffers are freed, and no other session can join.
+    TracingSession* detached_session = nullptr;
   };
 
   struct PendingFlush {
@@ -237,12 +342,25 @@ class ServiceImpl : public Service {
     // many entries as |config.buffers_size()|.
     std::vector<BufferID> buffers_index;
 
+    // The sum of the sizes of the buffers above, accounted against the limit
+    // set by SetTracingSessionLimits().
+    size_t total_buffer_size_kb = 0;
+
+    // Read-only copies of the buffers above, taken by ReadBuffersSnapshot()
+    // and drained by ReadSnapshotBuffers(). ReadBuffers() keeps reading the
+    // live buffers meanwhile. They are destroyed as soon as they have been
+    // fully read.
+    std::vector<std::unique_ptr<TraceBuffer>> snapshot_buffers;
+
     // When the last clock snapshot was emitted into the output stream.
     base::TimeMillis last_clock_snapshot = {};
 
     // When the last TraceStats snapshot was emitted into the output stream.
     base::TimeMillis last_stats_snapshot = {};
 
+    // The value of ServiceImpl::commit_requests_ at |last_stats_snapshot|.
+    uint64_t commit_requests_at_last_snapshot = 0;
+
     // Whether we mirrored the trace config back to the trace output yet.
     bool did_emit_config = false;
 
@@ -273,15 +391,114 @@ class ServiceImpl : public Service {
   // session doesn't exists.
   TracingSession* GetTracingSession(TracingSessionID);
 
+  // Returns the TracePacket.trusted_packet_sequence_id of the packets written
+  // by the given writer, assigning a new one the first time.
+  uint32_t GetPacketSequenceID(ProducerID, WriterID);
+
+  // Forgets the packet sequence IDs of a writer, or of all the writers of the
+  // producer if |writer_id| is 0, once the trace buffers that might still
+  // contain their packets have been freed (see FreeBufferID()). Until then
+  // the packets read keep the ID of their sequence.
+  void RetirePacketSequences(ProducerID,
+                             WriterID writer_id,
+                             std::set<BufferID> buffers);
+
   // Update the memory guard rail by using the latest information from the
   // shared memory and trace buffers.
   void UpdateMemoryGuardrail();
 
+  // Reads the packets of |tbuf| into |packets|, appending the trusted fields
+  // to each, until |*packets_bytes| reaches |max_packets_bytes|. Returns true
+  // if it stopped because of that, false if the buffer has been fully read.
+  bool ReadTraceBuffer(TraceBuffer* tbuf,
+                       size_t max_packets_bytes,
+                       std::vector<TracePacket>* packets,
+                       size_t* packets_bytes,
+                       size_t* total_slices);
+
+  // Sends the contents of the TracingSession.snapshot_buffers to |consumer|,
+  // reposting itself until they are fully read.
+  void ReadSnapshotBuffers(TracingSessionID,
+                           ConsumerEndpointImpl*,
+                           bool is_first_read);
+
+  // The Maybe* variants emit the packet periodically into the ReadBuffers()
+  // stream. The others emit it unconditionally, e.g. for a snapshot.
   void MaybeSnapshotClocks(TracingSession*, std::vector<TracePacket>*);
   void MaybeEmitTraceConfig(TracingSession*, std::vector<TracePacket>*);
   void MaybeSnapshotStats(TracingSession*, std::vector<TracePacket>*);
+  void SnapshotClocks(std::vector<TracePacket>*);
+  void EmitTraceConfig(TracingSession*, std::vector<TracePacket>*);
+  // |last_snapshot| is used to compute the rates, if not zero.
+  void SnapshotStats(TracingSession*,
+                     base::TimeMillis last_snapshot,
+                     std::vector<TracePacket>*);
   void OnFlushTimeout(TracingSessionID, FlushRequestID);
-  TraceBuffer* GetBufferByID(BufferID);
+  void OnFlushDoneForProducer(ProducerID, FlushRequestID);
+
+  BufferShard* GetBufferByID(BufferID);
+
+  // Returns the shared instance that |producer_id| writes into |routing_id|,
+  // or nullptr if |routing_id| isn't one of its shared instances.
+  SharedDataSourceInstance* GetSharedInstance(ProducerID, BufferID routing_id);
+
+  // Returns the buffers that the chunks written by |producer_id| into
+  // |target_buffer| are copied into: the buffer itself or, for a shared data
+  // source instance, the buffers of all the sessions that share it. Empty if
+  // |target_buffer| is not valid for the producer.
+  std::vector<BufferShard*> GetTargetShards(ProducerID,
+                                            BufferID target_buffer);
+
+  // Removes the buffers of |tracing_session| from the shared instance. Returns
+  // true if no other session uses it anymore, in which case the caller must
+  // tear it down. The instance is forgotten by FreeBuffers(), see
+  // SharedDataSourceInstance::detached_session.
+  bool DetachSharedInstance(BufferID routing_id, TracingSession*);
+
+  // Frees a trace buffer or routing ID and makes the producers forget the
+  // writers that target it, so that a later reuse of the ID doesn't route
+  // their chunks to another session.
+  void FreeBufferID(BufferID);
+
+  // A chunk acquired for reading from the SMB of a producer, to be copied into
+  // a trace buffer.
+  struct ChunkToCopy {
+    ProducerID producer_id;
+    uid_t producer_uid;
+    WriterID writer_id;
+    ChunkID chunk_id;
+    uint16_t num_fragments;
+    uint8_t chunk_flags;
+    SharedMemoryABI* abi;
+    SharedMemoryABI::Chunk chunk;
+  };
+
+  // Copies |chunks| into the buffers of |shards| and marks them free in their
+  // SMB. Appends to |buffers_became_full| the buffers that have become full
+  // with these chunks (see OnBufferFull()). Can run on any thread.
+  static void MoveChunksIntoShards(BufferShard* const* shards,
+                                   size_t num_shards,
+                                   ChunkToCopy* chunks,
+                                   size_t num_chunks,
+                                   std::vector<BufferID>* buffers_became_full);
+
+  // Posts the |pending_copies_| to the data plane.
+  void PostPendingCopies();
+
+  // Blocks until all the copies and patches posted to the data plane so far,
+  // and the pending ones, have been applied. No-op without data plane threads.
+  void WaitForDataPlane();
+
+  // Applies the patches to the buffers that |target_buffer| maps to (see
+  // GetTargetShards()), after any chunk copy still pending on the data plane
+  // thread that owns it.
+  void PatchChunk(ProducerID,
+                  BufferID target_buffer,
+                  WriterID,
+                  ChunkID,
+                  const TraceBuffer::Patch* patches,
+                  size_t num_patches,
+                  bool other_patches_pending);
 
   base::TaskRunner* const task_runner_;
   std::unique_ptr<SharedMemory::Factory> shm_factory_;
@@ -289,6 +506,7 @@ class ServiceImpl : public Service {
   DataSourceInstanceID last_data_source_instance_id_ = 0;
   TracingSessionID last_tracing_session_id_ = 0;
   FlushRequestID last_flush_request_id_ = 0;
+  uint32_t last_packet_sequence_id_ = 0;
   uid_t uid_ = 0;
 
   // Buffer IDs are global across all consumers (because a Producer can produce
@@ -299,9 +517,31 @@ class ServiceImpl : public Service {
   std::map<ProducerID, ProducerEndpointImpl*> producers_;
   std::set<ConsumerEndpointImpl*> consumers_;
   std::map<TracingSessionID, TracingSession> tracing_sessions_;
-  std::map<BufferID, std::unique_ptr<TraceBuffer>> buffers_;
+  std::map<BufferID, std::unique_ptr<BufferShard>> buffers_;
+  std::map<BufferID /*routing_id*/, SharedDataSourceInstance>
+      shared_instances_;
+  std::map<std::pair<ProducerID, WriterID>, uint32_t> packet_sequence_ids_;
+
+  // The sequences whose writer (or producer, for WriterID 0) has gone away,
+  // with the buffers that might still contain their packets.
+  std::map<std::pair<ProducerID, WriterID>, std::set<BufferID>>
+      retired_packet_sequences_;
 
   bool lockdown_mode_ = false;
+  size_t max_tracing_sessions_ = kDefaultMaxTracingSessions;
+  size_t max_total_buffer_size_kb_ = 0;
+
+  // Reported in TraceStats.
+  uint64_t commit_requests_ = 0;
+  uint64_t chunks_committed_ = 0;
+
+  // Null unless SetDataPlaneThreads() has been called. Declared after
+  // |buffers_|, so that its threads are joined before the buffers go away.
+  std::unique_ptr<DataPlane> data_plane_;
+
+  // The chunks moved by the current CommitData() request, per target buffer.
+  // Used only with |data_plane_|.
+  std::map<BufferID, std::vector<ChunkToCopy>> pending_copies_;
 
   PERFETTO_THREAD_CHECKER(thread_checker_)
 
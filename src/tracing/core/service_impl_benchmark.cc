@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "perfetto/base/logging.h"
+#include "perfetto/base/page_allocator.h"
+#include "perfetto/base/task_runner.h"
+#include "perfetto/tracing/core/commit_data_request.h"
+#include "perfetto/tracing/core/consumer.h"
+#include "perfetto/tracing/core/data_source_config.h"
+#include "perfetto/tracing/core/data_source_descriptor.h"
+#include "perfetto/tracing/core/producer.h"
+#include "perfetto/tracing/core/shared_memory.h"
+#include "perfetto/tracing/core/shared_memory_abi.h"
+#include "perfetto/tracing/core/trace_config.h"
+#include "perfetto/tracing/core/trace_packet.h"
+#include "src/tracing/core/service_impl.h"
+
+namespace perfetto {
+namespace {
+
+// Chunks are filled with packets of 128 bytes, as in trace_buffer_benchmark.cc.
+constexpr size_t kPacketSize = 128;
+constexpr uint16_t kPacketsPerChunk = 31;
+
+// Queues the tasks until RunPendingTasks() is called. The data plane threads
+// post tasks too, hence the lock.
+class QueueTaskRunner : public base::TaskRunner {
+ public:
+  void PostTask(std::function<void()> task) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  void PostDelayedTask(std::function<void()> task, uint32_t) override {
+    PostTask(std::move(task));
+  }
+  void AddFileDescriptorWatch(int, std::function<void()>) override {}
+  void RemoveFileDescriptorWatch(int) override {}
+
+  void RunPendingTasks() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tasks_.empty())
+          return;
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  std::deque<std::function<void()>> tasks_;
+};
+
+class HeapSharedMemory : public SharedMemory {
+ public:
+  class Factory : public SharedMemory::Factory {
+   public:
+    std::unique_ptr<SharedMemory> CreateSharedMemory(size_t size) override {
+      return std::unique_ptr<SharedMemory>(new HeapSharedMemory(size));
+    }
+  };
+
+  explicit HeapSharedMemory(size_t size)
+      : mem_(base::PageAllocator::Allocate(size)), size_(size) {}
+  void* start() const override { return mem_.get(); }
+  size_t size() const override { return size_; }
+
+ private:
+  base::PageAllocator::UniquePtr mem_;
+  const size_t size_;
+};
+
+class FakeConsumer : public Consumer {
+ public:
+  void OnConnect() override {}
+  void OnDisconnect() override {}
+  void OnTracingDisabled() override {}
+  void OnTraceData(std::vector<TracePacket>, bool) override {}
+};
+
+// Writes straight into the SMB with the SharedMemoryABI, without going through
+// a TraceWriter, so that the benchmark measures only the service side.
+class FakeProducer : public Producer {
+ public:
+  void OnConnect() override {}
+  void OnDisconnect() override {}
+  void CreateDataSourceInstance(DataSourceInstanceID,
+                                const DataSourceConfig& cfg) override {
+    target_buffer = static_cast<BufferID>(cfg.target_buffer());
+  }
+  void TearDownDataSourceInstance(DataSourceInstanceID) override {}
+  void OnTracingSetup() override {}
+  void Flush(FlushRequestID, const DataSourceInstanceID*, size_t) override {}
+
+  // Fills all the pages of the SMB with one chunk each and commits them in a
+  // single request. Waits for the service to free each chunk first, as a real
+  // producer would stall when the SMB is full.
+  void WriteAndCommitChunks(const std::vector<uint8_t>& payload) {
+    if (!abi.is_valid()) {
+      SharedMemory* shm = endpoint->shared_memory();
+      abi.Initialize(reinterpret_cast<uint8_t*>(shm->start()), shm->size(),
+                     endpoint->shared_buffer_page_size_kb() * 1024);
+    }
+    CommitDataRequest req;
+    for (size_t page_idx = 0; page_idx < abi.num_pages(); page_idx++) {
+      SharedMemoryABI::ChunkHeader header{};
+      header.writer_id.store(1, std::memory_order_relaxed);
+      header.chunk_id.store(next_chunk_id++, std::memory_order_relaxed);
+      header.packets.store({kPacketsPerChunk, 0}, std::memory_order_relaxed);
+      SharedMemoryABI::Chunk chunk;
+      for (;;) {
+        if (abi.is_page_free(page_idx))
+          abi.TryPartitionPage(page_idx, SharedMemoryABI::kPageDiv1);
+        chunk = abi.TryAcquireChunkForWriting(page_idx, 0, &header);
+        if (chunk.is_valid())
+          break;
+        std::this_thread::yield();
+      }
+      PERFETTO_CHECK(chunk.payload_size() >= payload.size());
+      memcpy(chunk.payload_begin(), payload.data(), payload.size());
+      abi.ReleaseChunkAsComplete(std::move(chunk));
+      auto* chunk_to_move = req.add_chunks_to_move();
+      chunk_to_move->set_page(static_cast<uint32_t>(page_idx));
+      chunk_to_move->set_chunk(0);
+      chunk_to_move->set_target_buffer(target_buffer);
+    }
+    endpoint->CommitData(req, nullptr);
+  }
+
+  std::unique_ptr<Service::ProducerEndpoint> endpoint;
+  BufferID target_buffer = 0;
+  SharedMemoryABI abi;
+  ChunkID next_chunk_id = 0;
+};
+
+// Args: {number of producers, number of buffers, data plane threads}.
+// Measures the throughput of the chunk copies when N producers, spread evenly
+// across M trace buffers, commit their SMB in full at each iteration.
+// 0 data plane threads means that the copies happen inline, on the service's
+// thread.
+void BM_ServiceImpl_CommitData(benchmark::State& state) {
+  const size_t num_producers = static_cast<size_t>(state.range(0));
+  const size_t num_buffers = static_cast<size_t>(state.range(1));
+  const size_t data_plane_threads = static_cast<size_t>(state.range(2));
+
+  QueueTaskRunner task_runner;
+  std::unique_ptr<ServiceImpl> svc(static_cast<ServiceImpl*>(
+      Service::CreateInstance(
+          std::unique_ptr<SharedMemory::Factory>(new HeapSharedMemory::Factory),
+          &task_runner)
+          .release()));
+  svc->SetDataPlaneThreads(data_plane_threads);
+
+  TraceConfig trace_config;
+  for (size_t i = 0; i < num_buffers; i++)
+    trace_config.add_buffers()->set_size_kb(16 * 1024);
+  std::vector<std::unique_ptr<FakeProducer>> producers;
+  for (size_t i = 0; i < num_producers; i++) {
+    const std::string name = "data_source_" + std::to_string(i);
+    producers.emplace_back(new FakeProducer());
+    FakeProducer* producer = producers.back().get();
+    producer->endpoint = svc->ConnectProducer(producer, 0 /*uid*/, name);
+    DataSourceDescriptor descriptor;
+    descriptor.set_name(name);
+    producer->endpoint->RegisterDataSource(descriptor);
+    auto* ds_config = trace_config.add_data_sources()->mutable_config();
+    ds_config->set_name(name);
+    ds_config->set_target_buffer(static_cast<uint32_t>(i % num_buffers));
+  }
+
+  FakeConsumer consumer;
+  std::unique_ptr<Service::ConsumerEndpoint> consumer_endpoint =
+      svc->ConnectConsumer(&consumer);
+  consumer_endpoint->EnableTracing(trace_config, base::ScopedFile());
+  task_runner.RunPendingTasks();
+
+  std::vector<uint8_t> payload(kPacketSize * kPacketsPerChunk);
+  for (size_t i = 0; i < kPacketsPerChunk; i++) {
+    uint8_t* packet = &payload[i * kPacketSize];
+    packet[0] = kPacketSize - 1;
+    memset(packet + 1, static_cast<int>('a' + i), kPacketSize - 1);
+  }
+
+  uint64_t chunks = 0;
+  while (state.KeepRunning()) {
+    for (auto& producer : producers) {
+      producer->WriteAndCommitChunks(payload);
+      chunks += producer->abi.num_pages();
+    }
+    task_runner.RunPendingTasks();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(chunks));
+  state.SetBytesProcessed(static_cast<int64_t>(chunks * payload.size()));
+
+  consumer_endpoint->FreeBuffers();
+  producers.clear();
+  consumer_endpoint.reset();
+  task_runner.RunPendingTasks();
+}
+
+}  // namespace
+
+BENCHMARK(BM_ServiceImpl_CommitData)
+    ->Args({1, 1, 0})
+    ->Args({4, 1, 0})
+    ->Args({4, 1, 2})
+    ->Args({4, 4, 0})
+    ->Args({4, 4, 2})
+    ->Args({4, 4, 4})
+    ->Args({8, 8, 0})
+    ->Args({8, 8, 4})
+    ->UseRealTime();
+
+}  // namespace perfetto
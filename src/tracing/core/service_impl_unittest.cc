@@ -18,6 +18,10 @@
 
 #include <string.h>
 
+#include <map>
+#include <thread>
+#include <vector>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "perfetto/base/file_utils.h"
@@ -42,6 +46,7 @@
 
 using ::testing::_;
 using ::testing::Contains;
+using ::testing::ElementsAre;
 using ::testing::ElementsAreArray;
 using ::testing::Eq;
 using ::testing::InSequence;
@@ -84,6 +89,12 @@ class ServiceImplTest : public testing::Test {
     return svc->GetProducer(producer_id)->uid_;
   }
 
+  size_t GetNumScannedWriters(ProducerID producer_id) {
+    return svc->GetProducer(producer_id)->writer_target_buffers_.size();
+  }
+
+  size_t GetNumPacketSequences() { return svc->packet_sequence_ids_.size(); }
+
   size_t GetNumPendingFlushes() {
     ServiceImpl::TracingSession* tracing_session =
         svc->GetTracingSession(svc->last_tracing_session_id_);
@@ -282,7 +293,7 @@ TEST_F(ServiceImplTest, WriteIntoFileAndStopOnMaxSize) {
   ds_config->set_target_buffer(0);
   trace_config.set_write_into_file(true);
   trace_config.set_file_write_period_ms(1);
-  const uint64_t kMaxFileSize = 512;
+  const uint64_t kMaxFileSize = 1024;
   trace_config.set_max_file_size_bytes(kMaxFileSize);
   base::TempFile tmp_file = base::TempFile::Create();
   consumer->EnableTracing(trace_config, base::ScopedFile(dup(tmp_file.fd())));
@@ -429,6 +440,43 @@ TEST_F(ServiceImplTest, ExplicitFlush) {
                         Property(&protos::TestEvent::str, Eq("payload")))));
 }
 
+// In-process producers can create their TraceWriter(s) on any thread. The
+// commits must still reach the service on its own thread.
+TEST_F(ServiceImplTest, CreateTraceWriterOnOtherThread) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  trace_config.add_data_sources()->mutable_config()->set_name("data_source");
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceStart("data_source");
+
+  const BufferID buf_id =
+      producer->GetDataSourceInstance("data_source")->target_buffer;
+  Service::ProducerEndpoint* endpoint = producer->endpoint();
+  std::thread writer_thread([endpoint, buf_id] {
+    std::unique_ptr<TraceWriter> writer = endpoint->CreateTraceWriter(buf_id);
+    writer->NewTracePacket()->set_for_testing()->set_str("payload");
+    writer->Flush();
+  });
+  writer_thread.join();
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+  EXPECT_THAT(
+      consumer->ReadBuffers(),
+      Contains(Property(&protos::TracePacket::for_testing,
+                        Property(&protos::TestEvent::str, Eq("payload")))));
+}
+
 TEST_F(ServiceImplTest, ImplicitFlushOnTimedTraces) {
   std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
   consumer->Connect(svc.get());
@@ -527,4 +575,652 @@ TEST_F(ServiceImplTest, BatchFlushes) {
                         Property(&protos::TestEvent::str, Eq("payload")))));
 }
 
+// Tests that ReadBuffersSnapshot() doesn't consume the contents of the buffers
+// and that the tracing session can keep writing into them in the meantime.
+TEST_F(ServiceImplTest, ReadBuffersSnapshot) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("data_source");
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceStart("data_source");
+
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  {
+    auto tp = writer->NewTracePacket();
+    tp->set_for_testing()->set_str("payload1");
+  }
+  auto flush_request = consumer->Flush();
+  producer->WaitForFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  auto payload = [](const char* str) {
+    return Property(&protos::TracePacket::for_testing,
+                    Property(&protos::TestEvent::str, Eq(str)));
+  };
+  auto snapshot = consumer->ReadBuffersSnapshot();
+  EXPECT_THAT(snapshot, Contains(payload("payload1")));
+  EXPECT_THAT(snapshot, Contains(Property(&protos::TracePacket::has_trace_config,
+                                          Eq(true))));
+
+  {
+    auto tp = writer->NewTracePacket();
+    tp->set_for_testing()->set_str("payload2");
+  }
+  flush_request = consumer->Flush();
+  producer->WaitForFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  // The snapshot didn't consume "payload1".
+  snapshot = consumer->ReadBuffersSnapshot();
+  EXPECT_THAT(snapshot, Contains(payload("payload1")));
+  EXPECT_THAT(snapshot, Contains(payload("payload2")));
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+  auto packets = consumer->ReadBuffers();
+  EXPECT_THAT(packets, Contains(payload("payload1")));
+  EXPECT_THAT(packets, Contains(payload("payload2")));
+  EXPECT_THAT(packets, Contains(Property(&protos::TracePacket::has_trace_config,
+                                         Eq(true))));
+}
+
+// A snapshot that takes more than one task to be read must not be drained by
+// the ReadBuffers() calls made in the meantime, which read the live buffers.
+TEST_F(ServiceImplTest, ReadBuffersWhileReadingSnapshot) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(512);
+  trace_config.add_data_sources()->mutable_config()->set_name("data_source");
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceStart("data_source");
+
+  static constexpr size_t kNumPackets = 64;
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  auto payload = [](size_t i) {
+    return std::to_string(i) + std::string(1024, '.');
+  };
+  for (size_t i = 0; i < kNumPackets; i++)
+    writer->NewTracePacket()->set_for_testing()->set_str(payload(i).c_str());
+  auto flush_request = consumer->Flush();
+  producer->WaitForFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  // The payloads of the for_testing packets passed to each OnTraceData().
+  std::vector<std::vector<std::string>> reads;
+  int num_reads_done = 0;
+  auto reads_done = task_runner.CreateCheckpoint("reads_done");
+  EXPECT_CALL(*consumer, OnTraceData(_, _))
+      .WillRepeatedly(Invoke([&reads, &num_reads_done, reads_done](
+                                 std::vector<TracePacket>* packets,
+                                 bool has_more) {
+        reads.emplace_back();
+        for (TracePacket& packet : *packets) {
+          protos::TracePacket decoded_packet;
+          packet.Decode(&decoded_packet);
+          if (decoded_packet.has_for_testing())
+            reads.back().push_back(decoded_packet.for_testing().str());
+        }
+        if (!has_more && ++num_reads_done == 2)
+          reads_done();
+      }));
+
+  // Both calls send their first batch of packets straight away.
+  consumer->endpoint()->ReadBuffersSnapshot();
+  consumer->endpoint()->ReadBuffers();
+  ASSERT_EQ(2u, reads.size());
+  ASSERT_FALSE(reads[0].empty());
+  ASSERT_FALSE(reads[1].empty());
+  EXPECT_EQ(payload(0), reads[0].front());
+  EXPECT_EQ(payload(0), reads[1].front());
+  task_runner.RunUntilCheckpoint("reads_done");
+
+  std::map<std::string, int> payload_counts;
+  for (const auto& read : reads) {
+    for (const std::string& str : read)
+      payload_counts[str]++;
+  }
+  // Each packet is read once from the snapshot and once from the live buffer.
+  EXPECT_EQ(kNumPackets, payload_counts.size());
+  for (const auto& payload_and_count : payload_counts)
+    EXPECT_EQ(2, payload_and_count.second);
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+}
+
+TEST_F(ServiceImplTest, StopWhenBuffersFull) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  auto* buffer_config = trace_config.add_buffers();
+  buffer_config->set_size_kb(16);
+  buffer_config->set_fill_policy(TraceConfig::BufferConfig::DISCARD);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("data_source");
+  trace_config.set_stop_when_buffers_full(true);
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceStart("data_source");
+
+  // Writes twice the size of the buffer. The service disables tracing on its
+  // own once the buffer is full.
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  const size_t kNumPackets = 32;
+  for (size_t i = 0; i < kNumPackets; i++) {
+    const std::string payload(1024, static_cast<char>('a' + i % 26));
+    writer->NewTracePacket()->set_for_testing()->set_str(payload.data(),
+                                                         payload.size());
+  }
+  writer->Flush();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+
+  // Only the oldest packets have been preserved.
+  std::vector<std::string> payloads;
+  for (const auto& packet : consumer->ReadBuffers()) {
+    if (packet.has_for_testing())
+      payloads.push_back(packet.for_testing().str());
+  }
+  ASSERT_GT(payloads.size(), 0u);
+  EXPECT_LT(payloads.size(), kNumPackets);
+  for (size_t i = 0; i < payloads.size(); i++)
+    EXPECT_EQ(std::string(1024, static_cast<char>('a' + i)), payloads[i]);
+}
+
+TEST_F(ServiceImplTest, CommitRing) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("data_source");
+  auto* producer_config = trace_config.add_producers();
+  producer_config->set_producer_name("mock_producer");
+  producer_config->set_use_commit_ring(true);
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceStart("data_source");
+  ASSERT_TRUE(producer->endpoint()->shared_memory_options().use_commit_ring);
+
+  // Write enough packets to go through several chunks.
+  static constexpr size_t kNumPackets = 500;
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  for (size_t i = 0; i < kNumPackets; i++) {
+    std::string payload = "payload_" + std::to_string(i);
+    writer->NewTracePacket()->set_for_testing()->set_str(payload.c_str());
+  }
+  auto flush_request = consumer->Flush();
+  producer->WaitForFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+  auto packets = consumer->ReadBuffers();
+  size_t num_test_packets = 0;
+  for (const auto& packet : packets) {
+    if (!packet.has_for_testing())
+      continue;
+    EXPECT_EQ("payload_" + std::to_string(num_test_packets++),
+              packet.for_testing().str());
+  }
+  EXPECT_EQ(kNumPackets, num_test_packets);
+}
+
+TEST_F(ServiceImplTest, SmbScanning) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  static constexpr uint32_t kScanPeriodMs = 1;
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("data_source");
+  auto* producer_config = trace_config.add_producers();
+  producer_config->set_producer_name("mock_producer");
+  producer_config->set_smb_scan_period_ms(kScanPeriodMs);
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceStart("data_source");
+  ASSERT_TRUE(producer->endpoint()->shared_memory_options().service_scans_smb);
+
+  static constexpr size_t kNumPackets = 500;
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  for (size_t i = 0; i < kNumPackets; i++) {
+    std::string payload = "payload_" + std::to_string(i);
+    writer->NewTracePacket()->set_for_testing()->set_str(payload.c_str());
+  }
+
+  // The periodic scan should move the completed chunks, without any flush.
+  auto scanned = task_runner.CreateCheckpoint("scanned");
+  task_runner.PostDelayedTask(scanned, kScanPeriodMs * 10);
+  task_runner.RunUntilCheckpoint("scanned");
+  size_t num_test_packets = 0;
+  for (const auto& packet : consumer->ReadBuffers()) {
+    if (!packet.has_for_testing())
+      continue;
+    EXPECT_EQ("payload_" + std::to_string(num_test_packets++),
+              packet.for_testing().str());
+  }
+  EXPECT_GT(num_test_packets, 0u);
+  EXPECT_LT(num_test_packets, kNumPackets);
+
+  // The flush returns the last chunk, the service scans it upon the
+  // CommitData() request.
+  auto flush_request = consumer->Flush();
+  producer->WaitForFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  // The service forgets the writer once the producer releases it.
+  EXPECT_EQ(1u, GetNumScannedWriters(*last_producer_id()));
+  writer.reset();
+  task_runner.RunUntilIdle();
+  EXPECT_EQ(0u, GetNumScannedWriters(*last_producer_id()));
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+  for (const auto& packet : consumer->ReadBuffers()) {
+    if (!packet.has_for_testing())
+      continue;
+    EXPECT_EQ("payload_" + std::to_string(num_test_packets++),
+              packet.for_testing().str());
+  }
+  EXPECT_EQ(kNumPackets, num_test_packets);
+}
+
+// The writers of a producer that outlive the trace buffer they target must not
+// be routed to the next buffer that gets the same ID.
+TEST_F(ServiceImplTest, SmbScanningForgetsFreedBuffers) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  trace_config.add_data_sources()->mutable_config()->set_name("data_source");
+  auto* producer_config = trace_config.add_producers();
+  producer_config->set_producer_name("mock_producer");
+  producer_config->set_smb_scan_period_ms(1);
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceStart("data_source");
+
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  writer->NewTracePacket()->set_for_testing()->set_str("payload");
+  auto flush_request = consumer->Flush();
+  producer->WaitForFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+  EXPECT_EQ(1u, GetNumScannedWriters(*last_producer_id()));
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+  consumer->FreeBuffers();
+  EXPECT_EQ(0u, GetNumScannedWriters(*last_producer_id()));
+}
+
+// The service keeps the sequence ID of a producer that went away as long as
+// its packets can still be read.
+TEST_F(ServiceImplTest, PacketSequenceIDsForgottenWithBuffers) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("data_source");
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceStart("data_source");
+
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  {
+    auto tp = writer->NewTracePacket();
+    tp->set_for_testing()->set_str("payload_0");
+  }
+  auto flush_request = consumer->Flush();
+  producer->WaitForFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+  EXPECT_THAT(
+      consumer->ReadBuffers(),
+      Contains(Property(&protos::TracePacket::for_testing,
+                        Property(&protos::TestEvent::str, Eq("payload_0")))));
+  EXPECT_EQ(1u, GetNumPacketSequences());
+
+  writer.reset();
+  producer.reset();
+  task_runner.RunUntilIdle();
+  EXPECT_EQ(1u, GetNumPacketSequences());
+
+  consumer->DisableTracing();
+  consumer->WaitForTracingDisabled();
+  consumer->FreeBuffers();
+  EXPECT_EQ(0u, GetNumPacketSequences());
+}
+
+// Packets larger than a chunk are fragmented, and the size fields of their
+// nested messages are backfilled through the patches of the CommitData()
+// requests.
+TEST_F(ServiceImplTest, PatchFragmentedPackets) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(256);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("data_source");
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceStart("data_source");
+
+  static constexpr size_t kNumPackets = 10;
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  for (size_t i = 0; i < kNumPackets; i++) {
+    std::string payload(10000 + i, static_cast<char>('a' + i));
+    writer->NewTracePacket()->set_for_testing()->set_str(payload.c_str());
+  }
+
+  auto flush_request = consumer->Flush();
+  producer->WaitForFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+  size_t num_test_packets = 0;
+  for (const auto& packet : consumer->ReadBuffers()) {
+    if (!packet.has_for_testing())
+      continue;
+    const size_t i = num_test_packets++;
+    EXPECT_EQ(std::string(10000 + i, static_cast<char>('a' + i)),
+              packet.for_testing().str());
+  }
+  EXPECT_EQ(kNumPackets, num_test_packets);
+}
+
+TEST_F(ServiceImplTest, DataPlaneThreads) {
+  svc->SetDataPlaneThreads(2);
+
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  static constexpr size_t kNumProducers = 2;
+  std::unique_ptr<MockProducer> producers[kNumProducers];
+  TraceConfig trace_config;
+  for (size_t i = 0; i < kNumProducers; i++) {
+    const std::string name = "data_source_" + std::to_string(i);
+    producers[i] = CreateMockProducer();
+    producers[i]->Connect(svc.get(), "mock_producer_" + std::to_string(i));
+    producers[i]->RegisterDataSource(name);
+    trace_config.add_buffers()->set_size_kb(256);
+    auto* ds_config = trace_config.add_data_sources()->mutable_config();
+    ds_config->set_name(name);
+    ds_config->set_target_buffer(static_cast<uint32_t>(i));
+  }
+
+  consumer->EnableTracing(trace_config);
+  std::unique_ptr<TraceWriter> writers[kNumProducers];
+  for (size_t i = 0; i < kNumProducers; i++) {
+    const std::string name = "data_source_" + std::to_string(i);
+    producers[i]->WaitForTracingSetup();
+    producers[i]->WaitForDataSourceStart(name);
+    writers[i] = producers[i]->CreateTraceWriter(name);
+  }
+
+  // The packets span several chunks, so the patches have to be applied after
+  // the chunks have been copied by the data plane.
+  static constexpr size_t kNumPackets = 10;
+  for (size_t i = 0; i < kNumPackets; i++) {
+    for (size_t p = 0; p < kNumProducers; p++) {
+      std::string payload(10000 + i, static_cast<char>('a' + p));
+      writers[p]->NewTracePacket()->set_for_testing()->set_str(
+          payload.c_str());
+    }
+  }
+
+  auto flush_request = consumer->Flush();
+  for (size_t i = 0; i < kNumProducers; i++)
+    producers[i]->WaitForFlush(writers[i].get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  consumer->DisableTracing();
+  for (size_t i = 0; i < kNumProducers; i++)
+    producers[i]->WaitForDataSourceStop("data_source_" + std::to_string(i));
+  consumer->WaitForTracingDisabled();
+  size_t num_test_packets[kNumProducers] = {};
+  for (const auto& packet : consumer->ReadBuffers()) {
+    if (!packet.has_for_testing())
+      continue;
+    const std::string& str = packet.for_testing().str();
+    ASSERT_FALSE(str.empty());
+    const size_t p = static_cast<size_t>(str[0] - 'a');
+    ASSERT_LT(p, kNumProducers);
+    const size_t i = num_test_packets[p]++;
+    EXPECT_EQ(std::string(10000 + i, static_cast<char>('a' + p)), str);
+  }
+  for (size_t i = 0; i < kNumProducers; i++)
+    EXPECT_EQ(kNumPackets, num_test_packets[i]);
+}
+
+TEST_F(ServiceImplTest, SharedDataSourceInstance) {
+  std::unique_ptr<MockConsumer> consumer_1 = CreateMockConsumer();
+  consumer_1->Connect(svc.get());
+  std::unique_ptr<MockConsumer> consumer_2 = CreateMockConsumer();
+  consumer_2->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  auto* data_source = trace_config.add_data_sources();
+  data_source->mutable_config()->set_name("data_source");
+  data_source->set_share_instance(true);
+
+  consumer_1->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceStart("data_source");
+
+  // The second session joins the instance started by the first one, the
+  // (strict) mock producer doesn't expect another start.
+  trace_config.set_duration_ms(60000);
+  consumer_2->EnableTracing(trace_config);
+  task_runner.RunUntilIdle();
+
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  writer->NewTracePacket()->set_for_testing()->set_str("payload");
+
+  auto flush_request = consumer_1->Flush();
+  producer->WaitForFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  // The instance outlives the first session.
+  consumer_1->DisableTracing();
+  consumer_1->WaitForTracingDisabled();
+  auto payload = Contains(Property(
+      &protos::TracePacket::for_testing,
+      Property(&protos::TestEvent::str, Eq("payload"))));
+  EXPECT_THAT(consumer_1->ReadBuffers(), payload);
+  consumer_1->FreeBuffers();
+
+  consumer_2->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer_2->WaitForTracingDisabled();
+
+  // The data source can still flush its data while stopping, the chunks are
+  // routed to the last session until its buffers are freed.
+  writer->NewTracePacket()->set_for_testing()->set_str("late_payload");
+  writer->Flush();
+  task_runner.RunUntilIdle();
+  auto packets = consumer_2->ReadBuffers();
+  EXPECT_THAT(packets, payload);
+  EXPECT_THAT(packets, Contains(Property(
+                           &protos::TracePacket::for_testing,
+                           Property(&protos::TestEvent::str,
+                                    Eq("late_payload")))));
+}
+
+TEST_F(ServiceImplTest, TracingSessionLimits) {
+  svc->SetTracingSessionLimits(2 /*max_sessions*/,
+                               1024 /*max_total_buffer_size_kb*/);
+  std::unique_ptr<MockConsumer> consumers[3];
+  for (auto& consumer : consumers) {
+    consumer = CreateMockConsumer();
+    consumer->Connect(svc.get());
+  }
+  auto config_with_buffer_kb = [](uint32_t size_kb) {
+    TraceConfig trace_config;
+    trace_config.add_buffers()->set_size_kb(size_kb);
+    return trace_config;
+  };
+
+  consumers[0]->EnableTracing(config_with_buffer_kb(512));
+
+  // Doesn't fit in the memory left.
+  consumers[1]->EnableTracing(config_with_buffer_kb(768));
+  consumers[1]->WaitForTracingDisabled();
+  consumers[1]->EnableTracing(config_with_buffer_kb(512));
+
+  // Too many sessions.
+  consumers[2]->EnableTracing(config_with_buffer_kb(4));
+  consumers[2]->WaitForTracingDisabled();
+
+  // The memory of a session is released with its buffers.
+  consumers[0]->DisableTracing();
+  consumers[0]->WaitForTracingDisabled();
+  consumers[0]->FreeBuffers();
+  consumers[2]->EnableTracing(config_with_buffer_kb(512));
+  consumers[2]->DisableTracing();
+  consumers[2]->WaitForTracingDisabled();
+}
+
+// The embedder (e.g. traced) can raise the limits through the Service
+// interface, above the default number of sessions.
+TEST_F(ServiceImplTest, TracingSessionLimitsThroughServiceInterface) {
+  const size_t kMaxSessions = Service::kDefaultMaxTracingSessions + 2;
+  Service* service = svc.get();
+  service->SetTracingSessionLimits(kMaxSessions,
+                                   0 /*max_total_buffer_size_kb*/);
+  std::vector<std::unique_ptr<MockConsumer>> consumers;
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(4);
+  for (size_t i = 0; i < kMaxSessions + 1; i++) {
+    consumers.emplace_back(CreateMockConsumer());
+    consumers.back()->Connect(service);
+    consumers.back()->EnableTracing(trace_config);
+  }
+
+  // Only the last session exceeds the limit.
+  consumers.back()->WaitForTracingDisabled();
+  for (size_t i = 0; i < kMaxSessions; i++) {
+    consumers[i]->DisableTracing();
+    consumers[i]->WaitForTracingDisabled();
+  }
+}
+
+TEST_F(ServiceImplTest, SortPackets) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  trace_config.add_data_sources()->mutable_config()->set_name("data_source");
+  trace_config.set_sort_packets(true);
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceStart("data_source");
+
+  // The sequence of the first writer comes first in the buffer, but its
+  // packet has the later timestamp.
+  std::unique_ptr<TraceWriter> writers[2];
+  for (size_t i = 0; i < 2; i++) {
+    writers[i] = producer->CreateTraceWriter("data_source");
+    auto tp = writers[i]->NewTracePacket();
+    tp->set_timestamp(2 - i);
+    tp->set_for_testing()->set_str(std::to_string(2 - i).c_str());
+  }
+  writers[0]->Flush();
+
+  auto flush_request = consumer->Flush();
+  producer->WaitForFlush(writers[1].get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+  std::vector<std::string> payloads;
+  for (const auto& packet : consumer->ReadBuffers()) {
+    if (packet.has_for_testing())
+      payloads.push_back(packet.for_testing().str());
+  }
+  EXPECT_THAT(payloads, ElementsAre("1", "2"));
+}
+
 }  // namespace perfetto
@@ -21,15 +21,21 @@
 #include "perfetto/tracing/core/commit_data_request.h"
 #include "perfetto/tracing/core/shared_memory.h"
 #include "src/tracing/core/null_trace_writer.h"
+#include "src/tracing/core/packed_commit_data.h"
 #include "src/tracing/core/trace_writer_impl.h"
 
+#include <algorithm>
 #include <limits>
 #include <utility>
+#include <vector>
 
 namespace perfetto {
 
 using Chunk = SharedMemoryABI::Chunk;
 
+constexpr size_t SharedMemoryArbiterImpl::kNumPageHintShards;
+constexpr size_t SharedMemoryArbiterImpl::kAdaptiveCommitSmbFraction;
+
 // static
 SharedMemoryABI::PageLayout SharedMemoryArbiterImpl::default_page_layout =
     SharedMemoryABI::PageLayout::kPageDiv1;
@@ -39,10 +45,16 @@ std::unique_ptr<SharedMemoryArbiter> SharedMemoryArbiter::CreateInstance(
     SharedMemory* shared_memory,
     size_t page_size,
     Service::ProducerEndpoint* producer_endpoint,
-    base::TaskRunner* task_runner) {
-  return std::unique_ptr<SharedMemoryArbiterImpl>(
-      new SharedMemoryArbiterImpl(shared_memory->start(), shared_memory->size(),
-                                  page_size, producer_endpoint, task_runner));
+    base::TaskRunner* task_runner,
+    const SharedMemoryOptions& options) {
+  return std::unique_ptr<SharedMemoryArbiterImpl>(new SharedMemoryArbiterImpl(
+      shared_memory->start(), shared_memory->size(), page_size,
+      producer_endpoint, task_runner, options));
+}
+
+std::unique_ptr<TraceWriter> SharedMemoryArbiter::CreateTraceWriter(
+    BufferID target_buffer) {
+  return CreateTraceWriter(target_buffer, BufferExhaustedPolicy::kStall);
 }
 
 SharedMemoryArbiterImpl::SharedMemoryArbiterImpl(
@@ -50,45 +62,89 @@ SharedMemoryArbiterImpl::SharedMemoryArbiterImpl(
     size_t size,
     size_t page_size,
     Service::ProducerEndpoint* producer_endpoint,
-    base::TaskRunner* task_runner)
+    base::TaskRunner* task_runner,
+    const SharedMemoryOptions& options)
     : task_runner_(task_runner),
       producer_endpoint_(producer_endpoint),
-      shmem_abi_(reinterpret_cast<uint8_t*>(start), size, page_size),
+      task_runner_thread_(std::this_thread::get_id()),
+      shmem_abi_(reinterpret_cast<uint8_t*>(start),
+                 options.use_commit_ring ? size - page_size : size,
+                 page_size),
+      service_scans_smb_(options.service_scans_smb),
+      commit_policy_(options.commit_policy),
       active_writer_ids_(kMaxWriterID),
-      weak_ptr_factory_(this) {}
+      weak_ptr_factory_(this) {
+  weak_this_ = weak_ptr_factory_.GetWeakPtr();
+
+  // The commit ring takes the last page of the SMB, see commit_ring.h.
+  if (options.use_commit_ring) {
+    PERFETTO_CHECK(size >= page_size * 2);
+    commit_ring_ = CommitRing(
+        reinterpret_cast<uint8_t*>(start) + size - page_size, page_size);
+  }
+
+  if (commit_policy_.adaptive)
+    last_fill_rate_update_ = base::GetWallTimeMs();
+
+  // Spread the initial hints evenly across the SMB.
+  for (size_t i = 0; i < kNumPageHintShards; i++) {
+    page_idx_hints_[i].store(i * shmem_abi_.num_pages() / kNumPageHintShards,
+                             std::memory_order_relaxed);
+  }
+}
 
 Chunk SharedMemoryArbiterImpl::GetNewChunk(
     const SharedMemoryABI::ChunkHeader& header,
-    size_t size_hint) {
-  PERFETTO_DCHECK(size_hint == 0);  // Not implemented yet.
+    size_t size_hint,
+    BufferExhaustedPolicy buffer_exhausted_policy) {
   int stall_count = 0;
   useconds_t stall_interval_us = 0;
   static const useconds_t kMaxStallIntervalUs = 100000;
   static const int kLogAfterNStalls = 3;
 
+  const size_t num_pages = shmem_abi_.num_pages();
+  std::atomic<size_t>& page_idx_hint =
+      page_idx_hints_[header.writer_id.load(std::memory_order_relaxed) %
+                      kNumPageHintShards];
+
+  // Free pages are partitioned with the layout that best fits |size_hint|.
+  const SharedMemoryABI::PageLayout layout =
+      GetPageLayoutForSizeHint(size_hint);
+  const size_t min_chunk_size =
+      sizeof(SharedMemoryABI::ChunkHeader) + size_hint;
+
   for (;;) {
-    // TODO(primiano): Probably this lock is not really required and this code
-    // could be rewritten leveraging only the Try* atomic operations in
-    // SharedMemoryABI. But let's not be too adventurous for the moment.
-    {
-      std::lock_guard<std::mutex> scoped_lock(lock_);
-      const size_t initial_page_idx = page_idx_;
-      for (size_t i = 0; i < shmem_abi_.num_pages(); i++) {
-        page_idx_ = (initial_page_idx + i) % shmem_abi_.num_pages();
+    // No lock is required here. Other threads (and the service) can change the
+    // state of pages and chunks concurrently, but all the transitions below are
+    // CAS operations that fail gracefully if we lose the race, in which case we
+    // just move on to the next chunk.
+    // If a |size_hint| is given, the first pass skips the pages that have been
+    // partitioned (by other writers) into chunks too small for it. If that
+    // fails, the second pass takes whatever free chunk is left.
+    for (int pass = size_hint ? 0 : 1; pass < 2; pass++) {
+      const bool skip_small_chunks = pass == 0;
+      const size_t initial_page_idx =
+          page_idx_hint.load(std::memory_order_relaxed);
+      for (size_t i = 0; i < num_pages; i++) {
+        const size_t page_idx = (initial_page_idx + i) % num_pages;
         bool is_new_page = false;
 
-        // TODO(primiano): make the page layout dynamic.
-        auto layout = SharedMemoryArbiterImpl::default_page_layout;
+        if (shmem_abi_.is_page_free(page_idx))
+          is_new_page = shmem_abi_.TryPartitionPage(page_idx, layout);
 
-        if (shmem_abi_.is_page_free(page_idx_)) {
-          // TODO(primiano): Use the |size_hint| here to decide the layout.
-          is_new_page = shmem_abi_.TryPartitionPage(page_idx_, layout);
-        }
         uint32_t free_chunks;
         if (is_new_page) {
-          free_chunks = (1 << SharedMemoryABI::kNumChunksForLayout[layout]) - 1;
+          free_chunks =
+              (1 << SharedMemoryABI::kNumChunksForLayout[layout]) - 1;
         } else {
-          free_chunks = shmem_abi_.GetFreeChunks(page_idx_);
+          if (skip_small_chunks) {
+            const uint32_t page_layout =
+                shmem_abi_.page_header(page_idx)->layout.load(
+                    std::memory_order_relaxed);
+            if (shmem_abi_.GetChunkSizeForLayout(page_layout) < min_chunk_size)
+              continue;
+          }
+          free_chunks = shmem_abi_.GetFreeChunks(page_idx);
         }
 
         for (uint32_t chunk_idx = 0; free_chunks;
@@ -97,9 +153,10 @@ Chunk SharedMemoryArbiterImpl::GetNewChunk(
             continue;
           // We found a free chunk.
           Chunk chunk = shmem_abi_.TryAcquireChunkForWriting(
-              page_idx_, chunk_idx, &header);
+              page_idx, chunk_idx, &header);
           if (!chunk.is_valid())
             continue;
+          page_idx_hint.store(page_idx, std::memory_order_relaxed);
           if (stall_count > kLogAfterNStalls) {
             PERFETTO_LOG("Recovered from stall after %d iterations",
                          stall_count);
@@ -107,11 +164,13 @@ Chunk SharedMemoryArbiterImpl::GetNewChunk(
           return chunk;
         }
       }
-    }  // std::lock_guard<std::mutex>
+    }
 
     // All chunks are taken (either kBeingWritten by us or kBeingRead by the
-    // Service). TODO: at this point we should return a bankrupcy chunk, not
-    // crash the process.
+    // Service).
+    if (buffer_exhausted_policy == BufferExhaustedPolicy::kDrop)
+      return Chunk();
+
     if (stall_count++ == kLogAfterNStalls) {
       PERFETTO_ELOG("Shared memory buffer overrun! Stalling");
 
@@ -133,53 +192,121 @@ void SharedMemoryArbiterImpl::ReturnCompletedChunk(Chunk chunk,
                                                    BufferID target_buffer,
                                                    PatchList* patch_list) {
   bool should_post_callback = false;
+  bool should_post_delayed_callback = false;
+  uint32_t commit_delay_ms = 0;
   bool should_commit_synchronously = false;
-  base::WeakPtr<SharedMemoryArbiterImpl> weak_this;
+  bool should_ring_doorbell = false;
+  bool committed_through_ring = false;
+  bool move_through_request = true;
+  bool left_to_scanner = false;
+  const uint8_t chunk_idx = chunk.chunk_idx();
+  const WriterID writer_id = chunk.writer_id();
+  const size_t chunk_size = chunk.size();
+  size_t page_idx;
   {
     std::lock_guard<std::mutex> scoped_lock(lock_);
-    uint8_t chunk_idx = chunk.chunk_idx();
-    const WriterID writer_id = chunk.writer_id();
-    bytes_pending_commit_ += chunk.size();
-    size_t page_idx = shmem_abi_.ReleaseChunkAsComplete(std::move(chunk));
+    page_idx = shmem_abi_.ReleaseChunkAsComplete(std::move(chunk));
+    bytes_pending_commit_ += chunk_size;
 
     // DO NOT access |chunk| after this point, has been std::move()-d above.
 
-    if (!commit_data_req_) {
+    const bool has_patches =
+        !patch_list->empty() && patch_list->front().is_patched();
+
+    // If the service scans the SMB, it will find the chunk by itself. It needs
+    // a CommitDataRequest only to learn the target buffer of new writers and
+    // to get the patches.
+    if (service_scans_smb_) {
+      move_through_request = !writers_known_to_service_[writer_id];
+      writers_known_to_service_[writer_id] = true;
+      left_to_scanner = !move_through_request && !has_patches;
+    }
+
+    // Try first the commit ring. Chunks that come with patches for the
+    // previous ones have to go through a CommitDataRequest. So do all the
+    // chunks returned while a CommitDataRequest is pending, to preserve the
+    // order in which the service sees them.
+    if (!left_to_scanner && commit_ring_.is_valid() && !commit_data_req_ &&
+        !has_patches) {
+      CommitRing::Entry entry{};
+      entry.page = static_cast<uint32_t>(page_idx);
+      entry.chunk = chunk_idx;
+      entry.target_buffer = target_buffer;
+      bool was_empty = false;
+      committed_through_ring = commit_ring_.TryPush(entry, &was_empty);
+      // See the comment about |bytes_pending_commit_| below.
+      if (committed_through_ring &&
+          bytes_pending_commit_ >= shmem_abi_.size() / 2) {
+        should_commit_synchronously = true;
+      } else if (was_empty && !commit_ring_doorbell_pending_) {
+        commit_ring_doorbell_pending_ = true;
+        should_ring_doorbell = true;
+      }
+    }
+  }  // scoped_lock(lock_)
+
+  if (left_to_scanner)
+    return;
+
+  if (committed_through_ring) {
+    if (should_commit_synchronously) {
+      FlushPendingCommitDataRequests();
+    } else if (should_ring_doorbell) {
+      auto weak_this = weak_this_;
+      task_runner_->PostTask([weak_this] {
+        if (weak_this)
+          weak_this->RingCommitDoorbell();
+      });
+    }
+    return;
+  }
+
+  // Otherwise fall back on the CommitDataRequest.
+  {
+    std::lock_guard<std::mutex> scoped_lock(lock_);
+    if (!commit_data_req_)
       commit_data_req_.reset(new CommitDataRequest());
-      weak_this = weak_ptr_factory_.GetWeakPtr();
-      should_post_callback = true;
+    if (move_through_request) {
+      PackedCommitData::AddChunkToMove(commit_data_req_.get(),
+                                       static_cast<uint32_t>(page_idx),
+                                       chunk_idx, target_buffer);
     }
-    CommitDataRequest::ChunksToMove* ctm =
-        commit_data_req_->add_chunks_to_move();
-    ctm->set_page(static_cast<uint32_t>(page_idx));
-    ctm->set_chunk(chunk_idx);
-    ctm->set_target_buffer(target_buffer);
 
     // If more than half of the SMB.size() is filled with completed chunks for
     // which we haven't notified the service yet (i.e. they are still enqueued
-    // in |commit_data_req_|), force a synchronous CommitDataRequest(), to
-    // reduce the likeliness of stalling the writer.
+    // in |commit_data_req_| or in |commit_ring_|), force a synchronous
+    // CommitDataRequest(), to reduce the likeliness of stalling the writer.
+    // Otherwise schedule the commit as dictated by the |commit_policy_|.
     if (bytes_pending_commit_ >= shmem_abi_.size() / 2) {
       should_commit_synchronously = true;
-      should_post_callback = false;
+    } else {
+      commit_delay_ms = GetCommitDelayMs();
+      const bool batch_ready =
+          commit_policy_.min_batch_bytes > 0 &&
+          bytes_pending_commit_ >= commit_policy_.min_batch_bytes;
+      if (commit_delay_ms == 0 || batch_ready) {
+        should_post_callback = !commit_task_pending_;
+        commit_task_pending_ = true;
+      } else {
+        should_post_delayed_callback = !delayed_commit_task_pending_;
+        delayed_commit_task_pending_ = true;
+      }
     }
 
     // Get the patches completed for the previous chunk from the |patch_list|
     // and update it.
+    PackedCommitData::ChunksToPatchWriter patches_writer(
+        &packed_chunks_to_patch_);
     ChunkID last_chunk_id = 0;  // 0 is irrelevant but keeps the compiler happy.
-    CommitDataRequest::ChunkToPatch* last_chunk_req = nullptr;
+    bool has_last_chunk = false;
     while (!patch_list->empty() && patch_list->front().is_patched()) {
-      if (!last_chunk_req || last_chunk_id != patch_list->front().chunk_id) {
-        last_chunk_req = commit_data_req_->add_chunks_to_patch();
-        last_chunk_req->set_writer_id(writer_id);
+      if (!has_last_chunk || last_chunk_id != patch_list->front().chunk_id) {
         last_chunk_id = patch_list->front().chunk_id;
-        last_chunk_req->set_chunk_id(last_chunk_id);
-        last_chunk_req->set_target_buffer(target_buffer);
+        has_last_chunk = true;
+        patches_writer.AddChunk(writer_id, last_chunk_id, target_buffer);
       }
-      auto* patch_req = last_chunk_req->add_patches();
-      patch_req->set_offset(patch_list->front().offset);
-      patch_req->set_data(&patch_list->front().size_field[0],
-                          patch_list->front().size_field.size());
+      patches_writer.AddPatch(patch_list->front().offset,
+                              &patch_list->front().size_field[0]);
       patch_list->pop_front();
     }
     // Patches are enqueued in the |patch_list| in order and are notified to
@@ -187,54 +314,167 @@ void SharedMemoryArbiterImpl::ReturnCompletedChunk(Chunk chunk,
     // patch list is incomplete is if there is an unpatched entry at the head of
     // the |patch_list| that belongs to the same ChunkID as the last one we are
     // about to send to the service.
-    if (last_chunk_req && !patch_list->empty() &&
+    if (has_last_chunk && !patch_list->empty() &&
         patch_list->front().chunk_id == last_chunk_id) {
-      last_chunk_req->set_has_more_patches(true);
+      patches_writer.SetHasMorePatches();
     }
   }  // scoped_lock(lock_)
 
   if (should_post_callback) {
-    PERFETTO_DCHECK(weak_this);
+    auto weak_this = weak_this_;
     task_runner_->PostTask([weak_this] {
       if (weak_this)
-        weak_this->FlushPendingCommitDataRequests();
+        weak_this->RunCommitTask(false /* delayed */);
     });
   }
 
+  if (should_post_delayed_callback) {
+    auto weak_this = weak_this_;
+    task_runner_->PostDelayedTask(
+        [weak_this] {
+          if (weak_this)
+            weak_this->RunCommitTask(true /* delayed */);
+        },
+        commit_delay_ms);
+  }
+
   if (should_commit_synchronously)
     FlushPendingCommitDataRequests();
 }
 
-// TODO(primiano): this is wrong w.r.t. threading because it will try to send
-// an IPC from a different thread than the IPC thread. Right now this works
-// because everything is single threaded. It will hit the thread checker
-// otherwise. What we really want to do here is doing this sync IPC only if
-// task_runner_.RunsTaskOnCurrentThread(), otherwise PostTask().
+void SharedMemoryArbiterImpl::RunCommitTask(bool delayed) {
+  {
+    std::lock_guard<std::mutex> scoped_lock(lock_);
+    if (delayed) {
+      delayed_commit_task_pending_ = false;
+    } else {
+      commit_task_pending_ = false;
+    }
+  }
+  // This is a no-op if the chunks have been committed in the meantime.
+  FlushPendingCommitDataRequests();
+}
+
+uint32_t SharedMemoryArbiterImpl::GetCommitDelayMs() const {
+  const uint32_t max_latency_ms = commit_policy_.max_latency_ms;
+  if (!commit_policy_.adaptive || fill_rate_bytes_per_ms_ == 0)
+    return max_latency_ms;
+
+  // Commit before the chunks pending, at the current fill rate, take more than
+  // 1/kAdaptiveCommitSmbFraction of the SMB.
+  const uint64_t delay_ms =
+      shmem_abi_.size() / kAdaptiveCommitSmbFraction / fill_rate_bytes_per_ms_;
+  return static_cast<uint32_t>(
+      std::min(static_cast<uint64_t>(max_latency_ms), delay_ms));
+}
+
+void SharedMemoryArbiterImpl::UpdateFillRate() {
+  bytes_since_last_fill_rate_update_ += bytes_pending_commit_;
+  const base::TimeMillis now = base::GetWallTimeMs();
+  const int64_t elapsed_ms = (now - last_fill_rate_update_).count();
+  if (elapsed_ms <= 0)
+    return;
+  const uint64_t fill_rate =
+      bytes_since_last_fill_rate_update_ / static_cast<uint64_t>(elapsed_ms);
+  fill_rate_bytes_per_ms_ = (fill_rate_bytes_per_ms_ * 3 + fill_rate) / 4;
+  bytes_since_last_fill_rate_update_ = 0;
+  last_fill_rate_update_ = now;
+}
+
 void SharedMemoryArbiterImpl::FlushPendingCommitDataRequests(
     std::function<void()> callback) {
+  // The IPC can be sent only from the thread of |task_runner_|.
+  if (std::this_thread::get_id() != task_runner_thread_) {
+    auto weak_this = weak_this_;
+    task_runner_->PostTask([weak_this, callback] {
+      if (weak_this)
+        weak_this->FlushPendingCommitDataRequests(callback);
+    });
+    return;
+  }
   PERFETTO_DCHECK_THREAD(thread_checker_);
 
   std::unique_ptr<CommitDataRequest> req;
   {
     std::lock_guard<std::mutex> scoped_lock(lock_);
     req = std::move(commit_data_req_);
+    // |commit_data_req_| could become nullptr if the forced sync flush happens
+    // in GetNewChunk(). If |commit_data_req_| was nullptr, it means that an
+    // enqueued deferred commit was executed just before this. At this point
+    // send an empty commit request to the service, just to linearize with it
+    // and give the guarantee to the caller that the data has been flushed into
+    // the service. An empty request is also required to make the service
+    // drain the chunks pushed into |commit_ring_| (or scan the chunks left in
+    // the SMB) since the last request.
+    const bool chunks_pending =
+        (commit_ring_.is_valid() || service_scans_smb_) &&
+        bytes_pending_commit_ > 0;
+    if (!req && (callback || chunks_pending))
+      req.reset(new CommitDataRequest());
+    if (req && commit_ring_.is_valid())
+      req->set_commit_ring_write_idx(commit_ring_.next_idx());
+    if (req && !packed_chunks_to_patch_.empty()) {
+      req->set_packed_chunks_to_patch(packed_chunks_to_patch_);
+      packed_chunks_to_patch_.clear();
+    }
+    if (commit_policy_.adaptive)
+      UpdateFillRate();
     bytes_pending_commit_ = 0;
   }
-  // |commit_data_req_| could become nullptr if the forced sync flush happens
-  // in GetNewChunk().
-  if (req) {
-    producer_endpoint_->CommitData(*req, callback);
-  } else if (callback) {
-    // If |commit_data_req_| was nullptr, it means that an enqueued deferred
-    // commit was executed just before this. At this point send an empty commit
-    // request to the service, just to linearize with it and give the guarantee
-    // to the caller that the data has been flushed into the service.
-    producer_endpoint_->CommitData(CommitDataRequest(), callback);
+  if (!req)
+    return;
+  if (req->released_writers_size()) {
+    // Free the IDs of the released writers only once the service has
+    // forgotten them.
+    auto weak_this = weak_this_;
+    std::vector<uint32_t> released_writers = req->released_writers();
+    auto original_callback = std::move(callback);
+    callback = [weak_this, released_writers, original_callback] {
+      if (weak_this) {
+        std::lock_guard<std::mutex> scoped_lock(weak_this->lock_);
+        for (uint32_t id : released_writers)
+          weak_this->active_writer_ids_.Free(static_cast<WriterID>(id));
+      }
+      if (original_callback)
+        original_callback();
+    };
+  }
+  producer_endpoint_->CommitData(*req, callback);
+}
+
+void SharedMemoryArbiterImpl::RingCommitDoorbell() {
+  {
+    std::lock_guard<std::mutex> scoped_lock(lock_);
+    commit_ring_doorbell_pending_ = false;
+  }
+  // The service drains the commit ring upon any CommitData() request. This is
+  // a no-op if another request has been sent after the chunks were pushed.
+  FlushPendingCommitDataRequests();
+}
+
+SharedMemoryABI::PageLayout SharedMemoryArbiterImpl::GetPageLayoutForSizeHint(
+    size_t size_hint) const {
+  if (!size_hint)
+    return default_page_layout;
+
+  // Pick the layout with the smallest chunks that can still fit |size_hint|.
+  // Larger chunks would waste space (the chunk is returned when the writer
+  // flushes, regardless of how full it is), smaller ones would fragment.
+  // Layouts are sorted by decreasing chunk size.
+  const size_t min_chunk_size =
+      sizeof(SharedMemoryABI::ChunkHeader) + size_hint;
+  for (uint32_t layout = SharedMemoryABI::kPageDiv14;
+       layout > SharedMemoryABI::kPageDiv1; layout--) {
+    const uint32_t page_layout = layout << SharedMemoryABI::kLayoutShift;
+    if (shmem_abi_.GetChunkSizeForLayout(page_layout) >= min_chunk_size)
+      return static_cast<SharedMemoryABI::PageLayout>(layout);
   }
+  return SharedMemoryABI::kPageDiv1;
 }
 
 std::unique_ptr<TraceWriter> SharedMemoryArbiterImpl::CreateTraceWriter(
-    BufferID target_buffer) {
+    BufferID target_buffer,
+    BufferExhaustedPolicy buffer_exhausted_policy) {
   WriterID id;
   {
     std::lock_guard<std::mutex> scoped_lock(lock_);
@@ -243,7 +483,7 @@ std::unique_ptr<TraceWriter> SharedMemoryArbiterImpl::CreateTraceWriter(
   if (!id)
     return std::unique_ptr<TraceWriter>(new NullTraceWriter());
   return std::unique_ptr<TraceWriter>(
-      new TraceWriterImpl(this, id, target_buffer));
+      new TraceWriterImpl(this, id, target_buffer, buffer_exhausted_policy));
 }
 
 void SharedMemoryArbiterImpl::NotifyFlushComplete(FlushRequestID req_id) {
@@ -263,7 +503,32 @@ void SharedMemoryArbiterImpl::NotifyFlushComplete(FlushRequestID req_id) {
     commit_data_req_->set_flush_request_id(req_id);
   }
   if (should_post_commit_task) {
-    auto weak_this = weak_ptr_factory_.GetWeakPtr();
+    auto weak_this = weak_this_;
+    task_runner_->PostTask([weak_this] {
+      if (weak_this)
+        weak_this->FlushPendingCommitDataRequests();
+    });
+  }
+}
+
+void SharedMemoryArbiterImpl::NotifyDataLoss(BufferID target_buffer,
+                                             uint64_t packets_dropped,
+                                             uint64_t bytes_dropped) {
+  bool should_post_commit_task = false;
+  {
+    std::lock_guard<std::mutex> scoped_lock(lock_);
+    if (!commit_data_req_) {
+      commit_data_req_.reset(new CommitDataRequest());
+      should_post_commit_task = true;
+    }
+    CommitDataRequest::DataLoss* data_loss =
+        commit_data_req_->add_data_losses();
+    data_loss->set_target_buffer(target_buffer);
+    data_loss->set_packets_dropped(packets_dropped);
+    data_loss->set_bytes_dropped(bytes_dropped);
+  }
+  if (should_post_commit_task) {
+    auto weak_this = weak_this_;
     task_runner_->PostTask([weak_this] {
       if (weak_this)
         weak_this->FlushPendingCommitDataRequests();
@@ -272,8 +537,31 @@ void SharedMemoryArbiterImpl::NotifyFlushComplete(FlushRequestID req_id) {
 }
 
 void SharedMemoryArbiterImpl::ReleaseWriterID(WriterID id) {
-  std::lock_guard<std::mutex> scoped_lock(lock_);
-  active_writer_ids_.Free(id);
+  bool should_post_commit_task = false;
+  {
+    std::lock_guard<std::mutex> scoped_lock(lock_);
+    if (!service_scans_smb_ || !writers_known_to_service_[id]) {
+      active_writer_ids_.Free(id);
+      return;
+    }
+    // The service still routes the chunks of this writer to its target buffer.
+    // Tell it to forget the writer, and don't reuse the ID (the next writer
+    // might target a different buffer) until the service has acknowledged
+    // that, see FlushPendingCommitDataRequests().
+    writers_known_to_service_[id] = false;
+    if (!commit_data_req_) {
+      commit_data_req_.reset(new CommitDataRequest());
+      should_post_commit_task = true;
+    }
+    *commit_data_req_->add_released_writers() = id;
+  }
+  if (should_post_commit_task) {
+    auto weak_this = weak_this_;
+    task_runner_->PostTask([weak_this] {
+      if (weak_this)
+        weak_this->FlushPendingCommitDataRequests();
+    });
+  }
 }
 
 }  // namespace perfetto
@@ -19,16 +19,23 @@
 
 #include <stdint.h>
 
+#include <array>
+#include <atomic>
+#include <bitset>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "perfetto/base/thread_checker.h"
+#include "perfetto/base/time.h"
 #include "perfetto/base/weak_ptr.h"
 #include "perfetto/tracing/core/basic_types.h"
 #include "perfetto/tracing/core/shared_memory_abi.h"
 #include "perfetto/tracing/core/shared_memory_arbiter.h"
+#include "src/tracing/core/commit_ring.h"
 #include "src/tracing/core/id_allocator.h"
 
 namespace perfetto {
@@ -44,7 +51,9 @@ class TaskRunner;
 // This class handles the shared memory buffer on the producer side. It is used
 // to obtain thread-local chunks and to partition pages from several threads.
 // There is one arbiter instance per Producer.
-// This class is thread-safe and uses locks to do so. Data sources are supposed
+// This class is thread-safe. Acquiring new chunks (GetNewChunk()) is lock-free
+// and relies only on the atomic operations of SharedMemoryABI. Committing
+// chunks and creating writers uses locks instead. Data sources are supposed
 // to interact with this sporadically, only when they run out of space on their
 // current thread-local chunk.
 class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
@@ -56,18 +65,33 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
   // |OnPagesCompleteCallback|: a callback that will be posted on the passed
   // |TaskRunner| when one or more pages are complete (and hence the Producer
   // should send a CommitData request to the Service).
+  // |SharedMemoryOptions|: whether the last page of the buffer is used as a
+  // CommitRing (see commit_ring.h), whether the service scans the buffer for
+  // the completed chunks and how to batch CommitData() requests. See
+  // basic_types.h.
   SharedMemoryArbiterImpl(void* start,
                           size_t size,
                           size_t page_size,
                           Service::ProducerEndpoint*,
-                          base::TaskRunner*);
-
-  // Returns a new Chunk to write tracing data. The call always returns a valid
-  // Chunk. TODO(primiano): right now this blocks if there are no free chunks
-  // in the SMB. In the long term the caller should be allowed to pick a policy
-  // and handle the retry itself asynchronously.
-  SharedMemoryABI::Chunk GetNewChunk(const SharedMemoryABI::ChunkHeader&,
-                                     size_t size_hint = 0);
+                          base::TaskRunner*,
+                          const SharedMemoryOptions& = SharedMemoryOptions());
+
+  // Returns a new Chunk to write tracing data. |size_hint| is the number of
+  // bytes the caller expects to write into the chunk (0 if unknown). It is
+  // used to pick the layout of the pages partitioned by this call and to
+  // prefer the chunks that are large enough. It's only a hint: the returned
+  // chunk can be smaller than that.
+  // If there are no free chunks in the SMB, the behavior depends on the
+  // |buffer_exhausted_policy|:
+  // kStall: blocks until the service frees up a chunk. The call always returns
+  // a valid Chunk.
+  // kDrop: returns immediately an invalid Chunk. The caller is expected to
+  // discard its data and retry later.
+  SharedMemoryABI::Chunk GetNewChunk(
+      const SharedMemoryABI::ChunkHeader&,
+      size_t size_hint = 0,
+      BufferExhaustedPolicy buffer_exhausted_policy =
+          BufferExhaustedPolicy::kStall);
 
   // Puts back a Chunk that has been completed and sends a request to the
   // service to move it to the central tracing buffer. |target_buffer| is the
@@ -81,10 +105,28 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
                             BufferID target_buffer,
                             PatchList*);
 
+  // Tells the service that a writer has discarded |packets_dropped| packets
+  // (|bytes_dropped| bytes in total) meant for |target_buffer|, because the SMB
+  // was full. The report is sent along with the next CommitData() request.
+  void NotifyDataLoss(BufferID target_buffer,
+                      uint64_t packets_dropped,
+                      uint64_t bytes_dropped);
+
   // Forces a synchronous commit of the completed packets without waiting for
-  // the next task.
+  // the next task. When called from a thread other than the one of
+  // |task_runner_| (e.g. by a TraceWriter being destroyed at thread exit), the
+  // commit is posted to that thread instead.
   void FlushPendingCommitDataRequests(std::function<void()> callback = {});
 
+  // The largest payload a chunk can hold, the one of a chunk that takes a
+  // whole page (kPageDiv1). GetNewChunk() returns such a chunk, if available,
+  // when the |size_hint| is larger than the chunks of the other layouts.
+  size_t GetMaxChunkPayloadSize() const {
+    return shmem_abi_.GetChunkSizeForLayout(SharedMemoryABI::kPageDiv1
+                                            << SharedMemoryABI::kLayoutShift) -
+           sizeof(SharedMemoryABI::ChunkHeader);
+  }
+
   SharedMemoryABI* shmem_abi_for_testing() { return &shmem_abi_; }
 
   static void set_default_layout_for_testing(SharedMemoryABI::PageLayout l) {
@@ -93,8 +135,10 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
 
   // SharedMemoryArbiter implementation.
   // See include/perfetto/tracing/core/shared_memory_arbiter.h for comments.
+  using SharedMemoryArbiter::CreateTraceWriter;
   std::unique_ptr<TraceWriter> CreateTraceWriter(
-      BufferID target_buffer = 0) override;
+      BufferID target_buffer,
+      BufferExhaustedPolicy buffer_exhausted_policy) override;
 
   void NotifyFlushComplete(FlushRequestID) override;
 
@@ -103,25 +147,100 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
 
   static SharedMemoryABI::PageLayout default_page_layout;
 
+  // Returns the layout to partition a free page with, in order to satisfy a
+  // GetNewChunk() call with the given |size_hint|.
+  SharedMemoryABI::PageLayout GetPageLayoutForSizeHint(size_t size_hint) const;
+
+  // See |page_idx_hints_| below.
+  static constexpr size_t kNumPageHintShards = 8;
+
+  // With CommitPolicy::adaptive, the chunks are committed before they take
+  // more than 1/N of the SMB.
+  static constexpr size_t kAdaptiveCommitSmbFraction = 4;
+
   SharedMemoryArbiterImpl(const SharedMemoryArbiterImpl&) = delete;
   SharedMemoryArbiterImpl& operator=(const SharedMemoryArbiterImpl&) = delete;
 
   // Called by the TraceWriter destructor.
   void ReleaseWriterID(WriterID);
 
+  // Posted after pushing into an empty |commit_ring_|. Sends a CommitData()
+  // request (empty, if none is pending) to make the service drain it.
+  void RingCommitDoorbell();
+
+  // Posted by ReturnCompletedChunk(), with a delay if |delayed|, to commit the
+  // chunks returned so far.
+  void RunCommitTask(bool delayed);
+
+  // How long the chunks returned now can wait before being committed. Must be
+  // called holding |lock_|.
+  uint32_t GetCommitDelayMs() const;
+
+  // Updates |fill_rate_bytes_per_ms_| before sending a CommitData() request.
+  // Must be called holding |lock_|.
+  void UpdateFillRate();
+
   base::TaskRunner* const task_runner_;
   Service::ProducerEndpoint* const producer_endpoint_;
   PERFETTO_THREAD_CHECKER(thread_checker_)
 
+  // The thread of |task_runner_|. The arbiter must be created on it.
+  const std::thread::id task_runner_thread_;
+
+  // All the state transitions of pages and chunks are CAS operations, hence
+  // SharedMemoryABI doesn't need |lock_|.
+  SharedMemoryABI shmem_abi_;
+
+  // Where GetNewChunk() should start looking for a free chunk. Writers are
+  // sharded by their WriterID, so that concurrent writers start scanning the
+  // SMB from different positions and don't race for the same free chunks.
+  // Each entry is just a hint: the page where the last chunk was acquired by
+  // a writer of that shard.
+  std::array<std::atomic<size_t>, kNumPageHintShards> page_idx_hints_;
+
+  const bool service_scans_smb_;
+  const CommitPolicy commit_policy_;
+
   // --- Begin lock-protected members ---
   std::mutex lock_;
-  SharedMemoryABI shmem_abi_;
-  size_t page_idx_ = 0;
   std::unique_ptr<CommitDataRequest> commit_data_req_;
-  size_t bytes_pending_commit_ = 0;  // SUM(chunk.size() : commit_data_req_).
+  // The patches for |commit_data_req_|, in the packed form (see
+  // packed_commit_data.h). Kept out of the request to reuse its capacity.
+  std::string packed_chunks_to_patch_;
+  // SUM(chunk.size()) of the chunks in |commit_data_req_| and of the ones
+  // pushed into |commit_ring_| since the last CommitData() request.
+  size_t bytes_pending_commit_ = 0;
   IdAllocator<WriterID> active_writer_ids_;
+
+  // Invalid if the service hasn't reserved the commit ring.
+  CommitRing commit_ring_;
+
+  // True when a RingCommitDoorbell() task has been posted and hasn't run yet.
+  bool commit_ring_doorbell_pending_ = false;
+
+  // Used only if |service_scans_smb_|. A bit is set once the first chunk of
+  // the writer with the corresponding ID has been sent in a CommitData()
+  // request. From there on, the service knows the writer's target buffer and
+  // moves its chunks as soon as it finds them in the SMB.
+  std::bitset<kMaxWriterID + 1> writers_known_to_service_;
+
+  // True when a RunCommitTask() has been posted (resp. with a delay) and
+  // hasn't run yet.
+  bool commit_task_pending_ = false;
+  bool delayed_commit_task_pending_ = false;
+
+  // Used only with CommitPolicy::adaptive. The rate at which the SMB is filled
+  // with completed chunks, as observed by the previous commits.
+  uint64_t fill_rate_bytes_per_ms_ = 0;
+  uint64_t bytes_since_last_fill_rate_update_ = 0;
+  base::TimeMillis last_fill_rate_update_ = {};
   // --- End lock-protected members ---
 
+  // Created once on the thread of |task_runner_| and copied by the tasks that
+  // the writer threads post: WeakPtrFactory::GetWeakPtr() and WeakPtr::get()
+  // can be called only on that thread.
+  base::WeakPtr<SharedMemoryArbiterImpl> weak_this_;
+
   // Keep at the end.
   base::WeakPtrFactory<SharedMemoryArbiterImpl> weak_ptr_factory_;
 };
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+
+#include "benchmark/benchmark.h"
+#include "perfetto/base/page_allocator.h"
+#include "perfetto/tracing/core/commit_data_request.h"
+#include "perfetto/tracing/core/shared_memory_abi.h"
+#include "src/tracing/core/shared_memory_arbiter_impl.h"
+
+namespace perfetto {
+namespace {
+
+constexpr size_t kPageSize = 4096;
+constexpr size_t kSmbSize = 256 * kPageSize;
+
+base::PageAllocator::UniquePtr g_smb;
+std::unique_ptr<SharedMemoryArbiterImpl> g_arbiter;
+
+// Measures the throughput (chunks/s) of GetNewChunk() when N threads, each one
+// with its own writer, acquire chunks concurrently. Each chunk is recycled
+// straight away, as the service would do after moving it into the trace
+// buffer, so the SMB never fills up and writers never stall.
+void BM_SharedMemoryArbiter_GetNewChunk(benchmark::State& state) {
+  if (state.thread_index == 0) {
+    g_smb = base::PageAllocator::Allocate(kSmbSize);
+    g_arbiter.reset(new SharedMemoryArbiterImpl(
+        g_smb.get(), kSmbSize, kPageSize, /*producer_endpoint=*/nullptr,
+        /*task_runner=*/nullptr));
+  }
+
+  SharedMemoryABI::ChunkHeader header = {};
+  header.writer_id.store(static_cast<WriterID>(state.thread_index + 1),
+                         std::memory_order_relaxed);
+  uint32_t chunk_id = 0;
+
+  // |g_arbiter| can be accessed only after the first KeepRunning() call, which
+  // waits for thread 0 to be done with the setup.
+  while (state.KeepRunning()) {
+    SharedMemoryABI* abi = g_arbiter->shmem_abi_for_testing();
+    header.chunk_id.store(chunk_id++, std::memory_order_relaxed);
+    SharedMemoryABI::Chunk chunk = g_arbiter->GetNewChunk(header);
+    const uint8_t chunk_idx = chunk.chunk_idx();
+    const size_t page_idx = abi->ReleaseChunkAsComplete(std::move(chunk));
+    chunk = abi->TryAcquireChunkForReading(page_idx, chunk_idx);
+    abi->ReleaseChunkAsFree(std::move(chunk));
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+
+  if (state.thread_index == 0) {
+    g_arbiter.reset();
+    g_smb.reset();
+  }
+}
+
+}  // namespace
+
+BENCHMARK(BM_SharedMemoryArbiter_GetNewChunk)
+    ->ThreadRange(1, 16)
+    ->UseRealTime();
+
+}  // namespace perfetto
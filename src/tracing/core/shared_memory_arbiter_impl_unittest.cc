@@ -19,11 +19,14 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "perfetto/base/utils.h"
+#include "perfetto/trace/test_event.pbzero.h"
+#include "perfetto/trace/trace_packet.pbzero.h"
 #include "perfetto/tracing/core/basic_types.h"
 #include "perfetto/tracing/core/commit_data_request.h"
 #include "perfetto/tracing/core/shared_memory_abi.h"
 #include "perfetto/tracing/core/trace_writer.h"
 #include "src/base/test/test_task_runner.h"
+#include "src/tracing/core/packed_commit_data.h"
 #include "src/tracing/core/patch_list.h"
 #include "src/tracing/test/aligned_buffer_test.h"
 
@@ -33,6 +36,17 @@ namespace {
 using testing::Invoke;
 using testing::_;
 
+using ChunkToMove = PackedCommitData::ChunksToMoveReader::Entry;
+
+std::vector<ChunkToMove> GetChunksToMove(const CommitDataRequest& req) {
+  std::vector<ChunkToMove> chunks;
+  PackedCommitData::ChunksToMoveReader reader(req.packed_chunks_to_move());
+  ChunkToMove entry;
+  while (reader.Next(&entry))
+    chunks.push_back(entry);
+  return chunks;
+}
+
 class MockProducerEndpoint : public Service::ProducerEndpoint {
  public:
   void RegisterDataSource(const DataSourceDescriptor&) override {}
@@ -40,7 +54,10 @@ class MockProducerEndpoint : public Service::ProducerEndpoint {
   void NotifyFlushComplete(FlushRequestID) override {}
   SharedMemory* shared_memory() const override { return nullptr; }
   size_t shared_buffer_page_size_kb() const override { return 0; }
-  std::unique_ptr<TraceWriter> CreateTraceWriter(BufferID) override {
+  SharedMemoryOptions shared_memory_options() const override { return {}; }
+  std::unique_ptr<TraceWriter> CreateTraceWriter(
+      BufferID,
+      BufferExhaustedPolicy) override {
     return nullptr;
   }
 
@@ -94,15 +111,16 @@ TEST_P(SharedMemoryArbiterImplTest, GetAndReturnChunks) {
   EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _))
       .WillOnce(Invoke([on_commit_1](const CommitDataRequest& req,
                                      MockProducerEndpoint::CommitDataCallback) {
-        ASSERT_EQ(14 * 2 + 1, req.chunks_to_move_size());
+        std::vector<ChunkToMove> chunks = GetChunksToMove(req);
+        ASSERT_EQ(14u * 2 + 1, chunks.size());
         for (size_t i = 0; i < 14 * 2; i++) {
-          ASSERT_EQ(i / 14, req.chunks_to_move()[i].page());
-          ASSERT_EQ((i % 14) ^ 1, req.chunks_to_move()[i].chunk());
-          ASSERT_EQ(i % 5, req.chunks_to_move()[i].target_buffer());
+          ASSERT_EQ(i / 14, chunks[i].page);
+          ASSERT_EQ((i % 14) ^ 1, chunks[i].chunk);
+          ASSERT_EQ(i % 5, chunks[i].target_buffer);
         }
-        ASSERT_EQ(2u, req.chunks_to_move()[28].page());
-        ASSERT_EQ(1u, req.chunks_to_move()[28].chunk());
-        ASSERT_EQ(42u, req.chunks_to_move()[28].target_buffer());
+        ASSERT_EQ(2u, chunks[28].page);
+        ASSERT_EQ(1u, chunks[28].chunk);
+        ASSERT_EQ(42u, chunks[28].target_buffer);
         on_commit_1();
       }));
   PatchList ignored;
@@ -117,16 +135,181 @@ TEST_P(SharedMemoryArbiterImplTest, GetAndReturnChunks) {
   EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _))
       .WillOnce(Invoke([on_commit_2](const CommitDataRequest& req,
                                      MockProducerEndpoint::CommitDataCallback) {
-        ASSERT_EQ(1, req.chunks_to_move_size());
-        ASSERT_EQ(2u, req.chunks_to_move()[0].page());
-        ASSERT_EQ(0u, req.chunks_to_move()[0].chunk());
-        ASSERT_EQ(43u, req.chunks_to_move()[0].target_buffer());
+        std::vector<ChunkToMove> chunks = GetChunksToMove(req);
+        ASSERT_EQ(1u, chunks.size());
+        ASSERT_EQ(2u, chunks[0].page);
+        ASSERT_EQ(0u, chunks[0].chunk);
+        ASSERT_EQ(43u, chunks[0].target_buffer);
         on_commit_2();
       }));
   arbiter_->ReturnCompletedChunk(std::move(chunks[28]), 43, &ignored);
   task_runner_->RunUntilCheckpoint("on_commit_2");
 }
 
+// Check that the |size_hint| passed to GetNewChunk() is used to partition free
+// pages into chunks that are large enough, but not larger than necessary.
+TEST_P(SharedMemoryArbiterImplTest, SizeHint) {
+  SharedMemoryArbiterImpl::set_default_layout_for_testing(
+      SharedMemoryABI::PageLayout::kPageDiv14);
+  SharedMemoryABI* abi = arbiter_->shmem_abi_for_testing();
+  const size_t small_chunk_size = abi->GetChunkSizeForLayout(
+      SharedMemoryABI::kPageDiv14 << SharedMemoryABI::kLayoutShift);
+  const size_t page_chunk_size = abi->GetChunkSizeForLayout(
+      SharedMemoryABI::kPageDiv1 << SharedMemoryABI::kLayoutShift);
+
+  // No hint: the default layout is used.
+  SharedMemoryABI::Chunk chunk = arbiter_->GetNewChunk({}, 0 /*size_hint*/);
+  ASSERT_TRUE(chunk.is_valid());
+  EXPECT_EQ(small_chunk_size, chunk.size());
+
+  for (size_t size_hint : {page_size() / 5, page_size() / 3, page_size()}) {
+    chunk = arbiter_->GetNewChunk({}, size_hint);
+    ASSERT_TRUE(chunk.is_valid());
+    if (size_hint < page_size()) {
+      EXPECT_GE(chunk.payload_size(), size_hint);
+      EXPECT_LT(chunk.payload_size(), size_hint * 2);
+    } else {
+      // The hint can't be satisfied, the largest chunk is returned.
+      EXPECT_EQ(page_chunk_size, chunk.size());
+    }
+  }
+}
+
+// If the service scans the SMB, only the first chunk of each writer should be
+// committed explicitly.
+TEST_P(SharedMemoryArbiterImplTest, ServiceScansSmb) {
+  SharedMemoryArbiterImpl::set_default_layout_for_testing(
+      SharedMemoryABI::PageLayout::kPageDiv14);
+  SharedMemoryOptions options;
+  options.service_scans_smb = true;
+  arbiter_.reset(new SharedMemoryArbiterImpl(buf(), buf_size(), page_size(),
+                                             &mock_producer_endpoint_,
+                                             task_runner_.get(), options));
+
+  int num_requests = 0;
+  std::vector<uint32_t> committed_chunks_target_buffers;
+  EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _))
+      .WillRepeatedly(Invoke([&num_requests, &committed_chunks_target_buffers](
+                                 const CommitDataRequest& req,
+                                 MockProducerEndpoint::CommitDataCallback) {
+        num_requests++;
+        for (const auto& ctm : GetChunksToMove(req))
+          committed_chunks_target_buffers.push_back(ctm.target_buffer);
+      }));
+
+  PatchList ignored;
+  for (WriterID writer_id = 1; writer_id <= 2; writer_id++) {
+    for (int i = 0; i < 3; i++) {
+      SharedMemoryABI::ChunkHeader header{};
+      header.writer_id.store(writer_id);
+      SharedMemoryABI::Chunk chunk = arbiter_->GetNewChunk(header);
+      ASSERT_TRUE(chunk.is_valid());
+      arbiter_->ReturnCompletedChunk(std::move(chunk), writer_id, &ignored);
+    }
+  }
+  task_runner_->RunUntilIdle();
+  EXPECT_EQ(1, num_requests);
+  ASSERT_EQ(2u, committed_chunks_target_buffers.size());
+  EXPECT_EQ(1u, committed_chunks_target_buffers[0]);
+  EXPECT_EQ(2u, committed_chunks_target_buffers[1]);
+
+  // A flush sends an empty request, to make the service scan the SMB.
+  arbiter_->FlushPendingCommitDataRequests([] {});
+  EXPECT_EQ(2, num_requests);
+  EXPECT_EQ(2u, committed_chunks_target_buffers.size());
+}
+
+// If the service scans the SMB, the ID of a released writer must be announced
+// to the service and freed only once the service has acknowledged that.
+TEST_P(SharedMemoryArbiterImplTest, ServiceScansSmbReleasedWriter) {
+  SharedMemoryOptions options;
+  options.service_scans_smb = true;
+  arbiter_.reset(new SharedMemoryArbiterImpl(buf(), buf_size(), page_size(),
+                                             &mock_producer_endpoint_,
+                                             task_runner_.get(), options));
+
+  std::vector<uint32_t> released_writers;
+  MockProducerEndpoint::CommitDataCallback ack;
+  EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _))
+      .WillRepeatedly(Invoke([&released_writers, &ack](
+                                 const CommitDataRequest& req,
+                                 MockProducerEndpoint::CommitDataCallback cb) {
+        if (!req.released_writers_size())
+          return;
+        released_writers = req.released_writers();
+        ack = cb;
+      }));
+
+  // A writer unknown to the service is freed right away.
+  std::unique_ptr<TraceWriter> writer = arbiter_->CreateTraceWriter(1);
+  writer.reset();
+  task_runner_->RunUntilIdle();
+  EXPECT_TRUE(released_writers.empty());
+
+  writer = arbiter_->CreateTraceWriter(1);
+  const WriterID writer_id = writer->writer_id();
+  writer->NewTracePacket()->set_for_testing()->set_str("payload");
+  writer.reset();
+  task_runner_->RunUntilIdle();
+  ASSERT_EQ(1u, released_writers.size());
+  EXPECT_EQ(writer_id, released_writers[0]);
+  ASSERT_TRUE(ack);
+  ack();
+}
+
+// Check that, with a CommitPolicy, the chunks are batched until either enough
+// bytes are pending or |max_latency_ms| expires.
+TEST_P(SharedMemoryArbiterImplTest, CommitPolicy) {
+  SharedMemoryArbiterImpl::set_default_layout_for_testing(
+      SharedMemoryABI::PageLayout::kPageDiv14);
+  SharedMemoryABI* abi = arbiter_->shmem_abi_for_testing();
+  const size_t chunk_size = abi->GetChunkSizeForLayout(
+      SharedMemoryABI::kPageDiv14 << SharedMemoryABI::kLayoutShift);
+  SharedMemoryOptions options;
+  options.commit_policy.max_latency_ms = 100;
+  options.commit_policy.min_batch_bytes = static_cast<uint32_t>(chunk_size * 4);
+  arbiter_.reset(new SharedMemoryArbiterImpl(buf(), buf_size(), page_size(),
+                                             &mock_producer_endpoint_,
+                                             task_runner_.get(), options));
+
+  std::vector<size_t> chunks_per_request;
+  EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _))
+      .WillRepeatedly(Invoke([&chunks_per_request](
+                                 const CommitDataRequest& req,
+                                 MockProducerEndpoint::CommitDataCallback) {
+        chunks_per_request.push_back(GetChunksToMove(req).size());
+      }));
+
+  PatchList ignored;
+  auto return_chunks = [this, &ignored](int num_chunks) {
+    for (int i = 0; i < num_chunks; i++) {
+      SharedMemoryABI::Chunk chunk = arbiter_->GetNewChunk({});
+      ASSERT_TRUE(chunk.is_valid());
+      arbiter_->ReturnCompletedChunk(std::move(chunk), 1, &ignored);
+    }
+  };
+
+  // Less than |min_batch_bytes|: nothing is committed until the delayed task.
+  return_chunks(3);
+  task_runner_->RunUntilIdle();
+  EXPECT_TRUE(chunks_per_request.empty());
+
+  // The 4th chunk completes the batch.
+  return_chunks(1);
+  task_runner_->RunUntilIdle();
+  ASSERT_EQ(1u, chunks_per_request.size());
+  EXPECT_EQ(4u, chunks_per_request[0]);
+
+  // The delayed task commits the remaining chunks.
+  return_chunks(2);
+  auto committed = task_runner_->CreateCheckpoint("committed");
+  task_runner_->PostDelayedTask(committed,
+                                options.commit_policy.max_latency_ms * 2);
+  task_runner_->RunUntilCheckpoint("committed");
+  ASSERT_EQ(2u, chunks_per_request.size());
+  EXPECT_EQ(2u, chunks_per_request[1]);
+}
+
 // Check that we can actually create up to kMaxWriterID TraceWriter(s).
 TEST_P(SharedMemoryArbiterImplTest, WriterIDsAllocation) {
   std::map<WriterID, std::unique_ptr<TraceWriter>> writers;
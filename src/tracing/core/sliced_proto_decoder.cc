@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/sliced_proto_decoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "perfetto/base/logging.h"
+
+namespace perfetto {
+
+using protozero::ProtoDecoder;
+
+namespace {
+
+// The header of a field is its preamble, a varint of up to 10 bytes, followed
+// by either its value (a varint of up to 10 bytes or a fixed value of up to 8
+// bytes) or the varint size of its payload.
+constexpr size_t kMaxFieldHeaderSize = 20;
+
+}  // namespace
+
+SlicedProtoDecoder::SlicedProtoDecoder(const Slices* slices)
+    : slices_(slices), cursor_{0, 0, 0} {
+  for (const Slice& slice : *slices_)
+    cursor_.bytes_left += slice.size;
+}
+
+SlicedProtoDecoder::~SlicedProtoDecoder() = default;
+
+SlicedProtoDecoder::Field SlicedProtoDecoder::ReadField() {
+  Cursor cursor = cursor_;
+  SkipReadSlices(&cursor);
+  if (cursor.bytes_left == 0)
+    return Field{};
+
+  // Parse the header in place, unless it might straddle two slices.
+  Field field;
+  size_t header_size;
+  const uint8_t* ptr = SliceData(cursor.slice) + cursor.offset;
+  const size_t avail = (*slices_)[cursor.slice].size - cursor.offset;
+  if (avail >= kMaxFieldHeaderSize || avail == cursor.bytes_left) {
+    const uint8_t* header_end =
+        ProtoDecoder::ParseFieldHeader(ptr, ptr + avail, &field);
+    if (!header_end)
+      return Field{};
+    header_size = static_cast<size_t>(header_end - ptr);
+  } else {
+    uint8_t header[kMaxFieldHeaderSize];
+    const size_t size = std::min(sizeof(header), cursor.bytes_left);
+    Cursor peek = cursor;
+    Read(&peek, size, header);
+    const uint8_t* header_end =
+        ProtoDecoder::ParseFieldHeader(header, header + size, &field);
+    if (!header_end)
+      return Field{};
+    header_size = static_cast<size_t>(header_end - header);
+  }
+  Read(&cursor, header_size, nullptr);
+
+  if (field.type == protozero::proto_utils::kFieldTypeLengthDelimited) {
+    if (field.int_value > cursor.bytes_left)
+      return Field{};  // Truncated.
+    const size_t size = static_cast<size_t>(field.int_value);
+    SkipReadSlices(&cursor);
+    if (size == 0) {
+      field.data = nullptr;
+    } else if (size <= (*slices_)[cursor.slice].size - cursor.offset) {
+      field.data = SliceData(cursor.slice) + cursor.offset;
+      Read(&cursor, size, nullptr);
+    } else {
+      stitched_payload_.resize(size);
+      Read(&cursor, size, stitched_payload_.data());
+      field.data = stitched_payload_.data();
+    }
+  }
+
+  cursor_ = cursor;
+  return field;
+}
+
+void SlicedProtoDecoder::SkipReadSlices(Cursor* cursor) const {
+  while (cursor->slice < slices_->size() &&
+         cursor->offset == (*slices_)[cursor->slice].size) {
+    cursor->slice++;
+    cursor->offset = 0;
+  }
+}
+
+void SlicedProtoDecoder::Read(Cursor* cursor,
+                              size_t size,
+                              uint8_t* dst) const {
+  PERFETTO_DCHECK(size <= cursor->bytes_left);
+  while (size) {
+    SkipReadSlices(cursor);
+    const size_t n =
+        std::min(size, (*slices_)[cursor->slice].size - cursor->offset);
+    if (dst) {
+      memcpy(dst, SliceData(cursor->slice) + cursor->offset, n);
+      dst += n;
+    }
+    cursor->offset += n;
+    cursor->bytes_left -= n;
+    size -= n;
+  }
+}
+
+}  // namespace perfetto
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACING_CORE_SLICED_PROTO_DECODER_H_
+#define SRC_TRACING_CORE_SLICED_PROTO_DECODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "perfetto/protozero/proto_decoder.h"
+#include "perfetto/tracing/core/slice.h"
+
+namespace perfetto {
+
+// Reads the top-level fields of a proto-encoded message which is split across
+// a sequence of Slice(s), e.g. a TracePacket fragmented across several chunks.
+// This is the protozero::ProtoDecoder counterpart of SlicedProtobufInputStream
+// and has the same contract as ProtoDecoder::ReadField().
+//
+// Fields that are entirely contained in one slice, which is the common case,
+// are returned without copying. The payload of the length-delimited fields
+// that straddle two or more slices is reassembled in a buffer owned by the
+// decoder, which stays valid only until the next call to ReadField().
+class SlicedProtoDecoder {
+ public:
+  using Field = protozero::ProtoDecoder::Field;
+
+  explicit SlicedProtoDecoder(const Slices*);
+  ~SlicedProtoDecoder();
+
+  // Reads the next field and moves past it. Returns the invalid field once
+  // the end of the slices is reached, or if the next field is malformed. In
+  // the latter case the read cursor doesn't move and bytes_left() is > 0.
+  Field ReadField();
+
+  size_t bytes_left() const { return cursor_.bytes_left; }
+
+ private:
+  SlicedProtoDecoder(const SlicedProtoDecoder&) = delete;
+  SlicedProtoDecoder& operator=(const SlicedProtoDecoder&) = delete;
+
+  struct Cursor {
+    size_t slice;
+    size_t offset;  // Within the |slice|-th slice.
+    size_t bytes_left;
+  };
+
+  // Moves |cursor| past the slices that have been entirely read.
+  void SkipReadSlices(Cursor*) const;
+
+  // Copies |size| bytes at |cursor| into |dst| (or just skips them if |dst|
+  // is nullptr) and moves |cursor| past them. |size| must be <=
+  // |cursor->bytes_left|.
+  void Read(Cursor*, size_t size, uint8_t* dst) const;
+
+  const uint8_t* SliceData(size_t slice) const {
+    return reinterpret_cast<const uint8_t*>((*slices_)[slice].start);
+  }
+
+  const Slices* const slices_;
+  Cursor cursor_;
+
+  // Holds the payload of the last field if it straddles two or more slices.
+  std::vector<uint8_t> stitched_payload_;
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACING_CORE_SLICED_PROTO_DECODER_H_
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/sliced_proto_decoder.h"
+
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "perfetto/trace/trace_packet.pb.h"
+
+namespace perfetto {
+namespace {
+
+using protozero::ProtoDecoder;
+
+// (id, type, int_value, payload) of each field.
+using FieldTuple = std::tuple<uint32_t, uint32_t, uint64_t, std::string>;
+
+FieldTuple ToTuple(const ProtoDecoder::Field& field) {
+  std::string payload;
+  if (field.type == protozero::proto_utils::kFieldTypeLengthDelimited)
+    payload = std::string(field.as_string().data, field.as_string().size);
+  return FieldTuple(field.id, field.type, field.int_value, payload);
+}
+
+std::string EncodePacket() {
+  protos::TracePacket packet;
+  packet.set_timestamp(1234567890123ull);
+  packet.mutable_for_testing()->set_str("string field");
+  packet.mutable_ftrace_events()->set_cpu(3);
+  for (int i = 0; i < 4; i++) {
+    auto* event = packet.mutable_ftrace_events()->add_event();
+    event->set_pid(42 + i);
+    event->mutable_sched_switch()->set_prev_comm("tom");
+    event->mutable_sched_switch()->set_next_comm("jerry");
+  }
+  packet.set_incremental_state_cleared(true);
+  return packet.SerializeAsString();
+}
+
+std::vector<FieldTuple> ReadAll(SlicedProtoDecoder* decoder) {
+  std::vector<FieldTuple> fields;
+  for (auto field = decoder->ReadField(); field.valid();
+       field = decoder->ReadField()) {
+    fields.push_back(ToTuple(field));
+  }
+  return fields;
+}
+
+std::vector<FieldTuple> ReadAllContiguous(const std::string& encoded) {
+  ProtoDecoder decoder(reinterpret_cast<const uint8_t*>(encoded.data()),
+                       encoded.size());
+  std::vector<FieldTuple> fields;
+  for (auto field = decoder.ReadField(); field.valid();
+       field = decoder.ReadField()) {
+    fields.push_back(ToTuple(field));
+  }
+  EXPECT_EQ(0u, decoder.bytes_left());
+  return fields;
+}
+
+TEST(SlicedProtoDecoderTest, NoSlices) {
+  Slices slices;
+  SlicedProtoDecoder decoder(&slices);
+  EXPECT_FALSE(decoder.ReadField().valid());
+  EXPECT_EQ(0u, decoder.bytes_left());
+}
+
+TEST(SlicedProtoDecoderTest, SingleSlice) {
+  const std::string encoded = EncodePacket();
+  Slices slices;
+  slices.emplace_back(&encoded[0], encoded.size());
+  SlicedProtoDecoder decoder(&slices);
+  EXPECT_EQ(ReadAllContiguous(encoded), ReadAll(&decoder));
+  EXPECT_EQ(0u, decoder.bytes_left());
+}
+
+TEST(SlicedProtoDecoderTest, FragmentedAtEveryOffset) {
+  const std::string encoded = EncodePacket();
+  const std::vector<FieldTuple> expected = ReadAllContiguous(encoded);
+  for (size_t i = 0; i < encoded.size(); i++) {
+    for (size_t j = i; j < encoded.size(); j++) {
+      Slices slices;
+      slices.emplace_back(&encoded[0], i);
+      slices.emplace_back(&encoded[i], j - i);
+      slices.emplace_back(&encoded[j], encoded.size() - j);
+      SlicedProtoDecoder decoder(&slices);
+      ASSERT_EQ(expected, ReadAll(&decoder)) << i << ", " << j;
+      ASSERT_EQ(0u, decoder.bytes_left());
+    }
+  }
+}
+
+TEST(SlicedProtoDecoderTest, OneByteSlices) {
+  const std::string encoded = EncodePacket();
+  Slices slices;
+  for (size_t i = 0; i < encoded.size(); i++)
+    slices.emplace_back(&encoded[i], 1);
+  SlicedProtoDecoder decoder(&slices);
+  EXPECT_EQ(ReadAllContiguous(encoded), ReadAll(&decoder));
+  EXPECT_EQ(0u, decoder.bytes_left());
+}
+
+TEST(SlicedProtoDecoderTest, Truncated) {
+  const std::string encoded = EncodePacket();
+  for (size_t size = 1; size < encoded.size(); size++) {
+    Slices slices;
+    slices.emplace_back(&encoded[0], size / 2);
+    slices.emplace_back(&encoded[size / 2], size - size / 2);
+    SlicedProtoDecoder decoder(&slices);
+    const std::vector<FieldTuple> fields = ReadAll(&decoder);
+    ProtoDecoder contiguous(reinterpret_cast<const uint8_t*>(encoded.data()),
+                            size);
+    size_t num_fields = 0;
+    while (contiguous.ReadField().valid())
+      num_fields++;
+    EXPECT_EQ(num_fields, fields.size());
+    EXPECT_EQ(contiguous.bytes_left(), decoder.bytes_left());
+  }
+}
+
+}  // namespace
+}  // namespace perfetto
@@ -17,13 +17,19 @@
 #include "src/tracing/core/trace_buffer.h"
 
 #include <sys/mman.h>
+
+#include <algorithm>
+#include <iterator>
 #include <limits>
 
 #include "perfetto/base/logging.h"
+#include "perfetto/protozero/proto_decoder.h"
 #include "perfetto/protozero/proto_utils.h"
 #include "perfetto/tracing/core/shared_memory_abi.h"
 #include "perfetto/tracing/core/trace_packet.h"
 
+#include "perfetto/trace/trace_packet.pbzero.h"
+
 #define TRACE_BUFFER_VERBOSE_LOGGING() 0  // Set to 1 when debugging unittests.
 #if TRACE_BUFFER_VERBOSE_LOGGING()
 #define TRACE_BUFFER_DLOG PERFETTO_DLOG
@@ -57,20 +63,73 @@ constexpr uint8_t kLastPacketContinuesOnNextChunk =
     SharedMemoryABI::ChunkHeader::kLastPacketContinuesOnNextChunk;
 constexpr uint8_t kChunkNeedsPatching =
     SharedMemoryABI::ChunkHeader::kChunkNeedsPatching;
+
+// BeginRead() releases the chunks read only once there are at least
+// max(1/16 of the buffer, this) bytes of them.
+constexpr size_t kMinReleaseSize = 16 * base::kPageSize;
+
+// Returns the TracePacket.timestamp of the first packet that begins in the
+// chunk |payload|, or 0 if it isn't found within the chunk. |payload| has been
+// copied out of the shared memory buffer already, but its contents are still
+// untrusted: the parsing just gives up on malformed data.
+uint64_t GetTimestampHint(const uint8_t* payload,
+                          size_t size,
+                          uint16_t num_fragments,
+                          uint8_t chunk_flags) {
+  using protozero::ProtoDecoder;
+  using protozero::proto_utils::kMessageLengthFieldSize;
+  const uint8_t* ptr = payload;
+  const uint8_t* const end = payload + size;
+
+  // Skip the tail of the packet that began in the previous chunk, if any.
+  if (chunk_flags & kFirstPacketContinuesFromPrevChunk) {
+    if (num_fragments-- == 0)
+      return 0;
+    uint64_t fragment_size = 0;
+    ptr = ProtoDecoder::ParseVarInt(
+        ptr, std::min(ptr + kMessageLengthFieldSize, end), &fragment_size);
+    if (!ptr || fragment_size > static_cast<uint64_t>(end - ptr))
+      return 0;
+    ptr += fragment_size;
+  }
+  if (num_fragments == 0 || ptr >= end)
+    return 0;
+
+  // Scan the top level fields of the packet, as far as they are in the chunk.
+  uint64_t packet_size = 0;
+  ptr = ProtoDecoder::ParseVarInt(
+      ptr, std::min(ptr + kMessageLengthFieldSize, end), &packet_size);
+  if (!ptr)
+    return 0;
+  const size_t size_in_chunk = static_cast<size_t>(
+      std::min(packet_size, static_cast<uint64_t>(end - ptr)));
+  ProtoDecoder packet(ptr, size_in_chunk);
+  for (auto field = packet.ReadField(); field.valid();
+       field = packet.ReadField()) {
+    if (field.id == protos::pbzero::TracePacket::kTimestampFieldNumber &&
+        field.type == protozero::proto_utils::kFieldTypeVarInt) {
+      return field.as_uint64();
+    }
+  }
+  return 0;
+}
 }  // namespace.
 
 constexpr size_t TraceBuffer::ChunkRecord::kMaxSize;
+constexpr size_t TraceBuffer::kMaxPaddingSize;
 constexpr size_t TraceBuffer::InlineChunkHeaderSize = sizeof(ChunkRecord);
 
 // static
-std::unique_ptr<TraceBuffer> TraceBuffer::Create(size_t size_in_bytes) {
-  std::unique_ptr<TraceBuffer> trace_buffer(new TraceBuffer());
-  if (!trace_buffer->Initialize(size_in_bytes))
+std::unique_ptr<TraceBuffer> TraceBuffer::Create(size_t size_in_bytes,
+                                                 OverwritePolicy pol,
+                                                 bool use_huge_pages) {
+  std::unique_ptr<TraceBuffer> trace_buffer(new TraceBuffer(pol));
+  if (!trace_buffer->Initialize(size_in_bytes, use_huge_pages))
     return nullptr;
   return trace_buffer;
 }
 
-TraceBuffer::TraceBuffer() {
+TraceBuffer::TraceBuffer(OverwritePolicy pol) : overwrite_policy_(pol) {
   // See comments in ChunkRecord for the rationale of this.
   static_assert(sizeof(ChunkRecord) == sizeof(SharedMemoryABI::PageHeader) +
                                            sizeof(SharedMemoryABI::ChunkHeader),
@@ -79,12 +138,51 @@ TraceBuffer::TraceBuffer() {
 
 TraceBuffer::~TraceBuffer() = default;
 
-bool TraceBuffer::Initialize(size_t size) {
+std::unique_ptr<TraceBuffer> TraceBuffer::CloneReadOnly() const {
+  std::unique_ptr<TraceBuffer> clone(new TraceBuffer(overwrite_policy_));
+  if (!clone->Initialize(size_, false /*use_huge_pages*/))
+    return nullptr;
+
+  // Until the buffer wraps for the first time, everything past the write
+  // pointer is still zero-filled, as is the freshly mmap()-ed |clone| memory.
+  // Skip copying it, to avoid committing pages that are not used. A full
+  // kDiscard buffer might have its write pointer reset to begin() instead.
+  const size_t used_size = stats_.write_wrap_count > 0 || discard_writes_
+                               ? size_
+                               : static_cast<size_t>(wptr_ - begin());
+  memcpy(clone->begin(), begin(), used_size);
+  clone->wptr_ = clone->begin() + (wptr_ - begin());
+
+  // Rebase the index entries onto the |clone| memory. |index_| is already
+  // sorted, hence the hinted insertions at the end take constant time.
+  for (const auto& key_and_meta : index_) {
+    const ChunkMeta& meta = key_and_meta.second;
+    uint8_t* record_ptr =
+        clone->begin() + (reinterpret_cast<uint8_t*>(meta.chunk_record) -
+                          begin());
+    auto it = clone->index_.emplace_hint(
+        clone->index_.end(), key_and_meta.first,
+        ChunkMeta(clone->GetChunkRecordAt(record_ptr), meta.num_fragments,
+                  meta.flags, meta.trusted_uid));
+    it->second.num_fragments_read = meta.num_fragments_read;
+    it->second.cur_fragment_offset = meta.cur_fragment_offset;
+    it->second.timestamp_hint = meta.timestamp_hint;
+  }
+  clone->last_chunk_id_ = last_chunk_id_;
+  clone->sequences_with_data_loss_ = sequences_with_data_loss_;
+  clone->stats_ = stats_;
+  clone->discard_writes_ = discard_writes_;
+  clone->read_order_ = read_order_;
+  clone->read_only_ = true;
+  return clone;
+}
+
+bool TraceBuffer::Initialize(size_t size, bool use_huge_pages) {
   static_assert(
       base::kPageSize % sizeof(ChunkRecord) == 0,
       "sizeof(ChunkRecord) must be an integer divider of a page size");
   PERFETTO_CHECK(size % base::kPageSize == 0);
-  data_ = base::PageAllocator::AllocateMayFail(size);
+  data_ = base::PageAllocator::AllocateMayFail(size, use_huge_pages);
   if (!data_) {
     PERFETTO_ELOG("Trace buffer allocation failed (size: %zu)", size);
     return false;
@@ -94,6 +192,7 @@ bool TraceBuffer::Initialize(size_t size) {
   wptr_ = begin();
   index_.clear();
   last_chunk_id_.clear();
+  sequences_with_data_loss_.clear();
   read_iter_ = GetReadIterForSequence(index_.end());
   return true;
 }
@@ -109,6 +208,16 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
                                      uint8_t chunk_flags,
                                      const uint8_t* src,
                                      size_t size) {
+  PERFETTO_DCHECK(!read_only_);
+  ProducerStats* producer_stats = GetProducerStats(producer_id_trusted);
+
+  // Once a kDiscard buffer is full, there is nothing else to do.
+  if (PERFETTO_UNLIKELY(discard_writes_)) {
+    stats_.chunks_discarded++;
+    producer_stats->chunks_discarded++;
+    return;
+  }
+
   // |record_size| = |size| + sizeof(ChunkRecord), rounded up to avoid to end
   // up in a fragmented state where size_to_end() < sizeof(ChunkRecord).
   const size_t record_size =
@@ -119,6 +228,17 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
     return;
   }
 
+  if (PERFETTO_UNLIKELY(producer_quota_ &&
+                        producer_stats->bytes_in_buffer + record_size >
+                            producer_quota_)) {
+    if (overwrite_policy_ == kDiscard) {
+      stats_.chunks_discarded++;
+      producer_stats->chunks_discarded++;
+      return;
+    }
+    SkipChunksWithinQuota(producer_id_trusted);
+  }
+
   TRACE_BUFFER_DLOG("CopyChunk @ %lu, size=%zu", wptr_ - begin(), record_size);
 
 #if PERFETTO_DCHECK_IS_ON()
@@ -129,6 +249,14 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
   // record to clear the end of the buffer and wrap back.
   const size_t cached_size_to_end = size_to_end();
   if (PERFETTO_UNLIKELY(record_size > cached_size_to_end)) {
+    if (overwrite_policy_ == kDiscard) {
+      // Keep the data written so far. The space left is not reused by smaller
+      // chunks either, to not leave holes in the sequences.
+      discard_writes_ = true;
+      stats_.chunks_discarded++;
+      producer_stats->chunks_discarded++;
+      return;
+    }
     size_t res = DeleteNextChunksFor(cached_size_to_end);
     PERFETTO_DCHECK(res <= cached_size_to_end);
     AddPaddingRecord(cached_size_to_end);
@@ -170,26 +298,51 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
   ChunkMeta::Key key(record);
   stats_.chunks_written++;
   stats_.bytes_written += size;
+  producer_stats->chunks_written++;
+  producer_stats->bytes_written += size;
+  producer_stats->bytes_in_buffer += record_size;
   auto it_and_inserted =
       index_.emplace(key, ChunkMeta(GetChunkRecordAt(wptr_), num_fragments,
                                     chunk_flags, producer_uid_trusted));
+  ChunkMap::iterator it = it_and_inserted.first;
   if (PERFETTO_UNLIKELY(!it_and_inserted.second)) {
     // More likely a producer bug, but could also be a malicious producer.
     stats_.abi_violations++;
     PERFETTO_DCHECK(suppress_sanity_dchecks_for_testing_);
-    index_.erase(it_and_inserted.first);
-    index_.emplace(key, ChunkMeta(GetChunkRecordAt(wptr_), num_fragments,
-                                  chunk_flags, producer_uid_trusted));
+    index_.erase(it);
+    it = index_
+             .emplace(key, ChunkMeta(GetChunkRecordAt(wptr_), num_fragments,
+                                     chunk_flags, producer_uid_trusted))
+             .first;
   }
   TRACE_BUFFER_DLOG("  copying @ [%lu - %lu] %zu", wptr_ - begin(),
                     wptr_ - begin() + record_size, record_size);
   WriteChunkRecord(record, src, size);
+  if (read_order_ == kTimestampOrder) {
+    uint64_t timestamp_hint = GetTimestampHint(wptr_ + sizeof(record), size,
+                                               num_fragments, chunk_flags);
+
+    // Chunks without a hint (e.g. containing just the middle of a large
+    // packet) inherit the one of the previous chunk of the sequence.
+    if (!timestamp_hint && it != index_.begin()) {
+      auto prev = std::prev(it);
+      if (prev->first.producer_id == producer_id_trusted &&
+          prev->first.writer_id == writer_id &&
+          prev->first.chunk_id == chunk_id - 1) {
+        timestamp_hint = prev->second.timestamp_hint;
+      }
+    }
+    it->second.timestamp_hint = timestamp_hint;
+  }
   TRACE_BUFFER_DLOG("Chunk raw: %s", HexDump(wptr_, record_size).c_str());
   wptr_ += record_size;
   if (wptr_ >= end()) {
     PERFETTO_DCHECK(padding_size == 0);
     wptr_ = begin();
-    stats_.write_wrap_count++;
+    if (overwrite_policy_ == kDiscard)
+      discard_writes_ = true;  // Never overwrite the data at begin().
+    else
+      stats_.write_wrap_count++;
   }
   DcheckIsAlignedAndWithinBounds(wptr_);
 
@@ -230,12 +383,20 @@ size_t TraceBuffer::DeleteNextChunksFor(size_t bytes_to_clear) {
     // records are not part of the index).
     if (PERFETTO_LIKELY(!next_chunk.is_padding)) {
       ChunkMeta::Key key(next_chunk);
+      ProducerStats* producer_stats = GetProducerStats(key.producer_id);
+      PERFETTO_DCHECK(producer_stats->bytes_in_buffer >= next_chunk.size);
+      producer_stats->bytes_in_buffer -= next_chunk.size;
       auto it = index_.find(key);
       bool removed = false;
       if (PERFETTO_LIKELY(it != index_.end())) {
         const ChunkMeta& meta = it->second;
-        if (PERFETTO_UNLIKELY(meta.num_fragments_read < meta.num_fragments))
+        if (PERFETTO_UNLIKELY(meta.num_fragments_read < meta.num_fragments)) {
           stats_.chunks_overwritten++;
+          producer_stats->chunks_overwritten++;
+          producer_stats->bytes_overwritten +=
+              next_chunk.size - sizeof(ChunkRecord);
+          sequences_with_data_loss_.emplace(key.producer_id, key.writer_id);
+        }
         index_.erase(it);
         removed = true;
       }
@@ -259,6 +420,39 @@ size_t TraceBuffer::DeleteNextChunksFor(size_t bytes_to_clear) {
   return static_cast<size_t>(next_chunk_ptr - search_end);
 }
 
+void TraceBuffer::SkipChunksWithinQuota(ProducerID producer_id) {
+  for (size_t skipped_size = 0; skipped_size < size_;) {
+    const ChunkRecord& record = *GetChunkRecordAt(wptr_);
+
+    // Stop at the zero-filled part of the buffer and at padding records (e.g.
+    // released chunks): they can be written without evicting anything.
+    if (!record.is_valid() || record.is_padding ||
+        record.producer_id == producer_id ||
+        GetProducerStats(record.producer_id)->bytes_in_buffer >
+            producer_quota_) {
+      return;
+    }
+    TRACE_BUFFER_DLOG("  skip chunk [%lu %lu] within quota", wptr_ - begin(),
+                      wptr_ - begin() + record.size);
+    skipped_size += record.size;
+    wptr_ += record.size;
+
+    // The records are chained until end(), see AddPaddingRecord().
+    PERFETTO_CHECK(wptr_ <= end());
+    if (wptr_ == end()) {
+      wptr_ = begin();
+      stats_.write_wrap_count++;
+    }
+  }
+}
+
+TraceBuffer::ProducerStats* TraceBuffer::LookupProducerStats(
+    ProducerID producer_id) {
+  last_producer_id_ = producer_id;
+  last_producer_stats_ = &stats_.producer_stats[producer_id];
+  return last_producer_stats_;
+}
+
 void TraceBuffer::AddPaddingRecord(size_t size) {
   PERFETTO_DCHECK(size >= sizeof(ChunkRecord) && size <= ChunkRecord::kMaxSize);
   ChunkRecord record(size);
@@ -275,6 +469,7 @@ bool TraceBuffer::TryPatchChunkContents(ProducerID producer_id,
                                         const Patch* patches,
                                         size_t patches_size,
                                         bool other_patches_pending) {
+  PERFETTO_DCHECK(!read_only_);
   ChunkMeta::Key key(producer_id, writer_id, chunk_id);
   auto it = index_.find(key);
   if (it == index_.end()) {
@@ -333,10 +528,35 @@ bool TraceBuffer::TryPatchChunkContents(ProducerID producer_id,
 }
 
 void TraceBuffer::BeginRead() {
+  // The packets returned by the previous read pass point into the chunks that
+  // it read, so these can't be released any earlier than this.
+  if (read_bytes_to_release_ >= std::max(size_ / 16, kMinReleaseSize) &&
+      !read_only_) {
+    ReleaseReadChunks();
+  }
   read_iter_ = GetReadIterForSequence(index_.begin());
 #if PERFETTO_DCHECK_IS_ON()
   changed_since_last_read_ = false;
 #endif
+  if (read_order_ != kTimestampOrder)
+    return;
+  sorted_sequences_.clear();
+  for (auto seq_begin = index_.begin(); seq_begin != index_.end();) {
+    SequenceIterator seq = GetReadIterForSequence(seq_begin);
+    seq_begin = seq.seq_end;
+    PushSortedSequence(seq);
+  }
+}
+
+void TraceBuffer::PushSortedSequence(SequenceIterator seq) {
+  while (seq.is_valid() &&
+         (*seq).num_fragments_read == (*seq).num_fragments) {
+    seq.MoveNext();
+  }
+  if (!seq.is_valid())
+    return;
+  sorted_sequences_.push_back({(*seq).timestamp_hint, seq});
+  std::push_heap(sorted_sequences_.begin(), sorted_sequences_.end());
 }
 
 TraceBuffer::SequenceIterator TraceBuffer::GetReadIterForSequence(
@@ -391,8 +611,39 @@ void TraceBuffer::SequenceIterator::MoveNext() {
     cur = seq_begin;
 }
 
-bool TraceBuffer::ReadNextTracePacket(TracePacket* packet,
-                                      uid_t* producer_uid) {
+bool TraceBuffer::ReadNextTracePacket(
+    TracePacket* packet,
+    PacketSequenceProperties* sequence_properties,
+    bool* previous_packet_on_sequence_dropped) {
+  if (read_order_ == kSequenceOrder) {
+    return ReadNextTracePacketInternal(packet, sequence_properties,
+                                       previous_packet_on_sequence_dropped,
+                                       false /*stay_on_sequence*/);
+  }
+
+  // Read the next packet of the sequence with the lowest timestamp hint. Then
+  // put the sequence back into the heap, keyed by the hint of the chunk that
+  // follows that packet. Sequences that have nothing readable left (e.g.
+  // because they are waiting for patches) are dropped until the next pass.
+  while (!sorted_sequences_.empty()) {
+    std::pop_heap(sorted_sequences_.begin(), sorted_sequences_.end());
+    read_iter_ = sorted_sequences_.back().iter;
+    sorted_sequences_.pop_back();
+    if (ReadNextTracePacketInternal(packet, sequence_properties,
+                                    previous_packet_on_sequence_dropped,
+                                    true /*stay_on_sequence*/)) {
+      PushSortedSequence(read_iter_);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TraceBuffer::ReadNextTracePacketInternal(
+    TracePacket* packet,
+    PacketSequenceProperties* sequence_properties,
+    bool* previous_packet_on_sequence_dropped,
+    bool stay_on_sequence) {
   // Note: MoveNext() moves only within the next chunk within the same
   // {ProducerID, WriterID} sequence. Here we want to:
   // - return the next patched+complete packet in the current sequence, if any.
@@ -401,7 +652,8 @@ bool TraceBuffer::ReadNextTracePacket(TracePacket* packet,
   TRACE_BUFFER_DLOG("ReadNextTracePacket()");
 
   // Just in case we forget to initialize it below.
-  *producer_uid = kInvalidUid;
+  *sequence_properties = {0, kInvalidUid, 0};
+  *previous_packet_on_sequence_dropped = false;
 
 #if PERFETTO_DCHECK_IS_ON()
   PERFETTO_DCHECK(!changed_since_last_read_);
@@ -411,8 +663,10 @@ bool TraceBuffer::ReadNextTracePacket(TracePacket* packet,
       // We ran out of chunks in the current {ProducerID, WriterID} sequence or
       // we just reached the index_.end().
 
-      if (PERFETTO_UNLIKELY(read_iter_.seq_end == index_.end()))
+      if (PERFETTO_UNLIKELY(stay_on_sequence ||
+                            read_iter_.seq_end == index_.end())) {
         return false;
+      }
 
       // We reached the end of sequence, move to the next one.
       // Note: ++read_iter_.seq_end might become index_.end(), but
@@ -431,6 +685,8 @@ bool TraceBuffer::ReadNextTracePacket(TracePacket* packet,
     }
 
     const uid_t trusted_uid = chunk_meta->trusted_uid;
+    const ProducerID producer_id = read_iter_.producer_id();
+    const WriterID writer_id = read_iter_.writer_id();
 
     // At this point we have a chunk in |chunk_meta| that has not been fully
     // read. We don't know yet whether we have enough data to read the full
@@ -487,13 +743,16 @@ bool TraceBuffer::ReadNextTracePacket(TracePacket* packet,
         // incrementing the |num_fragments_read| and marking the fragment as
         // read even if we didn't really.
         ReadNextPacketInChunk(chunk_meta, nullptr);
+        sequences_with_data_loss_.emplace(producer_id, writer_id);
         continue;
       }
 
       if (action == kReadOnePacket) {
         // The easy peasy case B.
         if (PERFETTO_LIKELY(ReadNextPacketInChunk(chunk_meta, packet))) {
-          *producer_uid = trusted_uid;
+          *sequence_properties = {producer_id, trusted_uid, writer_id};
+          *previous_packet_on_sequence_dropped =
+              ConsumeDataLoss(producer_id, writer_id);
           return true;
         }
 
@@ -501,6 +760,7 @@ bool TraceBuffer::ReadNextTracePacket(TracePacket* packet,
         // contain an invalid fragment. In such case we don't want to stall the
         // sequence but just skip the chunk and move on.
         stats_.abi_violations++;
+        sequences_with_data_loss_.emplace(producer_id, writer_id);
         PERFETTO_DCHECK(suppress_sanity_dchecks_for_testing_);
         break;
       }
@@ -509,7 +769,9 @@ bool TraceBuffer::ReadNextTracePacket(TracePacket* packet,
       ReadAheadResult ra_res = ReadAhead(packet);
       if (ra_res == ReadAheadResult::kSucceededReturnSlices) {
         stats_.readaheads_succeeded++;
-        *producer_uid = trusted_uid;
+        *sequence_properties = {producer_id, trusted_uid, writer_id};
+        *previous_packet_on_sequence_dropped =
+            ConsumeDataLoss(producer_id, writer_id);
         return true;
       }
 
@@ -558,12 +820,33 @@ TraceBuffer::ReadAheadResult TraceBuffer::ReadAhead(TracePacket* packet) {
 
     // If we miss the next chunk, stop looking in the current sequence and
     // try another sequence. This chunk might come in the near future.
-    // The second condition is the edge case of a buggy/malicious
-    // producer. The ChunkID is contiguous but its flags don't make sense.
-    if (it.chunk_id() != next_chunk_id ||
-        PERFETTO_UNLIKELY(
-            !((*it).flags & kFirstPacketContinuesFromPrevChunk))) {
+    if (it.chunk_id() != next_chunk_id)
       return ReadAheadResult::kFailedMoveToNextSequence;
+
+    // The ChunkID is contiguous but the chunk doesn't continue the packet.
+    // The producer gave up on the packet (e.g., it ran out of shared memory
+    // and is using BufferExhaustedPolicy::kDrop), so the packet will never be
+    // completed. Skip its fragments and resume reading from |it|, rather than
+    // stalling the sequence forever.
+    if (PERFETTO_UNLIKELY(
+            !((*it).flags & kFirstPacketContinuesFromPrevChunk))) {
+      for (; read_iter_.cur != it.cur; read_iter_.MoveNext()) {
+        ChunkMeta* chunk_meta = &*read_iter_;
+        while (chunk_meta->num_fragments_read < chunk_meta->num_fragments) {
+          if (ReadNextPacketInChunk(chunk_meta, nullptr))
+            continue;
+          // The chunk declares more fragments than it contains (producer
+          // bugged / malicious). Skip the rest of it, as ReadNextTracePacket()
+          // does, rather than trying again forever.
+          chunk_meta->num_fragments_read = chunk_meta->num_fragments;
+          stats_.abi_violations++;
+          break;
+        }
+      }
+      stats_.truncated_packets++;
+      sequences_with_data_loss_.emplace(read_iter_.producer_id(),
+                                        read_iter_.writer_id());
+      return ReadAheadResult::kFailedStayOnSameSequence;
     }
 
     // If the chunk is contiguous but has not been patched yet move to the next
@@ -607,6 +890,8 @@ TraceBuffer::ReadAheadResult TraceBuffer::ReadAhead(TracePacket* packet) {
 
     if (PERFETTO_UNLIKELY(packet_corruption)) {
       stats_.abi_violations++;
+      sequences_with_data_loss_.emplace(read_iter_.producer_id(),
+                                        read_iter_.writer_id());
       PERFETTO_DCHECK(suppress_sanity_dchecks_for_testing_);
       *packet = TracePacket();  // clear.
       return ReadAheadResult::kFailedStayOnSameSequence;
@@ -617,6 +902,88 @@ TraceBuffer::ReadAheadResult TraceBuffer::ReadAhead(TracePacket* packet) {
   return ReadAheadResult::kFailedMoveToNextSequence;
 }
 
+void TraceBuffer::ReleaseReadChunks() {
+  read_bytes_to_release_ = 0;
+  uint8_t* run_begin = nullptr;
+  uint8_t* ptr = begin();
+  while (ptr < end()) {
+    ChunkRecord* record = GetChunkRecordAt(ptr);
+
+    // The untouched part of the buffer, zero-filled until end().
+    if (!record->is_valid())
+      break;
+
+    // Runs can't span across |wptr_|: DeleteNextChunksFor() expects it to
+    // point to the beginning of a record.
+    if (ptr == wptr_ && run_begin) {
+      ReleaseRun(run_begin, ptr);
+      run_begin = nullptr;
+    }
+
+    bool is_released = record->is_padding;
+    if (!is_released) {
+      auto it = index_.find(ChunkMeta::Key(*record));
+      if (it != index_.end() &&
+          it->second.num_fragments_read == it->second.num_fragments &&
+          !(it->second.flags & kChunkNeedsPatching)) {
+        index_.erase(it);
+        is_released = true;
+        // The space of a kDiscard buffer is never reused, hence its released
+        // chunks keep counting towards the quota of their producer.
+        if (overwrite_policy_ == kOverwrite) {
+          GetProducerStats(record->producer_id)->bytes_in_buffer -=
+              record->size;
+        }
+      }
+    }
+    uint8_t* next_ptr = ptr + record->size;
+    if (is_released && !run_begin)
+      run_begin = ptr;
+    if (!is_released && run_begin) {
+      ReleaseRun(run_begin, ptr);
+      run_begin = nullptr;
+    }
+    ptr = next_ptr;
+  }
+  if (run_begin)
+    ReleaseRun(run_begin, ptr);
+}
+
+void TraceBuffer::ReleaseRun(uint8_t* run_begin, uint8_t* run_end) {
+  for (uint8_t* piece = run_begin; piece < run_end;) {
+    size_t piece_size = static_cast<size_t>(run_end - piece);
+    if (piece_size > kMaxPaddingSize) {
+      // End the piece on a page boundary, so that the header of the next one
+      // is at the beginning of a page.
+      size_t piece_end_offset = static_cast<size_t>(piece - begin()) +
+                                kMaxPaddingSize;
+      piece_end_offset -= piece_end_offset % base::kPageSize;
+      piece_size = piece_end_offset - static_cast<size_t>(piece - begin());
+    }
+    ChunkRecord record(piece_size);
+    record.is_padding = 1;
+    memcpy(piece, &record, sizeof(record));
+
+    // Release the pages after the one that holds the header.
+    uint8_t* release_begin = begin() + base::AlignUp<base::kPageSize>(
+        static_cast<size_t>(piece - begin()) + sizeof(record));
+    uint8_t* release_end = piece + piece_size;
+    release_end -= static_cast<size_t>(release_end - begin()) % base::kPageSize;
+    if (release_end > release_begin) {
+      base::PageAllocator::ReleasePages(
+          release_begin, static_cast<size_t>(release_end - release_begin));
+    }
+    piece += piece_size;
+  }
+}
+
+bool TraceBuffer::ConsumeDataLoss(ProducerID producer_id, WriterID writer_id) {
+  if (PERFETTO_LIKELY(sequences_with_data_loss_.empty()))
+    return false;
+  return sequences_with_data_loss_.erase(std::make_pair(producer_id,
+                                                        writer_id)) > 0;
+}
+
 bool TraceBuffer::ReadNextPacketInChunk(ChunkMeta* chunk_meta,
                                         TracePacket* packet) {
   PERFETTO_DCHECK(chunk_meta->num_fragments_read < chunk_meta->num_fragments);
@@ -659,6 +1026,8 @@ bool TraceBuffer::ReadNextPacketInChunk(ChunkMeta* chunk_meta,
   chunk_meta->cur_fragment_offset =
       static_cast<uint16_t>(next_packet - packets_begin);
   chunk_meta->num_fragments_read++;
+  if (chunk_meta->num_fragments_read == chunk_meta->num_fragments)
+    read_bytes_to_release_ += chunk_meta->chunk_record->size;
 
   if (PERFETTO_UNLIKELY(packet_size == 0)) {
     stats_.abi_violations++;
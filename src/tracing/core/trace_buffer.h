@@ -23,7 +23,9 @@
 #include <array>
 #include <limits>
 #include <map>
+#include <set>
 #include <tuple>
+#include <vector>
 
 #include "perfetto/base/logging.h"
 #include "perfetto/base/page_allocator.h"
@@ -61,6 +63,21 @@ class TracePacket;
 // content, entire chunks are overwritten or clobbered. The buffer never leaves
 // a partial chunk around. Chunks' payload is copied as-is, but their header is
 // not and is repacked in order to keep the ProducerID around.
+// With the kDiscard policy, instead, the buffer never wraps: once a chunk
+// doesn't fit in the space left, that chunk and all the following ones are
+// discarded.
+//
+// Producer quotas
+// ---------------
+// Optionally (see set_producer_quota()), the space that the chunks of each
+// producer can take up in the buffer is limited. This matters only once the
+// buffer is full: before overwriting the chunk at the write pointer, the
+// chunks of a producer that exceeds its quota skip over the chunks of the
+// producers within their quota, so that it ends up overwriting its own
+// oldest chunks (or the ones of other producers above quota) instead. With
+// kDiscard, the chunks of a producer above quota are discarded. The skipping
+// is limited to the chunks at the write pointer, hence the quota is enforced
+// only approximately, but it costs nothing in the common case.
 //
 // Chunks are stored in the buffer next to each other. Each chunk is prefixed by
 // an inline header (ChunkRecord), which contains most of the fields of the
@@ -124,12 +141,51 @@ class TracePacket;
 // (according to their ChunkID), but don't give any guarantee about the read
 // order of packets from different sequences, see comments in
 // ReadNextTracePacket() below.
+//
+// Reading in timestamp order
+// --------------------------
+// With kTimestampOrder (see set_read_order()), the sequences are merged
+// instead, so that the packets come out in approximate timestamp order. Each
+// chunk has a timestamp hint: the TracePacket.timestamp of the first packet
+// that begins in it, extracted when the chunk is copied. Within a read pass,
+// a min-heap of the sequences, keyed by the hint of their first unread chunk,
+// picks the sequence to read the next packet from. The heap holds one
+// SequenceIterator per sequence, hence the memory used doesn't depend on the
+// amount of data in the buffer. The order is approximate: the packets of a
+// chunk share its hint, and the hints of the writers are trusted as-is.
 class TraceBuffer {
  public:
   static const size_t InlineChunkHeaderSize;  // For test/fake_packet.{cc,h}.
 
+  // What happens when a chunk doesn't fit in the space left in the buffer.
+  enum OverwritePolicy {
+    // Overwrites the oldest chunks (ring buffer).
+    kOverwrite,
+
+    // Discards the new chunk and all the following ones.
+    kDiscard,
+  };
+
+  // The order in which ReadNextTracePacket() returns the packets.
+  enum ReadOrder {
+    // Sequence by sequence, see ReadNextTracePacket().
+    kSequenceOrder,
+
+    // Approximate timestamp order, see "Reading in timestamp order" above.
+    kTimestampOrder,
+  };
+
   // Maintain these fields consistent with trace_stats.proto. See comments in
   // the .proto for the semantic of these fields.
+  struct ProducerStats {
+    uint64_t bytes_written = 0;
+    uint64_t chunks_written = 0;
+    uint64_t chunks_overwritten = 0;
+    uint64_t bytes_overwritten = 0;
+    uint64_t chunks_discarded = 0;
+    uint64_t bytes_in_buffer = 0;
+  };
+
   struct Stats {
     uint64_t bytes_written = 0;
     uint64_t chunks_written = 0;
@@ -140,6 +196,11 @@ class TraceBuffer {
     uint64_t readaheads_succeeded = 0;
     uint64_t readaheads_failed = 0;
     uint64_t abi_violations = 0;
+    uint64_t producer_packets_dropped = 0;
+    uint64_t producer_bytes_dropped = 0;
+    uint64_t truncated_packets = 0;
+    uint64_t chunks_discarded = 0;
+    std::map<ProducerID, ProducerStats> producer_stats;
     // TODO(primiano): add bytes_lost_for_padding.
   };
 
@@ -152,8 +213,20 @@ class TraceBuffer {
     std::array<uint8_t, kSize> data;
   };
 
-  // Can return nullptr if the memory allocation fails.
-  static std::unique_ptr<TraceBuffer> Create(size_t size_in_bytes);
+  // The sequence of packets a packet returned by ReadNextTracePacket() belongs
+  // to, i.e. the writer that wrote it.
+  struct PacketSequenceProperties {
+    ProducerID producer_id_trusted;
+    uid_t producer_uid_trusted;
+    WriterID writer_id;
+  };
+
+  // Can return nullptr if the memory allocation fails. See
+  // PageAllocator::Allocate() for |use_huge_pages|.
+  static std::unique_ptr<TraceBuffer> Create(
+      size_t size_in_bytes,
+      OverwritePolicy = kOverwrite,
+      bool use_huge_pages = false);
 
   ~TraceBuffer();
 
@@ -194,9 +267,23 @@ class TraceBuffer {
   // Reads in the TraceBuffer are NOT idempotent.
   void BeginRead();
 
-  // Returns the next packet in the buffer, if any, and the uid of the producer
-  // that wrote it (as passed in the CopyChunkUntrusted() call). Returns false
-  // if no packets can be read at this point.
+  // Must be set before any chunk is copied: the timestamp hints are extracted
+  // only for kTimestampOrder buffers, as it costs a partial decoding of the
+  // first packet of each chunk.
+  void set_read_order(ReadOrder read_order) {
+    PERFETTO_DCHECK(index_.empty());
+    read_order_ = read_order;
+  }
+  ReadOrder read_order() const { return read_order_; }
+
+  // Returns the next packet in the buffer, if any, and the sequence it belongs
+  // to (as passed in the CopyChunkUntrusted() call). Returns false if no
+  // packets can be read at this point.
+  // |previous_packet_on_sequence_dropped| is set when some data of the same
+  // sequence has been lost since the previous packet returned for it (e.g.
+  // chunks overwritten before being read, or fragments that could never be
+  // stitched). Readers use it to invalidate the incremental state of the
+  // sequence.
   // This function returns only complete packets. Specifically:
   // When there is at least one complete packet in the buffer, this function
   // returns true and populates the TracePacket argument with the boundaries of
@@ -206,9 +293,9 @@ class TraceBuffer {
   // fragments) this function returns false.
   // This function guarantees also that packets for a given
   // {ProducerID, WriterID} are read in FIFO order.
-  // This function does not guarantee any ordering w.r.t. packets belonging to
-  // different WriterID(s). For instance, given the following packets copied
-  // into the buffer:
+  // Unless the buffer uses kTimestampOrder, this function does not guarantee
+  // any ordering w.r.t. packets belonging to different WriterID(s). For
+  // instance, given the following packets copied into the buffer:
   //   {ProducerID: 1, WriterID: 1}: P1 P2 P3
   //   {ProducerID: 1, WriterID: 2}: P4 P5 P6
   //   {ProducerID: 2, WriterID: 1}: P7 P8 P9
@@ -216,10 +303,37 @@ class TraceBuffer {
   //   P1, P4, P7, P2, P3, P5, P8, P9, P6
   // But the following is guaranteed to NOT happen:
   //   P1, P5, P7, P4 (P4 cannot come after P5)
-  bool ReadNextTracePacket(TracePacket*, uid_t* producer_uid);
+  bool ReadNextTracePacket(TracePacket*,
+                           PacketSequenceProperties*,
+                           bool* previous_packet_on_sequence_dropped);
+
+  // Creates a read-only copy of the buffer, so that its contents can be read
+  // without affecting the read state of this buffer, which can keep being
+  // written. The copy inherits the read state of this buffer as well (packets
+  // already read from this buffer are not returned again by the copy).
+  // Chunks that are still waiting for out-of-band patches are copied as-is and
+  // will not be returned by the copy. Can return nullptr if the memory
+  // allocation fails.
+  std::unique_ptr<TraceBuffer> CloneReadOnly() const;
+
+  // Accounts packets that a producer discarded before they could reach the
+  // shared memory buffer (see BufferExhaustedPolicy::kDrop).
+  void AddProducerDataLoss(uint64_t packets, uint64_t bytes) {
+    stats_.producer_packets_dropped += packets;
+    stats_.producer_bytes_dropped += bytes;
+  }
+
+  // Limits the bytes that the chunks of each producer can take up in the
+  // buffer, see "Producer quotas" above. 0 (the default) means no limit.
+  void set_producer_quota(size_t bytes) { producer_quota_ = bytes; }
+  size_t producer_quota() const { return producer_quota_; }
 
   const Stats& stats() const { return stats_; }
   size_t size() const { return size_; }
+  OverwritePolicy overwrite_policy() const { return overwrite_policy_; }
+
+  // True once a kDiscard buffer is full. Always false for kOverwrite buffers.
+  bool discarding_writes() const { return discard_writes_; }
 
  private:
   friend class TraceBufferTest;
@@ -326,6 +440,7 @@ class TraceBuffer {
 
     ChunkRecord* const chunk_record;   // Addr of ChunkRecord within |data_|.
     const uid_t trusted_uid;           // uid of the producer.
+    uint64_t timestamp_hint = 0;       // Only set for kTimestampOrder.
     uint8_t flags = 0;                 // See SharedMemoryABI::flags.
     const uint16_t num_fragments = 0;  // Total number of packet fragments.
     uint16_t num_fragments_read = 0;   // Number of fragments already read.
@@ -339,6 +454,10 @@ class TraceBuffer {
 
   using ChunkMap = std::map<ChunkMeta::Key, ChunkMeta>;
 
+  // The largest padding record, see ReleaseRun().
+  static constexpr size_t kMaxPaddingSize =
+      ChunkRecord::kMaxSize / sizeof(ChunkRecord) * sizeof(ChunkRecord);
+
   // Allows to iterate over a sub-sequence of |index_| for all keys belonging to
   // the same {ProducerID,WriterID}. Furthermore takes into account the wrapping
   // of ChunkID. Instances are valid only as long as the |index_| is not altered
@@ -395,17 +514,30 @@ class TraceBuffer {
     void MoveToEnd() { cur = seq_end; }
   };
 
+  // An entry of the heap used by kTimestampOrder reads.
+  struct SortedSequence {
+    // The hint of the first unread chunk of the sequence.
+    uint64_t timestamp_hint;
+    SequenceIterator iter;
+
+    // Makes std::*_heap() build a min-heap.
+    bool operator<(const SortedSequence& other) const {
+      return std::tie(timestamp_hint, iter.cur->first) >
+             std::tie(other.timestamp_hint, other.iter.cur->first);
+    }
+  };
+
   enum class ReadAheadResult {
     kSucceededReturnSlices,
     kFailedMoveToNextSequence,
     kFailedStayOnSameSequence,
   };
 
-  TraceBuffer();
+  explicit TraceBuffer(OverwritePolicy);
   TraceBuffer(const TraceBuffer&) = delete;
   TraceBuffer& operator=(const TraceBuffer&) = delete;
 
-  bool Initialize(size_t size);
+  bool Initialize(size_t size, bool use_huge_pages);
 
   // Returns an object that allows to iterate over chunks in the |index_| that
   // have the same {ProducerID, WriterID} of
@@ -423,6 +555,19 @@ class TraceBuffer {
   // sizeof(ChunkRecord)).
   void AddPaddingRecord(size_t);
 
+  // Reads the next packet starting from |read_iter_|, which is all that
+  // ReadNextTracePacket() does for kSequenceOrder. If |stay_on_sequence| is
+  // true, returns false when the sequence of |read_iter_| has no more packets
+  // to read, rather than moving on to the next sequence.
+  bool ReadNextTracePacketInternal(TracePacket*,
+                                   PacketSequenceProperties*,
+                                   bool* previous_packet_on_sequence_dropped,
+                                   bool stay_on_sequence);
+
+  // Moves |seq| past the chunks that have been fully read and, if it didn't
+  // reach the end of the sequence, pushes it into |sorted_sequences_|.
+  void PushSortedSequence(SequenceIterator seq);
+
   // Look for contiguous fragment of the same packet starting from |read_iter_|.
   // If a contiguous packet is found, all the fragments are pushed into
   // TracePacket and the function returns kSucceededReturnSlices. If not, the
@@ -454,6 +599,40 @@ class TraceBuffer {
   // be updated with the ProducerID that originally wrote the chunk.
   bool ReadNextPacketInChunk(ChunkMeta*, TracePacket*);
 
+  // Returns the stats of the given producer, creating them if needed. The
+  // last one looked up is cached, as consecutive chunks tend to come from the
+  // same producer.
+  ProducerStats* GetProducerStats(ProducerID producer_id) {
+    if (PERFETTO_LIKELY(last_producer_stats_ &&
+                        last_producer_id_ == producer_id)) {
+      return last_producer_stats_;
+    }
+    return LookupProducerStats(producer_id);
+  }
+
+  // Slow path of GetProducerStats(), updates the cache.
+  ProducerStats* LookupProducerStats(ProducerID);
+
+  // Moves |wptr_| past the chunks of the producers (other than |producer_id|)
+  // that are within their quota. Stops at the first chunk that can be
+  // overwritten, or after a full lap of the buffer.
+  void SkipChunksWithinQuota(ProducerID producer_id);
+
+  // Returns true, and forgets about it, if the given sequence has lost some
+  // data since the last packet read from it.
+  bool ConsumeDataLoss(ProducerID, WriterID);
+
+  // Turns the runs of contiguous chunks that have been fully read into padding
+  // records, removing them from the |index_|, and returns their pages to the
+  // kernel. Only the first page of each padding record, which holds its
+  // header, stays committed. Must not be called while the packets returned by
+  // ReadNextTracePacket() are in use, as they point into the chunks.
+  void ReleaseReadChunks();
+
+  // Replaces the records in [|run_begin|, |run_end|) with padding records of
+  // at most kMaxPaddingSize bytes, releasing the pages past their headers.
+  void ReleaseRun(uint8_t* run_begin, uint8_t* run_end);
+
   void DcheckIsAlignedAndWithinBounds(const uint8_t* ptr) const {
     PERFETTO_DCHECK(ptr >= begin() && ptr <= end() - sizeof(ChunkRecord));
     PERFETTO_DCHECK(
@@ -511,19 +690,50 @@ class TraceBuffer {
   // It becomes invalid after any call to methods that alters the |index_|.
   SequenceIterator read_iter_;
 
+  // A min-heap of the sequences left to read, for kTimestampOrder reads.
+  // Rebuilt by BeginRead().
+  std::vector<SortedSequence> sorted_sequences_;
+
+  ReadOrder read_order_ = kSequenceOrder;
+
   // Keeps track of the last ChunkID written for a given writer.
   // TODO(primiano): should clean up keys from this map. Right now this map
   // grows without bounds (although realistically is not a problem unless we
   // have too many producers/writers within the same trace session).
   std::map<std::pair<ProducerID, WriterID>, ChunkID> last_chunk_id_;
 
+  // The sequences that lost some data since the last packet read from them,
+  // see ReadNextTracePacket().
+  std::set<std::pair<ProducerID, WriterID>> sequences_with_data_loss_;
+
   // Statistics about buffer usage.
   Stats stats_;
 
+  // See set_producer_quota().
+  size_t producer_quota_ = 0;
+
+  // Cache for GetProducerStats(). Entries of |stats_.producer_stats| are
+  // never erased, hence the pointer stays valid.
+  ProducerID last_producer_id_ = 0;
+  ProducerStats* last_producer_stats_ = nullptr;
+
+  // Total size of the chunks that have been fully read since the last
+  // ReleaseReadChunks(). Used to amortize the cost of the latter.
+  size_t read_bytes_to_release_ = 0;
+
 #if PERFETTO_DCHECK_IS_ON()
   bool changed_since_last_read_ = false;
 #endif
 
+  const OverwritePolicy overwrite_policy_;
+
+  // Set by CopyChunkUntrusted() when a kDiscard buffer becomes full. From then
+  // on, all the chunks are discarded.
+  bool discard_writes_ = false;
+
+  // True for buffers created by CloneReadOnly(). They can only be read.
+  bool read_only_ = false;
+
   // When true disable some DCHECKs that have been put in place to detect
   // bugs in the producers. This is for tests that feed malicious inputs and
   // hence mimic a buggy producer.
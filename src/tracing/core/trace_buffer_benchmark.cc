@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "perfetto/base/logging.h"
+#include "perfetto/tracing/core/basic_types.h"
+#include "perfetto/tracing/core/trace_packet.h"
+#include "src/tracing/core/trace_buffer.h"
+
+namespace perfetto {
+namespace {
+
+// Chunks are filled with packets of 128 bytes: a 1 byte varint header that
+// states the size of the payload, plus 127 bytes of payload.
+constexpr size_t kPacketSize = 128;
+constexpr uint16_t kPacketsPerChunk = 31;
+
+// The chunks are written round-robin by this many writers, so that the chunks
+// of a sequence (which are read back in a row) are spread across the buffer.
+constexpr uint64_t kNumWriters = 64;
+
+std::vector<uint8_t> MakeChunkPayload() {
+  std::vector<uint8_t> payload(kPacketSize * kPacketsPerChunk);
+  for (size_t i = 0; i < kPacketsPerChunk; i++) {
+    uint8_t* packet = &payload[i * kPacketSize];
+    packet[0] = kPacketSize - 1;
+    memset(packet + 1, static_cast<int>('a' + i), kPacketSize - 1);
+  }
+  return payload;
+}
+
+// Copies the |n|-th chunk into |buf|, as the service does for each chunk
+// committed by the producers.
+void CopyChunk(TraceBuffer* buf, uint64_t n, const std::vector<uint8_t>& c) {
+  const WriterID writer_id = static_cast<WriterID>(1 + n % kNumWriters);
+  const ChunkID chunk_id = static_cast<ChunkID>(n / kNumWriters);
+  buf->CopyChunkUntrusted(1 /*producer_id*/, 0 /*uid*/, writer_id, chunk_id,
+                          kPacketsPerChunk, 0 /*flags*/, c.data(), c.size());
+}
+
+// Args: {use_huge_pages, buffer size in MB}.
+// Measures the throughput of CopyChunkUntrusted(). The first pass over the
+// buffer also includes the cost of faulting in its memory.
+void BM_TraceBuffer_WriteChunks(benchmark::State& state) {
+  const bool use_huge_pages = state.range(0) == 1;
+  const size_t buf_size = static_cast<size_t>(state.range(1)) * 1024 * 1024;
+  std::unique_ptr<TraceBuffer> buf =
+      TraceBuffer::Create(buf_size, TraceBuffer::kOverwrite, use_huge_pages);
+  PERFETTO_CHECK(buf);
+  const std::vector<uint8_t> chunk = MakeChunkPayload();
+
+  uint64_t chunks = 0;
+  while (state.KeepRunning())
+    CopyChunk(buf.get(), chunks++, chunk);
+
+  state.SetItemsProcessed(static_cast<int64_t>(chunks));
+  state.SetBytesProcessed(static_cast<int64_t>(chunks * chunk.size()));
+}
+
+// Args: {use_huge_pages, buffer size in MB}.
+// Fills the buffer (not measured) and then reads all the packets back, copying
+// them out as the service does when it sends them to the consumer.
+void BM_TraceBuffer_ReadPackets(benchmark::State& state) {
+  const bool use_huge_pages = state.range(0) == 1;
+  const size_t buf_size = static_cast<size_t>(state.range(1)) * 1024 * 1024;
+  std::unique_ptr<TraceBuffer> buf =
+      TraceBuffer::Create(buf_size, TraceBuffer::kOverwrite, use_huge_pages);
+  PERFETTO_CHECK(buf);
+  const std::vector<uint8_t> chunk = MakeChunkPayload();
+  // Leave some room for the chunk headers, so that no chunk gets overwritten.
+  const uint64_t chunks_per_fill = buf_size / (chunk.size() + 64);
+
+  std::vector<char> out(kPacketSize);
+  uint64_t chunks = 0;
+  uint64_t bytes = 0;
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    for (uint64_t i = 0; i < chunks_per_fill; i++)
+      CopyChunk(buf.get(), chunks++, chunk);
+    state.ResumeTiming();
+
+    buf->BeginRead();
+    for (;;) {
+      TracePacket packet;
+      TraceBuffer::PacketSequenceProperties sequence_properties;
+      bool previous_packet_dropped;
+      if (!buf->ReadNextTracePacket(&packet, &sequence_properties,
+                                    &previous_packet_dropped)) {
+        break;
+      }
+      for (const Slice& slice : packet.slices()) {
+        memcpy(out.data(), slice.start, slice.size);
+        bytes += slice.size;
+      }
+      benchmark::DoNotOptimize(out.data());
+    }
+  }
+
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+}  // namespace
+
+BENCHMARK(BM_TraceBuffer_WriteChunks)
+    ->Args({0, 4})
+    ->Args({1, 4})
+    ->Args({0, 32})
+    ->Args({1, 32});
+
+BENCHMARK(BM_TraceBuffer_ReadPackets)
+    ->Args({0, 4})
+    ->Args({1, 4})
+    ->Args({0, 32})
+    ->Args({1, 32});
+
+}  // namespace perfetto
@@ -21,10 +21,12 @@
 #include <sstream>
 #include <vector>
 
+#include "perfetto/base/utils.h"
 #include "perfetto/protozero/proto_utils.h"
 #include "perfetto/tracing/core/basic_types.h"
 #include "perfetto/tracing/core/shared_memory_abi.h"
 #include "perfetto/tracing/core/trace_packet.h"
+#include "src/base/test/vm_test_utils.h"
 #include "src/tracing/core/trace_buffer.h"
 #include "src/tracing/test/fake_packet.h"
 
@@ -54,8 +56,10 @@ class TraceBufferTest : public testing::Test {
     return FakeChunk(trace_buffer_.get(), p, w, c);
   }
 
-  void ResetBuffer(size_t size_) {
-    trace_buffer_ = TraceBuffer::Create(size_);
+  void ResetBuffer(
+      size_t size_,
+      TraceBuffer::OverwritePolicy policy = TraceBuffer::kOverwrite) {
+    trace_buffer_ = TraceBuffer::Create(size_, policy);
     ASSERT_TRUE(trace_buffer_);
   }
 
@@ -68,12 +72,28 @@ class TraceBufferTest : public testing::Test {
         p, w, c, patches.data(), patches.size(), other_patches_pending);
   }
 
-  std::vector<FakePacketFragment> ReadPacket(uint32_t* uid = nullptr) {
+  std::vector<FakePacketFragment> ReadPacket(
+      TraceBuffer::PacketSequenceProperties* sequence_properties = nullptr,
+      bool* previous_packet_dropped = nullptr) {
+    return ReadPacketFrom(trace_buffer_.get(), sequence_properties,
+                          previous_packet_dropped);
+  }
+
+  std::vector<FakePacketFragment> ReadPacketFrom(
+      TraceBuffer* trace_buffer,
+      TraceBuffer::PacketSequenceProperties* sequence_properties = nullptr,
+      bool* previous_packet_dropped = nullptr) {
     std::vector<FakePacketFragment> fragments;
     TracePacket packet;
-    uint32_t ignore;
-    if (!trace_buffer_->ReadNextTracePacket(&packet, uid ? uid : &ignore))
+    TraceBuffer::PacketSequenceProperties ignored_properties;
+    bool ignored_dropped;
+    if (!trace_buffer->ReadNextTracePacket(
+            &packet,
+            sequence_properties ? sequence_properties : &ignored_properties,
+            previous_packet_dropped ? previous_packet_dropped
+                                    : &ignored_dropped)) {
       return fragments;
+    }
     for (const Slice& slice : packet.slices())
       fragments.emplace_back(slice.start, slice.size);
     return fragments;
@@ -128,6 +148,7 @@ class TraceBufferTest : public testing::Test {
 
   TraceBuffer* trace_buffer() { return trace_buffer_.get(); }
   size_t size_to_end() { return trace_buffer_->size_to_end(); }
+  uint8_t* buffer_begin() { return trace_buffer_->begin(); }
 
  private:
   std::unique_ptr<TraceBuffer> trace_buffer_;
@@ -608,7 +629,32 @@ TEST_F(TraceBufferTest, Fragments_LongPacketWithWrappingID) {
   ASSERT_THAT(ReadPacket(), IsEmpty());
 }
 
-TEST_F(TraceBufferTest, Fragments_PreserveUID) {
+// Tests that a packet that the producer gave up on halfway through (e.g.
+// because its shared memory buffer was full) is skipped without stalling the
+// rest of the sequence.
+TEST_F(TraceBufferTest, Fragments_TruncatedPacket) {
+  ResetBuffer(4096);
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket(10, 'a')
+      .AddPacket(20, 'b', kContOnNextChunk)
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+      .AddPacket(30, 'c', kContFromPrevChunk | kContOnNextChunk)
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(2))
+      .AddPacket(40, 'd')
+      .AddPacket(50, 'e')
+      .CopyIntoTraceBuffer();
+
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(10, 'a')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(40, 'd')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(50, 'e')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+  ASSERT_EQ(1u, trace_buffer()->stats().truncated_packets);
+}
+
+TEST_F(TraceBufferTest, Fragments_PreserveSequenceProperties) {
   ResetBuffer(4096);
   CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
       .AddPacket(10, 'a')
@@ -626,26 +672,82 @@ TEST_F(TraceBufferTest, Fragments_PreserveUID) {
       .SetUID(11)
       .CopyIntoTraceBuffer();
   trace_buffer()->BeginRead();
-  uid_t uid = kInvalidUid;
-  ASSERT_THAT(ReadPacket(&uid), ElementsAre(FakePacketFragment(10, 'a')));
-  ASSERT_EQ(11u, uid);
+  TraceBuffer::PacketSequenceProperties props{};
+  ASSERT_THAT(ReadPacket(&props), ElementsAre(FakePacketFragment(10, 'a')));
+  ASSERT_EQ(1u, props.producer_id_trusted);
+  ASSERT_EQ(1u, props.writer_id);
+  ASSERT_EQ(11u, props.producer_uid_trusted);
 
-  ASSERT_THAT(ReadPacket(&uid), ElementsAre(FakePacketFragment(10, 'b'),
-                                            FakePacketFragment(10, 'e')));
-  ASSERT_EQ(11u, uid);
+  ASSERT_THAT(ReadPacket(&props), ElementsAre(FakePacketFragment(10, 'b'),
+                                              FakePacketFragment(10, 'e')));
+  ASSERT_EQ(11u, props.producer_uid_trusted);
 
-  ASSERT_THAT(ReadPacket(&uid), ElementsAre(FakePacketFragment(10, 'f')));
-  ASSERT_EQ(11u, uid);
+  ASSERT_THAT(ReadPacket(&props), ElementsAre(FakePacketFragment(10, 'f')));
+  ASSERT_EQ(11u, props.producer_uid_trusted);
 
-  ASSERT_THAT(ReadPacket(&uid), ElementsAre(FakePacketFragment(10, 'c')));
-  ASSERT_EQ(22u, uid);
+  ASSERT_THAT(ReadPacket(&props), ElementsAre(FakePacketFragment(10, 'c')));
+  ASSERT_EQ(2u, props.producer_id_trusted);
+  ASSERT_EQ(22u, props.producer_uid_trusted);
 
-  ASSERT_THAT(ReadPacket(&uid), ElementsAre(FakePacketFragment(10, 'd')));
-  ASSERT_EQ(22u, uid);
+  ASSERT_THAT(ReadPacket(&props), ElementsAre(FakePacketFragment(10, 'd')));
+  ASSERT_EQ(22u, props.producer_uid_trusted);
 
   ASSERT_THAT(ReadPacket(), IsEmpty());
 }
 
+TEST_F(TraceBufferTest, Fragments_PreviousPacketDropped) {
+  ResetBuffer(4096);
+  // c0 is overwritten by c4 before being read.
+  for (ChunkID chunk_id = 0; chunk_id < 5; chunk_id++) {
+    CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+        .AddPacket(1024 - 16, static_cast<char>('a' + chunk_id))
+        .CopyIntoTraceBuffer();
+  }
+  trace_buffer()->BeginRead();
+  bool dropped = false;
+  ASSERT_THAT(ReadPacket(nullptr, &dropped),
+              ElementsAre(FakePacketFragment(1024 - 16, 'b')));
+  ASSERT_TRUE(dropped);
+  ASSERT_THAT(ReadPacket(nullptr, &dropped),
+              ElementsAre(FakePacketFragment(1024 - 16, 'c')));
+  ASSERT_FALSE(dropped);
+  ASSERT_THAT(ReadPacket(nullptr, &dropped),
+              ElementsAre(FakePacketFragment(1024 - 16, 'd')));
+  ASSERT_FALSE(dropped);
+  ASSERT_THAT(ReadPacket(nullptr, &dropped),
+              ElementsAre(FakePacketFragment(1024 - 16, 'e')));
+  ASSERT_FALSE(dropped);
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+
+  // Chunks that have been read can be overwritten without any loss.
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(5))
+      .AddPacket(2048 - 16, 'f')
+      .CopyIntoTraceBuffer();
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(nullptr, &dropped),
+              ElementsAre(FakePacketFragment(2048 - 16, 'f')));
+  ASSERT_FALSE(dropped);
+
+  // A fragment that continues a packet never seen is skipped, and so is the
+  // truncated packet. Other sequences are not affected.
+  ResetBuffer(4096);
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+      .AddPacket(10, 'a', kContFromPrevChunk)
+      .AddPacket(10, 'b')
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(2), ChunkID(0))
+      .AddPacket(10, 'c')
+      .CopyIntoTraceBuffer();
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(nullptr, &dropped),
+              ElementsAre(FakePacketFragment(10, 'b')));
+  ASSERT_TRUE(dropped);
+  ASSERT_THAT(ReadPacket(nullptr, &dropped),
+              ElementsAre(FakePacketFragment(10, 'c')));
+  ASSERT_FALSE(dropped);
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
 // --------------------------
 // Out of band patching tests
 // --------------------------
@@ -848,6 +950,32 @@ TEST_F(TraceBufferTest, Malicious_DeclareMorePacketsBeyondBoundaries) {
   ASSERT_THAT(ReadPacket(), IsEmpty());
 }
 
+// A chunk that declares more fragments than it contains, the last of which
+// would continue on a next chunk that doesn't continue the packet. The
+// fragments fill the chunk exactly (there is no padding after them).
+TEST_F(TraceBufferTest, Malicious_DeclareMoreFragmentsInTruncatedPacket) {
+  ResetBuffer(4096);
+  SuppressSanityDchecksForTesting();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket(10, 'a')
+      .AddPacket(22, 'b', kContOnNextChunk)
+      .IncrementNumPackets()
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+      .AddPacket(30, 'c')
+      .AddPacket(40, 'd')
+      .CopyIntoTraceBuffer();
+
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(10, 'a')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(22, 'b')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(30, 'c')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(40, 'd')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+  EXPECT_EQ(1u, trace_buffer()->stats().truncated_packets);
+  EXPECT_GT(trace_buffer()->stats().abi_violations, 0u);
+}
+
 TEST_F(TraceBufferTest, Malicious_ZeroVarintHeader) {
   ResetBuffer(4096);
   SuppressSanityDchecksForTesting();
@@ -1018,6 +1146,332 @@ TEST_F(TraceBufferTest, Malicious_PatchOutOfBounds) {
   }
 }
 
+// ------------------------
+// CloneReadOnly() tests
+// ------------------------
+
+TEST_F(TraceBufferTest, Clone_ReadsDontAffectOriginal) {
+  ResetBuffer(4096);
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket(10, 'a')
+      .AddPacket(10, 'b')
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(2), WriterID(1), ChunkID(0))
+      .AddPacket(10, 'c')
+      .CopyIntoTraceBuffer();
+
+  // Packets already read from the original buffer are not read again from the
+  // clone.
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(10, 'a')));
+  std::unique_ptr<TraceBuffer> clone = trace_buffer()->CloneReadOnly();
+  ASSERT_TRUE(clone);
+
+  // Writes into the original buffer after the clone are not seen by the clone.
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+      .AddPacket(10, 'd')
+      .CopyIntoTraceBuffer();
+
+  clone->BeginRead();
+  ASSERT_THAT(ReadPacketFrom(clone.get()),
+              ElementsAre(FakePacketFragment(10, 'b')));
+  ASSERT_THAT(ReadPacketFrom(clone.get()),
+              ElementsAre(FakePacketFragment(10, 'c')));
+  ASSERT_THAT(ReadPacketFrom(clone.get()), IsEmpty());
+
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(10, 'b')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(10, 'd')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(10, 'c')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
+TEST_F(TraceBufferTest, Clone_AfterWrapping) {
+  ResetBuffer(4096);
+  for (ChunkID chunk_id = 0; chunk_id < 12; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id);
+    ASSERT_EQ(512u, CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+                        .AddPacket(512 - 16, seed)
+                        .CopyIntoTraceBuffer());
+  }
+  std::unique_ptr<TraceBuffer> clone = trace_buffer()->CloneReadOnly();
+  ASSERT_TRUE(clone);
+  ASSERT_EQ(trace_buffer()->stats().write_wrap_count,
+            clone->stats().write_wrap_count);
+
+  // Both the clone and the original should contain only the last 8 chunks.
+  trace_buffer()->BeginRead();
+  clone->BeginRead();
+  for (ChunkID chunk_id = 4; chunk_id < 12; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id);
+    ASSERT_THAT(ReadPacketFrom(clone.get()),
+                ElementsAre(FakePacketFragment(512 - 16, seed)));
+    ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(512 - 16, seed)));
+  }
+  ASSERT_THAT(ReadPacketFrom(clone.get()), IsEmpty());
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
+// ------------------------
+// Discard fill policy tests
+// ------------------------
+
+TEST_F(TraceBufferTest, Discard_NoWrapping) {
+  ResetBuffer(4096, TraceBuffer::kDiscard);
+  for (ChunkID chunk_id = 0; chunk_id < 3; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id);
+    ASSERT_EQ(1024u, CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+                         .AddPacket(1024 - 16, seed)
+                         .CopyIntoTraceBuffer());
+  }
+  ASSERT_FALSE(trace_buffer()->discarding_writes());
+
+  // Doesn't fit in the 1024 bytes left. Neither does any chunk after it, even
+  // if smaller.
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(3))
+      .AddPacket(2048 - 16, 'x')
+      .CopyIntoTraceBuffer();
+  ASSERT_TRUE(trace_buffer()->discarding_writes());
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(4))
+      .AddPacket(32 - 16, 'y')
+      .CopyIntoTraceBuffer();
+
+  EXPECT_EQ(3u, trace_buffer()->stats().chunks_written);
+  EXPECT_EQ(2u, trace_buffer()->stats().chunks_discarded);
+  EXPECT_EQ(0u, trace_buffer()->stats().chunks_overwritten);
+  EXPECT_EQ(0u, trace_buffer()->stats().write_wrap_count);
+
+  trace_buffer()->BeginRead();
+  for (ChunkID chunk_id = 0; chunk_id < 3; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id);
+    ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(1024 - 16, seed)));
+  }
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
+// Fills the buffer precisely until the end: the chunks at the beginning must
+// not be overwritten by the following ones, nor lost by CloneReadOnly().
+TEST_F(TraceBufferTest, Discard_FillTillEnd) {
+  ResetBuffer(4096, TraceBuffer::kDiscard);
+  for (ChunkID chunk_id = 0; chunk_id < 4; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id);
+    ASSERT_EQ(1024u, CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+                         .AddPacket(1024 - 16, seed)
+                         .CopyIntoTraceBuffer());
+  }
+  ASSERT_TRUE(trace_buffer()->discarding_writes());
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(4))
+      .AddPacket(1024 - 16, 'x')
+      .CopyIntoTraceBuffer();
+  EXPECT_EQ(1u, trace_buffer()->stats().chunks_discarded);
+
+  std::unique_ptr<TraceBuffer> clone = trace_buffer()->CloneReadOnly();
+  ASSERT_TRUE(clone);
+  EXPECT_TRUE(clone->discarding_writes());
+  trace_buffer()->BeginRead();
+  clone->BeginRead();
+  for (ChunkID chunk_id = 0; chunk_id < 4; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id);
+    ASSERT_THAT(ReadPacketFrom(clone.get()),
+                ElementsAre(FakePacketFragment(1024 - 16, seed)));
+    ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(1024 - 16, seed)));
+  }
+  ASSERT_THAT(ReadPacketFrom(clone.get()), IsEmpty());
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
+// ---------------------------
+// Timestamp order read tests
+// ---------------------------
+
+// The preamble of TracePacket.timestamp (id 11, varint). The packets in these
+// tests contain just that field: {size, preamble, timestamp}.
+constexpr uint8_t kTimestampPreamble = 11 << 3;
+
+TEST_F(TraceBufferTest, ReadOrder_Timestamp) {
+  ResetBuffer(4096);
+  trace_buffer()->set_read_order(TraceBuffer::kTimestampOrder);
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket({2, kTimestampPreamble, 10})
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+      .AddPacket({2, kTimestampPreamble, 40})
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(2), ChunkID(0))
+      .AddPacket({2, kTimestampPreamble, 20})
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(2), ChunkID(1))
+      .AddPacket({2, kTimestampPreamble, 30})
+      .CopyIntoTraceBuffer();
+  // The packets of a chunk share the hint of the first one.
+  CreateChunk(ProducerID(2), WriterID(1), ChunkID(0))
+      .AddPacket({2, kTimestampPreamble, 5})
+      .AddPacket({2, kTimestampPreamble, 50})
+      .CopyIntoTraceBuffer();
+
+  trace_buffer()->BeginRead();
+  for (uint8_t timestamp : {5, 50, 10, 20, 30, 40}) {
+    std::vector<FakePacketFragment> packet = ReadPacket();
+    ASSERT_EQ(1u, packet.size());
+    ASSERT_EQ(static_cast<char>(timestamp), packet[0].payload()[1]);
+  }
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
+// The hint of a chunk is the one of the first packet that begins in it, the
+// tail of a packet continuing from the previous chunk is skipped.
+TEST_F(TraceBufferTest, ReadOrder_TimestampWithFragments) {
+  ResetBuffer(4096);
+  trace_buffer()->set_read_order(TraceBuffer::kTimestampOrder);
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket({2, kTimestampPreamble, 50})
+      .AddPacket(10, 'a', kContOnNextChunk)
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(2), ChunkID(0))
+      .AddPacket({2, kTimestampPreamble, 60})
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+      .AddPacket(10, 'b', kContFromPrevChunk)
+      .AddPacket({2, kTimestampPreamble, 70})
+      .CopyIntoTraceBuffer();
+
+  // Reads across several passes don't lose or reorder the packets.
+  trace_buffer()->BeginRead();
+  ASSERT_EQ(static_cast<char>(50), ReadPacket().at(0).payload()[1]);
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(10, 'a'),
+                                        FakePacketFragment(10, 'b')));
+  trace_buffer()->BeginRead();
+  ASSERT_EQ(static_cast<char>(60), ReadPacket().at(0).payload()[1]);
+  ASSERT_EQ(static_cast<char>(70), ReadPacket().at(0).payload()[1]);
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
+// --------------------
+// Producer quota tests
+// --------------------
+
+// Once the buffer is full, the producer above quota must overwrite its own
+// chunks rather than the ones of the producer within its quota.
+TEST_F(TraceBufferTest, Quota_NoisyProducerOverwritesItsOwnChunks) {
+  ResetBuffer(4096);
+  trace_buffer()->set_producer_quota(1024);
+  for (ChunkID chunk_id = 0; chunk_id < 2; chunk_id++) {
+    ASSERT_EQ(512u, CreateChunk(ProducerID(2), WriterID(1), chunk_id)
+                        .AddPacket(512 - 16, 'q')
+                        .CopyIntoTraceBuffer());
+  }
+  for (ChunkID chunk_id = 0; chunk_id < 10; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id);
+    ASSERT_EQ(512u, CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+                        .AddPacket(512 - 16, seed)
+                        .CopyIntoTraceBuffer());
+  }
+
+  const auto& producer_stats = trace_buffer()->stats().producer_stats;
+  ASSERT_EQ(2u, producer_stats.size());
+  EXPECT_EQ(10u, producer_stats.at(1).chunks_written);
+  EXPECT_EQ(4u, producer_stats.at(1).chunks_overwritten);
+  EXPECT_EQ(4u * (512 - 16), producer_stats.at(1).bytes_overwritten);
+  EXPECT_EQ(3072u, producer_stats.at(1).bytes_in_buffer);
+  EXPECT_EQ(2u, producer_stats.at(2).chunks_written);
+  EXPECT_EQ(0u, producer_stats.at(2).chunks_overwritten);
+  EXPECT_EQ(1024u, producer_stats.at(2).bytes_in_buffer);
+
+  trace_buffer()->BeginRead();
+  for (ChunkID chunk_id = 4; chunk_id < 10; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id);
+    ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(512 - 16, seed)));
+  }
+  for (ChunkID chunk_id = 0; chunk_id < 2; chunk_id++)
+    ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(512 - 16, 'q')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
+TEST_F(TraceBufferTest, Quota_Discard) {
+  ResetBuffer(4096, TraceBuffer::kDiscard);
+  trace_buffer()->set_producer_quota(1024);
+  for (ChunkID chunk_id = 0; chunk_id < 3; chunk_id++) {
+    CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+        .AddPacket(512 - 16, 'a')
+        .CopyIntoTraceBuffer();
+  }
+  for (ChunkID chunk_id = 0; chunk_id < 2; chunk_id++) {
+    CreateChunk(ProducerID(2), WriterID(1), chunk_id)
+        .AddPacket(512 - 16, 'b')
+        .CopyIntoTraceBuffer();
+  }
+  ASSERT_FALSE(trace_buffer()->discarding_writes());
+  EXPECT_EQ(1u, trace_buffer()->stats().chunks_discarded);
+  const auto& producer_stats = trace_buffer()->stats().producer_stats;
+  EXPECT_EQ(2u, producer_stats.at(1).chunks_written);
+  EXPECT_EQ(1u, producer_stats.at(1).chunks_discarded);
+  EXPECT_EQ(2u, producer_stats.at(2).chunks_written);
+  EXPECT_EQ(0u, producer_stats.at(2).chunks_discarded);
+
+  trace_buffer()->BeginRead();
+  for (int i = 0; i < 2; i++)
+    ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(512 - 16, 'a')));
+  for (int i = 0; i < 2; i++)
+    ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(512 - 16, 'b')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
+// ---------------------
+// Memory release tests
+// ---------------------
+
+TEST_F(TraceBufferTest, Release_ReadChunks) {
+  const size_t kChunkSize = base::kPageSize;
+  ResetBuffer(64 * kChunkSize);
+  for (ChunkID chunk_id = 0; chunk_id < 48; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id % 26);
+    ASSERT_EQ(kChunkSize, CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+                              .AddPacket(kChunkSize - 16, seed)
+                              .CopyIntoTraceBuffer());
+  }
+  trace_buffer()->BeginRead();
+  for (ChunkID chunk_id = 0; chunk_id < 48; chunk_id++)
+    ASSERT_EQ(1u, ReadPacket().size());
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(48))
+      .AddPacket(kChunkSize - 16, 'x')
+      .CopyIntoTraceBuffer();
+  ASSERT_TRUE(base::vm_test_utils::IsMapped(buffer_begin(), 49 * kChunkSize));
+
+  // The chunks read have been replaced by padding records. Only the pages
+  // holding their headers, at most every kMaxPaddingSize bytes, are still
+  // resident.
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(GetIndex(), ElementsAre(ChunkMetaKey(1, 1, 48)));
+  ASSERT_EQ(kChunkSize,
+            trace_buffer()->stats().producer_stats.at(1).bytes_in_buffer);
+  size_t resident_pages = 0;
+  for (size_t page = 0; page < 48; page++) {
+    resident_pages += base::vm_test_utils::IsMapped(
+        buffer_begin() + page * base::kPageSize, base::kPageSize);
+  }
+  ASSERT_EQ(4u, resident_pages);
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(kChunkSize - 16,
+                                                           'x')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+
+  // The buffer keeps working when wrapping over the padding records.
+  for (ChunkID chunk_id = 49; chunk_id < 49 + 64; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id % 26);
+    CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+        .AddPacket(kChunkSize - 16, seed)
+        .CopyIntoTraceBuffer();
+  }
+  trace_buffer()->BeginRead();
+  for (ChunkID chunk_id = 49; chunk_id < 49 + 64; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id % 26);
+    ASSERT_THAT(ReadPacket(),
+                ElementsAre(FakePacketFragment(kChunkSize - 16, seed)));
+  }
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+  ASSERT_EQ(0u, trace_buffer()->stats().chunks_overwritten);
+}
+
 // -------------------
 // SequenceIterator tests
 // -------------------
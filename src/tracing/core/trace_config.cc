@@ -92,6 +92,16 @@ void TraceConfig::FromProto(const perfetto::protos::TraceConfig& proto) {
       static_cast<decltype(max_file_size_bytes_)>(proto.max_file_size_bytes());
 
   guardrail_overrides_.FromProto(proto.guardrail_overrides());
+
+  static_assert(
+      sizeof(stop_when_buffers_full_) == sizeof(proto.stop_when_buffers_full()),
+      "size mismatch");
+  stop_when_buffers_full_ = static_cast<decltype(stop_when_buffers_full_)>(
+      proto.stop_when_buffers_full());
+
+  static_assert(sizeof(sort_packets_) == sizeof(proto.sort_packets()),
+                "size mismatch");
+  sort_packets_ = static_cast<decltype(sort_packets_)>(proto.sort_packets());
   unknown_fields_ = proto.unknown_fields();
 }
 
@@ -152,6 +162,18 @@ void TraceConfig::ToProto(perfetto::protos::TraceConfig* proto) const {
           max_file_size_bytes_));
 
   guardrail_overrides_.ToProto(proto->mutable_guardrail_overrides());
+
+  static_assert(sizeof(stop_when_buffers_full_) ==
+                    sizeof(proto->stop_when_buffers_full()),
+                "size mismatch");
+  proto->set_stop_when_buffers_full(
+      static_cast<decltype(proto->stop_when_buffers_full())>(
+          stop_when_buffers_full_));
+
+  static_assert(sizeof(sort_packets_) == sizeof(proto->sort_packets()),
+                "size mismatch");
+  proto->set_sort_packets(
+      static_cast<decltype(proto->sort_packets())>(sort_packets_));
   *(proto->mutable_unknown_fields()) = unknown_fields_;
 }
 
@@ -174,6 +196,16 @@ void TraceConfig::BufferConfig::FromProto(
   static_assert(sizeof(fill_policy_) == sizeof(proto.fill_policy()),
                 "size mismatch");
   fill_policy_ = static_cast<decltype(fill_policy_)>(proto.fill_policy());
+
+  static_assert(sizeof(use_huge_pages_) == sizeof(proto.use_huge_pages()),
+                "size mismatch");
+  use_huge_pages_ =
+      static_cast<decltype(use_huge_pages_)>(proto.use_huge_pages());
+
+  static_assert(sizeof(producer_quota_kb_) == sizeof(proto.producer_quota_kb()),
+                "size mismatch");
+  producer_quota_kb_ =
+      static_cast<decltype(producer_quota_kb_)>(proto.producer_quota_kb());
   unknown_fields_ = proto.unknown_fields();
 }
 
@@ -188,6 +220,17 @@ void TraceConfig::BufferConfig::ToProto(
                 "size mismatch");
   proto->set_fill_policy(
       static_cast<decltype(proto->fill_policy())>(fill_policy_));
+
+  static_assert(sizeof(use_huge_pages_) == sizeof(proto->use_huge_pages()),
+                "size mismatch");
+  proto->set_use_huge_pages(
+      static_cast<decltype(proto->use_huge_pages())>(use_huge_pages_));
+
+  static_assert(
+      sizeof(producer_quota_kb_) == sizeof(proto->producer_quota_kb()),
+      "size mismatch");
+  proto->set_producer_quota_kb(
+      static_cast<decltype(proto->producer_quota_kb())>(producer_quota_kb_));
   *(proto->mutable_unknown_fields()) = unknown_fields_;
 }
 
@@ -214,6 +257,11 @@ void TraceConfig::DataSource::FromProto(
     producer_name_filter_.back() =
         static_cast<decltype(producer_name_filter_)::value_type>(field);
   }
+
+  static_assert(sizeof(share_instance_) == sizeof(proto.share_instance()),
+                "size mismatch");
+  share_instance_ =
+      static_cast<decltype(share_instance_)>(proto.share_instance());
   unknown_fields_ = proto.unknown_fields();
 }
 
@@ -229,6 +277,11 @@ void TraceConfig::DataSource::ToProto(
     static_assert(sizeof(it) == sizeof(proto->producer_name_filter(0)),
                   "size mismatch");
   }
+
+  static_assert(sizeof(share_instance_) == sizeof(proto->share_instance()),
+                "size mismatch");
+  proto->set_share_instance(
+      static_cast<decltype(proto->share_instance())>(share_instance_));
   *(proto->mutable_unknown_fields()) = unknown_fields_;
 }
 
@@ -256,6 +309,34 @@ void TraceConfig::ProducerConfig::FromProto(
   static_assert(sizeof(page_size_kb_) == sizeof(proto.page_size_kb()),
                 "size mismatch");
   page_size_kb_ = static_cast<decltype(page_size_kb_)>(proto.page_size_kb());
+
+  static_assert(sizeof(use_commit_ring_) == sizeof(proto.use_commit_ring()),
+                "size mismatch");
+  use_commit_ring_ =
+      static_cast<decltype(use_commit_ring_)>(proto.use_commit_ring());
+
+  static_assert(
+      sizeof(smb_scan_period_ms_) == sizeof(proto.smb_scan_period_ms()),
+      "size mismatch");
+  smb_scan_period_ms_ =
+      static_cast<decltype(smb_scan_period_ms_)>(proto.smb_scan_period_ms());
+
+  static_assert(
+      sizeof(commit_max_latency_ms_) == sizeof(proto.commit_max_latency_ms()),
+      "size mismatch");
+  commit_max_latency_ms_ = static_cast<decltype(commit_max_latency_ms_)>(
+      proto.commit_max_latency_ms());
+
+  static_assert(
+      sizeof(commit_min_batch_kb_) == sizeof(proto.commit_min_batch_kb()),
+      "size mismatch");
+  commit_min_batch_kb_ =
+      static_cast<decltype(commit_min_batch_kb_)>(proto.commit_min_batch_kb());
+
+  static_assert(sizeof(adaptive_commit_) == sizeof(proto.adaptive_commit()),
+                "size mismatch");
+  adaptive_commit_ =
+      static_cast<decltype(adaptive_commit_)>(proto.adaptive_commit());
   unknown_fields_ = proto.unknown_fields();
 }
 
@@ -277,6 +358,36 @@ void TraceConfig::ProducerConfig::ToProto(
                 "size mismatch");
   proto->set_page_size_kb(
       static_cast<decltype(proto->page_size_kb())>(page_size_kb_));
+
+  static_assert(sizeof(use_commit_ring_) == sizeof(proto->use_commit_ring()),
+                "size mismatch");
+  proto->set_use_commit_ring(
+      static_cast<decltype(proto->use_commit_ring())>(use_commit_ring_));
+
+  static_assert(
+      sizeof(smb_scan_period_ms_) == sizeof(proto->smb_scan_period_ms()),
+      "size mismatch");
+  proto->set_smb_scan_period_ms(
+      static_cast<decltype(proto->smb_scan_period_ms())>(smb_scan_period_ms_));
+
+  static_assert(
+      sizeof(commit_max_latency_ms_) == sizeof(proto->commit_max_latency_ms()),
+      "size mismatch");
+  proto->set_commit_max_latency_ms(
+      static_cast<decltype(proto->commit_max_latency_ms())>(
+          commit_max_latency_ms_));
+
+  static_assert(
+      sizeof(commit_min_batch_kb_) == sizeof(proto->commit_min_batch_kb()),
+      "size mismatch");
+  proto->set_commit_min_batch_kb(
+      static_cast<decltype(proto->commit_min_batch_kb())>(
+          commit_min_batch_kb_));
+
+  static_assert(sizeof(adaptive_commit_) == sizeof(proto->adaptive_commit()),
+                "size mismatch");
+  proto->set_adaptive_commit(
+      static_cast<decltype(proto->adaptive_commit())>(adaptive_commit_));
   *(proto->mutable_unknown_fields()) = unknown_fields_;
 }
 
@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/tracing/core/trace_event.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+
+#include "perfetto/base/build_config.h"
+#include "perfetto/base/logging.h"
+#include "perfetto/base/time.h"
+#include "perfetto/tracing/core/trace_writer.h"
+
+#include "perfetto/trace/chrome/chrome_trace_event.pbzero.h"
+#include "perfetto/trace/interned_data.pbzero.h"
+#include "perfetto/trace/trace_packet.pbzero.h"
+
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_MACOSX)
+#include <mach/mach.h>
+#else
+#include <sys/syscall.h>
+#endif
+
+namespace perfetto {
+
+namespace {
+
+// Protects the list of categories and their |source_|. Leaked, as categories
+// can be destroyed after any other static object.
+std::mutex& GetCategoriesLock() {
+  static std::mutex* lock = new std::mutex();
+  return *lock;
+}
+
+// Protects the list of the ThreadLocalWriters of all the threads. Leaked, as
+// threads can exit after any other static object has been destroyed.
+std::mutex& GetThreadsLock() {
+  static std::mutex* lock = new std::mutex();
+  return *lock;
+}
+
+// Head of the list of categories. Zero-initialized before any category is
+// constructed, regardless of the initialization order of the translation units.
+TraceCategory* g_categories = nullptr;
+
+int32_t GetCurrentThreadId() {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_MACOSX)
+  return static_cast<int32_t>(pthread_mach_thread_np(pthread_self()));
+#else
+  return static_cast<int32_t>(syscall(__NR_gettid));
+#endif
+}
+
+bool IsCategoryIn(const TraceCategory& category,
+                  const std::vector<std::string>& categories) {
+  if (categories.empty())
+    return true;
+  return std::find(categories.begin(), categories.end(), category.name()) !=
+         categories.end();
+}
+
+}  // namespace
+
+struct TraceEventSource::Session {
+  Service::ProducerEndpoint* endpoint;
+  BufferID target_buffer;
+};
+
+// The TraceWriter(s) of a thread, one per TraceEventSource. A writer is
+// replaced when the thread emits the first event after its source has been
+// restarted, which might have changed the target buffer, and destroyed when
+// the source is stopped.
+struct TraceEventSource::ThreadLocalWriters {
+  struct Entry {
+    const TraceEventSource* source;
+    const Session* session;
+    std::unique_ptr<TraceWriter> writer;
+  };
+
+  ThreadLocalWriters() {
+    std::lock_guard<std::mutex> threads_lock(GetThreadsLock());
+    GetAll().push_back(this);
+  }
+
+  ~ThreadLocalWriters() {
+    std::lock_guard<std::mutex> threads_lock(GetThreadsLock());
+    auto& all = GetAll();
+    all.erase(std::find(all.begin(), all.end(), this));
+  }
+
+  // Invokes |fn| on the writers of every thread, with their lock held.
+  static void ForEachThread(
+      const std::function<void(ThreadLocalWriters*)>& fn) {
+    std::lock_guard<std::mutex> threads_lock(GetThreadsLock());
+    for (ThreadLocalWriters* writers : GetAll()) {
+      std::lock_guard<std::mutex> writers_lock(writers->lock);
+      fn(writers);
+    }
+  }
+
+  // Leaked, see GetThreadsLock().
+  static std::vector<ThreadLocalWriters*>& GetAll() {
+    static auto* all = new std::vector<ThreadLocalWriters*>();
+    return *all;
+  }
+
+  // Held by the thread while it writes an event, and by the threads that
+  // flush or destroy its writers. Never contended outside of these.
+  std::mutex lock;
+  std::vector<Entry> entries;
+  int32_t thread_id = GetCurrentThreadId();
+};
+
+TraceCategory::TraceCategory(const char* name) : name_(name) {
+  std::lock_guard<std::mutex> lock(GetCategoriesLock());
+  next_ = g_categories;
+  g_categories = this;
+}
+
+TraceCategory::~TraceCategory() {
+  std::lock_guard<std::mutex> lock(GetCategoriesLock());
+  for (TraceCategory** it = &g_categories; *it; it = &(*it)->next_) {
+    if (*it == this) {
+      *it = next_;
+      break;
+    }
+  }
+}
+
+TraceEventSource::TraceEventSource() = default;
+
+TraceEventSource::~TraceEventSource() {
+  Stop();
+}
+
+void TraceEventSource::Start(Service::ProducerEndpoint* endpoint,
+                             BufferID target_buffer,
+                             const std::vector<std::string>& categories) {
+  std::lock_guard<std::mutex> lock(GetCategoriesLock());
+  std::unique_ptr<Session> session(new Session());
+  session->endpoint = endpoint;
+  session->target_buffer = target_buffer;
+  session_.store(session.get(), std::memory_order_release);
+  sessions_.push_back(std::move(session));
+
+  // The release store pairs with the acquire load in WriteEvent(), which then
+  // sees the new |session_|.
+  for (TraceCategory* category = g_categories; category;
+       category = category->next_) {
+    if (IsCategoryIn(*category, categories))
+      category->source_.store(this, std::memory_order_release);
+  }
+}
+
+void TraceEventSource::Stop() {
+  std::lock_guard<std::mutex> lock(GetCategoriesLock());
+  for (TraceCategory* category = g_categories; category;
+       category = category->next_) {
+    TraceEventSource* expected = this;
+    category->source_.compare_exchange_strong(expected, nullptr,
+                                              std::memory_order_relaxed);
+  }
+  session_.store(nullptr, std::memory_order_release);
+
+  // Destroying the writers commits their last chunk and releases their IDs.
+  // The threads that are writing an event hold their lock until it's done,
+  // the ones that start writing later find no session.
+  ThreadLocalWriters::ForEachThread([this](ThreadLocalWriters* writers) {
+    auto& entries = writers->entries;
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                 [this](const ThreadLocalWriters::Entry& e) {
+                                   return e.source == this;
+                                 }),
+                  entries.end());
+  });
+
+  // No thread can be looking at the sessions anymore.
+  sessions_.clear();
+}
+
+void TraceEventSource::Flush() {
+  ThreadLocalWriters::ForEachThread([this](ThreadLocalWriters* writers) {
+    for (auto& entry : writers->entries) {
+      // Null if the endpoint couldn't create the writer.
+      if (entry.source == this && entry.writer)
+        entry.writer->Flush();
+    }
+  });
+}
+
+// static
+TraceEventSource::ThreadLocalWriters*
+TraceEventSource::GetThreadLocalWriters() {
+  // The writers left are destroyed, and their last chunk committed, when the
+  // thread exits.
+  static thread_local ThreadLocalWriters writers;
+  return &writers;
+}
+
+TraceWriter* TraceEventSource::GetThreadLocalWriter(
+    ThreadLocalWriters* writers) {
+  const Session* session = session_.load(std::memory_order_acquire);
+  if (!session)
+    return nullptr;
+  for (auto& entry : writers->entries) {
+    if (entry.source != this)
+      continue;
+    if (entry.session != session) {
+      entry.writer.reset();  // Commits the data of the previous session.
+      entry.session = session;
+      entry.writer = session->endpoint->CreateTraceWriter(
+          session->target_buffer, BufferExhaustedPolicy::kDrop);
+    }
+    return entry.writer.get();
+  }
+  writers->entries.emplace_back();
+  ThreadLocalWriters::Entry& entry = writers->entries.back();
+  entry.source = this;
+  entry.session = session;
+  entry.writer = session->endpoint->CreateTraceWriter(
+      session->target_buffer, BufferExhaustedPolicy::kDrop);
+  return entry.writer.get();
+}
+
+// static
+void TraceEventSource::ResetCurrentThread() {
+  ThreadLocalWriters* writers = GetThreadLocalWriters();
+  std::lock_guard<std::mutex> lock(writers->lock);
+  writers->entries.clear();
+}
+
+// static
+void TraceEventSource::AddEvent(const TraceCategory& category,
+                                Phase phase,
+                                const char* name) {
+  WriteEvent(category, phase, name, nullptr);
+}
+
+// static
+void TraceEventSource::AddCounter(const TraceCategory& category,
+                                  const char* name,
+                                  int64_t value) {
+  WriteEvent(category, kPhaseCounter, name, &value);
+}
+
+// static
+void TraceEventSource::WriteEvent(const TraceCategory& category,
+                                  Phase phase,
+                                  const char* name,
+                                  const int64_t* counter_value) {
+  TraceEventSource* source = category.source_.load(std::memory_order_acquire);
+  if (!source)
+    return;  // The category has been disabled in the meantime.
+  ThreadLocalWriters* writers = GetThreadLocalWriters();
+  // Declared before |packet|, which is finalized first.
+  std::lock_guard<std::mutex> lock(writers->lock);
+  TraceWriter* writer = source->GetThreadLocalWriter(writers);
+  if (!writer)
+    return;
+
+  static const int32_t pid = static_cast<int32_t>(getpid());
+  const int64_t now_ns = base::GetWallTimeNs().count();
+  TraceWriter::TracePacketHandle packet = writer->NewTracePacket();
+  packet->set_timestamp(static_cast<uint64_t>(now_ns));
+
+  // The interned data must precede the event, nested messages can't be
+  // interleaved.
+  bool new_name = false;
+  bool new_category = false;
+  const uint64_t name_iid = writer->InternStaticString(name, &new_name);
+  const uint64_t category_iid =
+      writer->InternStaticString(category.name(), &new_category);
+  if (PERFETTO_UNLIKELY(new_name || new_category)) {
+    protos::pbzero::InternedData* interned_data = packet->set_interned_data();
+    if (new_name) {
+      protos::pbzero::InternedString* entry = interned_data->add_strings();
+      entry->set_iid(name_iid);
+      entry->set_str(reinterpret_cast<const uint8_t*>(name), strlen(name));
+    }
+    if (new_category) {
+      protos::pbzero::InternedString* entry = interned_data->add_strings();
+      entry->set_iid(category_iid);
+      entry->set_str(reinterpret_cast<const uint8_t*>(category.name()),
+                     strlen(category.name()));
+    }
+  }
+
+  protos::pbzero::ChromeTraceEvent* event =
+      packet->set_chrome_events()->add_trace_events();
+  event->set_name_iid(name_iid);
+  event->set_timestamp(now_ns / 1000);
+  event->set_phase(phase);
+  event->set_thread_id(writers->thread_id);
+  event->set_category_group_iid(category_iid);
+  event->set_process_id(pid);
+  if (counter_value) {
+    protos::pbzero::ChromeTraceEvent::Arg* arg = event->add_args();
+    arg->set_name("value");
+    arg->set_int_value(*counter_value);
+  }
+}
+
+}  // namespace perfetto
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/tracing/core/trace_event.h"
+
+#include <unistd.h>
+
+#include <future>
+#include <map>
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "perfetto/tracing/core/service.h"
+#include "perfetto/tracing/core/trace_config.h"
+#include "src/base/test/test_task_runner.h"
+#include "src/tracing/test/mock_consumer.h"
+#include "src/tracing/test/mock_producer.h"
+#include "src/tracing/test/test_shared_memory.h"
+
+#include "perfetto/trace/trace_packet.pb.h"
+
+namespace perfetto {
+namespace {
+
+using ::testing::StrictMock;
+
+PERFETTO_DEFINE_TRACE_CATEGORY(kEnabledCategory, "enabled_category");
+PERFETTO_DEFINE_TRACE_CATEGORY(kDisabledCategory, "disabled_category");
+
+TraceEventSource g_source;
+
+class TraceEventTest : public testing::Test {
+ public:
+  TraceEventTest() {
+    auto shm_factory =
+        std::unique_ptr<SharedMemory::Factory>(new TestSharedMemory::Factory());
+    svc_ = Service::CreateInstance(std::move(shm_factory), &task_runner_);
+    consumer_.reset(new StrictMock<MockConsumer>(&task_runner_));
+    producer_.reset(new StrictMock<MockProducer>(&task_runner_));
+  }
+
+  void StartTracing(const std::vector<std::string>& categories) {
+    consumer_->Connect(svc_.get());
+    producer_->Connect(svc_.get(), "mock_producer");
+    producer_->RegisterDataSource("trace_events");
+
+    TraceConfig trace_config;
+    trace_config.add_buffers()->set_size_kb(128);
+    trace_config.add_data_sources()->mutable_config()->set_name(
+        "trace_events");
+    consumer_->EnableTracing(trace_config);
+    producer_->WaitForTracingSetup();
+    producer_->WaitForDataSourceStart("trace_events");
+
+    BufferID target_buffer =
+        producer_->GetDataSourceInstance("trace_events")->target_buffer;
+    g_source.Start(producer_->endpoint(), target_buffer, categories);
+  }
+
+  std::vector<protos::ChromeTraceEvent> StopTracing() {
+    g_source.Stop();
+    TraceEventSource::ResetCurrentThread();
+    consumer_->DisableTracing();
+    producer_->WaitForDataSourceStop("trace_events");
+    consumer_->WaitForTracingDisabled();
+    // Resolves the interned names, like trace_to_text does.
+    std::map<uint32_t, std::map<uint64_t, std::string>> interned_strings;
+    std::vector<protos::ChromeTraceEvent> events;
+    for (const auto& packet : consumer_->ReadBuffers()) {
+      EXPECT_FALSE(packet.previous_packet_dropped());
+      auto& strings = interned_strings[packet.trusted_packet_sequence_id()];
+      if (packet.incremental_state_cleared())
+        strings.clear();
+      for (const auto& entry : packet.interned_data().strings())
+        strings[entry.iid()] = entry.str();
+      for (auto event : packet.chrome_events().trace_events()) {
+        EXPECT_FALSE(event.has_name());
+        EXPECT_EQ(1u, strings.count(event.name_iid()));
+        EXPECT_EQ(1u, strings.count(event.category_group_iid()));
+        event.set_name(strings[event.name_iid()]);
+        event.set_category_group_name(strings[event.category_group_iid()]);
+        events.push_back(event);
+      }
+    }
+    return events;
+  }
+
+  base::TestTaskRunner task_runner_;
+  std::unique_ptr<Service> svc_;
+  std::unique_ptr<MockConsumer> consumer_;
+  std::unique_ptr<MockProducer> producer_;
+};
+
+TEST_F(TraceEventTest, CategoriesAreDisabledByDefault) {
+  EXPECT_FALSE(PERFETTO_TRACE_EVENT_ENABLED(kEnabledCategory));
+  EXPECT_FALSE(PERFETTO_TRACE_EVENT_ENABLED(kDisabledCategory));
+
+  // Must be no-ops.
+  PERFETTO_TRACE_EVENT(kEnabledCategory, "scoped");
+  PERFETTO_TRACE_EVENT_INSTANT(kEnabledCategory, "instant");
+  PERFETTO_TRACE_COUNTER(kEnabledCategory, "counter", 42);
+}
+
+TEST_F(TraceEventTest, WriteEvents) {
+  StartTracing({"enabled_category"});
+  EXPECT_TRUE(PERFETTO_TRACE_EVENT_ENABLED(kEnabledCategory));
+  EXPECT_FALSE(PERFETTO_TRACE_EVENT_ENABLED(kDisabledCategory));
+
+  {
+    PERFETTO_TRACE_EVENT(kEnabledCategory, "scoped");
+    PERFETTO_TRACE_EVENT(kDisabledCategory, "disabled");
+    PERFETTO_TRACE_EVENT_INSTANT(kEnabledCategory, "instant");
+    PERFETTO_TRACE_COUNTER(kEnabledCategory, "counter", 42);
+  }
+
+  // The other thread commits its events when it exits.
+  std::thread thread(
+      [] { PERFETTO_TRACE_EVENT_INSTANT(kEnabledCategory, "other_thread"); });
+  thread.join();
+  g_source.Flush();
+
+  std::vector<protos::ChromeTraceEvent> events = StopTracing();
+  EXPECT_FALSE(PERFETTO_TRACE_EVENT_ENABLED(kEnabledCategory));
+
+  std::vector<protos::ChromeTraceEvent> main_thread_events;
+  std::vector<protos::ChromeTraceEvent> other_thread_events;
+  for (const auto& event : events) {
+    EXPECT_EQ("enabled_category", event.category_group_name());
+    EXPECT_EQ(getpid(), event.process_id());
+    if (event.name() == "other_thread") {
+      other_thread_events.push_back(event);
+    } else {
+      main_thread_events.push_back(event);
+    }
+  }
+
+  ASSERT_EQ(4u, main_thread_events.size());
+  EXPECT_EQ("scoped", main_thread_events[0].name());
+  EXPECT_EQ('B', main_thread_events[0].phase());
+  EXPECT_EQ("instant", main_thread_events[1].name());
+  EXPECT_EQ('I', main_thread_events[1].phase());
+  EXPECT_EQ("counter", main_thread_events[2].name());
+  EXPECT_EQ('C', main_thread_events[2].phase());
+  ASSERT_EQ(1, main_thread_events[2].args_size());
+  EXPECT_EQ("value", main_thread_events[2].args(0).name());
+  EXPECT_EQ(42, main_thread_events[2].args(0).int_value());
+  EXPECT_EQ("scoped", main_thread_events[3].name());
+  EXPECT_EQ('E', main_thread_events[3].phase());
+  for (size_t i = 1; i < main_thread_events.size(); i++) {
+    EXPECT_GE(main_thread_events[i].timestamp(),
+              main_thread_events[i - 1].timestamp());
+  }
+
+  ASSERT_EQ(1u, other_thread_events.size());
+  EXPECT_NE(main_thread_events[0].thread_id(),
+            other_thread_events[0].thread_id());
+}
+
+TEST_F(TraceEventTest, AllCategories) {
+  StartTracing({});
+  EXPECT_TRUE(PERFETTO_TRACE_EVENT_ENABLED(kEnabledCategory));
+  EXPECT_TRUE(PERFETTO_TRACE_EVENT_ENABLED(kDisabledCategory));
+  PERFETTO_TRACE_EVENT_BEGIN(kDisabledCategory, "begin");
+  PERFETTO_TRACE_EVENT_END(kDisabledCategory, "begin");
+  g_source.Flush();
+
+  std::vector<protos::ChromeTraceEvent> events = StopTracing();
+  ASSERT_EQ(2u, events.size());
+  EXPECT_EQ("disabled_category", events[0].category_group_name());
+  EXPECT_EQ('B', events[0].phase());
+  EXPECT_EQ('E', events[1].phase());
+}
+
+// The threads that are still alive commit their events when the source is
+// flushed or stopped.
+TEST_F(TraceEventTest, FlushAndStopCommitAllThreads) {
+  StartTracing({});
+  std::promise<void> first_event_written;
+  std::promise<void> flushed;
+  std::promise<void> second_event_written;
+  std::promise<void> stopped;
+  std::thread thread([&] {
+    PERFETTO_TRACE_EVENT_INSTANT(kEnabledCategory, "before_flush");
+    first_event_written.set_value();
+    flushed.get_future().wait();
+    // Another category, so that the event doesn't refer to the interned
+    // strings read before.
+    PERFETTO_TRACE_EVENT_INSTANT(kDisabledCategory, "before_stop");
+    second_event_written.set_value();
+    stopped.get_future().wait();
+  });
+
+  first_event_written.get_future().wait();
+  g_source.Flush();
+  int num_flushed_events = 0;
+  for (const auto& packet : consumer_->ReadBuffers())
+    num_flushed_events += packet.chrome_events().trace_events_size();
+  EXPECT_EQ(1, num_flushed_events);
+  flushed.set_value();
+
+  second_event_written.get_future().wait();
+  std::vector<protos::ChromeTraceEvent> events = StopTracing();
+  stopped.set_value();
+  thread.join();
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ("before_stop", events[0].name());
+}
+
+}  // namespace
+}  // namespace perfetto
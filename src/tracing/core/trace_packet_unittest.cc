@@ -35,6 +35,14 @@ static_assert(protos::TracePacket::kTrustedUidFieldNumber ==
                   protos::TrustedPacket::kTrustedUidFieldNumber,
               "trusted_uid field id mismatch");
 
+static_assert(protos::TracePacket::kTrustedPacketSequenceIdFieldNumber ==
+                  protos::TrustedPacket::kTrustedPacketSequenceIdFieldNumber,
+              "trusted_packet_sequence_id field id mismatch");
+
+static_assert(protos::TracePacket::kPreviousPacketDroppedFieldNumber ==
+                  protos::TrustedPacket::kPreviousPacketDroppedFieldNumber,
+              "previous_packet_dropped field id mismatch");
+
 static_assert(protos::TracePacket::kTraceConfigFieldNumber ==
                   protos::TrustedPacket::kTraceConfigFieldNumber,
               "trace_config field id mismatch");
@@ -28,7 +28,8 @@ namespace perfetto {
 TraceWriterForTesting::TraceWriterForTesting()
     : delegate_(static_cast<size_t>(base::kPageSize)), stream_(&delegate_) {
   delegate_.set_writer(&stream_);
-  cur_packet_.reset(new protos::pbzero::TracePacket());
+  cur_packet_.reset(
+      new protozero::RootMessage<protos::pbzero::TracePacket>());
   cur_packet_->Finalize();  // To avoid the DCHECK in NewTracePacket().
 }
 
@@ -67,4 +68,15 @@ WriterID TraceWriterForTesting::writer_id() const {
   return 0;
 }
 
+uint64_t TraceWriterForTesting::InternString(const char* str,
+                                             size_t size,
+                                             bool* is_new) {
+  return interned_strings_.InternString(str, size, is_new);
+}
+
+uint64_t TraceWriterForTesting::InternStaticString(const char* str,
+                                                   bool* is_new) {
+  return interned_strings_.InternStaticString(str, is_new);
+}
+
 }  // namespace perfetto
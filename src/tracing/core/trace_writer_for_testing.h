@@ -20,6 +20,7 @@
 #include "perfetto/trace/trace_packet.pb.h"
 #include "perfetto/tracing/core/trace_writer.h"
 #include "src/ftrace_reader/test/scattered_stream_delegate_for_testing.h"
+#include "src/tracing/core/interned_string_table.h"
 
 namespace perfetto {
 
@@ -40,6 +41,8 @@ class TraceWriterForTesting : public TraceWriter {
   std::unique_ptr<protos::TracePacket> ParseProto();
 
   WriterID writer_id() const override;
+  uint64_t InternString(const char* str, size_t size, bool* is_new) override;
+  uint64_t InternStaticString(const char* str, bool* is_new) override;
 
  private:
   TraceWriterForTesting(const TraceWriterForTesting&) = delete;
@@ -50,7 +53,10 @@ class TraceWriterForTesting : public TraceWriter {
 
   // The packet returned via NewTracePacket(). Its owned by this class,
   // TracePacketHandle has just a pointer to it.
-  std::unique_ptr<protos::pbzero::TracePacket> cur_packet_;
+  std::unique_ptr<protozero::RootMessage<protos::pbzero::TracePacket>>
+      cur_packet_;
+
+  InternedStringTable interned_strings_;
 };
 
 }  // namespace perfetto
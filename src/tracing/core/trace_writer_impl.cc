@@ -36,25 +36,43 @@ namespace perfetto {
 
 namespace {
 constexpr size_t kPacketHeaderSize = SharedMemoryABI::kPacketHeaderSize;
+
+// Size of the scratch buffer used to discard packets when the shared memory
+// buffer is full. Packets larger than this just wrap around it.
+constexpr size_t kGarbageChunkSize = 4096;
+
+// When acquiring a new chunk, ask for one that can fit this many packets of
+// the average size seen so far. Writers of large packets get larger chunks
+// (and fragment less), writers of small packets get smaller chunks (and
+// commit more often, wasting less of the SMB when they flush).
+constexpr size_t kPacketsPerChunkHint = 4;
+
+// The interning dictionary is reset every this many chunks, so that a reader
+// that lost the older chunks (e.g. overwritten in the ring buffer) can decode
+// the packets from the next reset onwards.
+constexpr ChunkID kIncrementalStateResetIntervalChunks = 64;
 }  // namespace
 
 TraceWriterImpl::TraceWriterImpl(SharedMemoryArbiterImpl* shmem_arbiter,
                                  WriterID id,
-                                 BufferID target_buffer)
+                                 BufferID target_buffer,
+                                 BufferExhaustedPolicy buffer_exhausted_policy)
     : shmem_arbiter_(shmem_arbiter),
       id_(id),
       target_buffer_(target_buffer),
+      buffer_exhausted_policy_(buffer_exhausted_policy),
       protobuf_stream_writer_(this) {
   // TODO(primiano): we could handle the case of running out of TraceWriterID(s)
   // more gracefully and always return a no-op TracePacket in NewTracePacket().
   PERFETTO_CHECK(id_ != 0);
 
-  cur_packet_.reset(new protos::pbzero::TracePacket());
+  cur_packet_.reset(
+      new protozero::RootMessage<protos::pbzero::TracePacket>());
   cur_packet_->Finalize();  // To avoid the DCHECK in NewTracePacket().
 }
 
 TraceWriterImpl::~TraceWriterImpl() {
-  if (cur_chunk_.is_valid()) {
+  if (cur_chunk_.is_valid() || drop_packets_) {
     cur_packet_->Finalize();
     Flush();
   }
@@ -69,6 +87,12 @@ void TraceWriterImpl::Flush(std::function<void()> callback) {
     shmem_arbiter_->ReturnCompletedChunk(std::move(cur_chunk_), target_buffer_,
                                          &patch_list_);
     shmem_arbiter_->FlushPendingCommitDataRequests(callback);
+  } else if (drop_packets_) {
+    // The SMB is full and we are discarding packets. Report the loss so far,
+    // the next NewTracePacket() will try again to acquire a chunk.
+    CountGarbageBytes();
+    ReportDataLoss();
+    shmem_arbiter_->FlushPendingCommitDataRequests(callback);
   } else {
     PERFETTO_DCHECK(patch_list_.empty());
   }
@@ -80,6 +104,8 @@ TraceWriterImpl::TracePacketHandle TraceWriterImpl::NewTracePacket() {
   // finalized the previous packet.
   PERFETTO_DCHECK(cur_packet_->is_finalized());
 
+  // Finalize() is a no-op on a finalized message and just returns its size.
+  UpdateAvgPacketSize(cur_packet_->Finalize());
   fragmenting_packet_ = false;
 
   // Reserve space for the size of the message. Note: this call might re-enter
@@ -91,17 +117,31 @@ TraceWriterImpl::TracePacketHandle TraceWriterImpl::NewTracePacket() {
   // It doesn't make sense to begin a packet that is going to fragment
   // immediately after (8 is just an arbitrary estimation on the minimum size of
   // a realistic packet).
-  if (protobuf_stream_writer_.bytes_available() < kPacketHeaderSize + 8)
+  // If we are discarding packets because the SMB was full, try again to get a
+  // chunk: the service might have freed some in the meantime.
+  if (protobuf_stream_writer_.bytes_available() < kPacketHeaderSize + 8 ||
+      PERFETTO_UNLIKELY(drop_packets_)) {
     protobuf_stream_writer_.Reset(GetNewBuffer());
+  }
 
   cur_packet_->Reset(&protobuf_stream_writer_);
   uint8_t* header = protobuf_stream_writer_.ReserveBytes(kPacketHeaderSize);
   memset(header, 0, kPacketHeaderSize);
   cur_packet_->set_size_field(header);
-  cur_chunk_.IncrementPacketCount();
+  if (PERFETTO_LIKELY(!drop_packets_)) {
+    cur_chunk_.IncrementPacketCount();
+  } else {
+    packets_dropped_++;
+  }
   TracePacketHandle handle(cur_packet_.get());
   cur_fragment_start_ = protobuf_stream_writer_.write_ptr();
   fragmenting_packet_ = true;
+
+  if (PERFETTO_UNLIKELY(incremental_state_reset_pending_)) {
+    incremental_state_reset_pending_ = false;
+    interned_strings_.Clear();
+    cur_packet_->set_incremental_state_cleared(true);
+  }
   return handle;
 }
 
@@ -114,6 +154,44 @@ TraceWriterImpl::TracePacketHandle TraceWriterImpl::NewTracePacket() {
 // In this case |fragmenting_packet_| == false and we just want a new chunk
 // without creating any fragments.
 protozero::ContiguousMemoryRange TraceWriterImpl::GetNewBuffer() {
+  size_t size_hint = 0;
+  if (avg_packet_size_)
+    size_hint = kPacketsPerChunkHint * (avg_packet_size_ + kPacketHeaderSize);
+  return GetNewBufferWithSizeHint(size_hint);
+}
+
+// Called by the Message for the large payloads that it wants to write in
+// place. They get a chunk as large as a page (if any is free), rather than
+// being copied in fragments across several smaller chunks.
+protozero::ContiguousMemoryRange TraceWriterImpl::GetNewBufferForDirectWrite(
+    size_t min_size) {
+  // The new chunk begins with the header of the next fragment of the packet.
+  const size_t size_hint = min_size + kPacketHeaderSize;
+
+  // Chunks can't span across pages, larger payloads have to be copied.
+  if (size_hint > shmem_arbiter_->GetMaxChunkPayloadSize())
+    return {nullptr, nullptr};
+
+  // Nothing has been written in the current fragment yet (e.g. right after
+  // NewTracePacket()): moving to a new chunk would commit an empty fragment.
+  // The payload is copied instead, starting in the current chunk.
+  if (fragmenting_packet_ &&
+      protobuf_stream_writer_.write_ptr() == cur_fragment_start_) {
+    return {nullptr, nullptr};
+  }
+  return GetNewBufferWithSizeHint(size_hint);
+}
+
+protozero::ContiguousMemoryRange TraceWriterImpl::GetNewBufferWithSizeHint(
+    size_t size_hint) {
+  if (PERFETTO_UNLIKELY(drop_packets_)) {
+    CountGarbageBytes();
+    // The packet being written is being discarded, discard the rest of it as
+    // well, by rewinding the garbage chunk.
+    if (fragmenting_packet_)
+      return GetGarbageChunk();
+  }
+
   if (fragmenting_packet_) {
     uint8_t* const wptr = protobuf_stream_writer_.write_ptr();
     PERFETTO_DCHECK(wptr >= cur_fragment_start_);
@@ -180,10 +258,37 @@ protozero::ContiguousMemoryRange TraceWriterImpl::GetNewBuffer() {
   // into the shared buffer with the proper barriers.
   ChunkHeader header = {};
   header.writer_id.store(id_, std::memory_order_relaxed);
-  header.chunk_id.store(next_chunk_id_++, std::memory_order_relaxed);
+  header.chunk_id.store(next_chunk_id_, std::memory_order_relaxed);
   header.packets.store(packets, std::memory_order_relaxed);
 
-  cur_chunk_ = shmem_arbiter_->GetNewChunk(header);
+  cur_chunk_ = shmem_arbiter_->GetNewChunk(header, size_hint,
+                                           buffer_exhausted_policy_);
+  if (PERFETTO_UNLIKELY(!cur_chunk_.is_valid())) {
+    // The SMB is full and the policy is BufferExhaustedPolicy::kDrop. Discard
+    // the data until a chunk becomes available. If we were in the middle of a
+    // packet, its first fragments have been already committed. The ChunkID is
+    // not consumed, so that the next chunk we get has a contiguous ChunkID but
+    // lacks kFirstPacketContinuesFromPrevChunk. This tells the service that
+    // the packet has been truncated.
+    PERFETTO_DCHECK(buffer_exhausted_policy_ == BufferExhaustedPolicy::kDrop);
+    if (fragmenting_packet_)
+      packets_dropped_++;
+    drop_packets_ = true;
+    protozero::ContiguousMemoryRange garbage = GetGarbageChunk();
+    if (fragmenting_packet_)
+      cur_packet_->set_size_field(garbage.begin);
+    return garbage;
+  }
+  if (next_chunk_id_ % kIncrementalStateResetIntervalChunks == 0)
+    incremental_state_reset_pending_ = true;
+  next_chunk_id_++;
+  if (PERFETTO_UNLIKELY(drop_packets_)) {
+    drop_packets_ = false;
+    ReportDataLoss();
+    // The discarded packets might have contained interned entries.
+    incremental_state_reset_pending_ = true;
+  }
+
   uint8_t* payload_begin = cur_chunk_.payload_begin();
   if (fragmenting_packet_) {
     cur_packet_->set_size_field(payload_begin);
@@ -195,10 +300,57 @@ protozero::ContiguousMemoryRange TraceWriterImpl::GetNewBuffer() {
   return protozero::ContiguousMemoryRange{payload_begin, cur_chunk_.end()};
 }
 
+protozero::ContiguousMemoryRange TraceWriterImpl::GetGarbageChunk() {
+  if (!garbage_chunk_)
+    garbage_chunk_.reset(new uint8_t[kGarbageChunkSize]);
+  return protozero::ContiguousMemoryRange{
+      garbage_chunk_.get(), garbage_chunk_.get() + kGarbageChunkSize};
+}
+
+void TraceWriterImpl::CountGarbageBytes() {
+  if (!garbage_chunk_)
+    return;
+  uint8_t* const wptr = protobuf_stream_writer_.write_ptr();
+  uint8_t* const garbage_begin = garbage_chunk_.get();
+  if (wptr > garbage_begin && wptr <= garbage_begin + kGarbageChunkSize)
+    bytes_dropped_ += static_cast<uint64_t>(wptr - garbage_begin);
+}
+
+void TraceWriterImpl::ReportDataLoss() {
+  if (!packets_dropped_ && !bytes_dropped_)
+    return;
+  shmem_arbiter_->NotifyDataLoss(target_buffer_, packets_dropped_,
+                                 bytes_dropped_);
+  packets_dropped_ = 0;
+  bytes_dropped_ = 0;
+}
+
+void TraceWriterImpl::UpdateAvgPacketSize(uint32_t packet_size) {
+  if (!packet_size)
+    return;
+  // Exponential moving average with a 1/8 weight for the new sample.
+  if (avg_packet_size_) {
+    avg_packet_size_ = static_cast<uint32_t>(
+        (uint64_t{avg_packet_size_} * 7 + packet_size) / 8);
+  } else {
+    avg_packet_size_ = packet_size;
+  }
+}
+
 WriterID TraceWriterImpl::writer_id() const {
   return id_;
 }
 
+uint64_t TraceWriterImpl::InternString(const char* str,
+                                       size_t size,
+                                       bool* is_new) {
+  return interned_strings_.InternString(str, size, is_new);
+}
+
+uint64_t TraceWriterImpl::InternStaticString(const char* str, bool* is_new) {
+  return interned_strings_.InternStaticString(str, is_new);
+}
+
 // Base class ctor/dtor definition.
 TraceWriter::TraceWriter() = default;
 TraceWriter::~TraceWriter() = default;
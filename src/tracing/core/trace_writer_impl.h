@@ -17,11 +17,14 @@
 #ifndef SRC_TRACING_CORE_TRACE_WRITER_IMPL_H_
 #define SRC_TRACING_CORE_TRACE_WRITER_IMPL_H_
 
+#include <memory>
+
 #include "perfetto/protozero/message_handle.h"
 #include "perfetto/protozero/scattered_stream_writer.h"
 #include "perfetto/tracing/core/basic_types.h"
 #include "perfetto/tracing/core/shared_memory_abi.h"
 #include "perfetto/tracing/core/trace_writer.h"
+#include "src/tracing/core/interned_string_table.h"
 #include "src/tracing/core/patch_list.h"
 
 namespace perfetto {
@@ -33,13 +36,18 @@ class TraceWriterImpl : public TraceWriter,
                         public protozero::ScatteredStreamWriter::Delegate {
  public:
   // TracePacketHandle is defined in trace_writer.h
-  TraceWriterImpl(SharedMemoryArbiterImpl*, WriterID, BufferID);
+  TraceWriterImpl(SharedMemoryArbiterImpl*,
+                  WriterID,
+                  BufferID,
+                  BufferExhaustedPolicy = BufferExhaustedPolicy::kStall);
   ~TraceWriterImpl() override;
 
   // TraceWriter implementation. See documentation in trace_writer.h.
   TracePacketHandle NewTracePacket() override;
   void Flush(std::function<void()> callback = {}) override;
   WriterID writer_id() const override;
+  uint64_t InternString(const char* str, size_t size, bool* is_new) override;
+  uint64_t InternStaticString(const char* str, bool* is_new) override;
 
  private:
   TraceWriterImpl(const TraceWriterImpl&) = delete;
@@ -47,6 +55,24 @@ class TraceWriterImpl : public TraceWriter,
 
   // ScatteredStreamWriter::Delegate implementation.
   protozero::ContiguousMemoryRange GetNewBuffer() override;
+  protozero::ContiguousMemoryRange GetNewBufferForDirectWrite(
+      size_t min_size) override;
+
+  // Returns the current chunk and acquires a new one, picking its size
+  // according to |size_hint| (see SharedMemoryArbiterImpl::GetNewChunk()).
+  protozero::ContiguousMemoryRange GetNewBufferWithSizeHint(size_t size_hint);
+
+  // Returns the range of |garbage_chunk_|, allocating it if necessary.
+  protozero::ContiguousMemoryRange GetGarbageChunk();
+
+  // Adds the bytes written into |garbage_chunk_| to |bytes_dropped_|.
+  void CountGarbageBytes();
+
+  // Reports |packets_dropped_| and |bytes_dropped_| (if any) to the service.
+  void ReportDataLoss();
+
+  // Accounts the size of the last completed packet into |avg_packet_size_|.
+  void UpdateAvgPacketSize(uint32_t packet_size);
 
   // The per-producer arbiter that coordinates access to the shared memory
   // buffer from several threads.
@@ -59,6 +85,9 @@ class TraceWriterImpl : public TraceWriter,
   // See comments in data_source_config.proto for |target_buffer|.
   const BufferID target_buffer_;
 
+  // See BufferExhaustedPolicy in basic_types.h.
+  const BufferExhaustedPolicy buffer_exhausted_policy_;
+
   // Monotonic (% wrapping) sequence id of the chunk. Together with the WriterID
   // this allows the Service to reconstruct the linear sequence of packets.
   uint16_t next_chunk_id_ = 0;
@@ -73,7 +102,8 @@ class TraceWriterImpl : public TraceWriter,
 
   // The packet returned via NewTracePacket(). Its owned by this class,
   // TracePacketHandle has just a pointer to it.
-  std::unique_ptr<protos::pbzero::TracePacket> cur_packet_;
+  std::unique_ptr<protozero::RootMessage<protos::pbzero::TracePacket>>
+      cur_packet_;
 
   // The start address of |cur_packet_| within |cur_chunk_|. Used to figure out
   // fragments sizes when a TracePacket write is interrupted by GetNewBuffer().
@@ -91,6 +121,31 @@ class TraceWriterImpl : public TraceWriter,
   // later sent out-of-band to the tracing service, who will patch the required
   // chunks, if they are still around.
   PatchList patch_list_;
+
+  // True when the SMB was found full by GetNewBuffer() and the writer is
+  // discarding data (only for BufferExhaustedPolicy::kDrop). While true, the
+  // writer writes into |garbage_chunk_| and retries acquiring a chunk at every
+  // NewTracePacket().
+  bool drop_packets_ = false;
+
+  // Scratch memory that discarded packets are written into. Allocated lazily,
+  // the first time the SMB is found full.
+  std::unique_ptr<uint8_t[]> garbage_chunk_;
+
+  // Packets and bytes discarded and not reported to the service yet.
+  uint64_t packets_dropped_ = 0;
+  uint64_t bytes_dropped_ = 0;
+
+  // Moving average of the size of the packets written so far (0 if none).
+  // Used as a size hint when acquiring new chunks from the arbiter.
+  uint32_t avg_packet_size_ = 0;
+
+  // The incremental state of the sequence, see TraceWriter::InternString().
+  InternedStringTable interned_strings_;
+
+  // When true, the next NewTracePacket() clears |interned_strings_| and sets
+  // TracePacket.incremental_state_cleared.
+  bool incremental_state_reset_pending_ = true;
 };
 
 }  // namespace perfetto
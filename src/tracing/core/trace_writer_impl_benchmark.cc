@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "perfetto/base/page_allocator.h"
+#include "perfetto/base/task_runner.h"
+#include "perfetto/protozero/proto_utils.h"
+#include "perfetto/tracing/core/commit_data_request.h"
+#include "perfetto/tracing/core/service.h"
+#include "perfetto/tracing/core/shared_memory_abi.h"
+#include "perfetto/tracing/core/trace_writer.h"
+#include "src/tracing/core/packed_commit_data.h"
+#include "src/tracing/core/shared_memory_arbiter_impl.h"
+
+#include "perfetto/common/commit_data_request.pb.h"
+#include "perfetto/trace/test_event.pbzero.h"
+#include "perfetto/trace/trace_packet.pbzero.h"
+
+namespace perfetto {
+namespace {
+
+constexpr size_t kPageSize = 4096;
+constexpr size_t kSmbSize = 64 * kPageSize;
+
+// The writer is flushed every N packets, as it would happen when the service
+// issues periodic flush requests. Flushing returns the current chunk to the
+// service, regardless of how full it is.
+constexpr int kPacketsPerFlush = 64;
+
+// Runs tasks synchronously, so that the CommitData() requests posted by the
+// arbiter are handled straight away and the SMB never fills up.
+class InlineTaskRunner : public base::TaskRunner {
+ public:
+  void PostTask(std::function<void()> task) override { task(); }
+  void PostDelayedTask(std::function<void()> task, uint32_t) override {
+    task();
+  }
+  void AddFileDescriptorWatch(int, std::function<void()>) override {}
+  void RemoveFileDescriptorWatch(int) override {}
+};
+
+// Queues the tasks until RunPendingTasks() is called, as it would happen on
+// the producer's thread while the data source is busy writing.
+class QueueTaskRunner : public base::TaskRunner {
+ public:
+  void PostTask(std::function<void()> task) override {
+    tasks_.push_back(std::move(task));
+  }
+  void PostDelayedTask(std::function<void()> task, uint32_t) override {
+    PostTask(std::move(task));
+  }
+  void AddFileDescriptorWatch(int, std::function<void()>) override {}
+  void RemoveFileDescriptorWatch(int) override {}
+
+  void RunPendingTasks() {
+    while (!tasks_.empty()) {
+      std::function<void()> task = std::move(tasks_.front());
+      tasks_.pop_front();
+      task();
+    }
+  }
+
+ private:
+  std::deque<std::function<void()>> tasks_;
+};
+
+// Plays the role of the service: moves the committed chunks out of the SMB
+// and accounts how the space in them has been used.
+class FakeProducerEndpoint : public Service::ProducerEndpoint {
+ public:
+  void RegisterDataSource(const DataSourceDescriptor&) override {}
+  void UnregisterDataSource(const std::string&) override {}
+  void NotifyFlushComplete(FlushRequestID) override {}
+  SharedMemory* shared_memory() const override { return nullptr; }
+  size_t shared_buffer_page_size_kb() const override { return 0; }
+  SharedMemoryOptions shared_memory_options() const override {
+    SharedMemoryOptions options;
+    options.service_scans_smb = scans_smb;
+    return options;
+  }
+  std::unique_ptr<TraceWriter> CreateTraceWriter(
+      BufferID,
+      BufferExhaustedPolicy) override {
+    return nullptr;
+  }
+
+  void CommitData(const CommitDataRequest& req,
+                  CommitDataCallback callback) override {
+    // Serialize the request, as the IPC layer would do. This is the only part
+    // of the CommitData() cost paid by the producer.
+    protos::CommitDataRequest proto;
+    req.ToProto(&proto);
+    commit_requests++;
+    commit_request_bytes += proto.SerializeAsString().size();
+
+    PackedCommitData::ChunksToMoveReader reader(req.packed_chunks_to_move());
+    PackedCommitData::ChunksToMoveReader::Entry ctm;
+    while (reader.Next(&ctm))
+      chunks_to_move_.emplace_back(ctm.page, ctm.chunk);
+    service_work_pending_ = true;
+    if (!defer_service_work)
+      RunServiceWork();
+    if (callback)
+      callback();
+  }
+
+  // Moves the committed chunks or, if |scans_smb|, all the complete ones.
+  void RunServiceWork() {
+    if (!service_work_pending_)
+      return;
+    service_work_pending_ = false;
+    SharedMemoryABI* abi = arbiter->shmem_abi_for_testing();
+    for (const auto& page_and_chunk : chunks_to_move_)
+      MoveChunk(page_and_chunk.first, page_and_chunk.second);
+    chunks_to_move_.clear();
+    if (!scans_smb)
+      return;
+    for (size_t page_idx = 0; page_idx < abi->num_pages(); page_idx++) {
+      const uint32_t num_chunks = SharedMemoryABI::GetNumChunksForLayout(
+          abi->page_layout_dbg(page_idx));
+      for (uint32_t chunk_idx = 0; chunk_idx < num_chunks; chunk_idx++) {
+        if (abi->GetChunkState(page_idx, chunk_idx) ==
+            SharedMemoryABI::kChunkComplete) {
+          MoveChunk(page_idx, chunk_idx);
+        }
+      }
+    }
+  }
+
+  void MoveChunk(size_t page_idx, size_t chunk_idx) {
+    SharedMemoryABI* abi = arbiter->shmem_abi_for_testing();
+    SharedMemoryABI::Chunk chunk =
+        abi->TryAcquireChunkForReading(page_idx, chunk_idx);
+    if (!chunk.is_valid())
+      return;
+    auto packets = chunk.GetPacketCountAndFlags();
+    chunks++;
+    chunk_bytes += chunk.size();
+    if (packets.second &
+        SharedMemoryABI::ChunkHeader::kLastPacketContinuesOnNextChunk) {
+      fragmented_packets++;
+    }
+
+    // Walk the fragments to count the bytes actually used in the chunk.
+    const uint8_t* ptr = chunk.payload_begin();
+    for (uint16_t i = 0; i < packets.first && ptr < chunk.end(); i++) {
+      uint64_t fragment_size = 0;
+      const uint8_t* payload =
+          protozero::proto_utils::ParseVarInt(ptr, chunk.end(),
+                                              &fragment_size);
+      ptr = payload + fragment_size;
+    }
+    used_bytes += static_cast<uint64_t>(ptr - chunk.payload_begin());
+    abi->ReleaseChunkAsFree(std::move(chunk));
+  }
+
+  SharedMemoryArbiterImpl* arbiter = nullptr;
+  bool scans_smb = false;
+  bool defer_service_work = false;
+  uint64_t commit_requests = 0;
+  uint64_t commit_request_bytes = 0;
+  uint64_t chunks = 0;
+  uint64_t chunk_bytes = 0;
+  uint64_t used_bytes = 0;
+  uint64_t fragmented_packets = 0;
+
+ private:
+  std::vector<std::pair<size_t, size_t>> chunks_to_move_;
+  bool service_work_pending_ = false;
+};
+
+// Writes packets of state.range(0) bytes through a TraceWriter and reports:
+// - frag_rate: the number of times a packet has been split across chunks,
+//   on average.
+// - smb_util: the fraction of the committed chunks that contains trace data
+//   (the rest is chunk headers and unused space at the end of chunks).
+// Comparing these counters against a build without the size hints shows the
+// effect of picking the page layout dynamically.
+void BM_TraceWriter_WritePackets(benchmark::State& state) {
+  InlineTaskRunner task_runner;
+  FakeProducerEndpoint endpoint;
+  base::PageAllocator::UniquePtr smb = base::PageAllocator::Allocate(kSmbSize);
+  SharedMemoryArbiterImpl arbiter(smb.get(), kSmbSize, kPageSize, &endpoint,
+                                  &task_runner);
+  endpoint.arbiter = &arbiter;
+  std::unique_ptr<TraceWriter> writer = arbiter.CreateTraceWriter(1);
+
+  const std::string payload(static_cast<size_t>(state.range(0)), 'x');
+  uint64_t packets = 0;
+  while (state.KeepRunning()) {
+    writer->NewTracePacket()->set_for_testing()->set_str(payload.data(),
+                                                         payload.size());
+    if (++packets % kPacketsPerFlush == 0)
+      writer->Flush();
+  }
+  writer->Flush();
+
+  state.SetItemsProcessed(static_cast<int64_t>(packets));
+  state.SetBytesProcessed(static_cast<int64_t>(packets * payload.size()));
+  state.counters["chunks"] = static_cast<double>(endpoint.chunks);
+  state.counters["frag_rate"] =
+      static_cast<double>(endpoint.fragmented_packets) /
+      static_cast<double>(packets);
+  state.counters["smb_util"] = static_cast<double>(endpoint.used_bytes) /
+                               static_cast<double>(endpoint.chunk_bytes);
+}
+
+// Measures the cost per packet paid by the producer to commit its chunks:
+// - Arg 0: the producer sends a CommitData() request for each batch of chunks.
+// - Arg 1: the service scans the SMB (TraceConfig.ProducerConfig.
+//   smb_scan_period_ms) and the producer sends requests only for flushes.
+// The work done by the service is not measured.
+void BM_TraceWriter_CommitCost(benchmark::State& state) {
+  const bool scans_smb = state.range(0) == 1;
+  QueueTaskRunner task_runner;
+  FakeProducerEndpoint endpoint;
+  endpoint.scans_smb = scans_smb;
+  endpoint.defer_service_work = true;
+  base::PageAllocator::UniquePtr smb = base::PageAllocator::Allocate(kSmbSize);
+  SharedMemoryArbiterImpl arbiter(smb.get(), kSmbSize, kPageSize, &endpoint,
+                                  &task_runner,
+                                  endpoint.shared_memory_options());
+  endpoint.arbiter = &arbiter;
+  std::unique_ptr<TraceWriter> writer = arbiter.CreateTraceWriter(1);
+
+  const std::string payload(static_cast<size_t>(state.range(1)), 'x');
+  uint64_t packets = 0;
+  while (state.KeepRunning()) {
+    writer->NewTracePacket()->set_for_testing()->set_str(payload.data(),
+                                                         payload.size());
+    if (++packets % kPacketsPerFlush == 0) {
+      writer->Flush();
+      task_runner.RunPendingTasks();
+
+      // The service runs in another process.
+      state.PauseTiming();
+      endpoint.RunServiceWork();
+      state.ResumeTiming();
+    }
+  }
+
+  state.SetItemsProcessed(static_cast<int64_t>(packets));
+  state.counters["requests"] = static_cast<double>(endpoint.commit_requests);
+  state.counters["request_bytes_per_packet"] =
+      static_cast<double>(endpoint.commit_request_bytes) /
+      static_cast<double>(packets);
+}
+
+}  // namespace
+
+BENCHMARK(BM_TraceWriter_CommitCost)
+    ->Args({0, 16})
+    ->Args({1, 16})
+    ->Args({0, 128})
+    ->Args({1, 128})
+    ->Args({0, 1024})
+    ->Args({1, 1024});
+
+BENCHMARK(BM_TraceWriter_WritePackets)
+    ->Arg(16)
+    ->Arg(128)
+    ->Arg(512)
+    ->Arg(1024)
+    ->Arg(3000)
+    ->Arg(10000);
+
+}  // namespace perfetto
@@ -18,6 +18,7 @@
 
 #include "gtest/gtest.h"
 #include "perfetto/base/utils.h"
+#include "perfetto/protozero/proto_utils.h"
 #include "perfetto/tracing/core/commit_data_request.h"
 #include "perfetto/tracing/core/service.h"
 #include "perfetto/tracing/core/trace_writer.h"
@@ -32,15 +33,23 @@ namespace perfetto {
 namespace {
 
 class FakeProducerEndpoint : public Service::ProducerEndpoint {
+ public:
   void RegisterDataSource(const DataSourceDescriptor&) override {}
   void UnregisterDataSource(const std::string&) override {}
-  void CommitData(const CommitDataRequest&, CommitDataCallback) override {}
+  void CommitData(const CommitDataRequest& req, CommitDataCallback) override {
+    commit_data_requests.push_back(req);
+  }
   void NotifyFlushComplete(FlushRequestID) override {}
   SharedMemory* shared_memory() const override { return nullptr; }
   size_t shared_buffer_page_size_kb() const override { return 0; }
-  std::unique_ptr<TraceWriter> CreateTraceWriter(BufferID) override {
+  SharedMemoryOptions shared_memory_options() const override { return {}; }
+  std::unique_ptr<TraceWriter> CreateTraceWriter(
+      BufferID,
+      BufferExhaustedPolicy) override {
     return nullptr;
   }
+
+  std::vector<CommitDataRequest> commit_data_requests;
 };
 
 class TraceWriterImplTest : public AlignedBufferTest {
@@ -105,6 +114,153 @@ TEST_P(TraceWriterImplTest, SingleWriter) {
   // TODO(primiano): check also the content of the packets decoding the protos.
 }
 
+// Tests that a writer with BufferExhaustedPolicy::kDrop doesn't stall when the
+// shared memory buffer is full and reports the packets it discarded.
+TEST_P(TraceWriterImplTest, DropPacketsWhenBufferExhausted) {
+  const BufferID kBufId = 42;
+  std::unique_ptr<TraceWriter> writer =
+      arbiter_->CreateTraceWriter(kBufId, BufferExhaustedPolicy::kDrop);
+
+  // Nothing ever frees the committed chunks, hence writing twice the size of
+  // the buffer guarantees that at least half of the packets are dropped.
+  const std::string payload(128, 'x');
+  const size_t kNumPackets = 2 * buf_size() / payload.size();
+  for (size_t i = 0; i < kNumPackets; i++) {
+    auto packet = writer->NewTracePacket();
+    packet->set_for_testing()->set_str(payload.data(), payload.size());
+  }
+  writer->Flush();
+
+  uint64_t packets_dropped = 0;
+  uint64_t bytes_dropped = 0;
+  for (const auto& req : fake_producer_endpoint_.commit_data_requests) {
+    for (const auto& data_loss : req.data_losses()) {
+      EXPECT_EQ(kBufId, data_loss.target_buffer());
+      packets_dropped += data_loss.packets_dropped();
+      bytes_dropped += data_loss.bytes_dropped();
+    }
+  }
+  EXPECT_GE(packets_dropped, kNumPackets / 2);
+  EXPECT_LT(packets_dropped, kNumPackets);
+  EXPECT_GT(bytes_dropped, (packets_dropped - 1) * payload.size());
+}
+
+TEST_P(TraceWriterImplTest, InternStrings) {
+  std::unique_ptr<TraceWriter> writer = arbiter_->CreateTraceWriter(42);
+  static const char kStaticString[] = "static";
+  bool is_new = false;
+  {
+    auto packet = writer->NewTracePacket();
+    EXPECT_EQ(1u, writer->InternString("foo", 3, &is_new));
+    EXPECT_TRUE(is_new);
+    EXPECT_EQ(1u, writer->InternString("foobar", 3, &is_new));
+    EXPECT_FALSE(is_new);
+    EXPECT_EQ(2u, writer->InternString("bar", 3, &is_new));
+    EXPECT_TRUE(is_new);
+    EXPECT_EQ(3u, writer->InternStaticString(kStaticString, &is_new));
+    EXPECT_TRUE(is_new);
+    EXPECT_EQ(3u, writer->InternStaticString(kStaticString, &is_new));
+    EXPECT_FALSE(is_new);
+  }
+
+  // The dictionary is reset periodically, as the writer moves on to new
+  // chunks. Free the chunks as they are completed, so the writer never stalls.
+  SharedMemoryABI* abi = arbiter_->shmem_abi_for_testing();
+  const std::string payload(page_size() / 8, 'x');
+  size_t num_packets = 1;
+  for (; num_packets < 1000; num_packets++) {
+    auto packet = writer->NewTracePacket();
+    uint64_t iid = writer->InternString("foo", 3, &is_new);
+    if (is_new) {
+      EXPECT_EQ(1u, iid);
+      break;
+    }
+    packet->set_for_testing()->set_str(payload.data(), payload.size());
+    packet->Finalize();
+    for (size_t page_idx = 0; page_idx < kNumPages; page_idx++) {
+      size_t num_chunks =
+          SharedMemoryABI::GetNumChunksForLayout(abi->page_layout_dbg(page_idx));
+      for (size_t chunk_idx = 0; chunk_idx < num_chunks; chunk_idx++) {
+        auto chunk = abi->TryAcquireChunkForReading(page_idx, chunk_idx);
+        if (chunk.is_valid())
+          abi->ReleaseChunkAsFree(std::move(chunk));
+      }
+    }
+  }
+  EXPECT_TRUE(is_new);
+  EXPECT_GT(num_packets, 16u);
+}
+
+// Large payloads written in place get a chunk that takes a whole page, rather
+// than being copied across several chunks of the default layout.
+TEST_P(TraceWriterImplTest, DirectWrite) {
+  std::unique_ptr<TraceWriter> writer = arbiter_->CreateTraceWriter(42);
+  SharedMemoryABI* abi = arbiter_->shmem_abi_for_testing();
+  const size_t kSize = page_size() / 2;
+  {
+    auto packet = writer->NewTracePacket();
+    uint8_t* payload = packet->set_for_testing()->AppendBytesForDirectWrite(
+        protos::pbzero::TestEvent::kStrFieldNumber, kSize);
+    ASSERT_NE(nullptr, payload);
+    memset(payload, 'x', kSize);
+
+    size_t page_idx = 0;
+    while (payload >= abi->page_start(page_idx) + page_size())
+      page_idx++;
+    EXPECT_LE(payload + kSize, abi->page_start(page_idx) + page_size());
+    EXPECT_EQ(1u, SharedMemoryABI::GetNumChunksForLayout(
+                      abi->page_layout_dbg(page_idx)));
+  }
+
+  // Payloads larger than a page can't be contiguous in the SMB.
+  {
+    auto packet = writer->NewTracePacket();
+    auto* event = packet->set_for_testing();
+    EXPECT_EQ(nullptr,
+              event->AppendBytesForDirectWrite(
+                  protos::pbzero::TestEvent::kStrFieldNumber, page_size()));
+    const std::string payload(page_size(), 'y');
+    event->set_str(payload.data(), payload.size());
+  }
+}
+
+// A payload written in place at the beginning of a packet that doesn't fit in
+// the current chunk is copied instead: moving to a new chunk would leave an
+// empty fragment of the packet behind.
+TEST_P(TraceWriterImplTest, DirectWriteAtBeginningOfPacket) {
+  std::unique_ptr<TraceWriter> writer = arbiter_->CreateTraceWriter(42);
+  const size_t kSize = page_size() / 2;
+  writer->NewTracePacket()->set_for_testing()->set_str("first");
+  {
+    auto packet = writer->NewTracePacket();
+    EXPECT_EQ(nullptr,
+              packet->AppendBytesForDirectWrite(
+                  protos::pbzero::TracePacket::kForTestingFieldNumber, kSize));
+    const std::string payload(kSize, 'x');
+    packet->AppendBytes(protos::pbzero::TracePacket::kForTestingFieldNumber,
+                        payload.data(), payload.size());
+  }
+  writer.reset();
+
+  SharedMemoryABI* abi = arbiter_->shmem_abi_for_testing();
+  size_t num_chunks_read = 0;
+  for (size_t page_idx = 0; page_idx < kNumPages; page_idx++) {
+    uint32_t page_layout = abi->page_layout_dbg(page_idx);
+    size_t num_chunks = SharedMemoryABI::GetNumChunksForLayout(page_layout);
+    for (size_t chunk_idx = 0; chunk_idx < num_chunks; chunk_idx++) {
+      auto chunk = abi->TryAcquireChunkForReading(page_idx, chunk_idx);
+      if (!chunk.is_valid())
+        continue;
+      num_chunks_read++;
+      uint64_t fragment_size = 0;
+      protozero::proto_utils::ParseVarInt(
+          chunk.payload_begin(), chunk.end(), &fragment_size);
+      EXPECT_GT(fragment_size, 0u);
+    }
+  }
+  EXPECT_GT(num_chunks_read, 1u);
+}
+
 // TODO(primiano): add multi-writer test.
 // TODO(primiano): add Flush() test.
 
@@ -34,17 +34,21 @@ namespace perfetto {
 std::unique_ptr<Service::ConsumerEndpoint> ConsumerIPCClient::Connect(
     const char* service_sock_name,
     Consumer* consumer,
-    base::TaskRunner* task_runner) {
+    base::TaskRunner* task_runner,
+    bool use_shared_memory_for_reads) {
   return std::unique_ptr<Service::ConsumerEndpoint>(
-      new ConsumerIPCClientImpl(service_sock_name, consumer, task_runner));
+      new ConsumerIPCClientImpl(service_sock_name, consumer, task_runner,
+                                use_shared_memory_for_reads));
 }
 
 ConsumerIPCClientImpl::ConsumerIPCClientImpl(const char* service_sock_name,
                                              Consumer* consumer,
-                                             base::TaskRunner* task_runner)
+                                             base::TaskRunner* task_runner,
+                                             bool use_shared_memory_for_reads)
     : consumer_(consumer),
       ipc_channel_(ipc::Client::CreateInstance(service_sock_name, task_runner)),
       consumer_port_(this /* event_listener */),
+      use_shared_memory_for_reads_(use_shared_memory_for_reads),
       weak_ptr_factory_(this) {
   ipc_channel_->BindService(consumer_port_.GetWeakPtr());
 }
@@ -104,6 +108,14 @@ void ConsumerIPCClientImpl::DisableTracing() {
 }
 
 void ConsumerIPCClientImpl::ReadBuffers() {
+  SendReadBuffersRequest(/*snapshot=*/false);
+}
+
+void ConsumerIPCClientImpl::ReadBuffersSnapshot() {
+  SendReadBuffersRequest(/*snapshot=*/true);
+}
+
+void ConsumerIPCClientImpl::SendReadBuffersRequest(bool snapshot) {
   if (!connected_) {
     PERFETTO_DLOG("Cannot ReadBuffers(), not connected to tracing service");
     return;
@@ -119,8 +131,10 @@ void ConsumerIPCClientImpl::ReadBuffers() {
       [this](ipc::AsyncResult<protos::ReadBuffersResponse> response) {
         OnReadBuffersResponse(std::move(response));
       });
-  consumer_port_.ReadBuffers(protos::ReadBuffersRequest(),
-                             std::move(async_response));
+  protos::ReadBuffersRequest req;
+  req.set_use_shared_memory(use_shared_memory_for_reads_);
+  req.set_snapshot(snapshot);
+  consumer_port_.ReadBuffers(req, std::move(async_response));
 }
 
 void ConsumerIPCClientImpl::OnReadBuffersResponse(
@@ -129,15 +143,59 @@ void ConsumerIPCClientImpl::OnReadBuffersResponse(
     PERFETTO_DLOG("ReadBuffers() failed");
     return;
   }
+
+  // The file descriptor of the shared memory region is attached to the first
+  // response that refers to it.
+  if (response->has_shm_release_offset() && !read_buffers_shm_) {
+    base::ScopedFile shm_fd = ipc_channel_->TakeReceivedFD();
+    if (!shm_fd || !use_shared_memory_for_reads_) {
+      PERFETTO_ELOG("Unexpected shared memory in ReadBuffers() response");
+      return;
+    }
+    read_buffers_shm_ = PosixSharedMemory::AttachToFd(std::move(shm_fd));
+  }
+
   std::vector<TracePacket> trace_packets;
   for (auto& resp_slice : *response->mutable_slices()) {
-    partial_packet_.AddSlice(
-        Slice(std::unique_ptr<std::string>(resp_slice.release_data())));
+    if (resp_slice.has_shm_size()) {
+      const size_t shm_offset = resp_slice.shm_offset();
+      const size_t shm_size = resp_slice.shm_size();
+      if (!read_buffers_shm_ ||
+          shm_offset + shm_size > read_buffers_shm_->size()) {
+        PERFETTO_ELOG("Invalid shared memory slice in ReadBuffers() response");
+        return;
+      }
+      partial_packet_.AddSlice(
+          static_cast<const uint8_t*>(read_buffers_shm_->start()) + shm_offset,
+          shm_size);
+    } else {
+      partial_packet_.AddSlice(
+          Slice(std::unique_ptr<std::string>(resp_slice.release_data())));
+    }
     if (resp_slice.last_slice_for_packet())
       trace_packets.emplace_back(std::move(partial_packet_));
   }
+  if (response->has_shm_release_offset())
+    shm_release_offset_ = response->shm_release_offset();
+
+  // The Consumer is allowed to destroy this class from within OnTraceData().
+  auto weak_this = weak_ptr_factory_.GetWeakPtr();
   if (!trace_packets.empty() || !response.has_more())
     consumer_->OnTraceData(std::move(trace_packets), response.has_more());
+  if (!weak_this)
+    return;
+
+  // Once OnTraceData() returns the packets are gone and the shared memory can
+  // be reused by the service. The only exception is a packet that spans
+  // several responses, whose first slices might still be in the region.
+  if (shm_release_offset_ > shm_released_offset_ &&
+      partial_packet_.slices().empty()) {
+    protos::ReleaseReadBuffersMemoryRequest release_req;
+    release_req.set_release_offset(shm_release_offset_);
+    consumer_port_.ReleaseReadBuffersMemory(
+        release_req, ipc::Deferred<protos::ReleaseReadBuffersMemoryResponse>());
+    shm_released_offset_ = shm_release_offset_;
+  }
 }
 
 void ConsumerIPCClientImpl::FreeBuffers() {
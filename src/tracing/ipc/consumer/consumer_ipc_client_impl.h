@@ -28,6 +28,7 @@
 #include "perfetto/tracing/core/service.h"
 #include "perfetto/tracing/core/trace_packet.h"
 #include "perfetto/tracing/ipc/consumer_ipc_client.h"
+#include "src/tracing/ipc/posix_shared_memory.h"
 
 #include "perfetto/ipc/consumer_port.ipc.h"
 
@@ -53,7 +54,8 @@ class ConsumerIPCClientImpl : public Service::ConsumerEndpoint,
  public:
   ConsumerIPCClientImpl(const char* service_sock_name,
                         Consumer*,
-                        base::TaskRunner*);
+                        base::TaskRunner*,
+                        bool use_shared_memory_for_reads = false);
   ~ConsumerIPCClientImpl() override;
 
   // Service::ConsumerEndpoint implementation.
@@ -62,6 +64,7 @@ class ConsumerIPCClientImpl : public Service::ConsumerEndpoint,
   void EnableTracing(const TraceConfig&, base::ScopedFile) override;
   void DisableTracing() override;
   void ReadBuffers() override;
+  void ReadBuffersSnapshot() override;
   void FreeBuffers() override;
   void Flush(uint32_t timeout_ms, FlushCallback) override;
 
@@ -72,6 +75,7 @@ class ConsumerIPCClientImpl : public Service::ConsumerEndpoint,
   void OnDisconnect() override;
 
  private:
+  void SendReadBuffersRequest(bool snapshot);
   void OnReadBuffersResponse(ipc::AsyncResult<protos::ReadBuffersResponse>);
 
   // TODO(primiano): think to dtor order, do we rely on any specific sequence?
@@ -93,6 +97,15 @@ class ConsumerIPCClientImpl : public Service::ConsumerEndpoint,
   // one with |last_slice_for_packet| == true is received.
   TracePacket partial_packet_;
 
+  // See ConsumerIPCClient::Connect(). |read_buffers_shm_| is attached lazily,
+  // when the first ReadBuffersResponse that uses it is received.
+  // |shm_release_offset_| is the offset received with the last response and
+  // |shm_released_offset_| the one last passed to ReleaseReadBuffersMemory().
+  const bool use_shared_memory_for_reads_;
+  std::unique_ptr<PosixSharedMemory> read_buffers_shm_;
+  uint64_t shm_release_offset_ = 0;
+  uint64_t shm_released_offset_ = 0;
+
   base::WeakPtrFactory<ConsumerIPCClientImpl> weak_ptr_factory_;
 };
 
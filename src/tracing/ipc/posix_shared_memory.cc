@@ -31,41 +31,92 @@
 #include "perfetto/base/logging.h"
 #include "perfetto/base/temp_file.h"
 
-#if PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
 #include <linux/memfd.h>
 #include <sys/syscall.h>
+
+// Not defined by older kernel and libc headers.
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
 #endif
 
 namespace perfetto {
 
+namespace {
+
+base::ScopedFile CreateUnlinkedTempFile(size_t size) {
+  base::ScopedFile fd = base::TempFile::CreateUnlinked().ReleaseFD();
+  PERFETTO_CHECK(fd);
+  int res = ftruncate(fd.get(), static_cast<off_t>(size));
+  PERFETTO_CHECK(res == 0);
+  return fd;
+}
+
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+// Returns an invalid fd if memfd_create() is not supported by the kernel, or
+// if it doesn't support |extra_flags| (MFD_HUGETLB requires Linux 4.14, 4.16
+// together with MFD_ALLOW_SEALING), or if the region can't be sized.
+base::ScopedFile CreateSealedMemfd(size_t size, unsigned int extra_flags) {
+  base::ScopedFile fd(static_cast<int>(
+      syscall(__NR_memfd_create, "perfetto_shmem",
+              MFD_CLOEXEC | MFD_ALLOW_SEALING | extra_flags)));
+  if (!fd)
+    return fd;
+  if (ftruncate(fd.get(), static_cast<off_t>(size)) != 0)
+    return base::ScopedFile();
+
+  // From now on nobody, including the producer which receives the fd, can
+  // change the size of the region.
+  int res = fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+  PERFETTO_DCHECK(res == 0);
+  return fd;
+}
+#endif
+
+}  // namespace
+
+constexpr size_t PosixSharedMemory::kHugePageSize;
+
 // static
-std::unique_ptr<PosixSharedMemory> PosixSharedMemory::Create(size_t size) {
-  base::ScopedFile fd;
-#if PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
-  bool is_memfd = false;
-  fd.reset(static_cast<int>(syscall(__NR_memfd_create, "perfetto_shmem",
-                                    MFD_CLOEXEC | MFD_ALLOW_SEALING)));
-  is_memfd = !!fd;
+std::unique_ptr<PosixSharedMemory> PosixSharedMemory::Create(
+    size_t size,
+    bool use_huge_pages) {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  if (use_huge_pages && size % kHugePageSize == 0) {
+    // The huge pages are reserved by mmap(), which fails if the pool of the
+    // system is exhausted.
+    base::ScopedFile fd = CreateSealedMemfd(size, MFD_HUGETLB);
+    std::unique_ptr<PosixSharedMemory> shm;
+    if (fd)
+      shm = MapFD(std::move(fd), size);
+    if (shm)
+      return shm;
+    PERFETTO_DPLOG("Could not use huge pages, falling back on regular pages");
+  }
 
+  base::ScopedFile fd = CreateSealedMemfd(size, 0);
   if (!fd) {
     // TODO: if this fails on Android we should fall back on ashmem.
     PERFETTO_DPLOG("memfd_create() failed");
+    fd = CreateUnlinkedTempFile(size);
   }
+#else
+  base::ScopedFile fd = CreateUnlinkedTempFile(size);
 #endif
 
-  if (!fd)
-    fd = base::TempFile::CreateUnlinked().ReleaseFD();
-
-  PERFETTO_CHECK(fd);
-  int res = ftruncate(fd.get(), static_cast<off_t>(size));
-  PERFETTO_CHECK(res == 0);
-#if PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
-  if (is_memfd) {
-    res = fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
-    PERFETTO_DCHECK(res == 0);
-  }
-#endif
-  return MapFD(std::move(fd), size);
+  std::unique_ptr<PosixSharedMemory> shm = MapFD(std::move(fd), size);
+  PERFETTO_CHECK(shm);
+  return shm;
 }
 
 // static
@@ -74,7 +125,10 @@ std::unique_ptr<PosixSharedMemory> PosixSharedMemory::AttachToFd(
   struct stat stat_buf = {};
   int res = fstat(fd.get(), &stat_buf);
   PERFETTO_CHECK(res == 0 && stat_buf.st_size > 0);
-  return MapFD(std::move(fd), static_cast<size_t>(stat_buf.st_size));
+  std::unique_ptr<PosixSharedMemory> shm =
+      MapFD(std::move(fd), static_cast<size_t>(stat_buf.st_size));
+  PERFETTO_CHECK(shm);
+  return shm;
 }
 
 // static
@@ -84,7 +138,8 @@ std::unique_ptr<PosixSharedMemory> PosixSharedMemory::MapFD(base::ScopedFile fd,
   PERFETTO_DCHECK(size > 0);
   void* start =
       mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
-  PERFETTO_CHECK(start != MAP_FAILED);
+  if (start == MAP_FAILED)
+    return nullptr;
   return std::unique_ptr<PosixSharedMemory>(
       new PosixSharedMemory(start, size, std::move(fd)));
 }
@@ -98,11 +153,14 @@ PosixSharedMemory::~PosixSharedMemory() {
   munmap(start(), size());
 }
 
+PosixSharedMemory::Factory::Factory(bool use_huge_pages)
+    : use_huge_pages_(use_huge_pages) {}
+
 PosixSharedMemory::Factory::~Factory() {}
 
 std::unique_ptr<SharedMemory> PosixSharedMemory::Factory::CreateSharedMemory(
     size_t size) {
-  return PosixSharedMemory::Create(size);
+  return PosixSharedMemory::Create(size, use_huge_pages_);
 }
 
 }  // namespace perfetto
@@ -31,12 +31,26 @@ class PosixSharedMemory : public SharedMemory {
  public:
   class Factory : public SharedMemory::Factory {
    public:
+    // See Create() for |use_huge_pages|.
+    explicit Factory(bool use_huge_pages = false);
     ~Factory() override;
     std::unique_ptr<SharedMemory> CreateSharedMemory(size_t) override;
+
+   private:
+    const bool use_huge_pages_;
   };
 
-  // Create a brand new SHM region (the service uses this).
-  static std::unique_ptr<PosixSharedMemory> Create(size_t size);
+  // The regions backed by huge pages must be a multiple of this size.
+  static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+  // Create a brand new SHM region (the service uses this). On Linux and
+  // Android the region is a memfd sealed against shrinking and growing, so
+  // that the other side can't truncate it and cause a SIGBUS in the process
+  // that created it. If |use_huge_pages| is true and |size| is a multiple of
+  // kHugePageSize, the region is backed by huge pages, when available. This
+  // saves TLB misses on large buffers, but the memory is committed upfront.
+  static std::unique_ptr<PosixSharedMemory> Create(size_t size,
+                                                   bool use_huge_pages = false);
 
   // Mmaps a file descriptor to an existing SHM region (the producer uses this).
   static std::unique_ptr<PosixSharedMemory> AttachToFd(base::ScopedFile);
@@ -50,6 +64,7 @@ class PosixSharedMemory : public SharedMemory {
   size_t size() const override { return size_; }
 
  private:
+  // Returns nullptr if the mmap() fails.
   static std::unique_ptr<PosixSharedMemory> MapFD(base::ScopedFile, size_t);
 
   PosixSharedMemory(void* start, size_t size, base::ScopedFile);
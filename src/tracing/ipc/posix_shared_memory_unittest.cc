@@ -31,6 +31,12 @@
 #include "src/base/test/test_task_runner.h"
 #include "src/base/test/vm_test_utils.h"
 
+#ifndef F_GET_SEALS
+#define F_GET_SEALS (1024 + 10)
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
 namespace perfetto {
 namespace {
 
@@ -86,5 +92,38 @@ TEST(PosixSharedMemoryTest, AttachToFd) {
   ASSERT_FALSE(base::vm_test_utils::IsMapped(shm_start, shm_size));
 }
 
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+TEST(PosixSharedMemoryTest, SealedAgainstResize) {
+  std::unique_ptr<PosixSharedMemory> shm =
+      PosixSharedMemory::Create(base::kPageSize);
+  int seals = fcntl(shm->fd(), F_GET_SEALS);
+  if (seals == -1)
+    return;  // memfd_create() is not supported by the kernel.
+  EXPECT_EQ(F_SEAL_SHRINK | F_SEAL_GROW,
+            seals & (F_SEAL_SHRINK | F_SEAL_GROW));
+  EXPECT_NE(0, ftruncate(shm->fd(), 0));
+  EXPECT_NE(0, ftruncate(shm->fd(), base::kPageSize * 2));
+  ASSERT_EQ(static_cast<off_t>(base::kPageSize),
+            lseek(shm->fd(), 0, SEEK_END));
+}
+#endif
+
+// Falls back on regular pages if the system has no huge pages available.
+TEST(PosixSharedMemoryTest, HugePages) {
+  PosixSharedMemory::Factory factory(true /* use_huge_pages */);
+  const size_t size = PosixSharedMemory::kHugePageSize;
+  std::unique_ptr<SharedMemory> shm = factory.CreateSharedMemory(size);
+  ASSERT_EQ(size, shm->size());
+  memset(shm->start(), 0x42, size);
+
+  base::ScopedFile fd(
+      dup(static_cast<PosixSharedMemory*>(shm.get())->fd()));
+  std::unique_ptr<PosixSharedMemory> attached =
+      PosixSharedMemory::AttachToFd(std::move(fd));
+  ASSERT_EQ(size, attached->size());
+  EXPECT_EQ(0x42, static_cast<uint8_t*>(attached->start())[size - 1]);
+}
+
 }  // namespace
 }  // namespace perfetto
@@ -131,9 +131,17 @@ void ProducerIPCClientImpl::OnServiceRequest(
     shared_memory_ = PosixSharedMemory::AttachToFd(std::move(shmem_fd));
     shared_buffer_page_size_kb_ =
         cmd.setup_tracing().shared_buffer_page_size_kb();
+    shared_memory_options_.use_commit_ring = cmd.setup_tracing().commit_ring();
+    shared_memory_options_.service_scans_smb =
+        cmd.setup_tracing().smb_scanning();
+    CommitPolicy& commit_policy = shared_memory_options_.commit_policy;
+    commit_policy.max_latency_ms = cmd.setup_tracing().commit_max_latency_ms();
+    commit_policy.min_batch_bytes =
+        cmd.setup_tracing().commit_min_batch_bytes();
+    commit_policy.adaptive = cmd.setup_tracing().adaptive_commit();
     shared_memory_arbiter_ = SharedMemoryArbiter::CreateInstance(
         shared_memory_.get(), shared_buffer_page_size_kb_ * 1024, this,
-        task_runner_);
+        task_runner_, shared_memory_options_);
     producer_->OnTracingSetup();
     return;
   }
@@ -213,10 +221,12 @@ void ProducerIPCClientImpl::CommitData(const CommitDataRequest& req,
 }
 
 std::unique_ptr<TraceWriter> ProducerIPCClientImpl::CreateTraceWriter(
-    BufferID target_buffer) {
+    BufferID target_buffer,
+    BufferExhaustedPolicy buffer_exhausted_policy) {
   // This method can be called by different threads. |shared_memory_arbiter_| is
   // thread-safe but be aware of accessing any other state in this function.
-  return shared_memory_arbiter_->CreateTraceWriter(target_buffer);
+  return shared_memory_arbiter_->CreateTraceWriter(target_buffer,
+                                                   buffer_exhausted_policy);
 }
 
 void ProducerIPCClientImpl::NotifyFlushComplete(FlushRequestID req_id) {
@@ -231,4 +241,8 @@ size_t ProducerIPCClientImpl::shared_buffer_page_size_kb() const {
   return shared_buffer_page_size_kb_;
 }
 
+SharedMemoryOptions ProducerIPCClientImpl::shared_memory_options() const {
+  return shared_memory_options_;
+}
+
 }  // namespace perfetto
@@ -17,6 +17,7 @@
 #include "src/tracing/ipc/service/consumer_ipc_service.h"
 
 #include <inttypes.h>
+#include <string.h>
 
 #include "perfetto/base/logging.h"
 #include "perfetto/base/scoped_file.h"
@@ -31,6 +32,15 @@
 
 namespace perfetto {
 
+namespace {
+
+// Size of the shared memory region used to move trace data to consumers that
+// pass ReadBuffersRequest.use_shared_memory. This is allocated lazily on the
+// first ReadBuffers() call that requires it.
+constexpr size_t kReadBuffersShmSize = 4 * 1024 * 1024;
+
+}  // namespace
+
 ConsumerIPCService::ConsumerIPCService(Service* core_service)
     : core_service_(core_service), weak_ptr_factory_(this) {}
 
@@ -78,11 +88,44 @@ void ConsumerIPCService::DisableTracing(const protos::DisableTracingRequest&,
 }
 
 // Called by the IPC layer.
-void ConsumerIPCService::ReadBuffers(const protos::ReadBuffersRequest&,
+void ConsumerIPCService::ReadBuffers(const protos::ReadBuffersRequest& req,
                                      DeferredReadBuffersResponse resp) {
   RemoteConsumer* remote_consumer = GetConsumerForCurrentRequest();
+  remote_consumer->read_buffers_use_shm = req.use_shared_memory();
+  if (req.use_shared_memory() && !remote_consumer->read_buffers_shm) {
+    remote_consumer->read_buffers_shm =
+        PosixSharedMemory::Create(kReadBuffersShmSize);
+  }
   remote_consumer->read_buffers_response = std::move(resp);
-  remote_consumer->service_endpoint->ReadBuffers();
+  if (req.snapshot()) {
+    remote_consumer->service_endpoint->ReadBuffersSnapshot();
+  } else {
+    remote_consumer->service_endpoint->ReadBuffers();
+  }
+}
+
+// Called by the IPC layer.
+void ConsumerIPCService::ReleaseReadBuffersMemory(
+    const protos::ReleaseReadBuffersMemoryRequest& req,
+    DeferredReleaseReadBuffersMemoryResponse resp) {
+  RemoteConsumer* remote_consumer = GetConsumerForCurrentRequest();
+  const uint64_t release_offset = req.release_offset();
+  if (release_offset < remote_consumer->read_buffers_shm_rel_off ||
+      release_offset > remote_consumer->read_buffers_shm_wr_off) {
+    PERFETTO_DLOG("Invalid ReleaseReadBuffersMemory() offset %" PRIu64,
+                  release_offset);
+    if (resp.IsBound())
+      resp.Reject();
+    return;
+  }
+  remote_consumer->read_buffers_shm_rel_off = release_offset;
+
+  // The consumer is not expected to bind a callback to this request, to avoid
+  // an extra wakeup for each batch of packets read.
+  if (resp.IsBound()) {
+    resp.Resolve(
+        ipc::AsyncResult<protos::ReleaseReadBuffersMemoryResponse>::Create());
+  }
 }
 
 // Called by the IPC layer.
@@ -176,7 +219,14 @@ void ConsumerIPCService::RemoteConsumer::OnTraceData(
       // 64: the overhead of the IPC InvokeMethodReply + wire_protocol's frame.
       // If these estimations are wrong, BufferedFrameDeserializer::Serialize()
       // will hit a DCHECK anyways.
-      const size_t approx_slice_size = slice.size + 16;
+      // When using the shared memory transport only the offset and size of
+      // the slice are sent over the socket. If the shared memory region is
+      // full (because the consumer is lagging behind) the payload is inlined
+      // in the IPC, as in the non-shared-memory case.
+      uint32_t shm_offset = 0;
+      const bool use_shm = read_buffers_use_shm && read_buffers_shm &&
+                           CopyIntoSharedMemory(slice, &shm_offset);
+      const size_t approx_slice_size = (use_shm ? 0 : slice.size) + 16;
       if (approx_reply_size + approx_slice_size > ipc::kIPCBufferSize - 64) {
         // If we hit this CHECK we got a single slice that is > kIPCBufferSize.
         PERFETTO_CHECK(result->slices_size() > 0);
@@ -187,10 +237,41 @@ void ConsumerIPCService::RemoteConsumer::OnTraceData(
 
       auto* res_slice = result->add_slices();
       res_slice->set_last_slice_for_packet(--num_slices_left_for_packet == 0);
-      res_slice->set_data(slice.start, slice.size);
+      if (!use_shm) {
+        res_slice->set_data(slice.start, slice.size);
+        continue;
+      }
+      res_slice->set_shm_offset(shm_offset);
+      res_slice->set_shm_size(static_cast<uint32_t>(slice.size));
+      result->set_shm_release_offset(read_buffers_shm_wr_off);
+      if (!read_buffers_shm_fd_sent) {
+        result.set_fd(read_buffers_shm->fd());
+        read_buffers_shm_fd_sent = true;
+      }
     }
   }
   send_ipc_reply(has_more);
 }
 
+bool ConsumerIPCService::RemoteConsumer::CopyIntoSharedMemory(
+    const Slice& slice,
+    uint32_t* offset) {
+  const uint64_t shm_size = read_buffers_shm->size();
+  uint64_t wr_off = read_buffers_shm_wr_off;
+
+  // Slices are never wrapped around the end of the region. If the slice
+  // doesn't fit in the tail of the region, skip the tail and restart from the
+  // beginning. The skipped bytes are released together with the slice.
+  if (wr_off % shm_size + slice.size > shm_size)
+    wr_off += shm_size - wr_off % shm_size;
+  if (wr_off + slice.size - read_buffers_shm_rel_off > shm_size)
+    return false;
+
+  *offset = static_cast<uint32_t>(wr_off % shm_size);
+  memcpy(static_cast<uint8_t*>(read_buffers_shm->start()) + *offset,
+         slice.start, slice.size);
+  read_buffers_shm_wr_off = wr_off + slice.size;
+  return true;
+}
+
 }  // namespace perfetto
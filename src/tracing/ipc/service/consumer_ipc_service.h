@@ -17,6 +17,8 @@
 #ifndef SRC_TRACING_IPC_SERVICE_CONSUMER_IPC_SERVICE_H_
 #define SRC_TRACING_IPC_SERVICE_CONSUMER_IPC_SERVICE_H_
 
+#include <stdint.h>
+
 #include <list>
 #include <map>
 #include <memory>
@@ -26,6 +28,7 @@
 #include "perfetto/ipc/basic_types.h"
 #include "perfetto/tracing/core/consumer.h"
 #include "perfetto/tracing/core/service.h"
+#include "src/tracing/ipc/posix_shared_memory.h"
 
 #include "perfetto/ipc/consumer_port.ipc.h"
 
@@ -35,6 +38,8 @@ namespace ipc {
 class Host;
 }  // namespace ipc
 
+struct Slice;
+
 // Implements the Consumer port of the IPC service. This class proxies requests
 // and responses between the core service logic (|svc_|) and remote Consumer(s)
 // on the IPC socket, through the methods overriddden from ConsumerPort.
@@ -51,6 +56,9 @@ class ConsumerIPCService : public protos::ConsumerPort {
                       DeferredDisableTracingResponse) override;
   void ReadBuffers(const protos::ReadBuffersRequest&,
                    DeferredReadBuffersResponse) override;
+  void ReleaseReadBuffersMemory(
+      const protos::ReleaseReadBuffersMemoryRequest&,
+      DeferredReleaseReadBuffersMemoryResponse) override;
   void FreeBuffers(const protos::FreeBuffersRequest&,
                    DeferredFreeBuffersResponse) override;
   void Flush(const protos::FlushRequest&, DeferredFlushResponse) override;
@@ -72,6 +80,11 @@ class ConsumerIPCService : public protos::ConsumerPort {
     void OnTracingDisabled() override;
     void OnTraceData(std::vector<TracePacket>, bool has_more) override;
 
+    // Copies |slice| into |read_buffers_shm|, if there is enough space left
+    // that has been released by the consumer. On success sets |offset| to the
+    // position of the slice within the region and returns true.
+    bool CopyIntoSharedMemory(const Slice& slice, uint32_t* offset);
+
     // The interface obtained from the core service business logic through
     // Service::ConnectConsumer(this). This allows to invoke methods for a
     // specific Consumer on the Service business logic.
@@ -84,6 +97,18 @@ class ConsumerIPCService : public protos::ConsumerPort {
     // After EnableTracing() is invoked, this binds the async callback that
     // allows to send the OnTracingDisabled notification.
     DeferredEnableTracingResponse enable_tracing_response;
+
+    // Only used if the consumer passes ReadBuffersRequest.use_shared_memory.
+    // In this case the slices' payload is moved through this region, which is
+    // used as a ring buffer, and only the offsets are sent over the socket.
+    // |read_buffers_shm_wr_off| and |read_buffers_shm_rel_off| are monotonic
+    // (i.e. never wrapped) offsets of, respectively, the next byte to write
+    // and the first byte that has not been released yet by the consumer.
+    bool read_buffers_use_shm = false;
+    bool read_buffers_shm_fd_sent = false;
+    uint64_t read_buffers_shm_wr_off = 0;
+    uint64_t read_buffers_shm_rel_off = 0;
+    std::unique_ptr<PosixSharedMemory> read_buffers_shm;
   };
 
   // This has to be a container that doesn't invalidate iterators.
@@ -139,8 +139,7 @@ void ProducerIPCService::CommitData(const protos::CommitDataRequest& proto_req,
         "Producer invoked CommitData() before InitializeConnection()");
     return;
   }
-  CommitDataRequest req;
-  req.FromProto(proto_req);
+  commit_data_req_.FromProto(proto_req);
 
   // We don't want to send a response if the client didn't attach a callback to
   // the original request. Doing so would generate unnecessary wakeups and
@@ -156,7 +155,7 @@ void ProducerIPCService::CommitData(const protos::CommitDataRequest& proto_req,
       resp.Resolve(ipc::AsyncResult<protos::CommitDataResponse>::Create());
     };
   }
-  producer->service_endpoint->CommitData(req, callback);
+  producer->service_endpoint->CommitData(commit_data_req_, callback);
 }
 
 void ProducerIPCService::GetAsyncCommand(
@@ -238,6 +237,15 @@ void ProducerIPCService::RemoteProducer::OnTracingSetup() {
   cmd.set_fd(shm_fd);
   cmd->mutable_setup_tracing()->set_shared_buffer_page_size_kb(
       static_cast<uint32_t>(service_endpoint->shared_buffer_page_size_kb()));
+  const SharedMemoryOptions options = service_endpoint->shared_memory_options();
+  cmd->mutable_setup_tracing()->set_commit_ring(options.use_commit_ring);
+  cmd->mutable_setup_tracing()->set_smb_scanning(options.service_scans_smb);
+  cmd->mutable_setup_tracing()->set_commit_max_latency_ms(
+      options.commit_policy.max_latency_ms);
+  cmd->mutable_setup_tracing()->set_commit_min_batch_bytes(
+      options.commit_policy.min_batch_bytes);
+  cmd->mutable_setup_tracing()->set_adaptive_commit(
+      options.commit_policy.adaptive);
   async_producer_commands.Resolve(std::move(cmd));
 }
 
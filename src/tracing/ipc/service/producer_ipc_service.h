@@ -23,6 +23,7 @@
 
 #include "perfetto/base/weak_ptr.h"
 #include "perfetto/ipc/basic_types.h"
+#include "perfetto/tracing/core/commit_data_request.h"
 #include "perfetto/tracing/core/producer.h"
 #include "perfetto/tracing/core/service.h"
 
@@ -101,6 +102,10 @@ class ProducerIPCService : public protos::ProducerPort {
   // |core_service_| business logic.
   std::map<ipc::ClientID, std::unique_ptr<RemoteProducer>> producers_;
 
+  // Reused across CommitData() calls, so that decoding a request doesn't
+  // allocate once the buffers of the previous ones are large enough.
+  CommitDataRequest commit_data_req_;
+
   base::WeakPtrFactory<ProducerIPCService> weak_ptr_factory_;
 };
 
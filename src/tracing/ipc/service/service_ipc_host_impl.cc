@@ -31,12 +31,15 @@ namespace perfetto {
 // Implements the publicly exposed factory method declared in
 // include/tracing/posix_ipc/posix_service_host.h.
 std::unique_ptr<ServiceIPCHost> ServiceIPCHost::CreateInstance(
-    base::TaskRunner* task_runner) {
-  return std::unique_ptr<ServiceIPCHost>(new ServiceIPCHostImpl(task_runner));
+    base::TaskRunner* task_runner,
+    bool use_huge_pages) {
+  return std::unique_ptr<ServiceIPCHost>(
+      new ServiceIPCHostImpl(task_runner, use_huge_pages));
 }
 
-ServiceIPCHostImpl::ServiceIPCHostImpl(base::TaskRunner* task_runner)
-    : task_runner_(task_runner) {}
+ServiceIPCHostImpl::ServiceIPCHostImpl(base::TaskRunner* task_runner,
+                                       bool use_huge_pages)
+    : task_runner_(task_runner), use_huge_pages_(use_huge_pages) {}
 
 ServiceIPCHostImpl::~ServiceIPCHostImpl() {}
 
@@ -67,7 +70,7 @@ bool ServiceIPCHostImpl::Start(base::ScopedFile producer_socket_fd,
 bool ServiceIPCHostImpl::DoStart() {
   // Create and initialize the platform-independent tracing business logic.
   std::unique_ptr<SharedMemory::Factory> shm_factory(
-      new PosixSharedMemory::Factory());
+      new PosixSharedMemory::Factory(use_huge_pages_));
   svc_ = Service::CreateInstance(std::move(shm_factory), task_runner_);
 
   if (!producer_ipc_port_) {
@@ -93,7 +96,7 @@ bool ServiceIPCHostImpl::DoStart() {
   return true;
 }
 
-Service* ServiceIPCHostImpl::service_for_testing() const {
+Service* ServiceIPCHostImpl::service() const {
   return svc_.get();
 }
 
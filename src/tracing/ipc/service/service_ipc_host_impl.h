@@ -33,7 +33,7 @@ class Host;
 // producer_ipc_service.cc and consumer_ipc_service.cc.
 class ServiceIPCHostImpl : public ServiceIPCHost {
  public:
-  ServiceIPCHostImpl(base::TaskRunner*);
+  ServiceIPCHostImpl(base::TaskRunner*, bool use_huge_pages);
   ~ServiceIPCHostImpl() override;
 
   // ServiceIPCHost implementation.
@@ -41,14 +41,14 @@ class ServiceIPCHostImpl : public ServiceIPCHost {
              const char* consumer_socket_name) override;
   bool Start(base::ScopedFile producer_socket_fd,
              base::ScopedFile consumer_socket_fd) override;
-
-  Service* service_for_testing() const;
+  Service* service() const override;
 
  private:
   bool DoStart();
   void Shutdown();
 
   base::TaskRunner* const task_runner_;
+  const bool use_huge_pages_;
   std::unique_ptr<Service> svc_;  // The service business logic.
 
   // The IPC host that listens on the Producer socket. It owns the
@@ -89,6 +89,15 @@ MockConsumer::FlushRequest MockConsumer::Flush(uint32_t timeout_ms) {
 }
 
 std::vector<protos::TracePacket> MockConsumer::ReadBuffers() {
+  return ReadBuffersInternal(/*snapshot=*/false);
+}
+
+std::vector<protos::TracePacket> MockConsumer::ReadBuffersSnapshot() {
+  return ReadBuffersInternal(/*snapshot=*/true);
+}
+
+std::vector<protos::TracePacket> MockConsumer::ReadBuffersInternal(
+    bool snapshot) {
   std::vector<protos::TracePacket> decoded_packets;
   static int i = 0;
   std::string checkpoint_name = "on_read_buffers_" + std::to_string(i++);
@@ -105,7 +114,11 @@ std::vector<protos::TracePacket> MockConsumer::ReadBuffers() {
             if (!has_more)
               on_read_buffers();
           }));
-  service_endpoint_->ReadBuffers();
+  if (snapshot) {
+    service_endpoint_->ReadBuffersSnapshot();
+  } else {
+    service_endpoint_->ReadBuffers();
+  }
   task_runner_->RunUntilCheckpoint(checkpoint_name);
   return decoded_packets;
 }
@@ -53,6 +53,7 @@ class MockConsumer : public Consumer {
   void WaitForTracingDisabled();
   FlushRequest Flush(uint32_t timeout_ms = 10000);
   std::vector<protos::TracePacket> ReadBuffers();
+  std::vector<protos::TracePacket> ReadBuffersSnapshot();
 
   Service::ConsumerEndpoint* endpoint() { return service_endpoint_.get(); }
 
@@ -70,6 +71,8 @@ class MockConsumer : public Consumer {
   }
 
  private:
+  std::vector<protos::TracePacket> ReadBuffersInternal(bool snapshot);
+
   base::TestTaskRunner* const task_runner_;
   std::unique_ptr<Service::ConsumerEndpoint> service_endpoint_;
 };
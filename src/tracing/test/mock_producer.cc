@@ -111,6 +111,12 @@ std::unique_ptr<TraceWriter> MockProducer::CreateTraceWriter(
   return service_endpoint_->CreateTraceWriter(buf_id);
 }
 
+const MockProducer::EnabledDataSource* MockProducer::GetDataSourceInstance(
+    const std::string& data_source_name) const {
+  auto it = data_source_instances_.find(data_source_name);
+  return it == data_source_instances_.end() ? nullptr : &it->second;
+}
+
 void MockProducer::WaitForFlush(TraceWriter* writer_to_flush) {
   auto& expected_call = EXPECT_CALL(*this, Flush(_, _, _));
   if (!writer_to_flush)
@@ -53,6 +53,8 @@ class MockProducer : public Producer {
   void WaitForDataSourceStop(const std::string& name);
   std::unique_ptr<TraceWriter> CreateTraceWriter(
       const std::string& data_source_name);
+  const EnabledDataSource* GetDataSourceInstance(
+      const std::string& data_source_name) const;
 
   // If |writer_to_flush| != nullptr does NOT reply to the flush request.
   // If |writer_to_flush| == nullptr does NOT reply to the flush request.
@@ -100,7 +100,10 @@ void CheckTraceStats(const protos::TracePacket& packet) {
   EXPECT_EQ(0, buf_stats.abi_violations());
 }
 
-class TracingIntegrationTest : public ::testing::Test {
+// The test parameter controls whether the consumer reads the trace data
+// through the shared memory region set up by the service rather than through
+// the IPC messages (see ConsumerIPCClient::Connect()).
+class TracingIntegrationTest : public ::testing::TestWithParam<bool> {
  public:
   void SetUp() override {
     DESTROY_TEST_SOCK(kProducerSockName);
@@ -127,7 +130,7 @@ class TracingIntegrationTest : public ::testing::Test {
 
     // Create and connect a Consumer.
     consumer_endpoint_ = ConsumerIPCClient::Connect(
-        kConsumerSockName, &consumer_, task_runner_.get());
+        kConsumerSockName, &consumer_, task_runner_.get(), GetParam());
     auto on_consumer_connect =
         task_runner_->CreateCheckpoint("on_consumer_connect");
     EXPECT_CALL(consumer_, OnConnect()).WillOnce(Invoke(on_consumer_connect));
@@ -171,7 +174,7 @@ class TracingIntegrationTest : public ::testing::Test {
   MockConsumer consumer_;
 };
 
-TEST_F(TracingIntegrationTest, WithIPCTransport) {
+TEST_P(TracingIntegrationTest, WithIPCTransport) {
   // Start tracing.
   TraceConfig trace_config;
   trace_config.add_buffers()->set_size_kb(4096 * 10);
@@ -292,7 +295,7 @@ TEST_F(TracingIntegrationTest, WithIPCTransport) {
   task_runner_->RunUntilCheckpoint("on_tracing_disabled");
 }
 
-TEST_F(TracingIntegrationTest, WriteIntoFile) {
+TEST_P(TracingIntegrationTest, WriteIntoFile) {
   // Start tracing.
   TraceConfig trace_config;
   trace_config.add_buffers()->set_size_kb(4096 * 10);
@@ -364,6 +367,8 @@ TEST_F(TracingIntegrationTest, WriteIntoFile) {
   ASSERT_TRUE(saw_trace_stats);
 }
 
+INSTANTIATE_TEST_CASE_P(ShmReads, TracingIntegrationTest, ::testing::Bool());
+
 // TODO(primiano): add tests to cover:
 // - unknown fields preserved end-to-end.
 // - >1 data source.
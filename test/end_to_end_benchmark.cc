@@ -36,11 +36,18 @@ bool IsBenchmarkFunctionalOnly() {
   return getenv("BENCHMARK_FUNCTIONAL_TEST_ONLY") != nullptr;
 }
 
-void BenchmarkCommon(benchmark::State& state) {
+// When |in_process| is true the service and the producer run on the thread of
+// the benchmark and are connected directly, without IPC. This measures the
+// overhead of the tracing machinery alone.
+void BenchmarkCommon(benchmark::State& state, bool in_process) {
   base::TestTaskRunner task_runner;
 
   TestHelper helper(&task_runner);
-  helper.StartServiceIfRequired();
+  if (in_process) {
+    helper.StartServiceInProcess();
+  } else {
+    helper.StartServiceIfRequired();
+  }
 
   FakeProducer* producer = helper.ConnectFakeProducer();
   helper.ConnectConsumer();
@@ -71,8 +78,15 @@ void BenchmarkCommon(benchmark::State& state) {
   helper.WaitForProducerEnabled();
 
   uint64_t wall_start_ns = static_cast<uint64_t>(base::GetWallTimeNs().count());
-  uint64_t service_start_ns = helper.service_thread()->GetThreadCPUTimeNs();
-  uint64_t producer_start_ns = helper.producer_thread()->GetThreadCPUTimeNs();
+  uint64_t service_start_ns = 0;
+  uint64_t producer_start_ns = 0;
+  if (in_process) {
+    service_start_ns =
+        static_cast<uint64_t>(base::GetThreadCPUTimeNs().count());
+  } else {
+    service_start_ns = helper.service_thread()->GetThreadCPUTimeNs();
+    producer_start_ns = helper.producer_thread()->GetThreadCPUTimeNs();
+  }
   uint32_t iterations = 0;
   for (auto _ : state) {
     auto cname = "produced.and.committed." + std::to_string(iterations++);
@@ -80,17 +94,28 @@ void BenchmarkCommon(benchmark::State& state) {
     producer->ProduceEventBatch(helper.WrapTask(on_produced_and_committed));
     task_runner.RunUntilCheckpoint(cname, time_for_messages_ms);
   }
-  uint64_t service_ns =
-      helper.service_thread()->GetThreadCPUTimeNs() - service_start_ns;
-  uint64_t producer_ns =
-      helper.producer_thread()->GetThreadCPUTimeNs() - producer_start_ns;
   uint64_t wall_ns =
       static_cast<uint64_t>(base::GetWallTimeNs().count()) - wall_start_ns;
 
-  state.counters["Pro CPU"] = benchmark::Counter(100.0 * producer_ns / wall_ns);
-  state.counters["Ser CPU"] = benchmark::Counter(100.0 * service_ns / wall_ns);
-  state.counters["Ser ns/m"] =
-      benchmark::Counter(1.0 * service_ns / message_count);
+  if (in_process) {
+    // The producer and the service share the same thread.
+    uint64_t cpu_ns =
+        static_cast<uint64_t>(base::GetThreadCPUTimeNs().count()) -
+        service_start_ns;
+    state.counters["CPU"] = benchmark::Counter(100.0 * cpu_ns / wall_ns);
+    state.counters["ns/m"] = benchmark::Counter(1.0 * cpu_ns / message_count);
+  } else {
+    uint64_t service_ns =
+        helper.service_thread()->GetThreadCPUTimeNs() - service_start_ns;
+    uint64_t producer_ns =
+        helper.producer_thread()->GetThreadCPUTimeNs() - producer_start_ns;
+    state.counters["Pro CPU"] =
+        benchmark::Counter(100.0 * producer_ns / wall_ns);
+    state.counters["Ser CPU"] =
+        benchmark::Counter(100.0 * service_ns / wall_ns);
+    state.counters["Ser ns/m"] =
+        benchmark::Counter(1.0 * service_ns / message_count);
+  }
   state.SetBytesProcessed(iterations * message_bytes * message_count);
 
   // Read back the buffer just to check correctness.
@@ -134,7 +159,7 @@ void ConstantRateArgs(benchmark::internal::Benchmark* b) {
 }  // namespace
 
 static void BM_EndToEnd_SaturateCpu(benchmark::State& state) {
-  BenchmarkCommon(state);
+  BenchmarkCommon(state, false /* in_process */);
 }
 
 BENCHMARK(BM_EndToEnd_SaturateCpu)
@@ -143,11 +168,29 @@ BENCHMARK(BM_EndToEnd_SaturateCpu)
     ->Apply(SaturateCpuArgs);
 
 static void BM_EndToEnd_ConstantRate(benchmark::State& state) {
-  BenchmarkCommon(state);
+  BenchmarkCommon(state, false /* in_process */);
 }
 
 BENCHMARK(BM_EndToEnd_ConstantRate)
     ->Unit(benchmark::kMicrosecond)
     ->UseRealTime()
     ->Apply(ConstantRateArgs);
+
+static void BM_EndToEnd_InProcess_SaturateCpu(benchmark::State& state) {
+  BenchmarkCommon(state, true /* in_process */);
+}
+
+BENCHMARK(BM_EndToEnd_InProcess_SaturateCpu)
+    ->Unit(benchmark::kMicrosecond)
+    ->UseRealTime()
+    ->Apply(SaturateCpuArgs);
+
+static void BM_EndToEnd_InProcess_ConstantRate(benchmark::State& state) {
+  BenchmarkCommon(state, true /* in_process */);
+}
+
+BENCHMARK(BM_EndToEnd_InProcess_ConstantRate)
+    ->Unit(benchmark::kMicrosecond)
+    ->UseRealTime()
+    ->Apply(ConstantRateArgs);
 }  // namespace perfetto
@@ -16,6 +16,8 @@
 
 #include "test/fake_producer.h"
 
+#include <unistd.h>
+
 #include <condition_variable>
 #include <mutex>
 
@@ -32,7 +34,13 @@
 namespace perfetto {
 
 FakeProducer::FakeProducer(const std::string& name) : name_(name) {}
-FakeProducer::~FakeProducer() = default;
+FakeProducer::~FakeProducer() {
+  // The endpoint of an in-process service calls OnDisconnect() from its
+  // destructor.
+  trace_writer_.reset();
+  disconnecting_ = true;
+  endpoint_.reset();
+}
 
 void FakeProducer::Connect(
     const char* socket_name,
@@ -45,6 +53,17 @@ void FakeProducer::Connect(
   on_create_data_source_instance_ = std::move(on_create_data_source_instance);
 }
 
+void FakeProducer::Connect(
+    Service* service,
+    base::TaskRunner* task_runner,
+    std::function<void()> on_create_data_source_instance) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  task_runner_ = task_runner;
+  endpoint_ = service->ConnectProducer(this, geteuid(),
+                                       "android.perfetto.FakeProducer");
+  on_create_data_source_instance_ = std::move(on_create_data_source_instance);
+}
+
 void FakeProducer::OnConnect() {
   PERFETTO_DCHECK_THREAD(thread_checker_);
   DataSourceDescriptor descriptor;
@@ -54,6 +73,8 @@ void FakeProducer::OnConnect() {
 
 void FakeProducer::OnDisconnect() {
   PERFETTO_DCHECK_THREAD(thread_checker_);
+  if (disconnecting_)
+    return;
   FAIL() << "Producer unexpectedly disconnected from the service";
 }
 
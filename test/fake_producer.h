@@ -39,6 +39,13 @@ class FakeProducer : public Producer {
                base::TaskRunner* task_runner,
                std::function<void()> on_create_data_source_instance);
 
+  // Like the above, but connects directly to a |service| living in the same
+  // process, bypassing the IPC layer. |task_runner| must be the one of the
+  // service.
+  void Connect(Service* service,
+               base::TaskRunner* task_runner,
+               std::function<void()> on_create_data_source_instance);
+
   // Produces a batch of events (as configured in the DataSourceConfig) and
   // posts a callback when the service acknowledges the commit.
   void ProduceEventBatch(std::function<void()> callback = [] {});
@@ -63,6 +70,7 @@ class FakeProducer : public Producer {
   uint32_t message_count_ = 0;
   uint32_t max_messages_per_second_ = 0;
   std::function<void()> on_create_data_source_instance_;
+  bool disconnecting_ = false;
   std::unique_ptr<Service::ProducerEndpoint> endpoint_;
   std::unique_ptr<TraceWriter> trace_writer_;
 };
@@ -22,6 +22,7 @@
 #include "test/task_runner_thread_delegates.h"
 
 #include "src/tracing/ipc/default_socket.h"
+#include "src/tracing/ipc/posix_shared_memory.h"
 
 #include "perfetto/trace/trace_packet.pb.h"
 #include "perfetto/trace/trace_packet.pbzero.h"
@@ -44,11 +45,20 @@ TestHelper::TestHelper(base::TestTaskRunner* task_runner)
       service_thread_("perfetto.svc"),
       producer_thread_("perfetto.prd") {}
 
+TestHelper::~TestHelper() {
+  // The endpoint of an in-process service calls OnDisconnect() from its
+  // destructor.
+  disconnecting_ = true;
+  endpoint_.reset();
+}
+
 void TestHelper::OnConnect() {
   std::move(on_connect_callback_)();
 }
 
 void TestHelper::OnDisconnect() {
+  if (disconnecting_)
+    return;
   FAIL() << "Consumer unexpectedly disconnected from the service";
 }
 
@@ -81,7 +91,22 @@ void TestHelper::StartServiceIfRequired() {
 #endif
 }
 
+void TestHelper::StartServiceInProcess() {
+  std::unique_ptr<SharedMemory::Factory> shm_factory(
+      new PosixSharedMemory::Factory());
+  in_process_service_ =
+      Service::CreateInstance(std::move(shm_factory), task_runner_);
+}
+
 FakeProducer* TestHelper::ConnectFakeProducer() {
+  if (in_process_service_) {
+    in_process_producer_.reset(
+        new FakeProducer("android.perfetto.FakeProducer"));
+    in_process_producer_->Connect(
+        in_process_service_.get(), task_runner_,
+        WrapTask(task_runner_->CreateCheckpoint("producer.enabled")));
+    return in_process_producer_.get();
+  }
   std::unique_ptr<FakeProducerDelegate> producer_delegate(
       new FakeProducerDelegate(
           TEST_PRODUCER_SOCK_NAME,
@@ -93,6 +118,10 @@ FakeProducer* TestHelper::ConnectFakeProducer() {
 
 void TestHelper::ConnectConsumer() {
   on_connect_callback_ = task_runner_->CreateCheckpoint("consumer.connected");
+  if (in_process_service_) {
+    endpoint_ = in_process_service_->ConnectConsumer(this);
+    return;
+  }
   endpoint_ =
       ConsumerIPCClient::Connect(TEST_CONSUMER_SOCK_NAME, this, task_runner_);
 }
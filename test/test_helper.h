@@ -17,7 +17,10 @@
 #ifndef TEST_TEST_HELPER_H_
 #define TEST_TEST_HELPER_H_
 
+#include <memory>
+
 #include "perfetto/tracing/core/consumer.h"
+#include "perfetto/tracing/core/service.h"
 #include "perfetto/tracing/core/trace_config.h"
 #include "perfetto/tracing/core/trace_packet.h"
 #include "perfetto/tracing/ipc/consumer_ipc_client.h"
@@ -32,6 +35,7 @@ namespace perfetto {
 class TestHelper : public Consumer {
  public:
   explicit TestHelper(base::TestTaskRunner* task_runner);
+  ~TestHelper() override;
 
   // Consumer implementation.
   void OnConnect() override;
@@ -40,6 +44,12 @@ class TestHelper : public Consumer {
   void OnTraceData(std::vector<TracePacket> packets, bool has_more) override;
 
   void StartServiceIfRequired();
+
+  // Creates the service on the task runner of the test, instead of talking to
+  // traced. The producer and consumer connected afterwards are connected to
+  // it directly, without any IPC.
+  void StartServiceInProcess();
+
   FakeProducer* ConnectFakeProducer();
   void ConnectConsumer();
   void StartTracing(const TraceConfig& config);
@@ -64,9 +74,15 @@ class TestHelper : public Consumer {
   std::function<void()> on_stop_tracing_callback_;
 
   std::vector<protos::TracePacket> trace_;
+  bool disconnecting_ = false;
 
   TaskRunnerThread service_thread_;
   TaskRunnerThread producer_thread_;
+
+  // Used only after StartServiceInProcess().
+  std::unique_ptr<Service> in_process_service_;
+  std::unique_ptr<FakeProducer> in_process_producer_;
+
   std::unique_ptr<Service::ConsumerEndpoint> endpoint_;  // Keep last.
 };
 
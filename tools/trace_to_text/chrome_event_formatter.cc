@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tools/trace_to_text/chrome_event_formatter.h"
+
+#include <stdio.h>
+
+#include <sstream>
+
+namespace perfetto {
+namespace {
+
+using protos::ChromeTraceEvent;
+
+std::string EscapeJson(const std::string& str) {
+  std::string escaped;
+  escaped.reserve(str.size());
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      escaped.push_back('\\');
+      escaped.push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      escaped.append(buf);
+    } else {
+      escaped.push_back(c);
+    }
+  }
+  return escaped;
+}
+
+std::string ResolveString(const std::string& str,
+                          uint64_t iid,
+                          const InternedStrings& interned_strings) {
+  if (!iid)
+    return str;
+  const std::string* interned = interned_strings.Get(iid);
+  if (interned)
+    return *interned;
+  return "<unknown interned string " + std::to_string(iid) + ">";
+}
+
+void FormatArgValue(const ChromeTraceEvent::Arg& arg, std::ostream* out) {
+  switch (arg.value_case()) {
+    case ChromeTraceEvent::Arg::kBoolValue:
+      *out << (arg.bool_value() ? "true" : "false");
+      break;
+    case ChromeTraceEvent::Arg::kUintValue:
+      *out << arg.uint_value();
+      break;
+    case ChromeTraceEvent::Arg::kIntValue:
+      *out << arg.int_value();
+      break;
+    case ChromeTraceEvent::Arg::kDoubleValue:
+      *out << arg.double_value();
+      break;
+    case ChromeTraceEvent::Arg::kStringValue:
+      *out << "\"" << EscapeJson(arg.string_value()) << "\"";
+      break;
+    case ChromeTraceEvent::Arg::VALUE_NOT_SET:
+      *out << "null";
+      break;
+  }
+}
+
+}  // namespace
+
+bool InternedStrings::OnPacket(const protos::TracePacket& packet) {
+  Sequence* sequence = &sequences_[packet.trusted_packet_sequence_id()];
+  cur_sequence_ = sequence;
+  if (packet.previous_packet_dropped())
+    sequence->lost_state = true;
+  if (packet.incremental_state_cleared()) {
+    sequence->strings.clear();
+    sequence->lost_state = false;
+  }
+  if (sequence->lost_state)
+    return false;
+  for (const auto& entry : packet.interned_data().strings())
+    sequence->strings[entry.iid()] = entry.str();
+  return true;
+}
+
+const std::string* InternedStrings::Get(uint64_t iid) const {
+  if (!cur_sequence_)
+    return nullptr;
+  auto it = cur_sequence_->strings.find(iid);
+  return it == cur_sequence_->strings.end() ? nullptr : &it->second;
+}
+
+std::string FormatChromeTraceEvent(const ChromeTraceEvent& event,
+                                   const InternedStrings& interned_strings) {
+  std::ostringstream out;
+  out << "{\"name\":\""
+      << EscapeJson(ResolveString(event.name(), event.name_iid(),
+                                  interned_strings))
+      << "\",\"cat\":\""
+      << EscapeJson(ResolveString(event.category_group_name(),
+                                  event.category_group_iid(),
+                                  interned_strings))
+      << "\",\"ph\":\"" << static_cast<char>(event.phase())
+      << "\",\"ts\":" << event.timestamp() << ",\"pid\":" << event.process_id()
+      << ",\"tid\":" << event.thread_id();
+  if (event.has_duration())
+    out << ",\"dur\":" << event.duration();
+  if (event.args_size()) {
+    out << ",\"args\":{";
+    for (int i = 0; i < event.args_size(); i++) {
+      const ChromeTraceEvent::Arg& arg = event.args(i);
+      out << (i ? "," : "") << "\"" << EscapeJson(arg.name()) << "\":";
+      FormatArgValue(arg, &out);
+    }
+    out << "}";
+  }
+  out << "}";
+  return out.str();
+}
+
+}  // namespace perfetto
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TOOLS_TRACE_TO_TEXT_CHROME_EVENT_FORMATTER_H_
+#define TOOLS_TRACE_TO_TEXT_CHROME_EVENT_FORMATTER_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include "perfetto/trace/trace_packet.pb.h"
+
+namespace perfetto {
+
+// Keeps the interning dictionary of each packet sequence, to resolve the
+// references to it (see TracePacket.interned_data).
+class InternedStrings {
+ public:
+  // Must be called for every packet, in the order they appear in the trace.
+  // Returns false if the packet can't be decoded, because some entries of its
+  // sequence have been lost (see TracePacket.previous_packet_dropped).
+  bool OnPacket(const protos::TracePacket&);
+
+  // Returns the entry |iid| of the sequence of the last packet passed to
+  // OnPacket(), or nullptr if unknown.
+  const std::string* Get(uint64_t iid) const;
+
+ private:
+  struct Sequence {
+    std::map<uint64_t, std::string> strings;
+    // True after some packets have been lost, until the next packet that
+    // resets the state.
+    bool lost_state = false;
+  };
+
+  std::map<uint32_t, Sequence> sequences_;
+  const Sequence* cur_sequence_ = nullptr;
+};
+
+// Formats |event| as a JSON object of the Trace Event Format, resolving its
+// interned names through |interned_strings|.
+std::string FormatChromeTraceEvent(const protos::ChromeTraceEvent& event,
+                                   const InternedStrings& interned_strings);
+
+}  // namespace perfetto
+
+#endif  // TOOLS_TRACE_TO_TEXT_CHROME_EVENT_FORMATTER_H_
@@ -42,6 +42,7 @@
 #include "perfetto/base/logging.h"
 #include "perfetto/trace/trace.pb.h"
 #include "perfetto/trace/trace_packet.pb.h"
+#include "tools/trace_to_text/chrome_event_formatter.h"
 #include "tools/trace_to_text/ftrace_event_formatter.h"
 #include "tools/trace_to_text/ftrace_inode_handler.h"
 
@@ -49,7 +50,9 @@ namespace perfetto {
 namespace {
 
 const char kTraceHeader[] = R"({
-  "traceEvents": [],
+  "traceEvents": [)";
+
+const char kTraceEventsFooter[] = R"(],
 )";
 
 const char kTraceFooter[] = R"(\n",
@@ -168,8 +171,25 @@ int TraceToSystrace(std::istream* input,
                     std::ostream* output,
                     bool wrap_in_json) {
   std::multimap<uint64_t, std::string> sorted;
+  std::vector<std::string> chrome_events;
+  InternedStrings interned_strings;
+  uint64_t undecodable_chrome_events = 0;
+
+  ForEachPacketInTrace(input, [&sorted, &chrome_events, &interned_strings,
+                               &undecodable_chrome_events](
+                                  const protos::TracePacket& packet) {
+    bool decodable = interned_strings.OnPacket(packet);
+    if (packet.has_chrome_events()) {
+      for (const auto& event : packet.chrome_events().trace_events()) {
+        if (!decodable && (event.name_iid() || event.category_group_iid())) {
+          undecodable_chrome_events++;
+          continue;
+        }
+        chrome_events.push_back(
+            FormatChromeTraceEvent(event, interned_strings));
+      }
+    }
 
-  ForEachPacketInTrace(input, [&sorted](const protos::TracePacket& packet) {
     if (!packet.has_ftrace_events())
       return;
 
@@ -183,8 +203,17 @@ int TraceToSystrace(std::istream* input,
     }
   });
 
+  if (undecodable_chrome_events) {
+    PERFETTO_ELOG("Skipped %" PRIu64
+                  " trace events that refer to lost interned data",
+                  undecodable_chrome_events);
+  }
+
   if (wrap_in_json) {
     *output << kTraceHeader;
+    for (size_t i = 0; i < chrome_events.size(); i++)
+      *output << (i ? ",\n    " : "\n    ") << chrome_events[i];
+    *output << kTraceEventsFooter;
     *output << kFtraceHeader;
   }
 